@@ -38,6 +38,22 @@
 #include "serial_io.h"
 #endif
 
+#ifdef SUPPORT_LINE_SERVER
+#include "line_server.h"
+#include <csignal>
+#endif
+
+#ifdef SUPPORT_SHM_SERVER
+#include "shm_server.h"
+#include <csignal>
+#endif
+
+#ifdef SUPPORT_TELNET_SERVER
+#include "telnet_server.h"
+#include "teletype.h"
+#include <csignal>
+#endif
+
 #include <iostream>
 #include <fstream>
 #include <string>
@@ -48,12 +64,44 @@
 #include <vector>
 #include <memory>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <algorithm>
 #include <deque>
 #include <cctype>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <array>
 #include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <stdexcept>
+#include <new>
+#include <coroutine>
+#include <exception>
+#include <queue>
+#include <utility>
+#include <tuple>
+#include <random>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <iterator>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#endif
 
 
 
@@ -2323,6 +2371,494 @@ DEF_TEST_FUNC(last_chunk_as_bcd_test)
 }
 
 
+// append given unsigned value v to given string s as a LEB128 varint
+// (7 bits per byte, least significant group first, top bit set on all
+// but the last byte)
+void append_varint(std::string & s, uint_least64_t v)
+{
+    while (v >= 0x80) {
+        s += static_cast<char>((v & 0x7F) | 0x80);
+        v >>= 7;
+    }
+    s += static_cast<char>(v);
+}
+
+
+// return the varint at s[pos]; advance pos past it
+uint_least64_t read_varint(const std::string & s, size_t & pos)
+{
+    uint_least64_t v = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (pos >= s.size())
+            throw std::runtime_error("read_varint: unexpected end of data");
+        const unsigned char c = static_cast<unsigned char>(s[pos++]);
+        v |= static_cast<uint_least64_t>(c & 0x7F) << shift;
+        if ((c & 0x80) == 0)
+            return v;
+    }
+    throw std::runtime_error("read_varint: varint too long");
+}
+
+
+DEF_TEST_FUNC(varint_test)
+{
+    for (uint_least64_t v : { 0ull, 1ull, 127ull, 128ull, 300ull, 16383ull, 16384ull, 0xFFFFFFFFFFFFFFFFull }) {
+        std::string s;
+        append_varint(s, v);
+        size_t pos = 0;
+        TEST_EQUAL(read_varint(s, pos), v);
+        TEST_EQUAL(pos, s.size());
+    }
+    std::string s;
+    append_varint(s, 300);
+    TEST_EQUAL(s, std::string("\xAC\x02"));
+    s.pop_back();
+    size_t pos = 0;
+    std::string error;
+    try {
+        read_varint(s, pos);
+    }
+    catch (const std::exception & e) {
+        error = e.what();
+    }
+    TEST_EQUAL(error, "read_varint: unexpected end of data");
+}
+
+
+/*  A word_table assigns each word of a script a small number, its id.
+    A list of words is encoded as a string of varints: id + 1 for each
+    word in the table, or 0 followed by the length and the characters of
+    the word for a word not in the table (e.g. a word the user typed that
+    the script doesn't mention). Most encoded MEMORY entries are short
+    enough to fit in a std::string without a separate allocation. */
+class word_table {
+public:
+    word_table() = default;
+
+    // the more often a word appears in given words the smaller its id,
+    // so the commonest words encode in one byte
+    explicit word_table(const stringlist & words)
+    {
+        std::map<std::string, size_t> frequency;
+        for (const auto & w : words)
+            if (!w.empty())
+                ++frequency[w];
+        std::vector<std::pair<size_t, std::string>> by_frequency;
+        for (const auto & [w, n] : frequency)
+            by_frequency.emplace_back(n, w);
+        std::stable_sort(by_frequency.begin(), by_frequency.end(),
+            [](const auto & a, const auto & b) { return a.first > b.first; });
+        for (auto & [n, w] : by_frequency) {
+            ids_.emplace(w, static_cast<uint_least32_t>(words_.size()));
+            words_.push_back(std::move(w));
+        }
+    }
+
+    size_t size() const { return words_.size(); }
+
+    // return the encoding of given words; empty words are omitted
+    std::string encode(const stringlist & words) const
+    {
+        std::string code;
+        for (const auto & w : words) {
+            if (w.empty())
+                continue;
+            const auto id = ids_.find(w);
+            if (id != ids_.end())
+                append_varint(code, id->second + 1ull);
+            else {
+                append_varint(code, 0);
+                append_varint(code, w.size());
+                code += w;
+            }
+        }
+        return code;
+    }
+
+    // return the words encoded in given code
+    stringlist decode(const std::string & code) const
+    {
+        stringlist words;
+        for (size_t pos = 0; pos < code.size(); ) {
+            const auto id = read_varint(code, pos);
+            if (id == 0) {
+                const auto len = read_varint(code, pos);
+                if (len > code.size() - pos)
+                    throw std::runtime_error("word_table::decode: unexpected end of data");
+                words.push_back(code.substr(pos, len));
+                pos += len;
+            }
+            else if (id > words_.size())
+                throw std::runtime_error("word_table::decode: unknown word id");
+            else
+                words.push_back(words_[id - 1]);
+        }
+        return words;
+    }
+
+private:
+    std::vector<std::string> words_;
+    std::unordered_map<std::string, uint_least32_t> ids_;
+};
+
+
+DEF_TEST_FUNC(word_table_test)
+{
+    const word_table wt({ "YOUR", "MOTHER", "YOUR", "", "FATHER" });
+    TEST_EQUAL(wt.size(), (size_t)3);
+    const stringlist words{ "YOUR", "", "MOTHER", "LIKES", "YOUR", "FATHER" };
+    const std::string code(wt.encode(words));
+    TEST_EQUAL(code, std::string("\x01\x03\x00\x05LIKES\x01\x02", 11));
+    TEST_EQUAL(join(wt.decode(code)), "YOUR MOTHER LIKES YOUR FATHER");
+    TEST_EQUAL(wt.decode("").size(), (size_t)0);
+}
+
+
+/*  Conversations served by different threads must not share cache lines,
+    or every write to one conversation's state slows the others ("false
+    sharing"). (std::hardware_destructive_interference_size is not reliably
+    available; 64 is right for x86-64 and most ARM cores.) */
+constexpr size_t cache_line_size = 64;
+
+// an allocator whose every allocation starts on a cache line and occupies
+// whole cache lines, so no two allocations share a line
+template<typename T>
+class cache_line_allocator {
+public:
+    using value_type = T;
+
+    cache_line_allocator() = default;
+    template<typename U>
+    cache_line_allocator(const cache_line_allocator<U> &) noexcept {}
+
+    T * allocate(size_t n)
+    {
+        if (n > (std::numeric_limits<size_t>::max() - cache_line_size) / sizeof(T))
+            throw std::bad_array_new_length();
+        return static_cast<T *>(::operator new(padded(n), std::align_val_t(cache_line_size)));
+    }
+
+    void deallocate(T * p, size_t n) noexcept
+    {
+        ::operator delete(p, padded(n), std::align_val_t(cache_line_size));
+    }
+
+    template<typename U>
+    bool operator==(const cache_line_allocator<U> &) const noexcept { return true; }
+
+private:
+    static size_t padded(size_t n)
+    {
+        return (n * sizeof(T) + cache_line_size - 1) / cache_line_size * cache_line_size;
+    }
+};
+
+// return a shared_ptr to a new T in its own cache lines (the shared_ptr's
+// reference counts are in the same lines)
+template<typename T, typename... Args>
+std::shared_ptr<T> make_shared_cache_aligned(Args &&... args)
+{
+    return std::allocate_shared<T>(cache_line_allocator<T>(), std::forward<Args>(args)...);
+}
+
+
+DEF_TEST_FUNC(cache_line_allocator_test)
+{
+    std::vector<char, cache_line_allocator<char>> a(1, 'a'), b(1, 'b');
+    const auto line = [](const void * p) { return reinterpret_cast<uintptr_t>(p) / cache_line_size; };
+    TEST_EQUAL(reinterpret_cast<uintptr_t>(a.data()) % cache_line_size, (uintptr_t)0);
+    TEST_EQUAL(line(a.data()) != line(b.data()), true);
+    auto p = make_shared_cache_aligned<int>(1);
+    auto q = make_shared_cache_aligned<int>(2);
+    TEST_EQUAL(line(p.get()) != line(q.get()), true);
+    TEST_EQUAL(*p + *q, 3);
+}
+
+
+/*  The MEMORY queue. In JW's ELIZA the queue could grow without limit.
+    Here it is a ring buffer holding at most capacity() entries; when it
+    is full a new memory is either discarded (drop_newest) or displaces
+    the oldest memory (drop_oldest). Memories are recalled oldest first,
+    so drop_newest, the default, reproduces JW's ELIZA exactly until more
+    than capacity() memories are waiting to be recalled. The queue doesn't
+    interpret its entries; eliza stores word_table-encoded text in them. */
+class memory_queue {
+public:
+    enum class eviction { drop_newest, drop_oldest };
+    static constexpr size_t default_capacity = 32;
+
+    memory_queue() = default;
+
+    explicit memory_queue(size_t capacity, eviction policy = eviction::drop_newest)
+        : capacity_(capacity), policy_(policy)
+    {}
+
+    size_t size() const { return count_; }
+    bool empty() const { return count_ == 0; }
+    size_t capacity() const { return capacity_; }
+    eviction policy() const { return policy_; }
+
+    // return the i'th oldest entry
+    const std::string & operator[](size_t i) const
+    {
+        assert(i < count_);
+        return slots_[(head_ + i) % slots_.size()];
+    }
+
+    // add given entry at the back of the queue, evicting per policy() if
+    // the queue is full; return false iff an entry was discarded to do so
+    bool push(std::string entry)
+    {
+        if (count_ == capacity_) {
+            if (policy_ == eviction::drop_newest || capacity_ == 0)
+                return false;
+            pop();
+            push_back(std::move(entry));
+            return false;
+        }
+        push_back(std::move(entry));
+        return true;
+    }
+
+    // remove and return the entry at the front of the queue
+    std::string pop()
+    {
+        assert(count_ > 0);
+        std::string entry(std::move(slots_[head_]));
+        head_ = (head_ + 1) % slots_.size();
+        --count_;
+        return entry;
+    }
+
+    // change the capacity and eviction policy; if the queue now holds
+    // too many entries, evict them per the given policy
+    void set_capacity(size_t capacity, eviction policy)
+    {
+        std::vector<std::string> entries;
+        while (!empty())
+            entries.push_back(pop());
+        if (entries.size() > capacity) {
+            if (policy == eviction::drop_oldest)
+                entries.erase(entries.begin(), entries.end() - capacity);
+            else
+                entries.resize(capacity);
+        }
+        *this = memory_queue(capacity, policy);
+        for (auto & e : entries)
+            push_back(std::move(e));
+    }
+
+private:
+    // the storage grows as needed up to capacity_ slots, so an idle
+    // conversation with few memories doesn't pay for a large capacity
+    std::vector<std::string, cache_line_allocator<std::string>> slots_;
+    size_t head_{ 0 };
+    size_t count_{ 0 };
+    size_t capacity_{ default_capacity };
+    eviction policy_{ eviction::drop_newest };
+
+    void push_back(std::string entry)
+    {
+        assert(count_ < capacity_);
+        if (count_ == slots_.size()) {
+            std::rotate(slots_.begin(), slots_.begin() + head_, slots_.end());
+            head_ = 0;
+            slots_.resize(std::min(capacity_, std::max<size_t>(4, 2 * slots_.size())));
+        }
+        slots_[(head_ + count_) % slots_.size()] = std::move(entry);
+        ++count_;
+    }
+};
+
+
+DEF_TEST_FUNC(memory_queue_test)
+{
+    auto contents = [](memory_queue q) {
+        std::string s;
+        while (!q.empty())
+            s += q.pop();
+        return s;
+    };
+
+    memory_queue q(3);
+    TEST_EQUAL(q.push("A"), true);
+    TEST_EQUAL(q.push("B"), true);
+    TEST_EQUAL(q.push("C"), true);
+    TEST_EQUAL(q.push("D"), false);
+    TEST_EQUAL(contents(q), "ABC");
+    TEST_EQUAL(q.pop(), "A");
+    TEST_EQUAL(q.push("E"), true);      // (wraps around)
+    TEST_EQUAL(contents(q), "BCE");
+    TEST_EQUAL(q[2], "E");
+
+    q.set_capacity(3, memory_queue::eviction::drop_oldest);
+    TEST_EQUAL(q.push("F"), false);
+    TEST_EQUAL(contents(q), "CEF");
+    q.set_capacity(2, memory_queue::eviction::drop_oldest);
+    TEST_EQUAL(contents(q), "EF");
+    q.set_capacity(1, memory_queue::eviction::drop_newest);
+    TEST_EQUAL(contents(q), "E");
+
+    memory_queue big(100);
+    for (int i = 0; i < 1000; ++i) {
+        big.push(std::to_string(i));
+        if (i % 3 == 0)
+            big.pop();
+    }
+    TEST_EQUAL(big.size(), (size_t)99);
+    TEST_EQUAL(big[0], "703");
+    TEST_EQUAL(big[98], "997");
+
+    memory_queue none(0, memory_queue::eviction::drop_oldest);
+    TEST_EQUAL(none.push("A"), false);
+    TEST_EQUAL(none.empty(), true);
+}
+
+
+/*  A conversation's mutable state is LIMIT, the index of the next
+    reassembly rule to use for each transformation in the script (here
+    called the transformation's cursor) and the MEMORY queue. Everything
+    else about a conversation comes from its script, which doesn't change.
+
+    Copying a conversation_state is O(1): the cursors and the memories are
+    shared by the copies until one of them changes, when that copy gets its
+    own. So any number of conversations may branch from one state cheaply. */
+class conversation_state {
+public:
+    using cursor = uint_least16_t;
+    // (cursors and memories are written with every response, so each
+    // conversation's are kept in cache lines of their own)
+    using cursor_vector = std::vector<cursor, cache_line_allocator<cursor>>;
+    // (transformation, reassembly rule) of each reassembly rule used
+    using rule_log = std::vector<std::pair<size_t, unsigned>>;
+
+    conversation_state() = default;
+
+    // initial_cursors would normally be all zero and initial_memories
+    // empty, both shared by every new conversation using the same script
+    conversation_state(
+        std::shared_ptr<const cursor_vector> initial_cursors,
+        std::shared_ptr<const memory_queue> initial_memories)
+        : cursors_(std::move(initial_cursors)), memories_(std::move(initial_memories))
+    {}
+
+    // JW's "a certain counting mechanism," LIMIT, cycles through 1..4, then back to 1
+    int limit() const { return limit_; }
+    void set_limit(int limit) { limit_ = limit; }
+    int advance_limit() { return limit_ = limit_ % 4 + 1; }
+
+    const cursor_vector & cursors() const { return cursors_ ? *cursors_ : empty_cursors; }
+    void set_cursors(cursor_vector cursors)
+    {
+        cursors_ = make_shared_cache_aligned<cursor_vector>(std::move(cursors));
+    }
+
+    // return the cursor of transformation t, which has n reassembly
+    // rules, and advance the cursor so that they all get cycled through
+    unsigned next_reassembly_rule(size_t t, size_t n)
+    {
+        assert(cursors_ && t < cursors_->size());
+        const unsigned r = (*cursors_)[t];
+        own(cursors_)[t] = static_cast<cursor>(r + 1 == n ? 0 : r + 1);
+        if (log_.p)
+            log_.p->emplace_back(t, r);
+        return r;
+    }
+
+    // if log is not null, append to it every reassembly rule subsequently
+    // used; the log is not part of the state and is not copied with it
+    void set_rule_log(rule_log * log) { log_.p = log; }
+
+    const memory_queue & memories() const { return memories_ ? *memories_ : empty_memories; }
+    void set_memories(memory_queue memories)
+    {
+        memories_ = make_shared_cache_aligned<memory_queue>(std::move(memories));
+    }
+    void set_memory_capacity(size_t capacity, memory_queue::eviction policy)
+    {
+        own(memories_).set_capacity(capacity, policy);
+    }
+
+    // return true iff we have at least one saved memory
+    bool memory_exists() const { return memories_ && !memories_->empty(); }
+
+    // save given memory at the back of the queue; return false iff the
+    // queue was full and a memory was discarded (see memory_queue)
+    bool push_memory(std::string memory) { return own(memories_).push(std::move(memory)); }
+
+    // return the next saved memory in the queue; remove it from the queue
+    std::string recall_memory()
+    {
+        return memory_exists() ? own(memories_).pop() : "";
+    }
+
+private:
+    int limit_{ 1 };
+    std::shared_ptr<const cursor_vector> cursors_;
+    std::shared_ptr<const memory_queue> memories_;
+
+    static inline const cursor_vector empty_cursors;
+    static inline const memory_queue empty_memories;
+
+    struct log_ptr {
+        rule_log * p{ nullptr };
+        log_ptr() = default;
+        log_ptr(const log_ptr &) {}
+        log_ptr & operator=(const log_ptr &) { return *this; }
+    } log_;
+
+    // return a modifiable p, first making a private copy of it if it is
+    // shared with another conversation_state (copy on write)
+    template<typename T>
+    static T & own(std::shared_ptr<const T> & p)
+    {
+        if (!p)
+            p = make_shared_cache_aligned<T>();
+        else if (p.use_count() > 1)
+            p = make_shared_cache_aligned<T>(*p);
+        // (every p was created non-const, so this is safe)
+        return const_cast<T &>(*p);
+    }
+};
+
+
+DEF_TEST_FUNC(conversation_state_test)
+{
+    auto zeros = std::make_shared<const conversation_state::cursor_vector>(3, 0);
+    conversation_state a(zeros, std::make_shared<const memory_queue>());
+    TEST_EQUAL(a.next_reassembly_rule(1, 2), 0u);
+    TEST_EQUAL(a.next_reassembly_rule(1, 2), 1u);
+    TEST_EQUAL(a.next_reassembly_rule(1, 2), 0u);
+    TEST_EQUAL((*zeros)[1], 0); // the shared initial cursors are never changed
+    a.push_memory("ONE");
+
+    conversation_state b(a); // b shares a's cursors and memories...
+    TEST_EQUAL(&b.cursors(), &a.cursors());
+    TEST_EQUAL(&b.memories(), &a.memories());
+    b.next_reassembly_rule(0, 4);
+    b.push_memory("TWO");
+    TEST_EQUAL(a.cursors()[0], 0); // ...until b changes them
+    TEST_EQUAL(b.cursors()[0], 1);
+    TEST_EQUAL(a.memories().size(), (size_t)1);
+    TEST_EQUAL(b.memories().size(), (size_t)2);
+    TEST_EQUAL(a.recall_memory(), "ONE");
+    TEST_EQUAL(a.recall_memory(), "");
+    TEST_EQUAL(b.recall_memory(), "ONE");
+    TEST_EQUAL(a.advance_limit(), 2);
+    TEST_EQUAL(b.limit(), 1);
+
+    conversation_state::rule_log log;
+    b.set_rule_log(&log);
+    b.next_reassembly_rule(2, 3);
+    b.next_reassembly_rule(0, 4);
+    a = b; // (a doesn't take over b's log)
+    a.next_reassembly_rule(0, 4);
+    TEST_EQUAL(log.size(), (size_t)2);
+    TEST_EQUAL(log[1].first, (size_t)0);
+    TEST_EQUAL(log[1].second, 1u);
+}
+
+
 /*  The ELIZA script contains the opening_remarks followed by rules.
     (The formal syntax is given in the elizascript namespace below.)
     There are two types of rule: keyword_rule and memory_rule. They
@@ -2380,17 +2916,45 @@ public:
     virtual bool has_transformation() const { return false; }
 
     // use this rule's decomposition/reassembly rules to transform given 'words'
+    // (the rule itself is not changed; the reassembly rule cursors are in
+    // the given conversation state, this rule's starting at cursor_base;
+    // if trace is not null, describe what was done there)
     virtual action apply_transformation(stringlist & /*words*/,
-        const tagmap & /*tags*/, std::string & /*link_keyword*/)
+        const tagmap & /*tags*/, std::string & /*link_keyword*/,
+        conversation_state & /*state*/, size_t /*cursor_base*/,
+        std::ostream * /*trace*/) const
     {
         return action::inapplicable;
     }
 
     virtual stringlist dlist_tags() const { return stringlist(); }
 
-    virtual std::string to_string() const = 0;
+    size_t transformation_count() const { return trans_.size(); }
+
+    // append every word used in this rule to given words
+    virtual void collect_words(stringlist & words) const
+    {
+        words.push_back(keyword_);
+        words.push_back(word_substitution_);
+        for (const auto & t : trans_) {
+            words.insert(words.end(), t.decomposition.begin(), t.decomposition.end());
+            for (const auto & r : t.reassembly_rules)
+                words.insert(words.end(), r.begin(), r.end());
+        }
+    }
+    size_t reassembly_rule_count(size_t t) const { return trans_[t].reassembly_rules.size(); }
+
+    // return the decomposition and reassembly rules of transformation t
+    // as one string (two transformations with the same signature are the same)
+    std::string transformation_signature(size_t t) const
+    {
+        std::string sig("(" + join(trans_[t].decomposition) + ")");
+        for (const auto & r : trans_[t].reassembly_rules)
+            sig += "(" + join(r) + ")";
+        return sig;
+    }
 
-    virtual std::string trace() const { return std::string(); }
+    virtual std::string to_string() const = 0;
 
 protected:
     std::string keyword_;           // the word that triggers this rule
@@ -2400,7 +2964,6 @@ protected:
     struct transform {              // decomposition and associated reassembly rules
         stringlist decomposition;
         std::vector<stringlist> reassembly_rules;
-        unsigned next_reassembly_rule{ 0 };
         transform() = default;
         transform(const stringlist & decomposition,
             const std::vector<stringlist> & reassembly_rules)
@@ -2444,10 +3007,13 @@ public:
 
     bool empty() const { return keyword_.empty() || trans_.empty(); }
 
-    void create_memory(const std::string & keyword, const stringlist & words, const tagmap & tags)
+    // if keyword is the MEMORY keyword and given words match the selected
+    // decomposition, set memory to the new memory and return true
+    bool create_memory(const std::string & keyword, const stringlist & words,
+        const tagmap & tags, stringlist & memory, std::ostream * trace) const
     {
         if (keyword != keyword_)
-            return;
+            return false;
 
         // JW says rules are selected at random [page 41 (f)]
         // But the ELIZA code shows that rules are actually selected via a HASH
@@ -2457,28 +3023,18 @@ public:
 
         stringlist constituents;
         if (!match(tags, transformation.decomposition, words, constituents)) {
-            trace_ << trace_prefix
-                 << "cannot form new memory: decomposition pattern ("
-                 << join(transformation.decomposition)
-                 << ") does not match user text\n";
-            return;
+            if (trace)
+                *trace << trace_prefix
+                    << "cannot form new memory: decomposition pattern ("
+                    << join(transformation.decomposition)
+                    << ") does not match user text\n";
+            return false;
         }
 
-        const auto new_memory{join(reassemble(transformation.reassembly_rules[0], constituents))};
-        trace_ << trace_prefix << "new memory: " << new_memory << '\n';
-        memories_.push_back(new_memory);
-    }
-
-    // return true iff we have at least one saved memory
-    bool memory_exists() const
-    {
-        return !memories_.empty();
-    }
-
-    // return the next saved memory in the queue; remove it from the queue
-    std::string recall_memory()
-    {
-        return memories_.empty() ? "" : pop_front(memories_);
+        memory = reassemble(transformation.reassembly_rules[0], constituents);
+        if (trace)
+            *trace << trace_prefix << "new memory: " << join(memory) << '\n';
+        return true;
     }
 
     virtual std::string to_string() const
@@ -2493,33 +3049,22 @@ public:
         return sexp;
     }
 
-    virtual void clear_trace()
-    {
-        trace_.str("");
-    }
-    virtual std::string trace() const
-    {
-        return trace_.str();
-    }
-    std::string trace_memory_stack() const
+    static std::string trace_memory_stack(const conversation_state & state, const word_table & words)
     {
         std::stringstream s;
-        if (memories_.empty())
+        const memory_queue & memories = state.memories();
+        if (memories.empty())
             s << trace_prefix << "memory queue: <empty>\n";
         else {
             s << trace_prefix << "memory queue:\n";
-            for (auto m : memories_)
-                s << trace_prefix << "  " << m << "\n";
+            for (size_t i = 0; i < memories.size(); ++i)
+                s << trace_prefix << "  " << join(words.decode(memories[i])) << "\n";
         }
         return s.str();
     }
 
     // the MEMORY rule must have this number of transformations
     static constexpr int num_transformations = 4;
-
-private:
-    stringlist memories_;
-    std::stringstream trace_;
 };
 
 
@@ -2552,38 +3097,49 @@ public:
 
     stringlist dlist_tags() const { return tags_; }
 
+    virtual void collect_words(stringlist & words) const
+    {
+        rule_base::collect_words(words);
+        words.insert(words.end(), tags_.begin(), tags_.end());
+        words.push_back(link_keyword_);
+    }
+
     virtual bool has_transformation() const
     {
         return !trans_.empty() || !link_keyword_.empty();
     }
 
     virtual action apply_transformation(
-        stringlist & words, const tagmap & tags, std::string & link_keyword)
+        stringlist & words, const tagmap & tags, std::string & link_keyword,
+        conversation_state & state, size_t cursor_base, std::ostream * trace) const
     {
-        trace_begin(words);
+        if (trace)
+            trace_begin(*trace, words);
         stringlist constituents;
         auto rule = trans_.begin();
         while (rule != trans_.end() && !match(tags, rule->decomposition, words, constituents))
             ++rule;
         if (rule == trans_.end()) {
             if (link_keyword_.empty()) {
-                trace_nomatch();
+                if (trace)
+                    trace_nomatch(*trace);
                 return action::inapplicable; // [page 39 (f)] should not happen?
             }
-            trace_reference(link_keyword_);
+            if (trace)
+                trace_reference(*trace, link_keyword_);
             link_keyword = link_keyword_;
             return action::linkkey;
         }
-        trace_decomp(rule->decomposition, constituents);
+        if (trace)
+            trace_decomp(*trace, rule->decomposition, constituents);
 
         // get the next reassembly rule to be used for this decomposition rule
-        stringlist& reassembly_rule = rule->reassembly_rules[rule->next_reassembly_rule];
-        trace_reassembly(reassembly_rule);
-
-        // update the reassembly rule index so that they all get cycled through
-        rule->next_reassembly_rule++;
-        if (rule->next_reassembly_rule == rule->reassembly_rules.size())
-            rule->next_reassembly_rule = 0;
+        // and update the reassembly rule index so that they all get cycled through
+        const size_t t = cursor_base + (rule - trans_.begin());
+        const stringlist & reassembly_rule = rule->reassembly_rules[
+            state.next_reassembly_rule(t, rule->reassembly_rules.size())];
+        if (trace)
+            trace_reassembly(*trace, reassembly_rule);
 
         // is it the special-case reassembly rule (NEWKEY)?
         if (reassembly_rule.size() == 1 && reassembly_rule[0] == "NEWKEY")
@@ -2652,40 +3208,33 @@ public:
         return sexp;
     }
 
-    virtual std::string trace() const
-    {
-        return trace_.str();
-    }
-
 private:
     stringlist tags_;
     std::string link_keyword_;
 
-    std::stringstream trace_;
-    void trace_begin(const stringlist & words) {
-        trace_.str("");
-        trace_
+    void trace_begin(std::ostream & trace, const stringlist & words) const {
+        trace
             << trace_prefix << "selected keyword: " << keyword_ << '\n'
             << trace_prefix << "input: " << join(words) << '\n';
     }
-    void trace_nomatch() {
-        trace_ << trace_prefix << "ill-formed script? No decomposition rule matches\n";
+    static void trace_nomatch(std::ostream & trace) {
+        trace << trace_prefix << "ill-formed script? No decomposition rule matches\n";
     }
-    void trace_reference(const std::string & ref) {
-        trace_ << trace_prefix << "reference to equivalence class: " << ref << '\n';
+    static void trace_reference(std::ostream & trace, const std::string & ref) {
+        trace << trace_prefix << "reference to equivalence class: " << ref << '\n';
     }
-    void trace_decomp(const stringlist & d, const stringlist & constituents) {
-        trace_ << trace_prefix << "matching decompose pattern: (" << join(d) << ")\n";
-        trace_ << trace_prefix << "decomposition parts: ";
+    static void trace_decomp(std::ostream & trace, const stringlist & d, const stringlist & constituents) {
+        trace << trace_prefix << "matching decompose pattern: (" << join(d) << ")\n";
+        trace << trace_prefix << "decomposition parts: ";
         for (int id = 1; const auto & c : constituents) {
             if (id > 1)
-                trace_ << ", ";
-            trace_ << id++ << ":\"" << c << '"';
+                trace << ", ";
+            trace << id++ << ":\"" << c << '"';
         }
-        trace_ << '\n';
+        trace << '\n';
     }
-    void trace_reassembly(const stringlist & r) {
-        trace_ << trace_prefix << "selected reassemble rule: (" << join(r) << ")\n";
+    static void trace_reassembly(std::ostream & trace, const stringlist & r) {
+        trace << trace_prefix << "selected reassemble rule: (" << join(r) << ")\n";
     }
 };
 
@@ -2709,7 +3258,7 @@ tagmap collect_tags(const rulemap & rules)
 
 
 template<typename T>
-auto get_rule(rulemap & rules, const std::string & keyword)
+auto get_rule(const rulemap & rules, const std::string & keyword)
 {
     auto rule = rules.find(keyword);
     if (rule == rules.end()) {
@@ -2727,6 +3276,158 @@ auto get_rule(rulemap & rules, const std::string & keyword)
 }
 
 
+// return the 64-bit FNV-1a hash of given s, continuing from given h
+uint_least64_t fnv1a(const std::string & s, uint_least64_t h = 0xCBF29CE484222325ull)
+{
+    for (const unsigned char c : s) {
+        h ^= c;
+        h *= 0x100000001B3ull;  // FNV prime
+        h &= 0xFFFFFFFFFFFFFFFFull;
+    }
+    return h;
+}
+
+
+// return a 64-bit FNV-1a hash of the given script's rules; two scripts
+// with the same hash are taken to be the same script
+uint_least64_t script_hash(const rulemap & rules, const rule_memory & mem_rule)
+{
+    uint_least64_t h = fnv1a("");
+    for (const auto & [keyword, rule] : rules)
+        h = fnv1a(rule->to_string(), h);
+    return fnv1a(mem_rule.to_string(), h);
+}
+
+
+/*  Everything a conversation needs from its script. This doesn't change
+    once made, so one script_context may be shared by any number of
+    conversations, each with its own conversation_state. */
+struct script_context {
+    script_context(const rulemap & rules, std::shared_ptr<rule_memory> mem_rule)
+        : rules(rules), mem_rule(mem_rule), tags(collect_tags(rules)),
+        hash(script_hash(rules, *mem_rule)),
+        words([&] {
+            stringlist w;
+            for (const auto & [keyword, rule] : rules)
+                rule->collect_words(w);
+            mem_rule->collect_words(w);
+            return word_table(w);
+        }()),
+        initial_memories(std::make_shared<memory_queue>())
+    {
+        // give each transformation its own cursor in conversation_state
+        // (the rules may be shared with other contexts, so the layout is
+        // kept here, not in the rules)
+        size_t cursor_base = 0;
+        for (const auto & [keyword, rule] : rules) {
+            cursor_bases[rule.get()] = cursor_base;
+            cursor_base += rule->transformation_count();
+            for (size_t t = 0; t < rule->transformation_count(); ++t) {
+                if (rule->reassembly_rule_count(t) > std::numeric_limits<conversation_state::cursor>::max())
+                    throw std::runtime_error("script error: too many reassembly rules for keyword " + keyword);
+                reassembly_counts.push_back(
+                    static_cast<conversation_state::cursor>(rule->reassembly_rule_count(t)));
+            }
+        }
+        initial_cursors = std::make_shared<conversation_state::cursor_vector>(cursor_base, 0);
+    }
+
+    // the ELIZA script in 'rulemap' form
+    const rulemap rules;
+
+    // the one MEMORY rule
+    const std::shared_ptr<rule_memory> mem_rule;
+
+    // e.g. tags[BELIEF] -> (BELIEVE FEEL THINK WISH)
+    // (This is derived from rules. It's a member so we only need derive it once.)
+    const tagmap tags;
+
+    // identifies the script; see eliza::snapshot()
+    const uint_least64_t hash;
+
+    // every word in the script; used to encode MEMORY entries compactly
+    const word_table words;
+
+    // reassembly_counts[t] is the number of reassembly rules in transformation t
+    conversation_state::cursor_vector reassembly_counts;
+
+    // each transformation has a cursor in the conversation_state: the index
+    // of the next reassembly rule to use; the given rule's cursors start at
+    // cursor_base(rule)
+    size_t cursor_base(const rule_base & rule) const { return cursor_bases.at(&rule); }
+    std::unordered_map<const rule_base *, size_t> cursor_bases;
+
+    // the cursors of a new conversation, all zero
+    std::shared_ptr<const conversation_state::cursor_vector> initial_cursors;
+
+    // the MEMORY queue of a new conversation, empty
+    const std::shared_ptr<const memory_queue> initial_memories;
+};
+
+
+/*  How to carry a conversation from one version of a script to another
+    (see eliza::migrate()). A transformation--a decomposition rule and its
+    reassembly rules--that is exactly the same under the same keyword in
+    both versions keeps its cursor; any other starts again at its first
+    reassembly rule. LIMIT and the MEMORY queue carry over as they are.
+    Making a script_migration costs about as much as reading the script,
+    so make one per new version and share it between conversations.
+
+    The migration doesn't keep the old version alive: that is freed when
+    the last conversation using it has moved on. */
+struct script_migration {
+    static constexpr size_t changed = static_cast<size_t>(-1);
+
+    script_migration(const std::shared_ptr<const script_context> & from_context,
+        std::shared_ptr<const script_context> to_context)
+        : from(from_context), to(std::move(to_context)),
+        from_hash(from_context->hash), from_reassembly_counts(from_context->reassembly_counts)
+    {
+        std::unordered_map<std::string, size_t> to_index;
+        const auto to_keys = keys(*to);
+        for (size_t t = 0; t < to_keys.size(); ++t)
+            to_index[to_keys[t]] = t;
+        for (const auto & key : keys(*from_context)) {
+            const auto i = to_index.find(key);
+            cursor_map.push_back(i == to_index.end() ? changed : i->second);
+            if (i != to_index.end())
+                ++kept;
+        }
+    }
+
+    // return true iff this is a migration from the given script
+    bool is_from(const std::shared_ptr<const script_context> & context) const
+    {
+        return !from.owner_before(context) && !context.owner_before(from);
+    }
+
+    const std::weak_ptr<const script_context> from;
+    const std::shared_ptr<const script_context> to;
+    const uint_least64_t from_hash;
+    const conversation_state::cursor_vector from_reassembly_counts;
+    std::vector<size_t> cursor_map;     // [t in from] -> t in to, or changed
+    size_t kept{ 0 };                   // number of cursors carried over
+
+private:
+    // return a key for each transformation: keyword + signature (+ the
+    // number of earlier identical transformations in the same rule, if any)
+    static stringlist keys(const script_context & context)
+    {
+        stringlist result(context.reassembly_counts.size());
+        for (const auto & [keyword, rule] : context.rules) {
+            std::map<std::string, int> seen;
+            for (size_t t = 0; t < rule->transformation_count(); ++t) {
+                std::string key(keyword + '\n' + rule->transformation_signature(t));
+                if (const int n = seen[key]++)
+                    key += '\n' + std::to_string(n);
+                result[context.cursor_base(*rule) + t] = key;
+            }
+        }
+        return result;
+    }
+};
+
+
 // return true iff given c is delimiter (see delimiter())
 bool delimiter_character(char c)
 {
@@ -2787,6 +3488,10 @@ DEF_TEST_FUNC(split_user_input_test)
 class tracer {
 public:
     virtual ~tracer() = 0;
+    // true iff this tracer wants the trace text and script rules passed to
+    // discard_subclause(), create_memory(), transform() etc.; the caller
+    // need not go to the trouble of making them if not
+    virtual bool active() const = 0;
     virtual void begin_response(const stringlist & /*words*/) = 0;
     virtual void limit(int /*limit*/, const std::string & /*built_in_msg*/) = 0;
     virtual void discard_subclause(const std::string & /*text*/) = 0;
@@ -2812,6 +3517,7 @@ tracer::~tracer() = default;
 class null_tracer : public tracer {
 public:
     virtual ~null_tracer() = default;
+    virtual bool active() const { return false; }
     virtual void begin_response(const stringlist & /*words*/) {}
     virtual void limit(int /*limit*/, const std::string & /*built_in_msg*/) {}
     virtual void discard_subclause(const std::string & /*text*/) {}
@@ -2847,6 +3553,7 @@ class string_tracer : public null_tracer {
     std::string word_substitutions_;
 public:
     virtual ~string_tracer() = default;
+    virtual bool active() const { return true; }
     virtual void begin_response(const stringlist & words)
     {
         trace_.str("");
@@ -2946,6 +3653,16 @@ public:
 };
 
 
+// a response part way through being made, stage by stage (see eliza::response())
+struct response_work {
+    stringlist words;                           // the input, then its transformation
+    stringlist keystack;                        // the keywords found, to be tried in order
+    int limit{ 0 };                             // LIMIT for this response
+    const char * message{ nullptr };            // if not null, the reply (a nomatch message)
+    std::string reply;
+};
+
+
 
                 //////// //       //// ////////    ///                    
                 //       //        //       //    // //                   
@@ -2958,7 +3675,14 @@ public:
 class eliza {
 public:
     eliza(const rulemap & rules, std::shared_ptr<rule_memory> mem_rule)
-        : rules_(rules), mem_rule_(mem_rule), tags_(collect_tags(rules_))
+        : eliza(std::make_shared<const script_context>(rules, mem_rule))
+    {}
+
+    // a new conversation using the given script (which may be shared
+    // with other conversations)
+    explicit eliza(std::shared_ptr<const script_context> context)
+        : context_(std::move(context)),
+        state_(context_->initial_cursors, context_->initial_memories)
     {
         /*  In the 1966 CACM ELIZA paper on page 37 Weizenbaum says
             "the procedure recognizes a comma or a period as a delimiter."
@@ -2980,7 +3704,7 @@ public:
     void set_use_nomatch_msgs(bool f) { use_nomatch_msgs_ = f; }
 
     void set_on_newkey_fail_use_none(bool f) { on_newkey_fail_use_none_ = f; }
-    void set_use_limit(bool f) { limit_ = 2; }
+    void set_use_limit(bool f) { state_.set_limit(2); }
 
     void set_delimeters(const stringlist & delims)
     {
@@ -2994,28 +3718,318 @@ public:
             }
         }
     }
+    const stringlist & delimiters() const { return delimiters_; }
 
     // provide the user with a window into ELIZA's thought processes(!)
     void set_tracer(tracer * tr) { trace_ = tr; }
 
 
-    //////////////////////////////// ELIZA ////////////////////////////////
-    //
-    // produce a response to the given input (this is the core ELIZA algorithm)
-    //
-    std::string response(const std::string & input)
+    /*  A conversation's entire mutable state is LIMIT, the next reassembly
+        rule index of every transformation and the MEMORY queue. snapshot()
+        returns this state as a compact binary blob; restore() sets this
+        conversation's state from such a blob. A blob may only be restored
+        into a conversation using the same script as the one it was taken
+        from. The format is
+
+            "ELZS"                  magic
+            version                 1 byte, currently 1
+            script hash             8 bytes, least significant first
+            LIMIT                   1 byte, 1..4
+            cursor count            varint
+            cursors                 varint each, in script_context order
+            memory count            varint
+            memories                varint length + bytes each, oldest first
+
+        (The options set via set_use_nomatch_msgs() etc. are configuration,
+        not conversation state, and are not included.) */
+    std::string snapshot() const
     {
-        // for simplicity, convert the given input string to a list of uppercase words
-        // e.g. "Hello, world!" -> ("HELLO" "," "WORLD" ".")
-        stringlist words(split_user_input(eliza_uppercase(input), punctuation_));
-        trace_->begin_response(words);
-
+        std::string blob(snapshot_magic);
+        blob += static_cast<char>(snapshot_version);
+        for (int i = 0; i < 8; ++i)
+            blob += static_cast<char>((context_->hash >> (8 * i)) & 0xFF);
+        blob += static_cast<char>(state_.limit());
+
+        const auto & cursors = state_.cursors();
+        append_varint(blob, cursors.size());
+        for (const auto c : cursors)
+            append_varint(blob, c);
+
+        const memory_queue & memories = state_.memories();
+        append_varint(blob, memories.size());
+        for (size_t i = 0; i < memories.size(); ++i) {
+            const std::string m(join(context_->words.decode(memories[i])));
+            append_varint(blob, m.size());
+            blob += m;
+        }
+        return blob;
+    }
+
+    // (if given, migration says how to take a blob from a conversation
+    // using migration->from; the blob may then come from either script)
+    void restore(const std::string & blob, const script_migration * migration = nullptr)
+    {
+        auto fail = [](const char * msg) {
+            throw std::runtime_error(std::string("restore: ") + msg);
+        };
+        size_t pos = snapshot_magic.size() + 1 + 8 + 1;
+        if (blob.size() < pos || blob.compare(0, snapshot_magic.size(), snapshot_magic) != 0)
+            fail("not an ELIZA session snapshot");
+        if (static_cast<unsigned char>(blob[snapshot_magic.size()]) != snapshot_version)
+            fail("unsupported snapshot version");
+        uint_least64_t hash = 0;
+        for (int i = 0; i < 8; ++i)
+            hash |= static_cast<uint_least64_t>(static_cast<unsigned char>(blob[snapshot_magic.size() + 1 + i])) << (8 * i);
+        if (migration && migration->to != context_)
+            fail("migration is not to this conversation's script");
+        const bool migrating = hash != context_->hash && migration && hash == migration->from_hash;
+        if (hash != context_->hash && !migrating)
+            fail("snapshot was taken from a different script");
+        const int limit = static_cast<unsigned char>(blob[pos - 1]);
+        if (limit < 1 || limit > 4)
+            fail("invalid LIMIT");
+
+        // decode everything before changing anything so that a bad blob
+        // leaves this conversation as it was
+        const auto & counts = migrating ? migration->from_reassembly_counts : context_->reassembly_counts;
+        if (read_varint(blob, pos) != counts.size())
+            fail("snapshot cursor count does not match script");
+        conversation_state::cursor_vector cursors(counts.size());
+        for (size_t t = 0; t < counts.size(); ++t) {
+            const auto c = read_varint(blob, pos);
+            if (c >= counts[t])
+                fail("reassembly rule index out of range");
+            cursors[t] = static_cast<conversation_state::cursor>(c);
+        }
+        if (migrating)
+            cursors = migrate_cursors(cursors, *migration);
+        // (if there are more memories than our queue can hold, the
+        // queue's eviction policy decides which are kept)
+        memory_queue memories(state_.memories().capacity(), state_.memories().policy());
+        for (auto n = read_varint(blob, pos); n; --n) {
+            const auto len = read_varint(blob, pos);
+            if (len > blob.size() - pos)
+                fail("unexpected end of data");
+            memories.push(context_->words.encode(split(blob.substr(pos, len))));
+            pos += len;
+        }
+        if (pos != blob.size())
+            fail("unexpected data after end of snapshot");
+
+        state_.set_limit(limit);
+        state_.set_cursors(std::move(cursors));
+        state_.set_memories(std::move(memories));
+    }
+
+    // return a new conversation that continues from this one's current
+    // state; the two then go their separate ways. This is O(1): the new
+    // conversation shares this one's script and, until one of them
+    // changes it, its state. (The new conversation is not traced.)
+    std::unique_ptr<eliza> fork() const
+    {
+        auto child = std::make_unique<eliza>(context_);
+        child->use_limit_ = use_limit_;
+        child->delimiters_ = delimiters_;
+        child->punctuation_ = punctuation_;
+        child->on_newkey_fail_use_none_ = on_newkey_fail_use_none_;
+        child->use_nomatch_msgs_ = use_nomatch_msgs_;
+        child->state_ = state_;
+        return child;
+    }
+
+    // limit the MEMORY queue to the given number of memories; see memory_queue
+    void set_memory_capacity(size_t capacity,
+        memory_queue::eviction policy = memory_queue::eviction::drop_newest)
+    {
+        state_.set_memory_capacity(capacity, policy);
+    }
+
+    // start this conversation afresh, as if newly constructed, but keep
+    // any settings (delimiters, MEMORY capacity etc.); the tracer reverts
+    // to the null tracer
+    void reset()
+    {
+        const size_t capacity = state_.memories().capacity();
+        const auto policy = state_.memories().policy();
+        state_ = conversation_state(context_->initial_cursors, context_->initial_memories);
+        if (capacity != state_.memories().capacity() || policy != state_.memories().policy())
+            state_.set_memory_capacity(capacity, policy);
+        trace_ = &nulltr_;
+    }
+
+    // this conversation's state (see conversation_state)
+    const conversation_state & state() const { return state_; }
+    void set_state(const conversation_state & state) { state_ = state; }
+
+    // record the reassembly rules used in subsequent responses in given log
+    // (see conversation_state::set_rule_log); null to stop
+    void set_rule_log(conversation_state::rule_log * log) { state_.set_rule_log(log); }
+
+    const script_context & context() const { return *context_; }
+    const std::shared_ptr<const script_context> & shared_context() const { return context_; }
+
+    // carry this conversation on under a new version of its script (see
+    // script_migration); migration.from must be this conversation's script
+    void migrate(const script_migration & migration)
+    {
+        if (!migration.is_from(context_))
+            throw std::runtime_error("migrate: conversation is not using the script migrated from");
+        const memory_queue & old_memories = state_.memories();
+        memory_queue memories(old_memories.capacity(), old_memories.policy());
+        for (size_t i = 0; i < old_memories.size(); ++i)
+            memories.push(migration.to->words.encode(context_->words.decode(old_memories[i])));
+
+        conversation_state state(migration.to->initial_cursors, migration.to->initial_memories);
+        state.set_limit(state_.limit());
+        state.set_cursors(migrate_cursors(state_.cursors(), migration));
+        state.set_memories(std::move(memories));
+        state_ = std::move(state);
+        context_ = migration.to;
+    }
+
+    /*  pack() returns this conversation's state in as few bytes as we can
+        reasonably manage, for keeping idle conversations in memory (see
+        idle_session_store); unpack() sets the state from such bytes. Unlike
+        snapshot() there is no header or script hash: the caller must only
+        unpack into a conversation using the same script_context. Most
+        cursors are zero, so only the non-zero ones are stored. The format is
+
+            flags                   1 byte: bits 0-1 LIMIT - 1, bit 2 set
+                                    iff any memories follow
+            non-zero cursor count   varint
+            cursors                 varint gap since the previous non-zero
+                                    cursor, then varint value (one byte for
+                                    any cursor < 128)
+            memory count            varint (only if flags bit 2 is set)
+            memories                varint length + word_table encoding */
+    std::string pack() const
+    {
+        const memory_queue & memories = state_.memories();
+        std::string packed;
+        packed += static_cast<char>((state_.limit() - 1) | (memories.empty() ? 0 : 4));
+
+        const auto & cursors = state_.cursors();
+        const auto nonzero = cursors.size() - std::count(cursors.begin(), cursors.end(), 0);
+        append_varint(packed, nonzero);
+        for (size_t t = 0, next = 0; t < cursors.size(); ++t) {
+            if (cursors[t]) {
+                append_varint(packed, t - next);
+                append_varint(packed, cursors[t]);
+                next = t + 1;
+            }
+        }
+
+        if (!memories.empty()) {
+            append_varint(packed, memories.size());
+            for (size_t i = 0; i < memories.size(); ++i) {
+                append_varint(packed, memories[i].size());
+                packed += memories[i];
+            }
+        }
+        return packed;
+    }
+
+    void unpack(const std::string & packed)
+    {
+        auto fail = [](const char * msg) {
+            throw std::runtime_error(std::string("unpack: ") + msg);
+        };
+        if (packed.empty())
+            fail("no data");
+        const unsigned flags = static_cast<unsigned char>(packed[0]);
+        if (flags & ~7u)
+            fail("invalid flags");
+        size_t pos = 1;
+
+        const auto & counts = context_->reassembly_counts;
+        conversation_state::cursor_vector cursors(counts.size(), 0);
+        size_t t = 0;
+        for (auto n = read_varint(packed, pos); n; --n) {
+            t += read_varint(packed, pos);
+            if (t >= counts.size())
+                fail("cursor index out of range");
+            const auto c = read_varint(packed, pos);
+            if (c == 0 || c >= counts[t])
+                fail("reassembly rule index out of range");
+            cursors[t++] = static_cast<conversation_state::cursor>(c);
+        }
+
+        memory_queue memories(state_.memories().capacity(), state_.memories().policy());
+        if (flags & 4) {
+            for (auto n = read_varint(packed, pos); n; --n) {
+                const auto len = read_varint(packed, pos);
+                if (len > packed.size() - pos)
+                    fail("unexpected end of data");
+                memories.push(packed.substr(pos, len));
+                pos += len;
+            }
+        }
+        if (pos != packed.size())
+            fail("unexpected data after end of state");
+
+        state_.set_limit(static_cast<int>(flags & 3) + 1);
+        state_.set_cursors(std::move(cursors));
+        state_.set_memories(std::move(memories));
+    }
+
+
+    //////////////////////////////// ELIZA ////////////////////////////////
+    //
+    // produce a response to the given input (this is the core ELIZA algorithm)
+    //
+    std::string response(const std::string & input)
+    {
+        response_work w;
+        split_input(input, w);
+        scan_keywords(w);
+        transform(w);
+        assemble_reply(w);
+        return std::move(w.reply);
+    }
+
+    // the cheapest reply there is, for when there's no time for response():
+    // advance LIMIT and return the nomatch message it selects, as if no
+    // transformation had applied; nothing else changes (the input isn't
+    // even looked at, so isn't remembered)
+    std::string shed_response()
+    {
+        return nomatch_msgs_[state_.advance_limit() - 1];
+    }
+
+    /*  The response is made in four stages, each of which may be run on
+        its own, e.g. each on its own thread (see response_pipeline). The
+        stages of one response must run in order, and each stage must see
+        a conversation's inputs in the order they were given. But while one
+        input is being transformed the next may be scanned: scan_keywords()
+        changes only LIMIT, which transform() doesn't use, and transform()
+        changes only the cursors and memories, which scan_keywords() uses
+        only when tracing. (So trace a conversation only if it's run a
+        stage at a time.) */
+
+    // stage 1: convert the input to a list of uppercase words
+    // e.g. "Hello, world!" -> ("HELLO" "," "WORLD" ".")
+    void split_input(const std::string & input, response_work & w) const
+    {
+        w.words = split_user_input(eliza_uppercase(input), punctuation_);
+    }
+
+    // stage 2: advance LIMIT; keep only the first clause to contain a
+    // keyword; build the keystack; apply word substitutions
+    void scan_keywords(response_work & w)
+    {
+        stringlist & words = w.words;
+        trace_->begin_response(words);
+
+        const rulemap & rules = context_->rules;
+        const bool tracing = trace_->active();
+
         // JW's "a certain counting mechanism" is updated for each response
-        limit_ = limit_ % 4 + 1;
-        trace_->limit(limit_, nomatch_msgs_[limit_ - 1]);
+        w.limit = state_.advance_limit();
+        trace_->limit(w.limit, nomatch_msgs_[w.limit - 1]);
 
         // scan for keywords [page 38 (c)]; build the keystack; apply word substitutions
-        stringlist keystack;
+        stringlist & keystack = w.keystack;
+        keystack.clear();
         int top_rank = 0;
         for (auto word = words.begin(); word != words.end(); ) {
             if (delimiter(*word)) {
@@ -3023,7 +4037,8 @@ public:
                 if (keystack.empty()) {
                     // discard left of and including, continue scanning what remains
                     ++word;
-                    trace_->discard_subclause(join({words.begin(), word}));
+                    if (tracing)
+                        trace_->discard_subclause(join({words.begin(), word}));
                     word = words.erase(words.begin(), word);
                     continue;
                 }
@@ -3034,8 +4049,8 @@ public:
                 }
             }
 
-            const auto r = rules_.find(*word);
-            if (r != rules_.end()) {
+            const auto r = rules.find(*word);
+            if (r != rules.end()) {
                 const auto & rule = r->second;
                 if (rule->has_transformation()) {
                     if (rule->precedence() > top_rank) {
@@ -3057,18 +4072,38 @@ public:
 
             ++word;
         }
-        trace_->subclause_complete(join(words), keystack, rules_);
+        if (tracing) {
+            trace_->subclause_complete(join(words), keystack, rules);
+            trace_->memory_stack(rule_memory::trace_memory_stack(state_, context_->words));
+        }
+    }
+
+    // stage 3: recall a memory, or apply the transformations of the
+    // keywords on the keystack, or of NONE; this leaves either w.words
+    // transformed or w.message set
+    void transform(response_work & w)
+    {
+        stringlist & words = w.words;
+        stringlist & keystack = w.keystack;
+        const int limit = w.limit;
+        w.message = nullptr;
+
+        const rulemap & rules = context_->rules;
+        const tagmap & tags = context_->tags;
+        const rule_memory & mem_rule = *context_->mem_rule;
+        const bool tracing = trace_->active();
 
-        mem_rule_->clear_trace();
-        trace_->memory_stack(mem_rule_->trace_memory_stack());
+        std::stringstream memory_trace;
         if (keystack.empty()) {
             /*  a text without keywords; can we recall a MEMORY ? [page 41 (f)]
                 JW's 1966 CACM paper refers to this decision as "a certain counting
                 mechanism is in a particular state." The ELIZA code shows that the
                 memory is recalled only when LIMIT has the value 4 */
-            if ((!use_limit_ || limit_ == 4) && mem_rule_->memory_exists()) {
-                trace_->using_memory(mem_rule_->to_string());
-                return mem_rule_->recall_memory();
+            if ((!use_limit_ || limit == 4) && state_.memory_exists()) {
+                if (tracing)
+                    trace_->using_memory(mem_rule.to_string());
+                words = context_->words.decode(state_.recall_memory());
+                return;
             }
         }
 
@@ -3078,33 +4113,47 @@ public:
             const std::string top_keyword = pop_front(keystack);
             trace_->pre_transform(top_keyword, words);
 
-            auto r = rules_.find(top_keyword);
-            if (r == rules_.end()) {
+            auto r = rules.find(top_keyword);
+            if (r == rules.end()) {
                 // e.g. could happen if a rule links to a non-existent keyword
                 trace_->unknown_key(top_keyword, use_nomatch_msgs_);
-                if (use_nomatch_msgs_)
-                    return nomatch_msgs_[limit_ - 1];
+                if (use_nomatch_msgs_) {
+                    w.message = nomatch_msgs_[limit - 1];
+                    return;
+                }
                 break; // (use NONE message)
             }
-            auto rule = r->second;
+            const auto & rule = r->second;
 
             // try to lay down a memory for future use
-            mem_rule_->create_memory(top_keyword, words, tags_);
-            trace_->create_memory(mem_rule_->trace());
+            stringlist memory;
+            if (mem_rule.create_memory(top_keyword, words, tags, memory, tracing ? &memory_trace : nullptr)) {
+                if (!state_.push_memory(context_->words.encode(memory)) && tracing)
+                    memory_trace << trace_prefix << "memory queue full: "
+                        << (state_.memories().policy() == memory_queue::eviction::drop_oldest
+                            ? "oldest memory discarded\n" : "new memory discarded\n");
+            }
+            if (tracing)
+                trace_->create_memory(memory_trace.str());
 
             // perform the transformation for this rule
             std::string link_keyword;
-            auto act = rule->apply_transformation(words, tags_, link_keyword);
-            trace_->transform(rule->trace(), rule->to_string());
+            std::stringstream rule_trace;
+            auto act = rule->apply_transformation(words, tags, link_keyword,
+                state_, context_->cursor_base(*rule), tracing ? &rule_trace : nullptr);
+            if (tracing)
+                trace_->transform(rule_trace.str(), rule->to_string());
 
             if (act == rule_base::action::complete)
-                return join(words); // decomposition/reassembly successfully applied
+                return; // decomposition/reassembly successfully applied
 
             if (act == rule_base::action::inapplicable) {
                 // no decomposition rule matched the input words; script error
                 trace_->decomp_failed(use_nomatch_msgs_);
-                if (use_nomatch_msgs_)
-                    return nomatch_msgs_[limit_ - 1];
+                if (use_nomatch_msgs_) {
+                    w.message = nomatch_msgs_[limit - 1];
+                    return;
+                }
                 break; // (use NONE message)
             }
 
@@ -3120,7 +4169,8 @@ public:
                 // study suggests that a built-in message is used.
                 if (!on_newkey_fail_use_none_ && use_nomatch_msgs_) {
                     trace_->newkey_failed("built-in nomatch");
-                    return nomatch_msgs_[limit_ - 1];
+                    w.message = nomatch_msgs_[limit - 1];
+                    return;
                 }
                 trace_->newkey_failed("NONE");
                 break; // (use NONE message)
@@ -3128,18 +4178,39 @@ public:
         }
 
         // last resort: the NONE rule never fails to produce a response [page 41 (d)]
-        auto none_rule = get_rule<rule_keyword>(rules_, elizalogic::special_rule_none);
+        auto none_rule = get_rule<rule_keyword>(rules, elizalogic::special_rule_none);
         std::string discard;
-        none_rule->apply_transformation(words, tags_, discard);
-        trace_->using_none(none_rule->to_string());
-        return join(words);
+        none_rule->apply_transformation(words, tags, discard, state_,
+            context_->cursor_base(*none_rule), nullptr);
+        if (tracing)
+            trace_->using_none(none_rule->to_string());
+    }
+
+    // stage 4: make the reply text
+    void assemble_reply(response_work & w) const
+    {
+        w.reply = w.message ? w.message : join(w.words);
     }
     //////////////////////////////// end ////////////////////////////////
 
 
 private:
-    // JW's "a certain counting mechanism," LIMIT, cycles through 1..4, then back to 1
-    int limit_{ 1 };
+    static conversation_state::cursor_vector migrate_cursors(
+        const conversation_state::cursor_vector & cursors, const script_migration & migration)
+    {
+        conversation_state::cursor_vector result(migration.to->reassembly_counts.size(), 0);
+        for (size_t t = 0; t < cursors.size() && t < migration.cursor_map.size(); ++t)
+            if (migration.cursor_map[t] != script_migration::changed)
+                result[migration.cursor_map[t]] = cursors[t];
+        return result;
+    }
+
+    // the script, shared with any other conversations using it
+    std::shared_ptr<const script_context> context_;
+
+    // LIMIT, cursors and MEMORY queue; everything that changes as we talk
+    conversation_state state_;
+
     bool use_limit_{ true };
     stringlist delimiters_;
     std::string punctuation_;
@@ -3165,17 +4236,10 @@ private:
         nomatch message, not a NONE message. */
     bool on_newkey_fail_use_none_{ true };
 
-    // the ELIZA script in 'rulemap' form
-    rulemap rules_;
-
-    // the one MEMORY rule
-    std::shared_ptr<rule_memory> mem_rule_;
-
-    // e.g. tags[BELIEF] -> (BELIEVE FEEL THINK WISH)
-    // (This is derived from rules_. It's a member so we only need derive it once.)
-    const tagmap tags_;
+    static inline const std::string snapshot_magic{"ELZS"};
+    static constexpr unsigned char snapshot_version = 1;
 
-    // script error messages hard-coded in JW's ELIZA, selected by LIMIT (our limit_)
+    // script error messages hard-coded in JW's ELIZA, selected by LIMIT
     static const char * const nomatch_msgs_[4];
     bool use_nomatch_msgs_{ true };
 
@@ -3183,12 +4247,15 @@ private:
     null_tracer nulltr_;
     tracer * trace_{ &nulltr_ };
 
+    // (batch_scanner does scan_keywords() for many conversations at once)
+    friend class batch_scanner;
+
     // eliza isn't copyable because various members aren't copyable
     eliza(const eliza &) = delete;
     eliza & operator=(const eliza &) = delete;
 };
 
-// script error messages hard-coded in JW's ELIZA, selected by LIMIT (our limit_)
+// script error messages hard-coded in JW's ELIZA, selected by LIMIT
 const char * const eliza::nomatch_msgs_[4] = {
     "PLEASE CONTINUE",
     "HMMM",
@@ -3196,911 +4263,4034 @@ const char * const eliza::nomatch_msgs_[4] = {
     "I SEE"
 };
 
-}//namespace elizalogic
 
 
+/*  Holds many conversations, all using the same script, keyed by session
+    id. Most conversations are idle most of the time, so any conversation
+    not used for a while can be demoted to its packed state (see
+    eliza::pack()), typically a few tens of bytes. A demoted conversation
+    is re-inflated when it is next used; the caller can't tell the
+    difference. Call demote_idle() from time to time to do the demoting. */
+class idle_session_store {
+public:
+    using clock = std::chrono::steady_clock;
+
+    // each new or re-inflated conversation is passed to configure, which
+    // may e.g. set delimiters; any settings must be re-applied here as only
+    // the conversation's state survives demotion
+    idle_session_store(
+        std::shared_ptr<const script_context> context,
+        clock::duration idle_time,
+        std::function<void(eliza &)> configure = nullptr)
+        : context_(std::move(context)), idle_time_(idle_time), configure_(std::move(configure))
+    {}
 
+    // return ELIZA's response to given input in the conversation with
+    // the given id, starting a new conversation if there isn't one
+    std::string response(const std::string & id, const std::string & input, clock::time_point now)
+    {
+        return session(id, now).response(input);
+    }
 
+    // return the conversation with the given id, starting a new
+    // conversation if there isn't one and re-inflating it if it's idle
+    eliza & session(const std::string & id, clock::time_point now)
+    {
+        auto & s = sessions_[id];
+        s.last_used = now;
+        if (!s.live) {
+            s.live = std::make_unique<eliza>(context_);
+            if (configure_)
+                configure_(*s.live);
+            if (!s.packed.empty()) {
+                s.live->unpack(s.packed);
+                s.packed.clear();
+                s.packed.shrink_to_fit();
+                --idle_count_;
+            }
+        }
+        return *s.live;
+    }
 
- //////// //       //// ////////    ///     //////   //////  ////////  //// ////////  //////// 
- //       //        //       //    // //   //    // //    // //     //  //  //     //    //    
- //       //        //      //    //   //  //       //       //     //  //  //     //    //    
- //////   //        //     //    //     //  //////  //       ////////   //  ////////     //    
- //       //        //    //     /////////       // //       //   //    //  //           //    
- //       //        //   //      //     // //    // //    // //    //   //  //           //    
- //////// //////// //// //////// //     //  //////   //////  //     // //// //           //    
+    // pack every conversation not used since now - idle_time; return the
+    // number of conversations packed
+    size_t demote_idle(clock::time_point now)
+    {
+        size_t demoted = 0;
+        for (auto & [id, s] : sessions_) {
+            if (s.live && now - s.last_used >= idle_time_) {
+                s.packed = s.live->pack();
+                s.live.reset();
+                ++idle_count_;
+                ++demoted;
+            }
+        }
+        return demoted;
+    }
 
+    // forget the conversation with the given id
+    void erase(const std::string & id)
+    {
+        auto s = sessions_.find(id);
+        if (s != sessions_.end()) {
+            if (!s->second.live)
+                --idle_count_;
+            sessions_.erase(s);
+        }
+    }
 
-namespace elizascript { // reader for 1966 ELIZA script file format
+    size_t size() const { return sessions_.size(); }
+    size_t idle_count() const { return idle_count_; }
 
+    // return the total size of the packed state of all idle conversations
+    size_t idle_bytes() const
+    {
+        size_t bytes = 0;
+        for (const auto & [id, s] : sessions_)
+            if (!s.live)
+                bytes += s.packed.size();
+        return bytes;
+    }
 
-/*  This is my understanding of the ELIZA script file from the explanation
-    in the CACM article and observation of the example script given in the
-    APPENDIX to the CACM article:
+private:
+    struct session_entry {
+        std::unique_ptr<eliza> live;    // null iff the conversation is idle...
+        std::string packed;             // ...in which case this is its state
+        clock::time_point last_used;
+    };
 
-    The script is a series of S-expressions. The first S-expression is a list
-    of words that ELIZA will emit at startup [page 42 (a)]. This may be
-    followed by the atom START. Following that are the pattern-matching and
-    message assembly Rules. Finally, there may be an empty list.
+    std::shared_ptr<const script_context> context_;
+    clock::duration idle_time_;
+    std::function<void(eliza &)> configure_;
+    std::unordered_map<std::string, session_entry> sessions_;
+    size_t idle_count_{ 0 };
+};
 
-    e.g.
-        (HOW DO YOU DO.  PLEASE TELL ME YOUR PROBLEM)
-        START
-        <Rules>
-        ()
 
-    The following modified BNF is used to define the ELIZA script syntax.
+// a link in an intrusive doubly-linked circular list; a hook that is not
+// in a list points to itself. owner points to the object containing the hook.
+struct list_hook {
+    list_hook * prev{ this };
+    list_hook * next{ this };
+    void * owner{ nullptr };
 
-        x : y ;
+    list_hook() = default;
+    explicit list_hook(void * owner) : owner(owner) {}
+    list_hook(const list_hook &) = delete;
+    list_hook & operator=(const list_hook &) = delete;
+    ~list_hook() { unlink(); }
 
-    Things on the left of the colon must be replaced by (or "produce") the
-    things on the right, and things on the right of the colon are either
-    terminals or must also appear on the left in some other rule.
-    The semicolon signals the end of the rule. In addition, things on the
-    right may be sequences, choices or repetitions:
+    bool linked() const { return next != this; }
 
-        x y     means there must be an x followed by a y here
-        x|y     means there must be either x or y here
-        [x]     means there must be zero or one of x here
-        {x}     means there must be zero of more x here; note that {x|y}
-                produces, for example, x, y, xx, yy, xy, yx, xyx, xyxxy, ...
-        'x'     means literally x, a terminal
+    void unlink()
+    {
+        prev->next = next;
+        next->prev = prev;
+        prev = next = this;
+    }
 
-    The ELIZA script syntax:
+    // link this hook into a list immediately before given hook
+    void link_before(list_hook & h)
+    {
+        unlink();
+        prev = h.prev;
+        next = &h;
+        h.prev->next = this;
+        h.prev = this;
+    }
+};
 
-    eliza_script        : opening_remarks ['START'] rules ['(' ')']             ;
-    opening_remarks     : '(' {word | punctuation} ')'                          ;
-    rules               : keyword_rule {keyword_rule} memory_rule none_rule     ;
 
-    keyword_rule        : '(' keyword rule ')'                                  ;
-    keyword             : word                                                  ;
-    rule                : '=' substitute_word
-                        | 'DLIST' tags
-                        | ['=' substitute_word]
-                            ['DLIST' tags]
-                            [precedence]
-                            reference
-                        | ['=' substitute_word]
-                            ['DLIST' tags]
-                            [precedence]
-                            transformation {transformation}
-                            [reference]                                         ;
+/*  A hierarchical timer wheel: levels wheels of 64 slots each, where a slot
+    on level n covers 64^n ticks. A timer is placed on the lowest level on
+    which its expiry time falls within the current revolution and moves
+    down when the wheel below reaches the start of its slot. Scheduling and cancelling are O(1);
+    advancing the time is O(1) per tick plus the timers that expire or move. */
+class timer_wheel {
+public:
+    struct timer : list_hook {
+        explicit timer(void * owner) : list_hook(owner) {}
+        uint_least64_t expires{ 0 };
+    };
 
-    memory_rule         : '(' 'MEMORY' keyword
-                            '(' decompose_terms '=' reassemble_terms ')'
-                            '(' decompose_terms '=' reassemble_terms ')'
-                            '(' decompose_terms '=' reassemble_terms ')'
-                            '(' decompose_terms '=' reassemble_terms ')' ')'    ;
+    static constexpr unsigned levels = 4;
+    static constexpr unsigned slot_bits = 6;
+    static constexpr unsigned slots = 1u << slot_bits;
+    // (the top wheel may not wrap round to its current slot)
+    static constexpr uint_least64_t max_delay = (slots - 1ull) << (slot_bits * (levels - 1));
 
-    none_rule           : '(' 'NONE' '(' '(' '0' ')'
-                            reassemble_pattern {reassemble_pattern} ')' ')'     ;
+    explicit timer_wheel(uint_least64_t now = 0) : now_(now) {}
 
-    substitute_word     : word                                                  ;
-    precedence          : integer                                               ;
-    reference           : '(' '=' keyword ')'                                   ;
+    uint_least64_t now() const { return now_; }
 
-    transformation      : '(' decompose_pattern
-                            reassemble_rule {reassemble_rule} ')'               ;
-    decompose_pattern   : '(' decompose_terms ')'                               ;
-    decompose_terms     : decompose_term {decompose_term}                       ;
-    decompose_term      : word | match_count | tags | any_of                    ;
-    match_count         : integer                                               ;
-    tags                : '(' '/' word {word} ')'                               ;
-    any_of              : '(' '*' word {word} ')'                               ;
+    // (re)schedule given timer to expire at given tick (which is clamped
+    // to the range the wheel can hold)
+    void schedule(timer & t, uint_least64_t expires)
+    {
+        t.expires = std::clamp(expires, now_ + 1, now_ + max_delay);
+        place(t);
+    }
 
-    reassemble_rule     : reassemble_pattern
-                        | reference
-                        | newkey
-                        | pre_transform_ref                                     ;
+    void cancel(timer & t) { t.unlink(); }
 
-    reassemble_pattern  : '(' reassemble_terms ')'                              ;
-    reassemble_terms    : reassemble_term {reassemble_term}                     ;
-    reassemble_term     : word | punctuation | match_index                      ;
-    match_index         : integer                                               ;
-    newkey              : '(' 'NEWKEY' ')'                                      ;
-    pre_transform_ref   : '(' 'PRE' reassemble_pattern reference ')'            ;
+    // advance the time to given tick, calling on_expire(t) for each timer
+    // t that expires on the way; on_expire may schedule or cancel timers
+    template<typename F>
+    void advance(uint_least64_t now, F on_expire)
+    {
+        while (now_ < now) {
+            ++now_;
+            // cascade: when a wheel completes a revolution, move the timers
+            // from the next slot of the wheel above down to where they belong
+            for (unsigned level = 1; level < levels; ++level) {
+                if ((now_ & ((1ull << (slot_bits * level)) - 1)) != 0)
+                    break;
+                list_hook & slot = wheel_[level][(now_ >> (slot_bits * level)) & (slots - 1)];
+                while (slot.linked())
+                    place(*static_cast<timer *>(slot.next));
+            }
+            list_hook & due = wheel_[0][now_ & (slots - 1)];
+            while (due.linked()) {
+                timer & t = *static_cast<timer *>(due.next);
+                t.unlink();
+                on_expire(t);
+            }
+        }
+    }
 
-    word                : word_char {word_char}                                 ;
-    word_char           : 'A'-'Z' | '-' | ''' (i.e. a single quote)             ;
-    punctuation         : ',' | '.'                                             ;
-    integer             : digit {digit}                                         ;
-    digit               : '0'-'9'                                               ;
+private:
+    uint_least64_t now_;
+    list_hook wheel_[levels][slots];
 
+    void place(timer & t)
+    {
+        unsigned level = 0;
+        while (level + 1 < levels
+                && (t.expires >> (slot_bits * (level + 1))) != (now_ >> (slot_bits * (level + 1))))
+            ++level;
+        t.link_before(wheel_[level][(t.expires >> (slot_bits * level)) & (slots - 1)]);
+    }
+};
 
-    Note that whitespace is ignored, except where it is necessary to separate
-    symbols that would otherwise merge. For example, two adjacent words need
-    at least one space between them to stop them merging into one.
 
-    To the syntax we must add these semantic rules
+DEF_TEST_FUNC(timer_wheel_test)
+{
+    timer_wheel wheel(1000);
+    std::vector<std::unique_ptr<timer_wheel::timer>> timers;
+    std::vector<uint_least64_t> delays{ 1, 5, 63, 64, 65, 3000, 4095, 4096, 4097, 300000 };
+    for (uint_least64_t r = 1; delays.size() < 500; ) {
+        r = (r * 6364136223846793005ull + 1442695040888963407ull) & 0xFFFFFFFFFFFFFFFFull;
+        delays.push_back(1 + (r >> 33) % 300000);
+    }
+    delays.push_back(5);
+    for (auto d : delays) {
+        timers.push_back(std::make_unique<timer_wheel::timer>(nullptr));
+        wheel.schedule(*timers.back(), wheel.now() + d);
+    }
+    wheel.cancel(*timers.back());
+
+    // every timer fires exactly when due
+    size_t fired = 0, late = 0;
+    wheel.advance(1000 + 300000, [&](timer_wheel::timer & t) {
+        ++fired;
+        if (t.expires != wheel.now())
+            ++late;
+    });
+    TEST_EQUAL(fired, delays.size() - 1);
+    TEST_EQUAL(late, (size_t)0);
+
+    // a timer may be rescheduled from within its own expiry
+    timer_wheel::timer t(nullptr);
+    int count = 0;
+    wheel.schedule(t, wheel.now() + 10);
+    wheel.advance(wheel.now() + 100, [&](timer_wheel::timer & x) {
+        if (++count < 3)
+            wheel.schedule(x, wheel.now() + 10);
+    });
+    TEST_EQUAL(count, 3);
+}
 
-    1. No two keyword_rules may have the same keyword.
 
-    2. If there are multiple transformation rules, the decompose_pattern of
-    each is tried in turn and the first that successfully matches the user’s
-    input text is selected. If none of the decompose_patterns match the user’s
-    input, and the transformation rules are not followed by a reference, the
-    keyword rule fails to produce a response and ELIZA will emit one of four
-    built-in messages.
+// somewhere to keep conversations evicted from a session_table, as
+// eliza::snapshot() blobs, until they're wanted again
+class snapshot_store {
+public:
+    virtual ~snapshot_store() = default;
+    virtual void put(const std::string & id, std::string snapshot) = 0;
+    // if there's a snapshot for id, remove it from the store, set given
+    // snapshot to it and return true; otherwise return false
+    virtual bool take(const std::string & id, std::string & snapshot) = 0;
+};
 
-    3. If a transformation has multiple reassemble_rules they are used in
-    turn: the first time a decompose_pattern matches a user's input the first
-    reassemble_rule is used to create ELIZA’s response. The next time the
-    user's input matches the same decompose_pattern the second reassemble_rule
-    is used, and so on. When they have all been used a subsequent match will
-    begin again with the first reassemble_rule.
 
-    4. There must be exactly one memory_rule. The keyword associated with the
-    memory_rule must also be the keyword in one of the keyword_rules.
+class memory_snapshot_store : public snapshot_store {
+public:
+    virtual void put(const std::string & id, std::string snapshot)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        snapshots_[id] = std::move(snapshot);
+    }
 
-    5. There must be a keyword_rule for the special keyword NONE. This rule
-    must have a decompose_pattern that matches any text, (0), and associated
-    "content-free" remarks, such as "PLEASE GO ON". It must not have a
-    substitute_word, precedence or any DLIST tags.
+    virtual bool take(const std::string & id, std::string & snapshot)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto s = snapshots_.find(id);
+        if (s == snapshots_.end())
+            return false;
+        snapshot = std::move(s->second);
+        snapshots_.erase(s);
+        return true;
+    }
 
-    6. Any tag word referenced in a decompose_pattern must also be associated
-    with at least one keyword via the DLIST mechanism.
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return snapshots_.size();
+    }
 
-    7. match_count will match the specified number of words, but doesn't
-    specify what the words are. So a match_count of 2 means there must be two
-    words here, but they can be any two words. A match_count of 0 means there
-    can be any number, including none, of any words here.
+private:
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, std::string> snapshots_;
+};
 
-    8. match_index is a 1-based index of the parts matching the
-    decompose_pattern. For example, a decompose_pattern (A 1 0) will match the
-    text "A HILL OF BEANS" and when associated with the reassemble_pattern
-    (FIRST 1 SECOND 2 THIRD 3) will produce the output "FIRST A SECOND HILL
-    THIRD OF BEANS."
 
-    9. There must exist a keyword_rule for any keyword referred to in a
-    (=keyword) reference.
+/*  A conversation held in a session_table; lock mutex while using
+    conversation. Sessions served by different threads are often allocated
+    side by side, so each session starts on a cache line and is padded to
+    whole lines: the mutex and eliza's conversation_state, written on every
+    response, never share a line with another session. (The cursors and
+    MEMORY queue the state refers to are in lines of their own; see
+    cache_line_allocator. The script_context every session refers to is
+    only ever read.) */
+struct alignas(cache_line_size) session {
+    explicit session(std::shared_ptr<const script_context> context)
+        : conversation(std::move(context))
+    {}
+    std::mutex mutex;
+    eliza conversation;
+    bool retired{ false };  // true once evicted from its session_table (which
+                            // may hold a newer copy); check it under mutex
+
+    // inputs waiting to be answered by a session_scheduler, oldest first
+    struct inbox {
+        using reply_handler = std::function<void(const std::string & reply)>;
+        struct waiting {
+            std::string input;
+            reply_handler handler;
+            std::chrono::steady_clock::time_point queued; // (only if there's a delay target)
+        };
+        std::mutex mutex;
+        std::vector<waiting> inputs;
+        bool scheduled{ false };    // true iff the session is queued or running
+    } inbox;
+};
 
-    10. An infinite loop may be created if keyword_rule A has a reference to
-    itself or to another keyword_rule, which either refers directly back to A
-    or refers back to A via one or more other keyword_rules. In this case
-    ELIZA would generate no response message. Weizenbaum does not explicitly
-    disallow this. This looping mechanism is fundamental to the possibility
-    that ELIZA scripts are Turing complete; looping via the pre_transform_ref
-    rule is not necessarily infinite.
 
-    11. The script has the word START following the opening_remarks, and ends
-    with an empty list. Both these elements are present in Weizenbaum's
-    published DOCTOR script, but he doesn't mention them in the CACM paper.
-    The purpose of the START symbol isn't clear, but the ELIZA source code
-    appears to use an empty list as a sentinel signalling the end of the
-    script. Both elements are included in this formal script syntax as
-    optional. 
-*/
+/*  Constructing a session on the critical path of a user's first message
+    costs allocations and set-up that a response doesn't need. A
+    session_pool keeps sessions constructed and configured in advance and
+    takes back finished sessions to be reset and reused. The pool is
+    divided into stripes, picked by thread, so threads seldom contend.
 
+    A session from acquire() returns to the pool when the last shared_ptr
+    to it goes, even if that's after the pool itself has gone. Settings
+    come from the pool's configure function; a user of a pooled session
+    shouldn't change them, as they'd persist into the session's next use. */
+class session_pool {
+public:
+    session_pool(
+        std::shared_ptr<const script_context> context,
+        size_t prewarm_per_stripe = 64,
+        std::function<void(eliza &)> configure = nullptr,
+        size_t stripes = std::max(1u, std::thread::hardware_concurrency()))
+        : shared_(std::make_shared<shared>(std::move(context), std::move(configure), stripes))
+    {
+        for (auto & st : shared_->stripes)
+            for (size_t i = 0; i < prewarm_per_stripe; ++i)
+                st.free.push_back(shared_->make());
+    }
 
-struct script {
-    // ELIZA's opening remarks e.g. "HOW DO YOU DO.  PLEASE TELL ME YOUR PROBLEM"
-    stringlist hello_message;
+    // return a fresh session, as if newly constructed and configured
+    std::shared_ptr<session> acquire()
+    {
+        stripe & st = shared_->stripe_for_this_thread();
+        session * s = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(st.mutex);
+            if (!st.free.empty()) {
+                s = st.free.back().release();
+                st.free.pop_back();
+            }
+        }
+        if (!s)
+            s = shared_->make().release(); // (the pool ran dry)
+        return std::shared_ptr<session>(s, recycler{ shared_ });
+    }
 
-    // maps keywords -> transformation rules
-    elizalogic::rulemap rules;
+    // return the number of sessions waiting to be acquired
+    size_t available() const
+    {
+        size_t n = 0;
+        for (auto & st : shared_->stripes) {
+            std::lock_guard<std::mutex> lock(st.mutex);
+            n += st.free.size();
+        }
+        return n;
+    }
 
-    // the one and only special case MEMORY rule
-    std::shared_ptr<elizalogic::rule_memory> mem_rule;
-};
+    const script_context & context() const { return *shared_->context; }
 
+private:
+    struct alignas(cache_line_size) stripe {
+        mutable std::mutex mutex;
+        std::vector<std::unique_ptr<session>> free;
+    };
 
-struct token {
-    // types of token in an ELIZA script file
-    enum class typ { eof, symbol, number, open_bracket, close_bracket };
+    struct shared {
+        shared(std::shared_ptr<const script_context> context,
+            std::function<void(eliza &)> configure, size_t stripes)
+            : context(std::move(context)), configure(std::move(configure)),
+            stripes(std::max<size_t>(1, stripes))
+        {}
 
-    typ t{ typ::eof };
-    std::string value;
+        const std::shared_ptr<const script_context> context;
+        const std::function<void(eliza &)> configure;
+        std::vector<stripe> stripes;
 
-    token() = default;
-    explicit token(typ t) : t(t) {}
-    token(typ t, const std::string & value) : t(t), value(value) {}
+        std::unique_ptr<session> make() const
+        {
+            auto s = std::make_unique<session>(context);
+            if (configure)
+                configure(s->conversation);
+            return s;
+        }
 
-    bool symbol()               const { return t == typ::symbol; }
-    bool symbol(const char * v) const { return t == typ::symbol && value == v; }
-    bool number()               const { return t == typ::number; }
-    bool open()                 const { return t == typ::open_bracket; }
-    bool close()                const { return t == typ::close_bracket; }
-    bool eof()                  const { return t == typ::eof; }
+        stripe & stripe_for_this_thread()
+        {
+            return stripes[std::hash<std::thread::id>()(std::this_thread::get_id()) % stripes.size()];
+        }
+    };
 
-    bool operator==(const token & rhs) const { return t == rhs.t && value == rhs.value; }
+    // the shared_ptr deleter for pooled sessions
+    struct recycler {
+        std::shared_ptr<shared> pool;
+        void operator()(session * s) const
+        {
+            std::unique_ptr<session> owned(s);
+            owned->conversation.reset();
+            owned->retired = false;
+            stripe & st = pool->stripe_for_this_thread();
+            std::lock_guard<std::mutex> lock(st.mutex);
+            st.free.push_back(std::move(owned));
+        }
+    };
+
+    std::shared_ptr<shared> shared_;
 };
 
 
-// this is just good enough to divide the ELIZA script file format
-// into tokens useful to eliza_script_reader
-template<typename T>
-class tokenizer {
+/*  Many conversations, all using the same script, keyed by session id and
+    safe to use from many threads. The table holds at most a given number
+    of conversations, evicting the least recently used to make room for a
+    new one, and evicts any conversation left idle for longer than a given
+    time. Evicted conversations go to the snapshot_store, if one is given,
+    and are restored from it if their id is seen again.
+
+    The table is divided into shards, each with its own lock, LRU list and
+    timer wheel, so threads using different sessions seldom contend; every
+    operation is O(1) on average. A session is shared with the caller;
+    callers should lock its mutex while using its conversation. Eviction
+    unlinks a session under the shard lock, then marks it retired and
+    spills it with only its own mutex held. Anything done to a retired
+    session is lost, so a caller holding a session across calls should
+    check retired and, if it's set, get the session again from create()
+    (as response() does). create() waits while a session with the same
+    id is being spilled, so there's never more than one live copy.
+
+    reload() publishes a new version of the script with one atomic pointer
+    swap; nothing waits for it. Responses already under way finish with the
+    version they started with. Each conversation moves to the new version
+    (see script_migration) the next time response() is called for it, or
+    when migrate_all() gets to it, and an evicted conversation when it's
+    restored. (A conversation spilled two or more versions ago can't be
+    restored and starts afresh.) The old version is freed once the last
+    conversation using it has moved on. */
+class session_table {
 public:
-    explicit tokenizer(T & script_file) : stream_(script_file) {}
+    using clock = std::chrono::steady_clock;
+
+    struct options {
+        size_t capacity{ 100000 };                      // most conversations held
+        clock::duration idle_timeout{ std::chrono::minutes(30) };
+        clock::duration tick{ std::chrono::seconds(1) }; // idle timeout resolution
+        size_t shards{ 16 };
+        snapshot_store * spill{ nullptr };              // evicted conversations go here
+        std::function<void(eliza &)> configure;         // applied to each new conversation
+        session_pool * pool{ nullptr };                 // if given, new sessions come from here
+                                                        // (and configure is not used)
+    };
 
-    // return the current token, but don't advance past it
-    token peektok()
+    session_table(std::shared_ptr<const script_context> context, const options & opt,
+        clock::time_point now = clock::now())
+        : opt_(opt), epoch_(now), shards_(std::max<size_t>(1, opt.shards))
     {
-        if (got_token_)
-            return t_;
-        got_token_ = true;
-        return t_ = readtok();
+        if (opt_.pool && &opt_.pool->context() != context.get())
+            throw std::runtime_error("session_table: pool uses a different script_context");
+        current_ = context.get();
+        version_ = std::make_shared<const version>(version{ std::move(context), nullptr });
+        const size_t per_shard = (std::max<size_t>(1, opt_.capacity) + shards_.size() - 1) / shards_.size();
+        for (auto & sh : shards_)
+            sh.capacity = per_shard;
     }
 
-    // return the current token, advance read point past it
-    token nexttok()
-    {
-        if (got_token_) {
-            got_token_ = false;
-            return t_;
-        }
-        return readtok();
-    }
+    session_table(const session_table &) = delete;
+    session_table & operator=(const session_table &) = delete;
 
-    size_t line() const
+    // return the session with given id, or null if the table doesn't hold it
+    std::shared_ptr<session> lookup(const std::string & id)
     {
-        return line_number_;
+        shard & sh = shard_for(id);
+        std::lock_guard<std::mutex> lock(sh.mutex);
+        auto e = sh.entries.find(id);
+        return e == sh.entries.end() ? nullptr : e->second.s;
     }
 
-private:
-    T & stream_;
-    token t_;
-    bool got_token_{ false };
-    const static size_t buflen_ = 512;
-    uint8_t buf_[buflen_];
-    size_t bufdata_{ 0 };
-    size_t bufptr_{ 0 };
-    size_t line_number_{ 1 };
-
-    token readtok()
+    // return the session with given id, creating it if the table doesn't
+    // hold it (from the spill store if it's there); mark it used at now
+    std::shared_ptr<session> create(const std::string & id, clock::time_point now)
     {
-        uint8_t ch;
-        for (;;) {
-            do { // skip whitespace
-                if (!nextch(ch))
-                    return token(token::typ::eof);
-                if (is_newline(ch))
-                    consume_newline(ch);
-            } while (is_whitespace(ch));
-            if (ch != ';')
-                break;
-            do { // skip comment
-                if (!nextch(ch))
-                    return token(token::typ::eof);
-            } while (!is_newline(ch));
-            consume_newline(ch);
+        shard & sh = shard_for(id);
+        retirees gone;
+        std::unique_lock<std::mutex> lock(sh.mutex);
+        if (advance(sh, now, gone)) {
+            lock.unlock();
+            retire(sh, gone); // (this might be the session we want)
+            lock.lock();
         }
-
-        if (ch == '(')
-            return token(token::typ::open_bracket);
-
-        if (ch == ')')
-            return token(token::typ::close_bracket);
-
-        if (ch == '=')
-            return token(token::typ::symbol, "=");
-
-        if (is_digit(ch)) {
-            token t(token::typ::number);
-            t.value.push_back(ch);
-            while (peekch(ch) && is_digit(ch)) {
-                t.value.push_back(ch);
-                nextch(ch);
+        sh.retired.wait(lock, [&] { return sh.retiring.count(id) == 0; });
+        auto [e, inserted] = sh.entries.try_emplace(id);
+        entry & en = e->second;
+        if (inserted) {
+            en.id = &e->first;
+            const auto v = version_.load();
+            if (opt_.pool)
+                en.s = opt_.pool->acquire();
+            else {
+                en.s = std::make_shared<session>(v->context);
+                if (opt_.configure)
+                    opt_.configure(en.s->conversation);
             }
-            return t;
-        }
-
-        // anything else is a symbol
-        token t(token::typ::symbol);
-        t.value.push_back(ch);
-        while (peekch(ch) && !non_symbol(ch) && ch != '=') {
-            t.value.push_back(ch);
-            nextch(ch);
+            migrate(en.s->conversation, *v); // (pooled sessions may be older)
+            std::string snapshot;
+            if (opt_.spill && opt_.spill->take(id, snapshot)) {
+                try {
+                    en.s->conversation.restore(snapshot, v->migration.get());
+                }
+                catch (const std::runtime_error &) {
+                    // too old to restore: start afresh
+                    en.s->conversation.reset();
+                }
+            }
+            if (sh.entries.size() > sh.capacity)
+                unlink(sh, *static_cast<entry *>(sh.lru.next->owner), gone); // least recently used
         }
-        t.value = elizalogic::eliza_uppercase(t.value);
-        return t;
+        use(sh, en, now);
+        auto s = en.s;
+        lock.unlock();
+        retire(sh, gone);
+        return s;
     }
 
-    bool nextch(uint8_t & ch)
+    // mark the session with given id used at now; return false iff the
+    // table doesn't hold it
+    bool touch(const std::string & id, clock::time_point now)
     {
-        if (peekch(ch)) {
-            ++bufptr_;
-            return true;
+        shard & sh = shard_for(id);
+        retirees gone;
+        bool found = false;
+        {
+            std::lock_guard<std::mutex> lock(sh.mutex);
+            advance(sh, now, gone);
+            auto e = sh.entries.find(id);
+            if (e != sh.entries.end()) {
+                use(sh, e->second, now);
+                found = true;
+            }
         }
-        return false;
+        retire(sh, gone);
+        return found;
     }
 
-    bool peekch(uint8_t & ch)
+    // remove the session with given id (to the spill store, if any);
+    // return false iff the table doesn't hold it
+    bool evict(const std::string & id)
     {
-        if (bufptr_ == bufdata_) {
-            refilbuf();
-            if (bufptr_ == bufdata_)
+        shard & sh = shard_for(id);
+        retirees gone;
+        {
+            std::lock_guard<std::mutex> lock(sh.mutex);
+            auto e = sh.entries.find(id);
+            if (e == sh.entries.end())
                 return false;
+            unlink(sh, e->second, gone);
         }
-        ch = buf_[bufptr_];
+        retire(sh, gone);
         return true;
     }
-    
-    void refilbuf()
+
+    // evict every session idle for longer than the idle timeout; return
+    // the number evicted (sessions also expire as a side effect of create()
+    // and touch() on the same shard)
+    size_t expire(clock::time_point now)
     {
-        bufptr_ = bufdata_ = 0;
-        if (!stream_.eof()) {
-            stream_.read(reinterpret_cast<char *>(buf_), buflen_);
-            bufdata_ = static_cast<size_t>(stream_.gcount());
+        size_t n = 0;
+        for (auto & sh : shards_) {
+            retirees gone;
+            {
+                std::lock_guard<std::mutex> lock(sh.mutex);
+                n += advance(sh, now, gone);
+            }
+            retire(sh, gone);
         }
+        return n;
     }
 
-    inline bool is_whitespace(uint8_t ch) const
+    // return ELIZA's response to given input in the conversation with
+    // given id, starting a new conversation if need be
+    std::string response(const std::string & id, const std::string & input, clock::time_point now)
     {
-        return ch <= 0x20 || ch == 0x7F;
-        // this must hold: is_newline(ch) implies is_whitespace(ch)
+        for (;;) {
+            auto s = create(id, now);
+            std::lock_guard<std::mutex> lock(s->mutex);
+            if (s->retired)
+                continue; // evicted meanwhile: carry on with the spilled copy
+            migrate(s->conversation);
+            return s->conversation.response(input);
+        }
     }
 
-    inline bool is_newline(uint8_t ch) const
+    // publish given new version of the script (which the caller may take as
+    // long as it likes to make, e.g. on another thread); return the
+    // migration conversations will use to move to it
+    std::shared_ptr<const script_migration> reload(std::shared_ptr<const script_context> next)
     {
-        return ch == '\x0A'     // LF
-            || ch == '\x0B'     // VT
-            || ch == '\x0C'     // FF
-            || ch == '\x0D';    // CR
+        std::lock_guard<std::mutex> lock(reload_mutex_); // (one reload at a time)
+        auto migration = std::make_shared<const script_migration>(version_.load()->context, next);
+        const script_context * next_ptr = next.get();
+        version_.store(std::make_shared<const version>(version{ std::move(next), migration }));
+        current_.store(next_ptr);
+        return migration;
     }
 
-    inline void consume_newline(uint8_t ch)
+    // move given conversation to the latest version of the script, if it's
+    // not already using it; the caller must hold the session's mutex
+    void migrate(eliza & conversation) const
     {
-        if (ch == '\x0D'        // CR
-            && peekch(ch)
-            && ch == '\x0A')    // LF
-            nextch(ch);
-        ++line_number_;
+        if (&conversation.context() != current_.load())
+            migrate(conversation, *version_.load());
     }
 
-    inline bool is_digit(uint8_t ch) const
+    // move every conversation in the table to the latest version of the
+    // script, a shard at a time, waiting for any conversation in use;
+    // return the number moved
+    size_t migrate_all()
     {
-        return unsigned(ch) - '0' < 10;
+        size_t n = 0;
+        for (auto & sh : shards_) {
+            std::vector<std::shared_ptr<session>> sessions;
+            {
+                std::lock_guard<std::mutex> lock(sh.mutex);
+                for (auto & [id, en] : sh.entries)
+                    sessions.push_back(en.s);
+            }
+            for (auto & s : sessions) {
+                std::lock_guard<std::mutex> lock(s->mutex);
+                if (&s->conversation.context() != current_.load()) {
+                    migrate(s->conversation);
+                    ++n;
+                }
+            }
+        }
+        return n;
     }
 
-    inline bool non_symbol(uint8_t ch) const
+    size_t size() const
     {
-        return ch == '(' || ch == ')' || ch == ';' || is_whitespace(ch);
+        size_t n = 0;
+        for (auto & sh : shards_) {
+            std::lock_guard<std::mutex> lock(sh.mutex);
+            n += sh.entries.size();
+        }
+        return n;
     }
-};
 
+    // the latest version of the script
+    std::shared_ptr<const script_context> context() const { return version_.load()->context; }
 
-template<typename T>
-class eliza_script_reader {
-public:
+private:
+    struct version {
+        std::shared_ptr<const script_context> context;
+        std::shared_ptr<const script_migration> migration; // from the version before; null if none
+    };
 
-    eliza_script_reader(T & script_file, script & s)
-        : tok_(script_file), script_(s)
-    {
-        script_.hello_message = rdlist();
-        if (tok_.peektok().symbol("START"))
-            tok_.nexttok(); // skip over START, if present
+    struct entry {
+        entry() : lru(this), idle(this) {}
+        const std::string * id{ nullptr };  // (the key of this entry in shard::entries)
+        std::shared_ptr<session> s;
+        list_hook lru;                      // in shard::lru, most recently used last
+        timer_wheel::timer idle;            // expires when this session has been idle too long
+    };
 
-        while (read_rule())
-            ;
+    struct alignas(cache_line_size) shard {
+        mutable std::mutex mutex;
+        std::unordered_map<std::string, entry> entries;
+        list_hook lru;
+        timer_wheel wheel;
+        size_t capacity{ 0 };
+        std::unordered_set<std::string> retiring;   // unlinked, not yet spilled
+        std::condition_variable retired;            // notified as retiring shrinks
+    };
 
-        // does the script meet the minimum requirements?
-        if (script_.rules.find(elizalogic::special_rule_none) == std::end(script_.rules))
-            throw std::runtime_error(
-                "Script error: no NONE rule specified; see Jan 1966 CACM page 41");
-        if (!script_.mem_rule)
-            throw std::runtime_error(
-                "Script error: no MEMORY rule specified; see Jan 1966 CACM page 41");
-        if (script_.rules.find(script_.mem_rule->keyword()) == std::end(script_.rules)) {
-            std::string msg("Script error: MEMORY rule keyword '");
-            msg += script_.mem_rule->keyword();
-            msg += "' is not also a keyword in its own right; see Jan 1966 CACM page 41";
-            throw std::runtime_error(msg);
-        }
-#if 0
-        std::cout << "----------------\n";
-        const int dict_size = 7;
-        stringlist dict[1 << dict_size];
-        int count = 0;
-        for (const auto & tag : script_.rules) {
-            if (tag.first == elizalogic::special_rule_none)
-                continue;
-            //std::cout << tag.first << " '" << tag.first.substr(0, 6) << "' " << elizalogic::hash(elizalogic::last_chunk_as_bcd(tag.first.substr(0, 6)), dict_size) << "\n";
-            dict[elizalogic::hash(elizalogic::last_chunk_as_bcd(tag.first.substr(0, 6)), dict_size)].push_back(tag.first);
-            ++count;
-        }
-        std::cout << count << " total entries\n";
-        for (int i = 0; i < (1 << dict_size); ++i) {
-            std::cout << i << ":";
-            for (const auto k : dict[i]) {
-                std::cout << " " << k;
-            }
-            std::cout << "\n";
-        }
-#endif
-    }
+    // sessions unlinked from a shard, to be passed to retire()
+    using retirees = std::vector<std::pair<std::string, std::shared_ptr<session>>>;
 
-private:
-    tokenizer<T> tok_;
-    script & script_;
+    std::atomic<std::shared_ptr<const version>> version_;
+    std::atomic<const script_context *> current_{ nullptr }; // version_.load()->context, for a quick check
+    std::mutex reload_mutex_;
+    const options opt_;
+    const clock::time_point epoch_;
+    std::vector<shard> shards_;
 
+    static void migrate(eliza & conversation, const version & v)
+    {
+        if (conversation.shared_context() == v.context)
+            return;
+        if (v.migration && v.migration->is_from(conversation.shared_context()))
+            conversation.migrate(*v.migration);
+        else // (more than one version behind)
+            conversation.migrate(script_migration(conversation.shared_context(), v.context));
+    }
 
-    std::string errormsg(const std::string & msg)
+    shard & shard_for(const std::string & id)
     {
-        return std::string("Script error on line ")
-            + std::to_string(tok_.line())
-            + ": "
-            + msg;
+        return shards_[std::hash<std::string>()(id) % shards_.size()];
     }
 
+    uint_least64_t ticks(clock::time_point t) const
+    {
+        return t <= epoch_ ? 0 : static_cast<uint_least64_t>((t - epoch_) / opt_.tick);
+    }
 
-    // in the following comments, @ = position in symbol stream on function entry
-
-    // return words between opening and closing brackets
-    // if prior is true nexttok() should be the opening bracket, e.g. @(WORD WORD 0 WORD)
-    // if prior is false nexttok() should be the first symbol following the
-    // opening bracket, e.g. (@WORD WORD 0 WORD)
-    stringlist rdlist(bool prior = true)
+    void use(shard & sh, entry & en, clock::time_point now)
     {
-        stringlist s;
-        token t = tok_.nexttok();
-        if (prior) {
-            if (!t.open())
-                throw std::runtime_error(errormsg("expected '('"));
-            t = tok_.nexttok();
-        }
-        while (!t.close()) {
-            if (t.symbol())
-                s.emplace_back(t.value);
-            else if (t.number())
-                s.emplace_back(t.value);
-            else if (t.open()) {
-                // embed entire sublist in one sub-string
-                std::string sublist;
-                t = tok_.nexttok();
-                while (!t.close()) {
-                    if (!t.symbol())
-                        throw std::runtime_error(errormsg("expected symbol"));
-                    if (!sublist.empty())
-                        sublist += ' ';
-                    sublist += t.value;
-                    t = tok_.nexttok();
-                }
-                s.emplace_back("(" + sublist + ")");
-            }
-            else
-                throw std::runtime_error(errormsg("expected ')'"));
-            t = tok_.nexttok();
-        }
+        en.lru.link_before(sh.lru);
+        // (+1 so a session is never expired early by rounding)
+        sh.wheel.schedule(en.idle, ticks(now) + opt_.idle_timeout / opt_.tick + 1);
+    }
 
-        return s;
+    size_t advance(shard & sh, clock::time_point now, retirees & gone)
+    {
+        size_t n = 0;
+        sh.wheel.advance(ticks(now), [&](timer_wheel::timer & t) {
+            unlink(sh, *static_cast<entry *>(t.owner), gone);
+            ++n;
+        });
+        return n;
     }
 
+    // remove given entry from its shard, adding its session to gone; the
+    // caller must hold the shard's mutex
+    static void unlink(shard & sh, entry & en, retirees & gone)
+    {
+        gone.emplace_back(*en.id, std::move(en.s));
+        sh.retiring.insert(gone.back().first);
+        sh.entries.erase(gone.back().first);
+    }
 
-    /* e.g.
-        (@MEMORY MY
-            (0 YOUR 0 = LETS DISCUSS FURTHER WHY YOUR 3)
-            (0 YOUR 0 = EARLIER YOU SAID YOUR 3)
-            (0 YOUR 0 = BUT YOUR 3)
-            (0 YOUR 0 = DOES THAT HAVE ANYTHING TO DO WITH THE FACT THAT YOUR 3))
-    */
-    bool read_memory_rule()
+    // finish evicting the given sessions unlinked from sh: wait for anyone
+    // using each to finish with it, then mark it retired and spill it; the
+    // caller must not hold the shard's mutex
+    void retire(shard & sh, retirees & gone)
     {
-#define MEMFORM "; expected form is (MEMORY keyword (decomp1=reassm1)(decomp2=reassm2)(decomp3=reassm3)(decomp4=reassm4))"
+        for (auto & [id, s] : gone) {
+            {
+                std::lock_guard<std::mutex> lock(s->mutex);
+                s->retired = true;
+                if (opt_.spill)
+                    opt_.spill->put(id, s->conversation.snapshot());
+            }
+            {
+                std::lock_guard<std::mutex> lock(sh.mutex);
+                sh.retiring.erase(id);
+            }
+            sh.retired.notify_all();
+        }
+        gone.clear();
+    }
+};
 
-        token t = tok_.nexttok();
-        assert(t.symbol("MEMORY"));
-        if (script_.mem_rule)
-            throw std::runtime_error(errormsg("MEMORY rule already specified"));
 
-        t = tok_.nexttok();
-        if (!t.symbol())
-            throw std::runtime_error(errormsg("expected keyword to follow MEMORY" MEMFORM));
-        script_.mem_rule = std::make_shared<elizalogic::rule_memory>(t.value);
 
-        for (int i = 0; i < elizalogic::rule_memory::num_transformations; ++i) {
-            stringlist decomposition;
-            std::vector<stringlist> reassembly_rules;
+/*  A contended multi-thread benchmark of the session layout: each of the
+    given number of threads talks to its own sessions_per_thread sessions
+    in one session_table, giving each of the given inputs in turn,
+    exchanges_per_thread times in all. The sessions are created in
+    round-robin order before the clock starts, so sessions served by
+    different threads are as close together in memory as the allocator
+    puts them. With no false sharing, throughput should scale with the
+    number of threads up to the number of cores. */
+struct contention_result {
+    unsigned threads{ 0 };
+    size_t exchanges{ 0 };
+    double seconds{ 0 };
+    double exchanges_per_second() const { return seconds > 0 ? exchanges / seconds : 0; }
+};
 
-            if (!tok_.nexttok().open())
-                throw std::runtime_error(errormsg("expected '('" MEMFORM));
-            for (t = tok_.nexttok(); !t.symbol("=") && !t.eof(); t = tok_.nexttok())
-                decomposition.push_back(t.value);
-            if (decomposition.empty())
-                throw std::runtime_error(errormsg("expected 'decompose_terms = reassemble_terms'" MEMFORM));
-            if (!t.symbol("="))
-                throw std::runtime_error(errormsg("expected '='" MEMFORM));
+contention_result contention_benchmark(
+    std::shared_ptr<const script_context> context,
+    const stringlist & inputs,
+    unsigned threads,
+    size_t sessions_per_thread = 64,
+    size_t exchanges_per_thread = 20000)
+{
+    if (inputs.empty() || threads == 0 || sessions_per_thread == 0)
+        throw std::runtime_error("contention_benchmark: nothing to do");
+    session_table::options opt;
+    opt.capacity = threads * sessions_per_thread;
+    opt.idle_timeout = std::chrono::hours(1);
+    session_table table(context, opt);
+    const auto now = session_table::clock::now();
+
+    // sessions[t] are thread t's, created interleaved with everyone else's
+    std::vector<std::vector<std::shared_ptr<session>>> sessions(threads);
+    for (size_t i = 0; i < sessions_per_thread; ++i)
+        for (unsigned t = 0; t < threads; ++t)
+            sessions[t].push_back(table.create(std::to_string(t) + ":" + std::to_string(i), now));
+
+    std::atomic<unsigned> ready{ 0 };
+    std::atomic<bool> go{ false };
+    auto work = [&](unsigned t) {
+        ++ready;
+        while (!go)
+            std::this_thread::yield();
+        auto & mine = sessions[t];
+        for (size_t x = 0; x < exchanges_per_thread; ++x) {
+            session & s = *mine[x % mine.size()];
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.conversation.response(inputs[(x / mine.size()) % inputs.size()]);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t)
+        workers.emplace_back(work, t);
+    while (ready < threads)
+        std::this_thread::yield();
+    const auto start = std::chrono::steady_clock::now();
+    go = true;
+    for (auto & w : workers)
+        w.join();
+
+    contention_result result;
+    result.threads = threads;
+    result.exchanges = threads * exchanges_per_thread;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
 
-            stringlist reassembly;
-            for (t = tok_.nexttok(); !t.close() && !t.eof(); t = tok_.nexttok())
-                reassembly.push_back(t.value);
-            if (reassembly.empty())
-                throw std::runtime_error(errormsg("expected 'decompose_terms = reassemble_terms'" MEMFORM));
-            if (!t.close())
-                throw std::runtime_error(errormsg("expected ')'" MEMFORM));
-            reassembly_rules.push_back(reassembly);
 
-            std::string index_out_of_range_msg;
-            if (!elizalogic::reassembly_indexes_valid(decomposition, reassembly, index_out_of_range_msg))
-                throw std::runtime_error(errormsg(index_out_of_range_msg));
 
-            script_.mem_rule->add_transformation_rule(decomposition, reassembly_rules);
-        }
+/*  Admission control, for a session_scheduler under more load than it
+    can answer promptly. Rather than let every session's replies get later
+    and later, it sets three limits:
+
+    - in flight: inputs submitted but not yet answered, so many per worker
+      thread. Over this, submit() refuses the input, and the caller should
+      tell the client to back off.
+
+    - per session: inputs waiting in one session's inbox. Over this, too,
+      submit() refuses the input, so one client flooding one session can't
+      take all the in-flight allowance.
+
+    - queue delay: how long an input waited between submit() and a worker
+      taking it. As in CoDel, a delay above target is a burst, which will
+      pass, until a whole interval has gone by since the first such delay
+      with no delay below target; then it's a standing queue, and the
+      scheduler is overloaded until an input is taken having waited less
+      than target. An input that waited longer
+      than target, taken while overloaded, is answered, if shedding, with
+      eliza::shed_response() (cheap, so the queue drains quickly);
+      otherwise it's answered late, as usual.
+
+    A limit of zero is no limit; the default options limit nothing. */
+struct admission_options {
+    size_t max_in_flight_per_worker{ 0 };
+    size_t max_per_session{ 0 };
+    std::chrono::steady_clock::duration target_delay{ 0 };
+    std::chrono::steady_clock::duration interval{ std::chrono::milliseconds(100) };
+    bool shed{ false };
+    // the clock queue delays are measured by (e.g. a test's own)
+    std::function<std::chrono::steady_clock::time_point()> now{ std::chrono::steady_clock::now };
+};
 
-        if (!tok_.nexttok().close())
-            throw std::runtime_error(errormsg("expected ')'" MEMFORM));
+class admission_control {
+public:
+    using clock = std::chrono::steady_clock;
 
-        return true;
+    struct statistics {
+        unsigned long long admitted{ 0 };   // inputs accepted by submit()
+        unsigned long long refused{ 0 };    // inputs refused by submit()
+        unsigned long long shed{ 0 };       // inputs answered with eliza::shed_response()
+        unsigned long long late{ 0 };       // inputs taken after waiting longer than the target
+    };
 
-#undef MEMFORM
+    explicit admission_control(const admission_options & opt = admission_options())
+        : opt_(opt)
+    {
     }
 
+    const admission_options & options() const { return opt_; }
 
-    stringlist read_reassembly()
+    // true iff given input, taken at now after waiting for given delay,
+    // should be shed; may be called from any thread
+    bool shed(clock::duration delay, clock::time_point now)
     {
-        if (!tok_.nexttok().open())
-            throw std::runtime_error(errormsg("expected '('"));
-        if (!tok_.peektok().symbol("PRE"))
-            return rdlist(false);
-
-        // It's a PRE reassembly, e.g. (PRE (I ARE 3) (=YOU))
-        tok_.nexttok(); // skip "PRE"
-        stringlist pre{ "(", "PRE" };
-        stringlist reconstruct = rdlist();
-        stringlist reference = rdlist();
-        if (reference.size() != 2 || reference[0] != "=")
-            throw std::runtime_error(errormsg("expected '(=reference)' in PRE rule"));
-        pre.emplace_back("(");
-        pre.insert(pre.end(), reconstruct.begin(), reconstruct.end());
-        pre.emplace_back(")");
-        pre.emplace_back("(");
-        pre.insert(pre.end(), reference.begin(), reference.end());
-        pre.emplace_back(")");
-        pre.emplace_back(")");
-        if (!tok_.nexttok().close())
-            throw std::runtime_error(errormsg("expected ')'"));
-        return pre;
+        if (opt_.target_delay == clock::duration::zero())
+            return false;
+        if (delay < opt_.target_delay) {
+            // the queue is moving: any overload is over
+            if (overloaded_from_.load(std::memory_order_relaxed) != never)
+                overloaded_from_.store(never, std::memory_order_relaxed);
+            return false;
+        }
+        ++late_;
+        auto from = overloaded_from_.load(std::memory_order_relaxed);
+        if (from == never) {
+            // (if another thread beat us to it, its time is as good as ours)
+            const auto t = (now + opt_.interval).time_since_epoch().count();
+            overloaded_from_.compare_exchange_strong(from, t, std::memory_order_relaxed);
+            return false;
+        }
+        if (!opt_.shed || now.time_since_epoch().count() < from)
+            return false;
+        ++shed_;
+        return true;
     }
 
-    bool read_keyword_rule()
+    void count_admitted() { ++admitted_; }
+    void count_refused() { ++refused_; }
+
+    statistics stats() const
     {
-        std::string keyword, keyword_substitution, msg_keyword;
-        int precedence = 0;
-        stringlist tags;
-        struct transform {
-            stringlist decomposition;
-            std::vector<stringlist> reassembly;
-        };
-        std::vector<transform> transformation;
-        std::string class_name;
+        statistics result;
+        result.admitted = admitted_.load();
+        result.refused = refused_.load();
+        result.shed = shed_.load();
+        result.late = late_.load();
+        return result;
+    }
 
-        token t = tok_.nexttok();
-        assert(t.symbol());
-        keyword = msg_keyword = t.value;
-        if (keyword == "NONE")
-            keyword = elizalogic::special_rule_none;
+private:
+    static constexpr clock::rep never = std::numeric_limits<clock::rep>::max();
+    const admission_options opt_;
+    std::atomic<clock::rep> overloaded_from_{ never }; // an interval after the first late input since one on time
+    std::atomic<unsigned long long> admitted_{ 0 };
+    std::atomic<unsigned long long> refused_{ 0 };
+    std::atomic<unsigned long long> shed_{ 0 };
+    std::atomic<unsigned long long> late_{ 0 };
+};
 
-        if (script_.rules.find(keyword) != script_.rules.end()) {
-            std::string msg("keyword rule already specified for keyword '");
-            msg += msg_keyword;
-            msg += "'";
-            throw std::runtime_error(errormsg(msg));
-        }
 
-        if (tok_.peektok().close()) {
-            std::string msg("keyword '");
-            msg += msg_keyword;
-            msg += "' has no associated body";
-            throw std::runtime_error(errormsg(msg));
-        }
+// what a server answers to an input refused by admission control
+const std::string busy_reply("*BUSY*");
 
-        for (t = tok_.nexttok(); !t.close(); t = tok_.nexttok()) {
-            if (t.symbol("=")) {
-                t = tok_.nexttok();
-                if (!t.symbol())
-                    throw std::runtime_error(errormsg("expected keyword"));
-                keyword_substitution = t.value;
-            }
-            else if (t.number())
-                precedence = std::stoi(t.value);
-            else if (t.symbol("DLIST"))
-                tags = rdlist();
-            else if (t.open()) {
-                // a transformation rule
-                t = tok_.peektok();
-                if (t.symbol("=")) {
-                    // a reference
-                    tok_.nexttok();
-                    t = tok_.nexttok();
-                    if (!t.symbol())
-                        throw std::runtime_error(errormsg("expected equivalence class name"));
-                    class_name = t.value;
 
-                    if (!tok_.nexttok().close())
-                        throw std::runtime_error(errormsg("expected ')'"));
-                    if (!tok_.peektok().close())
-                        throw std::runtime_error(errormsg("expected ')'"));
-                }
-                else {
-                    // a decompose/reassemble transformation
-                    transform trans;
-                    trans.decomposition = rdlist();
-                    if (trans.decomposition.empty())
-                        throw std::runtime_error(errormsg("decompose pattern cannot be empty"));
-                    do {
-                        trans.reassembly.push_back(read_reassembly());
-                        std::string index_out_of_range_msg;
-                        if (!elizalogic::reassembly_indexes_valid(trans.decomposition, trans.reassembly.back(), index_out_of_range_msg))
-                            throw std::runtime_error(errormsg(index_out_of_range_msg));
-                    } while (tok_.peektok().open());
-                    if (!tok_.nexttok().close())
-                        throw std::runtime_error(errormsg("expected ')'"));
-                    transformation.emplace_back(trans);
-                }
-            }
-            else
-                throw std::runtime_error(errormsg("malformed rule"));
-        }
+/*  Runs many sessions on a fixed set of worker threads. Each session is a
+    serial queue of inputs (session::inbox): submit() adds an input, and a
+    session with inputs waiting is queued on one of the workers. A worker
+    takes all the inputs waiting for the session, answers them in order
+    and passes each reply to its handler, so a session's replies always
+    come in the order its inputs were submitted and a session is only
+    ever run by one worker at a time. Different sessions run in parallel;
+    they share only their script_context, which is never written, so no
+    lock is taken on the script.
 
-        auto r = std::make_shared<elizalogic::rule_keyword>(
-            keyword, keyword_substitution, precedence, tags, class_name);
-        for (auto const & tr : transformation)
-            r->add_transformation_rule(tr.decomposition, tr.reassembly);
-        script_.rules[keyword] = r;
+    Each worker runs sessions from the front of its own queue, oldest
+    first, and, when that is empty, steals from the back of another
+    worker's queue. A
+    session made runnable by a worker (e.g. by a reply handler that
+    submits more input) goes on that worker's own queue; one made
+    runnable by any other thread goes to the workers in turn.
 
-        return true;
+    Given admission_options, a scheduler under overload refuses inputs
+    and may shed them; see admission_control. */
+class session_scheduler {
+public:
+    using reply_handler = session::inbox::reply_handler;
+
+    explicit session_scheduler(
+        unsigned threads = std::max(1u, std::thread::hardware_concurrency()),
+        const admission_options & admission = admission_options())
+        : workers_(std::max(1u, threads)), admission_(admission),
+        max_in_flight_(admission.max_in_flight_per_worker * workers_.size()),
+        timed_(admission.target_delay != admission_control::clock::duration::zero())
+    {
+        for (size_t w = 0; w < workers_.size(); ++w)
+            threads_.emplace_back([this, w]() { run(w); });
     }
 
-    // read one rule of any type; return false => end of file reached
-    bool read_rule()
+    session_scheduler(const session_scheduler &) = delete;
+    session_scheduler & operator=(const session_scheduler &) = delete;
+
+    // answer every input already submitted, then stop
+    ~session_scheduler()
     {
-        token t = tok_.nexttok();
-        if (t.eof())
+        wait_idle();
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for (auto & t : threads_)
+            t.join();
+    }
+
+    // queue given input for given session; handler, if given, will be
+    // called on a worker thread with the session's reply (it must not
+    // lock the session's mutex); false, and handler isn't called, if the
+    // input is refused by admission control
+    bool submit(std::shared_ptr<session> s, std::string input, reply_handler handler = nullptr)
+    {
+        if (++outstanding_ > max_in_flight_ && max_in_flight_ != 0) {
+            refuse();
             return false;
-        if (!t.open())
-            throw std::runtime_error(errormsg("expected '('"));
-        t = tok_.peektok();
-        if (t.close()) {
-            tok_.nexttok();
-            return true; // ignore empty rule list, if present
         }
-        if (!t.symbol())
-            throw std::runtime_error(errormsg("expected keyword|MEMORY|NONE"));
-        if (t.value == "MEMORY")
-            return read_memory_rule();
-        return read_keyword_rule();
+        bool runnable = false;
+        {
+            std::lock_guard<std::mutex> lock(s->inbox.mutex);
+            const size_t max_per_session = admission_.options().max_per_session;
+            if (max_per_session != 0 && s->inbox.inputs.size() >= max_per_session) {
+                refuse();
+                return false;
+            }
+            s->inbox.inputs.push_back({ std::move(input), std::move(handler),
+                timed_ ? admission_.options().now() : admission_control::clock::time_point() });
+            if (!s->inbox.scheduled)
+                runnable = s->inbox.scheduled = true;
+        }
+        admission_.count_admitted();
+        if (runnable)
+            schedule(std::move(s));
+        return true;
     }
 
-};
+    // wait until every input submitted so far has been answered
+    void wait_idle()
+    {
+        std::unique_lock<std::mutex> lock(idle_mutex_);
+        idle_.wait(lock, [this]() { return outstanding_ == 0; });
+    }
 
+    size_t threads() const { return workers_.size(); }
 
-template<typename T>
-void read(T & script_file, script & s)
-{
-    eliza_script_reader<T> reader(script_file, s);
-}
+    admission_control::statistics admission_stats() const { return admission_.stats(); }
 
-template<>
-void read(const char * const & script_text, script & s)
-{
-    std::stringstream ss(script_text);
-    elizascript::read<std::stringstream>(ss, s);
-}
+private:
+    struct alignas(cache_line_size) worker {
+        std::mutex mutex;
+        std::deque<std::shared_ptr<session>> runnable;
+    };
 
-template<>
-void read(const char * & script_text, script & s)
+    std::vector<worker> workers_;
+    std::vector<std::thread> threads_;
+    std::atomic<size_t> queued_{ 0 };       // sessions in all workers' queues
+    std::atomic<size_t> outstanding_{ 0 };  // inputs submitted but not yet answered
+    std::atomic<size_t> next_worker_{ 0 };  // for round-robin scheduling
+    std::atomic<unsigned> sleepers_{ 0 };
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    bool stopping_{ false };
+    std::mutex idle_mutex_;
+    std::condition_variable idle_;
+    admission_control admission_;
+    const size_t max_in_flight_;            // (0: no limit)
+    const bool timed_;                      // true iff inputs are timed for admission_
+
+    // the scheduler and worker index of the calling thread, if it is a worker
+    static inline thread_local const session_scheduler * this_scheduler_{ nullptr };
+    static inline thread_local size_t this_worker_{ 0 };
+
+    // (outstanding_ was counted for the input refused)
+    void refuse()
+    {
+        admission_.count_refused();
+        if (--outstanding_ == 0) {
+            std::lock_guard<std::mutex> lock(idle_mutex_);
+            idle_.notify_all();
+        }
+    }
+
+    void schedule(std::shared_ptr<session> s)
+    {
+        const size_t w = this_scheduler_ == this
+            ? this_worker_
+            : next_worker_++ % workers_.size();
+        {
+            std::lock_guard<std::mutex> lock(workers_[w].mutex);
+            workers_[w].runnable.push_back(std::move(s));
+        }
+        ++queued_;
+        if (sleepers_ > 0) {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            wake_.notify_one();
+        }
+    }
+
+    // return the next session for worker w to run, or null if there isn't one
+    std::shared_ptr<session> next(size_t w)
+    {
+        std::shared_ptr<session> s;
+        {
+            std::lock_guard<std::mutex> lock(workers_[w].mutex);
+            if (!workers_[w].runnable.empty()) {
+                s = std::move(workers_[w].runnable.front());
+                workers_[w].runnable.pop_front();
+            }
+        }
+        for (size_t i = 1; !s && i < workers_.size(); ++i) {
+            worker & victim = workers_[(w + i) % workers_.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.runnable.empty()) {
+                s = std::move(victim.runnable.back());
+                victim.runnable.pop_back();
+            }
+        }
+        if (s)
+            --queued_;
+        return s;
+    }
+
+    void run(size_t w)
+    {
+        this_scheduler_ = this;
+        this_worker_ = w;
+        std::vector<session::inbox::waiting> batch;
+        std::vector<std::string> replies;
+        for (;;) {
+            std::shared_ptr<session> s = next(w);
+            if (!s) {
+                std::unique_lock<std::mutex> lock(sleep_mutex_);
+                ++sleepers_;
+                wake_.wait(lock, [this]() { return queued_ > 0 || stopping_; });
+                --sleepers_;
+                if (queued_ == 0 && stopping_)
+                    return;
+                continue;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(s->inbox.mutex);
+                batch.swap(s->inbox.inputs);
+            }
+            replies.clear();
+            {
+                const auto now = timed_ ? admission_.options().now() : admission_control::clock::time_point();
+                std::lock_guard<std::mutex> lock(s->mutex);
+                for (const auto & in : batch) {
+                    if (timed_ && admission_.shed(now - in.queued, now))
+                        replies.push_back(s->conversation.shed_response());
+                    else
+                        replies.push_back(s->conversation.response(in.input));
+                }
+            }
+            for (size_t i = 0; i < batch.size(); ++i)
+                if (batch[i].handler)
+                    batch[i].handler(replies[i]);
+            const size_t answered = batch.size();
+            batch.clear();
+
+            // if more input arrived meanwhile, go to the back of the queue
+            bool more;
+            {
+                std::lock_guard<std::mutex> lock(s->inbox.mutex);
+                more = s->inbox.scheduled = !s->inbox.inputs.empty();
+            }
+            if (more)
+                schedule(std::move(s));
+
+            if ((outstanding_ -= answered) == 0) {
+                std::lock_guard<std::mutex> lock(idle_mutex_);
+                idle_.notify_all();
+            }
+        }
+    }
+};
+
+
+// like contention_benchmark(), but the sessions are run by a
+// session_scheduler with the given number of worker threads; as many
+// producer threads submit the inputs, each to its own sessions
+contention_result scheduler_benchmark(
+    std::shared_ptr<const script_context> context,
+    const stringlist & inputs,
+    unsigned threads,
+    size_t sessions_per_thread = 64,
+    size_t exchanges_per_thread = 20000)
 {
-    std::stringstream ss(script_text);
-    elizascript::read<std::stringstream>(ss, s);
+    if (inputs.empty() || threads == 0 || sessions_per_thread == 0)
+        throw std::runtime_error("scheduler_benchmark: nothing to do");
+    std::vector<std::vector<std::shared_ptr<session>>> sessions(threads);
+    for (size_t i = 0; i < sessions_per_thread; ++i)
+        for (unsigned t = 0; t < threads; ++t)
+            sessions[t].push_back(std::make_shared<session>(context));
+
+    session_scheduler scheduler(threads);
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> producers;
+    for (unsigned t = 0; t < threads; ++t) {
+        producers.emplace_back([&, t]() {
+            auto & mine = sessions[t];
+            for (size_t x = 0; x < exchanges_per_thread; ++x)
+                scheduler.submit(mine[x % mine.size()], inputs[(x / mine.size()) % inputs.size()]);
+        });
+    }
+    for (auto & p : producers)
+        p.join();
+    scheduler.wait_idle();
+
+    contention_result result;
+    result.threads = threads;
+    result.exchanges = threads * exchanges_per_thread;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
 }
 
 
-const char * const CACM_1966_01_DOCTOR_script =
-    ";\n"
-    "; Joseph Weizenbaum's DOCTOR script for ELIZA\n"
-    "; Copyright (c) 1966 Association for Computing Machinery, Inc."
-    ";\n"
-    "; This is a verbatim transcription of the script on page 44 of the\n"
-    "; January 1966 edition of Communications of the ACM, with the following\n"
-    "; caveats:\n"
-    ";\n"
-    "; a) Whitespace has been added to help reveal the structure of the script.\n"
-    "; b) In the CACM paper six lines were printed twice adjacent to each\n"
-    ";    other (with exactly 34 lines between each duplicate), making the\n"
-    ";    structure nonsensical. These duplicates have been commented out of\n"
-    ";    this transcription.\n"
-    "; c) There were no comments in the script in the CACM paper.\n"
-    ";\n"
-    "\n"
-    "\n"
-    "(HOW DO YOU DO.  PLEASE TELL ME YOUR PROBLEM)\n"
-    "\n"
-    "START\n"
-    "\n"
-    "(SORRY\n"
-    "    ((0)\n"
-    "        (PLEASE DON'T APOLIGIZE)\n"
-    "        (APOLOGIES ARE NOT NECESSARY)\n"
-    "        (WHAT FEELINGS DO YOU HAVE WHEN YOU APOLOGIZE)\n"
-    "        (I'VE TOLD YOU THAT APOLOGIES ARE NOT REQUIRED)))\n"
-    "\n"
-    "(DONT = DON'T)\n"
-    "(CANT = CAN'T)\n"
-    "(WONT = WON'T)\n"
-    "\n"
-    "(REMEMBER 5\n"
-    "    ((0 YOU REMEMBER 0)\n"
-    "        (DO YOU OFTEN THINK OF 4)\n"
-    "        (DOES THINKING OF 4 BRING ANYTHING ELSE TO MIND)\n"
-    "        (WHAT ELSE DO YOU REMEMBER)\n"
-    "        (WHY DO YOU REMEMBER 4 JUST NOW)\n"
-    "        (WHAT IN THE PRESENT SITUATION REMINDS YOU OF 4)\n"
-    "        (WHAT IS THE CONNECTION BETWEEN ME AND 4))\n"
-    "    ((0 DO I REMEMBER 0)\n"
-    "        (DID YOU THINK I WOULD FORGET 5)\n"
-    "        (WHY DO YOU THINK I SHOULD RECALL 5 NOW)\n"
-    "        (WHAT ABOUT 5)\n"
-    "        (=WHAT)\n"
-    "        (YOU MENTIONED 5))\n"
-    "    ((0)\n"
-    "        (NEWKEY)))\n"
-    "\n"
-    "(IF 3\n"
-    "    ((0 IF 0)\n"
-    "        (DO YOU THINK ITS LIKELY THAT 3)\n"
-    "        (DO YOU WISH THAT 3)\n"
-    "        (WHAT DO YOU THINK ABOUT 3)\n"
-    "        (REALLY, 2 3)))\n"
-    "; duplicate line removed: (WHAT DO YOU THINK ABOUT 3) (REALLY, 2 3)))\n"
-    "\n"
-    "(DREAMT 4\n"
-    "    ((0 YOU DREAMT 0)\n"
-    "        (REALLY, 4)\n"
-    "        (HAVE YOU EVER FANTASIED 4 WHILE YOU WERE AWAKE)\n"
-    "        (HAVE YOU DREAMT 4 BEFORE)\n"
-    "        (=DREAM)\n"
-    "        (NEWKEY)))\n"
-    "\n"
-    "(DREAMED = DREAMT 4\n"
-    "    (=DREAMT))\n"
-    "\n"
-    "(DREAM 3\n"
-    "    ((0)\n"
-    "        (WHAT DOES THAT DREAM SUGGEST TO YOU)\n"
-    "        (DO YOU DREAM OFTEN)\n"
-    "        (WHAT PERSONS APPEAR IN YOUR DREAMS)\n"
-    "        (DON'T YOU BELIEVE THAT DREAM HAS SOMETHING TO DO WITH YOUR PROBLEM)\n"
-    "        (NEWKEY)))\n"
-    "\n"
-    "(DREAMS = DREAM 3\n"
-    "    (=DREAM))\n"
-    "\n"
-    "(HOW\n"
-    "    (=WHAT))\n"
-    "(WHEN\n"
-    "    (=WHAT))\n"
-    "(ALIKE 10\n"
-    "    (=DIT))\n"
-    "(SAME 10\n"
-    "    (=DIT))\n"
-    "(CERTAINLY\n"
-    "    (=YES))\n"
-    "\n"
-    "(FEEL DLIST(/BELIEF))\n"
-    "(THINK DLIST(/BELIEF))\n"
-    "(BELIEVE DLIST(/BELIEF))\n"
-    "(WISH DLIST(/BELIEF))\n"
-    "\n"
-    "(MEMORY MY\n"
-    "    (0 YOUR 0 = LETS DISCUSS FURTHER WHY YOUR 3)\n"
-    "    (0 YOUR 0 = EARLIER YOU SAID YOUR 3)\n"
-    "    (0 YOUR 0 = BUT YOUR 3)\n"
-    "    (0 YOUR 0 = DOES THAT HAVE ANYTHING TO DO WITH THE FACT THAT YOUR 3))\n"
-    "\n"
-    "(NONE\n"
-    "    ((0)\n"
-    "        (I AM NOT SURE I UNDERSTAND YOU FULLY)\n"
-    "        (PLEASE GO ON)\n"
-    "        (WHAT DOES THAT SUGGEST TO YOU)\n"
-    "        (DO YOU FEEL STRONGLY ABOUT DISCUSSING SUCH THINGS)))\n"
-    "\n"
-    "(PERHAPS\n"
-    "    ((0)\n"
-    "        (YOU DON'T SEEM QUITE CERTAIN)\n"
-    "        (WHY THE UNCERTAIN TONE)\n"
-    "        (CAN'T YOU BE MORE POSITIVE)\n"
-    "        (YOU AREN'T SURE)\n"
-    "        (DON'T YOU KNOW)))\n"
-    "\n"
-    "(MAYBE\n"
-    "    (=PERHAPS))\n"
-    "\n"
-    "(NAME 15\n"
-    "    ((0)\n"
-    "        (I AM NOT INTERESTED IN NAMES)\n"
-    "        (I'VE TOLD YOU BEFORE, I DON'T CARE ABOUT NAMES - PLEASE CONTINUE)))\n"
-    "; duplicate line removed: PLEASE CONTINUE)) )\n"
-    "\n"
-    "(DEUTSCH\n"
-    "    (=XFREMD))\n"
-    "(FRANCAIS\n"
-    "    (=XFREMD))\n"
-    "(ITALIANO\n"
-    "    (=XFREMD))\n"
-    "(ESPANOL\n"
-    "    (=XFREMD))\n"
-    "\n"
-    "(XFREMD\n"
-    "    ((0)\n"
-    "        (I AM SORRY, I SPEAK ONLY ENGLISH)))\n"
-    "\n"
-    "(HELLO\n"
-    "    ((0)\n"
-    "        (HOW DO YOU DO.  PLEASE STATE YOUR PROBLEM)))\n"
-    "\n"
-    "(COMPUTER 50\n"
-    "    ((0)\n"
-    "        (DO COMPUTERS WORRY YOU)\n"
-    "        (WHY DO YOU MENTION COMPUTERS)\n"
-    "        (WHAT DO YOU THINK MACHINES HAVE TO DO WITH YOUR PROBLEM)\n"
-    "        (DON'T YOU THINK COMPUTERS CAN HELP PEOPLE)\n"
-    "        (WHAT ABOUT MACHINES WORRIES YOU)\n"
-    "        (WHAT DO YOU THINK ABOUT MACHINES)))\n"
-    "\n"
-    "(MACHINE 50\n"
-    "    (=COMPUTER))\n"
-    "(MACHINES 50\n"
-    "    (=COMPUTER))\n"
-    "(COMPUTERS 50\n"
-    "    (=COMPUTER))\n"
-    "\n"
-    "(AM = ARE\n"
-    "    ((0 ARE YOU 0)\n"
-    "        (DO YOU BELIEVE YOU ARE 4)\n"
-    "        (WOULD YOU WANT TO BE 4)\n"
-    "        (YOU WISH I WOULD TELL YOU YOU ARE 4)\n"
-    "        (WHAT WOULD IT MEAN IF YOU WERE 4)\n"
-    "        (=WHAT))\n"
-    "    ((0)\n"
-    "        (WHY DO YOU SAY 'AM')\n"
-    "        (I DON'T UNDERSTAND THAT)))\n"
-    "\n"
-    "(ARE\n"
-    "    ((0 ARE I 0)\n"
-    "        (WHY ARE YOU INTERESTED IN WHETHER I AM 4 OR NOT)\n"
-    "        (WOULD YOU PREFER IF I WEREN'T 4)\n"
-    "        (PERHAPS I AM 4 IN YOUR FANTASIES)\n"
-    "        (DO YOU SOMETIMES THINK I AM 4)\n"
-    "        (=WHAT))\n"
-    "    ((0 ARE 0)\n"
-    "        (DID YOU THINK THEY MIGHT NOT BE 3)\n"
-    "        (WOULD YOU LIKE IT IF THEY WERE NOT 3)\n"
-    "        (WHAT IF THEY WERE NOT 3)\n"
-    "        (POSSIBLY THEY ARE 3)))\n"
-    "\n"
-    "(YOUR = MY\n"
-    "    ((0 MY 0)\n"
-    "        (WHY ARE YOU CONCERNED OVER MY 3)\n"
-    "        (WHAT ABOUT YOUR OWN 3)\n"
-    "        (ARE YOU WORRIED ABOUT SOMEONE ELSES 3)\n"
-    "        (REALLY, MY 3)))\n"
-    "\n"
-    "(WAS 2\n"
-    "    ((0 WAS YOU 0)\n"
-    "        (WHAT IF YOU WERE 4)\n"
-    "        (DO YOU THINK YOU WERE 4)\n"
-    "        (WERE YOU 4)\n"
-    "        (WHAT WOULD IT MEAN IF YOU WERE 4)\n"
-    "        (WHAT DOES ' 4 ' SUGGEST TO YOU)\n"
-    "        (=WHAT))\n"
-    "    ((0 YOU WAS 0)\n"
-    "        (WERE YOU REALLY)\n"
-    "        (WHY DO YOU TELL ME YOU WERE 4 NOW)\n"
-    "; duplicate line removed: (WERE YOU REALLY) (WHY DO YOU TELL ME YOU WERE 4 NOW)\n"
-    "        (PERHAPS I ALREADY KNEW YOU WERE 4))\n"
-    "    ((0 WAS I 0)\n"
-    "        (WOULD YOU LIKE TO BELIEVE I WAS 4)\n"
-    "        (WHAT SUGGESTS THAT I WAS 4)\n"
-    "        (WHAT DO YOU THINK)\n"
-    "        (PERHAPS I WAS 4)\n"
-    "        (WHAT IF I HAD BEEN 4))\n"
-    "    ((0)\n"
-    "        (NEWKEY)))\n"
-    "\n"
-    "(WERE = WAS\n"
-    "    (=WAS))\n"
-    "(ME = YOU)\n"
-    "\n"
+
+/*  Does stage 2 of eliza::response() (see eliza::scan_keywords()) for the
+    inputs of many conversations at once. Each input's words are looked
+    up once, in a hash table, to give their ids (0 for a word that is
+    neither a keyword nor a delimiter). The ids are laid out a word
+    position at a time: the first word of every input, then the second
+    word of every input, and so on. The scan then goes a word position at a
+    time over all the inputs, eight inputs to a group. For each input's
+    word it gathers the word's delimiter,
+    keyword and precedence from a table indexed by id, and checks them
+    against that input's scan so far. That finds the clause to keep and
+    which of its words go to the front or back of the keystack. What's
+    left, the substitutions and the keystack itself, is then done for
+    each input on its own, touching only the words of its clause.
+
+    The conversations should use the script and delimiters the scanner
+    was made for, and not be tracing; any that don't are scanned by
+    eliza::scan_keywords(). */
+class batch_scanner {
+public:
+    batch_scanner(std::shared_ptr<const script_context> context, stringlist delimiters)
+        : context_(std::move(context)), delimiters_(std::move(delimiters))
+    {
+        info_.push_back(0);
+        rules_.push_back(nullptr);
+        for (const auto & d : delimiters_) {
+            if (ids_.emplace(d, static_cast<int32_t>(info_.size())).second) {
+                info_.push_back(delimiter_flag);
+                rules_.push_back(nullptr);
+            }
+        }
+        for (const auto & [keyword, rule] : context_->rules) {
+            if (ids_.count(keyword))
+                continue; // (a delimiter is never a keyword)
+            ids_.emplace(keyword, static_cast<int32_t>(info_.size()));
+            info_.push_back(rule->has_transformation()
+                ? keyword_flag | static_cast<int32_t>(rule->precedence()) << precedence_shift
+                : 0);
+            rules_.push_back(rule.get());
+        }
+    }
+
+    // true if given conversation can be scanned in a batch
+    bool suits(const eliza & conversation) const
+    {
+        return &conversation.context() == context_.get()
+            && !conversation.trace_->active()
+            && conversation.delimiters_ == delimiters_;
+    }
+
+    // as conversations[i]->scan_keywords(*work[i]) for each i < n, each
+    // work having been through stage 1
+    void scan(eliza * const * conversations, response_work * const * work, size_t n)
+    {
+        lanes_.clear();
+        size_t longest = 0;
+        for (size_t i = 0; i < n; ++i) {
+            if (suits(*conversations[i])) {
+                lanes_.push_back(i);
+                longest = std::max(longest, work[i]->words.size());
+            }
+            else
+                conversations[i]->scan_keywords(*work[i]);
+        }
+        if (lanes_.empty())
+            return;
+
+        // the ids, a word position at a time (a lane is one input)
+        groups_ = (lanes_.size() + 7) / 8;
+        stride_ = groups_ * 8;
+        ids_by_position_.assign(longest * stride_, 0);
+        length_.assign(stride_, 0);
+        for (size_t lane = 0; lane < lanes_.size(); ++lane) {
+            const stringlist & words = work[lanes_[lane]]->words;
+            length_[lane] = static_cast<int32_t>(words.size());
+            int32_t * id = &ids_by_position_[lane];
+            for (const auto & word : words) {
+                const auto w = ids_.find(word);
+                *id = w == ids_.end() ? 0 : w->second;
+                id += stride_;
+            }
+        }
+
+        begin_.assign(stride_, 0);
+        end_.assign(stride_, 0);
+        key_bits_.assign(longest * groups_, 0);
+        front_bits_.assign(longest * groups_, 0);
+        for (size_t g = 0; g < groups_; ++g)
+            scan_group(g);
+
+        // each input's substitutions and keystack
+        for (size_t lane = 0; lane < lanes_.size(); ++lane) {
+            eliza & conversation = *conversations[lanes_[lane]];
+            response_work & w = *work[lanes_[lane]];
+            w.limit = conversation.state_.advance_limit();
+            w.keystack.clear();
+            const size_t g = lane / 8;
+            const unsigned bit = 1u << (lane % 8);
+            const auto begin = static_cast<size_t>(begin_[lane]), end = static_cast<size_t>(end_[lane]);
+            for (size_t p = begin; p < end; ++p) {
+                std::string & word = w.words[p];
+                if (key_bits_[p * groups_ + g] & bit) {
+                    if (front_bits_[p * groups_ + g] & bit)
+                        w.keystack.push_front(word);
+                    else
+                        w.keystack.push_back(word);
+                }
+                if (const rule_base * rule = rules_[ids_by_position_[p * stride_ + lane]])
+                    word = rule->word_substitute(word); // [page 39 (a)]
+            }
+            w.words.erase(w.words.begin() + end, w.words.end());
+            w.words.erase(w.words.begin(), w.words.begin() + begin);
+        }
+    }
+
+private:
+    // info_[id] is a word's flags and, if it's a keyword, its precedence
+    static constexpr int32_t delimiter_flag = 1;
+    static constexpr int32_t keyword_flag = 2;     // (a keyword with a transformation)
+    static constexpr int precedence_shift = 8;
+
+    const std::shared_ptr<const script_context> context_;
+    const stringlist delimiters_;
+    std::unordered_map<std::string, int32_t> ids_;
+    std::vector<int32_t> info_;
+    std::vector<const rule_base *> rules_;          // rules_[id], for substitutions
+
+    // (the rest is working storage for scan(), kept for reuse)
+    std::vector<size_t> lanes_;                     // the index of each lane's input
+    size_t groups_{ 0 };                            // groups of eight lanes
+    size_t stride_{ 0 };
+    std::vector<int32_t> ids_by_position_;          // [position * stride_ + lane]
+    std::vector<int32_t> length_;                   // [lane]: words in lane's input
+    std::vector<int32_t> begin_, end_;              // [lane]: the clause kept
+    std::vector<uint8_t> key_bits_, front_bits_;    // [position * groups_ + group], a bit a lane:
+                                                    // the word goes on the keystack; at the front
+
+    /*  Find each lane's clause, as eliza::scan_keywords() does: until a
+        keyword is found, a delimiter starts the clause again after it;
+        after one is found, a delimiter ends it. A keyword goes to the
+        front of the keystack if its precedence is higher than any before
+        it, otherwise to the back. */
+    void scan_group(size_t g)
+    {
+        for (size_t lane = g * 8; lane < g * 8 + 8; ++lane) {
+            const size_t length = static_cast<size_t>(length_[lane]);
+            bool found = false;
+            int32_t begin = 0, end = static_cast<int32_t>(length), top = 0;
+            const uint8_t bit = static_cast<uint8_t>(1u << (lane % 8));
+            for (size_t p = 0; p < length; ++p) {
+                const int32_t info = info_[ids_by_position_[p * stride_ + lane]];
+                if (info & delimiter_flag) {
+                    if (!found)
+                        begin = static_cast<int32_t>(p + 1);
+                    else {
+                        end = static_cast<int32_t>(p);
+                        break;
+                    }
+                }
+                else if (info & keyword_flag) {
+                    found = true;
+                    key_bits_[p * groups_ + g] |= bit;
+                    const int32_t precedence = info >> precedence_shift;
+                    if (precedence > top) {
+                        top = precedence;
+                        front_bits_[p * groups_ + g] |= bit;
+                    }
+                }
+            }
+            begin_[lane] = begin;
+            end_[lane] = end;
+        }
+    }
+};
+
+
+// scan the inputs of the given number of conversations, rounds times
+// over, either one at a time with eliza::scan_keywords() or all together
+// with a batch_scanner; each input is
+// split (stage 1) before the clock starts (result.exchanges is the number
+// of inputs scanned)
+contention_result scan_benchmark(
+    std::shared_ptr<const script_context> context,
+    const stringlist & inputs,
+    bool batched,
+    size_t conversations = 256,
+    size_t rounds = 400)
+{
+    if (inputs.empty() || conversations == 0)
+        throw std::runtime_error("scan_benchmark: nothing to do");
+    std::vector<std::unique_ptr<eliza>> talk;
+    std::vector<eliza *> talk_ptrs;
+    for (size_t i = 0; i < conversations; ++i) {
+        talk.push_back(std::make_unique<eliza>(context));
+        talk_ptrs.push_back(talk.back().get());
+    }
+    std::vector<response_work> split(inputs.size());
+    for (size_t i = 0; i < inputs.size(); ++i)
+        talk[0]->split_input(inputs[i], split[i]);
+    std::vector<response_work> work(conversations);
+    std::vector<response_work *> work_ptrs;
+    for (auto & w : work)
+        work_ptrs.push_back(&w);
+    batch_scanner scanner(context, talk[0]->delimiters());
+
+    double seconds = 0;
+    for (size_t r = 0; r < rounds; ++r) {
+        for (size_t i = 0; i < conversations; ++i)
+            work[i].words = split[(r + i) % split.size()].words;
+        const auto start = std::chrono::steady_clock::now();
+        if (batched)
+            scanner.scan(talk_ptrs.data(), work_ptrs.data(), conversations);
+        else
+            for (size_t i = 0; i < conversations; ++i)
+                talk[i]->scan_keywords(work[i]);
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    contention_result result;
+    result.threads = 1;
+    result.exchanges = conversations * rounds;
+    result.seconds = seconds;
+    return result;
+}
+
+
+
+/*  For batch jobs over many conversations: runs the four stages of
+    eliza::response() on a thread each, so four cores are kept busy and
+    each keeps to one stage's code and data. Inputs go through the stages
+    in batches, and stage 2 scans each batch at once (see batch_scanner).
+    The stages are joined by queues with one producer and one
+    consumer that take no lock; a stage with nothing to do waits on an
+    atomic (std::atomic::wait). There are only so many batches, which go
+    back to submit() when the last stage is done with them, so the queues
+    are bounded and never full, and submit() waits when all the batches
+    are in use.
+
+    Every input goes through every stage in the order submitted, so each
+    conversation's replies come in order; one input of a conversation may
+    be in a later stage while the next is in an earlier one, which
+    eliza::response() allows. submit() and wait_idle() must be called
+    from one thread. A conversation given to submit() must not be used
+    otherwise, nor be tracing, until wait_idle() returns. */
+class response_pipeline {
+public:
+    using reply_handler = std::function<void(const std::string & reply)>;
+
+    static constexpr unsigned stages = 4;
+
+    explicit response_pipeline(size_t batch_size = 64, size_t batches = 16)
+        : batch_size_(std::max<size_t>(1, batch_size)),
+        batches_(std::max<size_t>(stages, batches)),
+        free_(batches_.size() + 1)
+    {
+        for (auto & b : batches_) {
+            b.items.resize(batch_size_);
+            free_.push(&b);
+        }
+        for (unsigned k = 0; k < stages; ++k)
+            queues_.push_back(std::make_unique<queue>(batches_.size() + 1));
+        for (unsigned k = 0; k < stages; ++k)
+            threads_.emplace_back([this, k]() { run(k); });
+    }
+
+    response_pipeline(const response_pipeline &) = delete;
+    response_pipeline & operator=(const response_pipeline &) = delete;
+
+    // answer every input already submitted, then stop
+    ~response_pipeline()
+    {
+        wait_idle();
+        queues_[0]->push(nullptr); // (passed down the stages, stopping each)
+        for (auto & t : threads_)
+            t.join();
+    }
+
+    // queue given input for given conversation; handler, if given, will
+    // be called on the last stage's thread with the reply
+    void submit(eliza & conversation, std::string input, reply_handler handler = nullptr)
+    {
+        if (!filling_)
+            filling_ = free_.pop();
+        item & it = filling_->items[filling_->size++];
+        it.conversation = &conversation;
+        it.input = std::move(input);
+        it.handler = std::move(handler);
+        ++submitted_;
+        if (filling_->size == batch_size_) {
+            queues_[0]->push(filling_);
+            filling_ = nullptr;
+        }
+    }
+
+    // wait until every input submitted so far has been answered
+    void wait_idle()
+    {
+        if (filling_) {
+            queues_[0]->push(filling_);
+            filling_ = nullptr;
+        }
+        for (size_t done; (done = answered_.load()) != submitted_; )
+            answered_.wait(done);
+    }
+
+private:
+    struct item {
+        eliza * conversation{ nullptr };
+        std::string input;
+        response_work work;
+        reply_handler handler;
+    };
+
+    struct batch {
+        std::vector<item> items;
+        size_t size{ 0 };
+    };
+
+    // a queue with one producer and one consumer, which has room for
+    // every batch (and the null that stops the stages)
+    class queue {
+    public:
+        explicit queue(size_t capacity) : slots_(capacity) {}
+
+        void push(batch * b)
+        {
+            const size_t tail = tail_.load(std::memory_order_relaxed);
+            assert(tail - head_.load(std::memory_order_acquire) < slots_.size());
+            slots_[tail % slots_.size()] = b;
+            tail_.store(tail + 1, std::memory_order_release);
+            tail_.notify_one();
+        }
+
+        // wait for and return the batch at the front of the queue
+        batch * pop()
+        {
+            const size_t head = head_.load(std::memory_order_relaxed);
+            for (size_t tail; (tail = tail_.load(std::memory_order_acquire)) == head; )
+                tail_.wait(tail, std::memory_order_acquire);
+            batch * b = slots_[head % slots_.size()];
+            head_.store(head + 1, std::memory_order_release);
+            return b;
+        }
+
+    private:
+        std::vector<batch *> slots_;
+        alignas(cache_line_size) std::atomic<size_t> head_{ 0 };
+        alignas(cache_line_size) std::atomic<size_t> tail_{ 0 };
+    };
+
+    const size_t batch_size_;
+    std::vector<batch> batches_;
+    queue free_;                                    // batches for submit() to fill
+    std::vector<std::unique_ptr<queue>> queues_;    // queues_[k] feeds stage k
+    std::vector<std::thread> threads_;
+    batch * filling_{ nullptr };                    // the batch submit() is filling
+    size_t submitted_{ 0 };
+    alignas(cache_line_size) std::atomic<size_t> answered_{ 0 };
+
+    // (stage 1's, made for the first conversation it sees)
+    std::unique_ptr<batch_scanner> scanner_;
+    std::vector<eliza *> scanning_;
+    std::vector<response_work *> scanning_work_;
+
+    // stage 1: scan the whole batch at once
+    void scan(batch & b)
+    {
+        if (!scanner_) {
+            const eliza & first = *b.items[0].conversation;
+            scanner_ = std::make_unique<batch_scanner>(first.shared_context(), first.delimiters());
+        }
+        scanning_.clear();
+        scanning_work_.clear();
+        for (size_t i = 0; i < b.size; ++i) {
+            scanning_.push_back(b.items[i].conversation);
+            scanning_work_.push_back(&b.items[i].work);
+        }
+        scanner_->scan(scanning_.data(), scanning_work_.data(), b.size);
+    }
+
+    void run(unsigned k)
+    {
+        for (;;) {
+            batch * b = queues_[k]->pop();
+            if (!b) {
+                if (k + 1 < stages)
+                    queues_[k + 1]->push(nullptr);
+                return;
+            }
+            if (k == 1) {
+                if (b->size > 0)
+                    scan(*b);
+            }
+            else {
+                for (size_t i = 0; i < b->size; ++i) {
+                    item & it = b->items[i];
+                    switch (k) {
+                    case 0: it.conversation->split_input(it.input, it.work); break;
+                    case 2: it.conversation->transform(it.work); break;
+                    default:
+                        it.conversation->assemble_reply(it.work);
+                        if (it.handler) {
+                            it.handler(it.work.reply);
+                            it.handler = nullptr;
+                        }
+                    }
+                }
+            }
+            if (k + 1 < stages) {
+                queues_[k + 1]->push(b);
+                continue;
+            }
+            const size_t n = b->size;
+            b->size = 0;
+            free_.push(b);
+            answered_ += n;
+            answered_.notify_all();
+        }
+    }
+};
+
+
+// exchanges_per_session responses to each of the given number of
+// conversations, the inputs given in turn to each, made either one after
+// another on this thread or by a response_pipeline (result.threads is 1
+// or response_pipeline::stages)
+contention_result pipeline_benchmark(
+    std::shared_ptr<const script_context> context,
+    const stringlist & inputs,
+    bool staged,
+    size_t sessions = 1024,
+    size_t exchanges_per_session = 100)
+{
+    if (inputs.empty() || sessions == 0)
+        throw std::runtime_error("pipeline_benchmark: nothing to do");
+    std::vector<std::unique_ptr<eliza>> conversations;
+    for (size_t i = 0; i < sessions; ++i)
+        conversations.push_back(std::make_unique<eliza>(context));
+
+    const auto start = std::chrono::steady_clock::now();
+    if (staged) {
+        response_pipeline pipeline;
+        for (size_t x = 0; x < exchanges_per_session; ++x)
+            for (auto & c : conversations)
+                pipeline.submit(*c, inputs[x % inputs.size()]);
+        pipeline.wait_idle();
+    }
+    else {
+        for (size_t x = 0; x < exchanges_per_session; ++x)
+            for (auto & c : conversations)
+                c->response(inputs[x % inputs.size()]);
+    }
+
+    contention_result result;
+    result.threads = staged ? response_pipeline::stages : 1;
+    result.exchanges = sessions * exchanges_per_session;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+
+/*  For batch jobs over many conversations, on one thread. Inputs in
+    consecutive exchanges of different conversations usually have
+    different top keywords, so each transformation's decompositions and
+    reassemblies evict the last's from the cache. So this runs the first
+    two stages of eliza::response() for a whole batch of inputs (scanning
+    them with a batch_scanner), then groups the transformations (stage 3)
+    by the rule of the keyword at the top of each keystack and does each
+    group's together, while that rule's data is still in cache. Inputs
+    with no keyword (which recall a memory or use NONE) are a group of
+    their own.
+
+    A conversation may have several inputs in a batch: its first is in
+    round 0, its second in round 1, and so on, and the groups are formed
+    within each round, so each conversation's inputs are still
+    transformed, and its replies given, in the order they were submitted.
+    A conversation given to submit() must not be used otherwise, nor be
+    tracing, until flush() returns. */
+class batch_scheduler {
+public:
+    using reply_handler = std::function<void(const std::string & reply)>;
+
+    struct statistics {
+        unsigned long long inputs{ 0 };     // inputs answered
+        unsigned long long groups{ 0 };     // groups transformed (if not grouped, inputs)
+    };
+
+    // if not grouped, transform each batch in the order submitted (to
+    // measure what grouping is worth)
+    explicit batch_scheduler(size_t batch_size = 256, bool grouped = true)
+        : batch_size_(std::max<size_t>(1, batch_size)), grouped_(grouped), items_(batch_size_)
+    {
+    }
+
+    batch_scheduler(const batch_scheduler &) = delete;
+    batch_scheduler & operator=(const batch_scheduler &) = delete;
+
+    ~batch_scheduler() { flush(); }
+
+    // queue given input for given conversation; handler, if given, will
+    // be called with the reply when the batch the input is in is run (and
+    // must not call submit() or flush())
+    void submit(eliza & conversation, std::string input, reply_handler handler = nullptr)
+    {
+        item & it = items_[size_++];
+        it.conversation = &conversation;
+        it.input = std::move(input);
+        it.handler = std::move(handler);
+        if (size_ == batch_size_)
+            flush();
+    }
+
+    // answer every input submitted so far
+    void flush()
+    {
+        if (size_ == 0)
+            return;
+        const size_t n = size_;
+
+        // stages 1 and 2
+        conversations_.clear();
+        work_.clear();
+        for (size_t i = 0; i < n; ++i) {
+            item & it = items_[i];
+            it.conversation->split_input(it.input, it.work);
+            conversations_.push_back(it.conversation);
+            work_.push_back(&it.work);
+        }
+        if (!scanner_) {
+            const eliza & first = *items_[0].conversation;
+            scanner_ = std::make_unique<batch_scanner>(first.shared_context(), first.delimiters());
+        }
+        scanner_->scan(conversations_.data(), work_.data(), n);
+
+        // the order to transform in: by round, then by group
+        order_.resize(n);
+        for (size_t i = 0; i < n; ++i)
+            order_[i] = i;
+        if (grouped_) {
+            rounds_.clear();
+            groups_.clear();
+            for (size_t i = 0; i < n; ++i) {
+                item & it = items_[i];
+                it.round = rounds_[it.conversation]++;
+                it.group = groups_.emplace(
+                    it.work.keystack.empty() ? std::string() : it.work.keystack.front(),
+                    groups_.size()).first->second;
+            }
+            std::stable_sort(order_.begin(), order_.end(), [this](size_t a, size_t b) {
+                const item & x = items_[a];
+                const item & y = items_[b];
+                return x.round != y.round ? x.round < y.round : x.group < y.group;
+            });
+        }
+
+        // stages 3 and 4
+        size_t last_group = ~size_t(0);
+        for (const size_t i : order_) {
+            item & it = items_[i];
+            if (!grouped_ || it.group != last_group) {
+                ++stats_.groups;
+                last_group = it.group;
+            }
+            it.conversation->transform(it.work);
+            it.conversation->assemble_reply(it.work);
+            if (it.handler) {
+                it.handler(it.work.reply);
+                it.handler = nullptr;
+            }
+        }
+        stats_.inputs += n;
+        size_ = 0;
+    }
+
+    statistics stats() const { return stats_; }
+
+private:
+    struct item {
+        eliza * conversation{ nullptr };
+        std::string input;
+        response_work work;
+        reply_handler handler;
+        size_t round{ 0 };
+        size_t group{ 0 };
+    };
+
+    const size_t batch_size_;
+    const bool grouped_;
+    std::vector<item> items_;
+    size_t size_{ 0 };
+    statistics stats_;
+
+    // (working storage for flush(), kept for reuse)
+    std::unique_ptr<batch_scanner> scanner_;        // made for the first conversation seen
+    std::vector<eliza *> conversations_;
+    std::vector<response_work *> work_;
+    std::vector<size_t> order_;
+    std::unordered_map<const eliza *, size_t> rounds_;
+    std::unordered_map<std::string, size_t> groups_; // top keyword -> group
+};
+
+
+// exchanges_per_session responses to each of the given number of
+// conversations, conversation i given inputs i, i+1, i+2, ... in turn (so
+// consecutive exchanges have different inputs, as in an offline replay),
+// made either one after another with eliza::response() or by a
+// batch_scheduler, grouped or not
+contention_result batch_benchmark(
+    std::shared_ptr<const script_context> context,
+    const stringlist & inputs,
+    bool batched,
+    bool grouped,
+    size_t sessions = 1024,
+    size_t exchanges_per_session = 100)
+{
+    if (inputs.empty() || sessions == 0)
+        throw std::runtime_error("batch_benchmark: nothing to do");
+    std::vector<std::unique_ptr<eliza>> conversations;
+    for (size_t i = 0; i < sessions; ++i)
+        conversations.push_back(std::make_unique<eliza>(context));
+
+    const auto start = std::chrono::steady_clock::now();
+    if (batched) {
+        batch_scheduler scheduler(256, grouped);
+        for (size_t x = 0; x < exchanges_per_session; ++x)
+            for (size_t i = 0; i < sessions; ++i)
+                scheduler.submit(*conversations[i], inputs[(i + x) % inputs.size()]);
+        scheduler.flush();
+    }
+    else {
+        for (size_t x = 0; x < exchanges_per_session; ++x)
+            for (size_t i = 0; i < sessions; ++i)
+                conversations[i]->response(inputs[(i + x) % inputs.size()]);
+    }
+
+    contention_result result;
+    result.threads = 1;
+    result.exchanges = sessions * exchanges_per_session;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+
+
+/*  ELIZA is deterministic: given the same script, settings and inputs a
+    conversation always goes the same way. So a record of the inputs is as
+    good as a record of the state. A journal is a text file with one record
+    per line, fields separated by tabs:
+
+        ELIZA-JOURNAL   1                                   header
+        S   <session>   <script hash>   <time>              session start
+        I   <session>   <time>   <input>   <reply>          one exchange
+
+    <time> is milliseconds since the Unix epoch; <script hash> is the
+    script_context::hash in hex. A session may have more than one S record
+    (e.g. one from each run of a server that was restarted), but all must
+    give the same script hash. In <session>, <input> and <reply> a tab,
+    newline, carriage return or backslash is written as \t, \n, \r or \\. */
+namespace journal {
+
+const std::string header{ "ELIZA-JOURNAL\t1" };
+
+std::string escape(const std::string & s)
+{
+    std::string result;
+    result.reserve(s.size());
+    for (const char c : s) {
+        switch (c) {
+        case '\t':  result += "\\t";    break;
+        case '\n':  result += "\\n";    break;
+        case '\r':  result += "\\r";    break;
+        case '\\':  result += "\\\\";   break;
+        default:    result += c;        break;
+        }
+    }
+    return result;
+}
+
+std::string unescape(const std::string & s)
+{
+    std::string result;
+    result.reserve(s.size());
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] != '\\' || i + 1 == s.size()) {
+            result += s[i];
+            continue;
+        }
+        switch (s[++i]) {
+        case 't':   result += '\t';     break;
+        case 'n':   result += '\n';     break;
+        case 'r':   result += '\r';     break;
+        default:    result += s[i];     break;
+        }
+    }
+    return result;
+}
+
+
+DEF_TEST_FUNC(journal_escape_test)
+{
+    const std::string awkward("tab\there\nnewline\rcr\\backslash\\t");
+    TEST_EQUAL(escape(awkward), "tab\\there\\nnewline\\rcr\\\\backslash\\\\t");
+    TEST_EQUAL(unescape(escape(awkward)), awkward);
+    TEST_EQUAL(escape(awkward).find('\t'), std::string::npos);
+}
+
+
+uint_least64_t now_ms()
+{
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+
+// appends records to a journal; may be shared by many threads
+class writer {
+public:
+    // os should be opened for appending; the header is written only if
+    // os is at its start; the writer remembers which sessions it has
+    // written an S record for, up to max_started of them, then forgets
+    // them all (a session's S record may be repeated, so that only costs
+    // a few bytes)
+    writer(std::ostream & os, uint_least64_t script_hash, size_t flush_every = 1,
+        size_t max_started = 4096)
+        : os_(os), script_hash_(script_hash), flush_every_(std::max<size_t>(1, flush_every)),
+        max_started_(std::max<size_t>(1, max_started))
+    {
+        if (os_.tellp() <= 0)
+            os_ << header << '\n';
+    }
+
+    ~writer() { os_.flush(); }
+
+    void record(const std::string & session, const std::string & input,
+        const std::string & reply, uint_least64_t time = now_ms())
+    {
+        std::string line;
+        const std::string id(escape(session));
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (started_.size() == max_started_ && !started_.count(session))
+            started_.clear();
+        if (started_.insert(session).second) {
+            std::ostringstream hash;
+            hash << std::hex << script_hash_;
+            line += "S\t" + id + '\t' + hash.str() + '\t' + std::to_string(time) + '\n';
+        }
+        line += "I\t" + id + '\t' + std::to_string(time) + '\t'
+            + escape(input) + '\t' + escape(reply) + '\n';
+        os_ << line;
+        if (++unflushed_ == flush_every_) {
+            os_.flush();
+            unflushed_ = 0;
+        }
+    }
+
+    // forget given session, which has ended; nothing is written
+    void end(const std::string & session)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        started_.erase(session);
+    }
+
+private:
+    std::ostream & os_;
+    const uint_least64_t script_hash_;
+    const size_t flush_every_;
+    const size_t max_started_;
+    size_t unflushed_{ 0 };
+    std::unordered_set<std::string> started_; // sessions with an S record
+    std::mutex mutex_;
+};
+
+
+struct exchange {
+    uint_least64_t time;
+    std::string input;
+    std::string reply;
+};
+
+struct session_record {
+    std::string id;
+    uint_least64_t script_hash{ 0 };
+    std::vector<exchange> exchanges;
+};
+
+
+// return the sessions recorded in the journal read from given is, in the
+// order each session started; throw on a malformed journal
+std::vector<session_record> read(std::istream & is)
+{
+    std::string line;
+    if (!std::getline(is, line) || line != header)
+        throw std::runtime_error("journal: missing header");
+    std::vector<session_record> sessions;
+    std::unordered_map<std::string, size_t> index;
+    for (size_t line_num = 2; std::getline(is, line); ++line_num) {
+        if (line.empty())
+            continue;
+        std::vector<std::string> f;
+        for (size_t start = 0; ; ) {
+            const size_t tab = line.find('\t', start);
+            f.push_back(line.substr(start, tab - start));
+            if (tab == std::string::npos)
+                break;
+            start = tab + 1;
+        }
+        auto fail = [&]() {
+            throw std::runtime_error("journal: malformed record on line " + std::to_string(line_num));
+        };
+        // the value of given field, which must be 1 to max_digits digits
+        // in given base (10 or 16), so it can't overflow
+        auto number = [&](const std::string & field, int base, size_t max_digits) {
+            if (field.empty() || field.size() > max_digits)
+                fail();
+            for (const unsigned char c : field)
+                if (!(base == 16 ? std::isxdigit(c) : std::isdigit(c)))
+                    fail();
+            return static_cast<uint_least64_t>(std::stoull(field, nullptr, base));
+        };
+        if (f[0] == "S" && f.size() == 4) {
+            const std::string id(unescape(f[1]));
+            const uint_least64_t hash = number(f[2], 16, 16);
+            const auto i = index.find(id);
+            if (i != index.end()) {
+                // the session started again, e.g. after a restart
+                if (sessions[i->second].script_hash != hash)
+                    fail();
+                continue;
+            }
+            index[id] = sessions.size();
+            session_record r;
+            r.id = id;
+            r.script_hash = hash;
+            sessions.push_back(std::move(r));
+        }
+        else if (f[0] == "I" && f.size() == 5) {
+            const auto i = index.find(unescape(f[1]));
+            if (i == index.end())
+                fail();
+            sessions[i->second].exchanges.push_back({ number(f[2], 10, 19), unescape(f[3]), unescape(f[4]) });
+        }
+        else
+            fail();
+    }
+    return sessions;
+}
+
+
+struct replay_result {
+    size_t sessions{ 0 };           // sessions replayed
+    size_t exchanges{ 0 };          // exchanges replayed
+    size_t mismatches{ 0 };         // replies that differ from those recorded
+    size_t skipped{ 0 };            // sessions recorded with a different script
+    std::vector<std::string> errors;// a description of each mismatch (up to max_errors)
+    std::map<std::string, std::string> snapshots; // session id -> eliza::snapshot() at end
+    double seconds{ 0 };            // wall-clock time taken
+};
+
+
+/*  Re-run every session in the given journal against the given script,
+    threads sessions at a time, checking each reply against the recorded
+    reply. configure, if given, is applied to each new conversation; it
+    must set whatever was set when the journal was recorded. If keep_state
+    is true the result includes each session's final state, which may be
+    used to rebuild the sessions after a crash (e.g. by putting them in the
+    snapshot_store of a session_table). */
+replay_result replay(
+    const std::vector<session_record> & sessions,
+    std::shared_ptr<const script_context> context,
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency()),
+    std::function<void(eliza &)> configure = nullptr,
+    bool keep_state = false,
+    size_t max_errors = 100)
+{
+    replay_result result;
+    std::mutex mutex;
+    std::atomic<size_t> next{ 0 };
+    const auto start = std::chrono::steady_clock::now();
+
+    auto work = [&]() {
+        size_t exchanges = 0, mismatches = 0, replayed = 0, skipped = 0;
+        for (size_t i; (i = next++) < sessions.size(); ) {
+            const session_record & rec = sessions[i];
+            if (rec.script_hash != context->hash) {
+                ++skipped;
+                continue;
+            }
+            ++replayed;
+            eliza e(context);
+            if (configure)
+                configure(e);
+            for (size_t x = 0; x < rec.exchanges.size(); ++x) {
+                const std::string reply(e.response(rec.exchanges[x].input));
+                ++exchanges;
+                if (reply != rec.exchanges[x].reply) {
+                    ++mismatches;
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (result.errors.size() < max_errors)
+                        result.errors.push_back("session " + rec.id + " exchange "
+                            + std::to_string(x + 1) + ": expected '" + rec.exchanges[x].reply
+                            + "', but got '" + reply + "'");
+                }
+            }
+            if (keep_state) {
+                std::string snapshot(e.snapshot());
+                std::lock_guard<std::mutex> lock(mutex);
+                result.snapshots[rec.id] = std::move(snapshot);
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        result.sessions += replayed;
+        result.exchanges += exchanges;
+        result.mismatches += mismatches;
+        result.skipped += skipped;
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < std::max(1u, threads); ++t)
+        workers.emplace_back(work);
+    work();
+    for (auto & w : workers)
+        w.join();
+
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+}//namespace journal
+
+
+
+// the contents of a file, read-only; where the platform allows, the file
+// is mapped into memory rather than read
+class mapped_file {
+public:
+    explicit mapped_file(const std::string & path)
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            throw std::runtime_error("failed to open '" + path + "'");
+        struct stat st {};
+        if (::fstat(fd, &st) == -1) {
+            ::close(fd);
+            throw std::runtime_error("failed to read '" + path + "'");
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ != 0) {
+            void * p = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("failed to map '" + path + "'");
+            }
+            ::madvise(p, size_, MADV_SEQUENTIAL);
+            map_ = static_cast<const char *>(p);
+        }
+        ::close(fd);
+#else
+        std::ifstream is(path, std::ios::binary);
+        if (!is.is_open())
+            throw std::runtime_error("failed to open '" + path + "'");
+        contents_.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+        size_ = contents_.size();
+#endif
+    }
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file & operator=(const mapped_file &) = delete;
+
+    ~mapped_file()
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        if (map_)
+            ::munmap(const_cast<char *>(map_), size_);
+#endif
+    }
+
+    const char * data() const
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        return map_;
+#else
+        return contents_.data();
+#endif
+    }
+
+    size_t size() const { return size_; }
+
+private:
+#if defined(__unix__) || defined(__APPLE__)
+    const char * map_{ nullptr };
+#else
+    std::string contents_;
+#endif
+    size_t size_{ 0 };
+};
+
+
+// just enough JSON for a corpus stored as JSON Lines
+namespace jsonl {
+
+void skip_space(const char *& p, const char * end)
+{
+    while (p != end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+        ++p;
+}
+
+void append_utf8(unsigned long c, std::string & out)
+{
+    if (c < 0x80)
+        out += static_cast<char>(c);
+    else if (c < 0x800) {
+        out += static_cast<char>(0xC0 | (c >> 6));
+        out += static_cast<char>(0x80 | (c & 0x3F));
+    }
+    else if (c < 0x10000) {
+        out += static_cast<char>(0xE0 | (c >> 12));
+        out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (c & 0x3F));
+    }
+    else {
+        out += static_cast<char>(0xF0 | (c >> 18));
+        out += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (c & 0x3F));
+    }
+}
+
+// read the 4 hex digits at p
+bool parse_hex4(const char *& p, const char * end, unsigned long & c)
+{
+    if (end - p < 4)
+        return false;
+    c = 0;
+    for (int i = 0; i < 4; ++i, ++p) {
+        const char h = *p;
+        c <<= 4;
+        if (h >= '0' && h <= '9')       c |= h - '0';
+        else if (h >= 'a' && h <= 'f')  c |= h - 'a' + 10;
+        else if (h >= 'A' && h <= 'F')  c |= h - 'A' + 10;
+        else
+            return false;
+    }
+    return true;
+}
+
+// read the string at p (which must be at its opening quote) into out
+bool parse_string(const char *& p, const char * end, std::string & out)
+{
+    out.clear();
+    if (p == end || *p != '"')
+        return false;
+    for (++p; p != end; ) {
+        const char c = *p++;
+        if (c == '"')
+            return true;
+        if (c != '\\') {
+            out += c;
+            continue;
+        }
+        if (p == end)
+            return false;
+        switch (*p++) {
+        case '"':   out += '"';     break;
+        case '\\':  out += '\\';    break;
+        case '/':   out += '/';     break;
+        case 'b':   out += '\b';    break;
+        case 'f':   out += '\f';    break;
+        case 'n':   out += '\n';    break;
+        case 'r':   out += '\r';    break;
+        case 't':   out += '\t';    break;
+        case 'u': {
+            unsigned long u;
+            if (!parse_hex4(p, end, u))
+                return false;
+            if (u >= 0xD800 && u < 0xDC00) {
+                // a surrogate pair
+                unsigned long low;
+                if (end - p < 2 || p[0] != '\\' || p[1] != 'u')
+                    return false;
+                p += 2;
+                if (!parse_hex4(p, end, low) || low < 0xDC00 || low >= 0xE000)
+                    return false;
+                u = 0x10000 + ((u - 0xD800) << 10) + (low - 0xDC00);
+            }
+            append_utf8(u, out);
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+    return false;
+}
+
+// step p over the value at p: a string, number, true, false, null, or
+// any object or array (whose contents aren't checked beyond the nesting
+// of brackets and quotes)
+bool skip_value(const char *& p, const char * end)
+{
+    if (p == end)
+        return false;
+    if (*p == '"') {
+        for (++p; p != end; ++p) {
+            if (*p == '\\') {
+                if (++p == end)
+                    return false;
+            }
+            else if (*p == '"') {
+                ++p;
+                return true;
+            }
+        }
+        return false;
+    }
+    if (*p == '{' || *p == '[') {
+        int depth = 0;
+        for (; p != end; ++p) {
+            if (*p == '"') {
+                if (!skip_value(p, end))
+                    return false;
+                --p;
+            }
+            else if (*p == '{' || *p == '[')
+                ++depth;
+            else if ((*p == '}' || *p == ']') && --depth == 0) {
+                ++p;
+                return true;
+            }
+        }
+        return false;
+    }
+    const char * start = p;
+    while (p != end && *p != ',' && *p != '}' && *p != ']'
+        && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+        ++p;
+    return p != start;
+}
+
+// s as a JSON string, quoted
+std::string quote(const std::string & s)
+{
+    static const char hex[] = "0123456789abcdef";
+    std::string result;
+    result.reserve(s.size() + 2);
+    result += '"';
+    for (const char c : s) {
+        switch (c) {
+        case '"':   result += "\\\"";   break;
+        case '\\':  result += "\\\\";   break;
+        case '\n':  result += "\\n";    break;
+        case '\r':  result += "\\r";    break;
+        case '\t':  result += "\\t";    break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                result += "\\u00";
+                result += hex[(c >> 4) & 0xF];
+                result += hex[c & 0xF];
+            }
+            else
+                result += c;
+            break;
+        }
+    }
+    result += '"';
+    return result;
+}
+
+}//namespace jsonl
+
+
+/*  Answers a stored corpus of conversations: a stream of records, one per
+    line, each an input for a conversation named by an id. A record is
+    either
+
+        <conversation id> TAB <input>                   (TSV)
+
+    with a tab, newline, carriage return or backslash in either field
+    written as in a journal (\t, \n, \r, \\), or
+
+        {"id": <conversation id>, "input": "<input>"}   (JSON Lines)
+
+    where the id is a JSON string or number and other members are ignored.
+    The format is that of the first record; blank lines are skipped. Each
+    record gets one reply record, in the same format ({"id": ..., "reply":
+    "..."} for JSON Lines), and the replies are written in the order of
+    the records.
+
+    Each conversation is an eliza of its own, made when its id is first
+    seen. The conversations are spread over worker threads by a hash of
+    their ids, so each conversation's inputs are answered in order by one
+    thread, a batch_scheduler's batch at a time. The replies come back out
+    of order; they're put back in order in a window of a fixed number of
+    records, and reading stops while the oldest unwritten record is a
+    window behind the newest. */
+class batch_job {
+public:
+    struct options {
+        unsigned threads{ std::max(1u, std::thread::hardware_concurrency()) };
+        size_t window{ 65536 };             // records in flight (rounded up to a power of 2)
+        size_t output_chunk{ 1 << 20 };     // write replies this many bytes at a time
+    };
+
+    struct statistics {
+        unsigned long long records{ 0 };        // inputs answered
+        unsigned long long conversations{ 0 };  // distinct conversation ids
+        double seconds{ 0 };                    // wall-clock time taken
+    };
+
+    explicit batch_job(std::shared_ptr<const script_context> context)
+        : batch_job(std::move(context), options())
+    {
+    }
+
+    batch_job(std::shared_ptr<const script_context> context, options opt)
+        : context_(std::move(context)), opt_(opt)
+    {
+        opt_.threads = std::max(1u, opt_.threads);
+        size_t window = 1;
+        while (window < std::max<size_t>(opt_.window, 2))
+            window <<= 1;
+        opt_.window = window;
+    }
+
+    // answer each record in the size bytes at data, writing the replies to
+    // os; throw on a malformed record (some replies may have been written)
+    statistics run(const char * data, size_t size, std::ostream & os)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        run_state rs(*this, os);
+        const char * const end = data + size;
+        format f = format::tsv;
+        bool first = true;
+        size_t line_num = 0;
+        for (const char * p = data; p != end; ) {
+            const char * eol = static_cast<const char *>(std::memchr(p, '\n', end - p));
+            if (!eol)
+                eol = end;
+            const char * line_end = eol;
+            if (line_end != p && line_end[-1] == '\r')
+                --line_end;
+            ++line_num;
+            const char * q = p;
+            p = eol == end ? end : eol + 1;
+            jsonl::skip_space(q, line_end);
+            if (q == line_end)
+                continue;
+            if (first) {
+                f = *q == '{' ? format::jsonl : format::tsv;
+                first = false;
+            }
+            slot & s = rs.next_slot();
+            if (!(f == format::jsonl ? parse_json(q, line_end, s) : parse_tsv(q, line_end, s)))
+                throw std::runtime_error("batch: malformed record on line " + std::to_string(line_num));
+            s.json = f == format::jsonl;
+            rs.hand_over(s);
+        }
+        rs.finish();
+
+        statistics result;
+        result.records = rs.records();
+        result.conversations = rs.conversations();
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return result;
+    }
+
+private:
+    enum class format { tsv, jsonl };
+
+    struct slot {
+        std::string key;        // the conversation id, as written for JSON Lines
+        std::string input;
+        std::string output;     // the reply record, newline and all
+        bool json{ false };
+        bool ready{ false };    // output is complete (guarded by run_state::done_mutex)
+    };
+
+    static bool parse_tsv(const char * p, const char * end, slot & s)
+    {
+        const char * tab = static_cast<const char *>(std::memchr(p, '\t', end - p));
+        if (!tab)
+            return false;
+        s.key = journal::unescape(std::string(p, tab));
+        s.input = journal::unescape(std::string(tab + 1, end));
+        return true;
+    }
+
+    static bool parse_json(const char * p, const char * end, slot & s)
+    {
+        bool have_id = false, have_input = false;
+        std::string name;
+        if (*p++ != '{')
+            return false;
+        jsonl::skip_space(p, end);
+        if (p != end && *p == '}')
+            return false;
+        for (;;) {
+            jsonl::skip_space(p, end);
+            if (!jsonl::parse_string(p, end, name))
+                return false;
+            jsonl::skip_space(p, end);
+            if (p == end || *p++ != ':')
+                return false;
+            jsonl::skip_space(p, end);
+            if (name == "input") {
+                if (!jsonl::parse_string(p, end, s.input))
+                    return false;
+                have_input = true;
+            }
+            else {
+                const char * value = p;
+                if (!jsonl::skip_value(p, end))
+                    return false;
+                if (name == "id") {
+                    if (*value == '{' || *value == '[')
+                        return false;
+                    s.key.assign(value, p);
+                    have_id = true;
+                }
+            }
+            jsonl::skip_space(p, end);
+            if (p == end)
+                return false;
+            if (*p == '}')
+                break;
+            if (*p++ != ',')
+                return false;
+        }
+        jsonl::skip_space(++p, end);
+        return p == end && have_id && have_input;
+    }
+
+    static void format_reply(slot & s, const std::string & reply)
+    {
+        s.output.clear();
+        if (s.json) {
+            s.output += "{\"id\": ";
+            s.output += s.key;
+            s.output += ", \"reply\": ";
+            s.output += jsonl::quote(reply);
+            s.output += "}\n";
+        }
+        else {
+            s.output += journal::escape(s.key);
+            s.output += '\t';
+            s.output += reply;
+            s.output += '\n';
+        }
+    }
+
+    // (the state of one run(): the reorder window and the workers)
+    class run_state {
+    public:
+        run_state(batch_job & job, std::ostream & os)
+            : job_(job), os_(os), mask_(job.opt_.window - 1), slots_(job.opt_.window),
+              workers_(job.opt_.threads)
+        {
+            for (auto & w : workers_)
+                w.thread = std::thread([this, &w]() { work(w); });
+        }
+
+        ~run_state()
+        {
+            for (auto & w : workers_) {
+                {
+                    std::lock_guard<std::mutex> lock(w.mutex);
+                    w.stop = true;
+                }
+                w.cv.notify_one();
+            }
+            for (auto & w : workers_)
+                w.thread.join();
+        }
+
+        // the slot for the next record, once the window has room for it
+        slot & next_slot()
+        {
+            if (next_ - written_ == slots_.size())
+                write_ready(true);
+            else if ((next_ & 255) == 0)
+                write_ready(false);
+            return slots_[next_ & mask_];
+        }
+
+        // give the record in s, the slot from next_slot(), to its worker
+        void hand_over(slot & s)
+        {
+            worker & w = workers_[std::hash<std::string>()(s.key) % workers_.size()];
+            w.pending.push_back(next_++);
+            if (w.pending.size() >= handover_size)
+                hand_over(w);
+        }
+
+        // write every reply
+        void finish()
+        {
+            while (written_ != next_)
+                write_ready(true);
+            if (!out_.empty())
+                os_.write(out_.data(), out_.size());
+            out_.clear();
+            os_.flush();
+        }
+
+        unsigned long long records() const { return next_; }
+
+        unsigned long long conversations()
+        {
+            unsigned long long n = 0;
+            for (auto & w : workers_) {
+                std::lock_guard<std::mutex> lock(w.mutex);
+                n += w.conversations;
+            }
+            return n;
+        }
+
+    private:
+        static constexpr size_t handover_size = 256;
+
+        struct worker {
+            std::mutex mutex;
+            std::condition_variable cv;
+            std::vector<size_t> queue;      // record numbers handed over (guarded by mutex)
+            bool stop{ false };             // (guarded by mutex)
+            unsigned long long conversations{ 0 }; // (guarded by mutex)
+            std::vector<size_t> pending;    // record numbers not yet handed over (reader only)
+            std::thread thread;
+        };
+
+        void hand_over(worker & w)
+        {
+            if (w.pending.empty())
+                return;
+            {
+                std::lock_guard<std::mutex> lock(w.mutex);
+                w.queue.insert(w.queue.end(), w.pending.begin(), w.pending.end());
+            }
+            w.pending.clear();
+            w.cv.notify_one();
+        }
+
+        // move the replies that are ready, in order, to the output; if
+        // wait, wait for at least one
+        void write_ready(bool wait)
+        {
+            if (wait)
+                for (auto & w : workers_)
+                    hand_over(w);
+            std::unique_lock<std::mutex> lock(done_mutex_);
+            if (wait)
+                done_cv_.wait(lock, [this]() { return slots_[written_ & mask_].ready; });
+            for (; written_ != next_; ++written_) {
+                slot & s = slots_[written_ & mask_];
+                if (!s.ready)
+                    break;
+                out_ += s.output;
+                s.ready = false;
+            }
+            lock.unlock();
+            if (out_.size() >= job_.opt_.output_chunk) {
+                os_.write(out_.data(), out_.size());
+                out_.clear();
+            }
+        }
+
+        void work(worker & w)
+        {
+            std::unordered_map<std::string, std::unique_ptr<eliza>> conversations;
+            batch_scheduler scheduler;
+            std::vector<size_t> taken;
+            for (;;) {
+                {
+                    std::unique_lock<std::mutex> lock(w.mutex);
+                    w.cv.wait(lock, [&w]() { return w.stop || !w.queue.empty(); });
+                    if (w.queue.empty())
+                        return;
+                    taken.swap(w.queue);
+                    w.queue.clear();
+                }
+                for (const size_t n : taken) {
+                    slot & s = slots_[n & mask_];
+                    auto & conversation = conversations[s.key];
+                    if (!conversation)
+                        conversation = std::make_unique<eliza>(job_.context_);
+                    scheduler.submit(*conversation, std::move(s.input), [&s](const std::string & reply) {
+                        format_reply(s, reply);
+                    });
+                }
+                scheduler.flush();
+                {
+                    std::lock_guard<std::mutex> lock(w.mutex);
+                    w.conversations = conversations.size();
+                }
+                {
+                    std::lock_guard<std::mutex> lock(done_mutex_);
+                    for (const size_t n : taken)
+                        slots_[n & mask_].ready = true;
+                }
+                done_cv_.notify_one();
+                taken.clear();
+            }
+        }
+
+        batch_job & job_;
+        std::ostream & os_;
+        const size_t mask_;
+        std::vector<slot> slots_;           // the window; record n is in slots_[n & mask_]
+        std::deque<worker> workers_;
+        size_t next_{ 0 };                  // the number of the next record read
+        size_t written_{ 0 };               // the number of the oldest record not yet written
+        std::string out_;                   // replies not yet written
+        std::mutex done_mutex_;
+        std::condition_variable done_cv_;
+    };
+
+    std::shared_ptr<const script_context> context_;
+    options opt_;
+};
+
+
+/*  ELIZA as a filter, e.g. a co-process: each record read is the next
+    input of one conversation and gets one reply record. A record ends
+    with the delimiter, a newline (a CR before it is dropped) or a NUL,
+    which lets any text through. There are no commands, no banner and no
+    tracing. Input is read, and replies written, in large blocks. The
+    replies are flushed when every record read so far has been answered,
+    so a client that sends a record and waits for the reply gets it, and,
+    if flush_every isn't 0, after every flush_every replies. */
+class pipe_filter {
+public:
+    // read up to size bytes into buf, waiting for at least one; return
+    // the number read, 0 at the end of the input
+    using read_function = std::function<size_t(char * buf, size_t size)>;
+
+    // write the size bytes at data; false if they couldn't be written
+    using write_function = std::function<bool(const char * data, size_t size)>;
+
+    struct options {
+        char delimiter{ '\n' };
+        size_t flush_every{ 0 };            // replies between flushes (0: only when all read are answered)
+        size_t buffer_size{ 1 << 16 };      // read, and write, this many bytes at a time
+    };
+
+    pipe_filter(eliza & conversation, read_function read, write_function write)
+        : pipe_filter(conversation, std::move(read), std::move(write), options())
+    {
+    }
+
+    pipe_filter(eliza & conversation, read_function read, write_function write, options opt)
+        : conversation_(conversation), read_(std::move(read)), write_(std::move(write)), opt_(opt)
+    {
+        opt_.buffer_size = std::max<size_t>(opt_.buffer_size, 16);
+    }
+
+    // answer every record to the end of the input; false if the replies
+    // couldn't all be written
+    bool run()
+    {
+        std::vector<char> in(opt_.buffer_size);
+        size_t begin = 0, end = 0;
+        out_.reserve(opt_.buffer_size);
+        for (;;) {
+            for (;;) {
+                const char * d = static_cast<const char *>(
+                    std::memchr(in.data() + begin, opt_.delimiter, end - begin));
+                if (!d)
+                    break;
+                const size_t record_end = d - in.data();
+                if (!answer(in.data() + begin, in.data() + record_end))
+                    return false;
+                begin = record_end + 1;
+            }
+            if (!flush())
+                return false;
+            // keep the partial record, if any, and make room after it
+            if (begin != 0) {
+                std::memmove(in.data(), in.data() + begin, end - begin);
+                end -= begin;
+                begin = 0;
+            }
+            if (end == in.size())
+                in.resize(in.size() * 2);
+            const size_t n = read_(in.data() + end, in.size() - end);
+            if (n == 0)
+                break;
+            end += n;
+        }
+        // (the last record needn't end with the delimiter)
+        if (begin != end && !answer(in.data() + begin, in.data() + end))
+            return false;
+        return flush();
+    }
+
+    // the number of records answered
+    unsigned long long records() const { return records_; }
+
+    // read_function and write_function for the standard input and output
+    static size_t read_stdin(char * buf, size_t size)
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        ssize_t n;
+        do
+            n = ::read(STDIN_FILENO, buf, size);
+        while (n == -1 && errno == EINTR);
+        return n > 0 ? static_cast<size_t>(n) : 0;
+#elif defined(_WIN32)
+        static const bool binary = _setmode(_fileno(stdin), _O_BINARY) != -1;
+        (void)binary;
+        const int n = _read(_fileno(stdin), buf, static_cast<unsigned>(std::min<size_t>(size, INT_MAX)));
+        return n > 0 ? static_cast<size_t>(n) : 0;
+#else
+        // (a byte at a time: fread() waits for all size bytes, so a
+        // co-process would get no replies until it had sent that many)
+        return size == 0 ? 0 : std::fread(buf, 1, 1, stdin);
+#endif
+    }
+
+    static bool write_stdout(const char * data, size_t size)
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        while (size != 0) {
+            const ssize_t n = ::write(STDOUT_FILENO, data, size);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+#elif defined(_WIN32)
+        static const bool binary = _setmode(_fileno(stdout), _O_BINARY) != -1;
+        (void)binary;
+        while (size != 0) {
+            const int n = _write(_fileno(stdout), data, static_cast<unsigned>(std::min<size_t>(size, INT_MAX)));
+            if (n <= 0)
+                return false;
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+#else
+        return std::fwrite(data, 1, size, stdout) == size && std::fflush(stdout) == 0;
+#endif
+    }
+
+private:
+    bool answer(const char * begin, const char * end)
+    {
+        if (opt_.delimiter == '\n' && begin != end && end[-1] == '\r')
+            --end;
+        input_.assign(begin, end);
+        out_ += conversation_.response(input_);
+        out_ += opt_.delimiter;
+        ++records_;
+        if (opt_.flush_every != 0 && ++unflushed_ == opt_.flush_every)
+            return flush();
+        if (out_.size() >= opt_.buffer_size)
+            return write();
+        return true;
+    }
+
+    // write the replies so far
+    bool write()
+    {
+        if (out_.empty())
+            return true;
+        const bool ok = write_(out_.data(), out_.size());
+        out_.clear();
+        return ok;
+    }
+
+    bool flush()
+    {
+        unflushed_ = 0;
+        return write();
+    }
+
+    eliza & conversation_;
+    read_function read_;
+    write_function write_;
+    options opt_;
+    std::string input_;
+    std::string out_;                   // replies not yet written
+    size_t unflushed_{ 0 };             // replies since the last flush
+    unsigned long long records_{ 0 };
+};
+
+
+
+/*  For script QA: starting from a given conversation, try every one of a
+    list of candidate inputs, then every candidate again from each of the
+    resulting states, and so on to a given depth, collecting every distinct
+    reply and the rules that produced it.
+
+    Each branch is an O(1) copy of a conversation_state, so branches are
+    cheap. Different inputs often lead to the same state (e.g. any input
+    with no keyword just advances the NONE cursor), so each state is
+    identified by a hash of its eliza::pack() form and explored only once.
+    Each level of the tree is spread across worker threads. */
+class conversation_explorer {
+public:
+    struct options {
+        unsigned depth{ 2 };                // number of exchanges to explore
+        unsigned threads{ std::max(1u, std::thread::hardware_concurrency()) };
+        size_t max_states{ 1000000 };       // don't explore beyond this many distinct states
+    };
+
+    struct reply_record {
+        size_t count{ 0 };                  // times this reply was given
+        stringlist path;                    // the inputs that first led to it
+        conversation_state::rule_log rules; // the reassembly rules used that time
+        bool from_memory{ false };          // true iff that time it came from MEMORY
+    };
+
+    struct result {
+        std::map<std::string, reply_record> replies;
+        size_t exchanges{ 0 };              // responses computed
+        size_t states{ 0 };                 // distinct states reached
+        size_t duplicates{ 0 };             // branches not explored: state already seen
+        size_t memory_replies{ 0 };         // responses taken from MEMORY
+        std::vector<size_t> reassembly_hits;// times each reassembly rule used; see explorer::reassembly_index()
+    };
+
+    // start is the conversation to explore from (with its settings); it
+    // is not changed
+    explicit conversation_explorer(const eliza & start)
+        : start_(start.fork())
+    {
+        const script_context & context = start.context();
+        transformation_keyword_.resize(context.reassembly_counts.size());
+        for (const auto & [keyword, rule] : context.rules) {
+            for (size_t t = 0; t < rule->transformation_count(); ++t)
+                transformation_keyword_[context.cursor_base(*rule) + t] = keyword;
+        }
+        size_t offset = 0;
+        for (const auto n : context.reassembly_counts) {
+            reassembly_offset_.push_back(offset);
+            offset += n;
+        }
+        reassembly_offset_.push_back(offset);
+    }
+
+    result explore(const stringlist & inputs, const options & opt) const
+    {
+        struct node {
+            conversation_state state;
+            stringlist path;
+        };
+        result total;
+        total.reassembly_hits.assign(reassembly_offset_.back(), 0);
+        seen_set seen;
+        std::vector<node> frontier{ { start_->state(), {} } };
+        seen.insert(state_hash(*start_));
+        total.states = 1;
+
+        std::mutex mutex;
+        for (unsigned level = 0; level < opt.depth && !frontier.empty(); ++level) {
+            std::vector<node> next_frontier;
+            const bool last_level = level + 1 == opt.depth;
+            std::atomic<size_t> next{ 0 };
+
+            auto work = [&]() {
+                result local;
+                local.reassembly_hits.assign(reassembly_offset_.back(), 0);
+                std::vector<node> discovered;
+                auto e = start_->fork();
+                conversation_state::rule_log log;
+                e->set_rule_log(&log);
+                for (size_t i; (i = next++) < frontier.size(); ) {
+                    for (const auto & input : inputs) {
+                        e->set_state(frontier[i].state);
+                        const size_t memories_before = e->state().memories().size();
+                        log.clear();
+                        const std::string reply(e->response(input));
+                        ++local.exchanges;
+                        const bool from_memory = log.empty()
+                            && e->state().memories().size() < memories_before;
+                        if (from_memory)
+                            ++local.memory_replies;
+                        for (const auto & [t, r] : log)
+                            ++local.reassembly_hits[reassembly_offset_[t] + r];
+
+                        reply_record & rec = local.replies[reply];
+                        if (rec.count++ == 0) {
+                            rec.path = frontier[i].path;
+                            rec.path.push_back(input);
+                            rec.rules = log;
+                            rec.from_memory = from_memory;
+                        }
+
+                        if (!seen.insert(state_hash(*e)))
+                            ++local.duplicates;
+                        else {
+                            ++local.states;
+                            if (!last_level && seen.size() < opt.max_states) {
+                                node n{ e->state(), frontier[i].path };
+                                n.path.push_back(input);
+                                discovered.push_back(std::move(n));
+                            }
+                        }
+                    }
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+                merge(total, local);
+                for (auto & n : discovered)
+                    next_frontier.push_back(std::move(n));
+            };
+
+            std::vector<std::thread> workers;
+            const size_t thread_count = std::min<size_t>(std::max(1u, opt.threads), frontier.size());
+            for (size_t t = 1; t < thread_count; ++t)
+                workers.emplace_back(work);
+            work();
+            for (auto & w : workers)
+                w.join();
+            frontier.swap(next_frontier);
+        }
+        return total;
+    }
+
+    // return the index in result::reassembly_hits of reassembly rule r of
+    // transformation t
+    size_t reassembly_index(size_t t, unsigned r) const { return reassembly_offset_[t] + r; }
+
+    // return the keyword of the rule containing transformation t
+    const std::string & keyword(size_t t) const { return transformation_keyword_[t]; }
+
+    // describe how much of the script the given result exercised
+    std::string coverage_report(const result & res) const
+    {
+        std::set<std::string> keywords, keywords_used;
+        size_t decompositions_used = 0, reassemblies_used = 0;
+        for (size_t t = 0; t < transformation_keyword_.size(); ++t) {
+            keywords.insert(transformation_keyword_[t]);
+            bool used = false;
+            for (size_t i = reassembly_offset_[t]; i < reassembly_offset_[t + 1]; ++i) {
+                if (res.reassembly_hits[i]) {
+                    used = true;
+                    ++reassemblies_used;
+                }
+            }
+            if (used) {
+                ++decompositions_used;
+                keywords_used.insert(transformation_keyword_[t]);
+            }
+        }
+
+        std::ostringstream report;
+        report
+            << res.exchanges << " exchanges, " << res.states << " distinct states ("
+            << res.duplicates << " duplicates), " << res.replies.size() << " distinct replies, "
+            << res.memory_replies << " from MEMORY\n"
+            << "keywords:        " << keywords_used.size() << '/' << keywords.size() << '\n'
+            << "decompositions:  " << decompositions_used << '/' << transformation_keyword_.size() << '\n'
+            << "reassemblies:    " << reassemblies_used << '/' << reassembly_offset_.back() << '\n';
+        std::string unused;
+        for (const auto & k : keywords)
+            if (!keywords_used.count(k))
+                unused += (unused.empty() ? "" : " ") + (k == special_rule_none ? "NONE" : k);
+        if (!unused.empty())
+            report << "keywords not used: " << unused << '\n';
+        return report.str();
+    }
+
+private:
+    std::unique_ptr<eliza> start_;
+    stringlist transformation_keyword_;         // [t] -> keyword of transformation t
+    std::vector<size_t> reassembly_offset_;     // [t] -> index of t's first reassembly rule
+
+    // a set of state hashes that may be used by many threads at once
+    class seen_set {
+    public:
+        // return false iff h was already in the set
+        bool insert(uint_least64_t h)
+        {
+            shard & s = shards_[h % shard_count];
+            std::lock_guard<std::mutex> lock(s.mutex);
+            if (!s.hashes.insert(h).second)
+                return false;
+            ++size_;
+            return true;
+        }
+        size_t size() const { return size_; }
+
+    private:
+        static const size_t shard_count = 64;
+        struct alignas(cache_line_size) shard {
+            std::mutex mutex;
+            std::unordered_set<uint_least64_t> hashes;
+        };
+        shard shards_[shard_count];
+        std::atomic<size_t> size_{ 0 };
+    };
+
+    static uint_least64_t state_hash(const eliza & e) { return fnv1a(e.pack()); }
+
+    static void merge(result & total, result & part)
+    {
+        for (auto & [reply, rec] : part.replies) {
+            auto & t = total.replies[reply];
+            // (keep the shortest path, whichever thread found it)
+            if (t.count == 0 || rec.path.size() < t.path.size()) {
+                const size_t count = t.count;
+                t = std::move(rec);
+                t.count += count;
+            }
+            else
+                t.count += rec.count;
+        }
+        total.exchanges += part.exchanges;
+        total.states += part.states;
+        total.duplicates += part.duplicates;
+        total.memory_replies += part.memory_replies;
+        for (size_t i = 0; i < part.reassembly_hits.size(); ++i)
+            total.reassembly_hits[i] += part.reassembly_hits[i];
+    }
+};
+
+
+}//namespace elizalogic
+
+
+
+
+
+ //////// //       //// ////////    ///     //////   //////  ////////  //// ////////  //////// 
+ //       //        //       //    // //   //    // //    // //     //  //  //     //    //    
+ //       //        //      //    //   //  //       //       //     //  //  //     //    //    
+ //////   //        //     //    //     //  //////  //       ////////   //  ////////     //    
+ //       //        //    //     /////////       // //       //   //    //  //           //    
+ //       //        //   //      //     // //    // //    // //    //   //  //           //    
+ //////// //////// //// //////// //     //  //////   //////  //     // //// //           //    
+
+
+namespace elizascript { // reader for 1966 ELIZA script file format
+
+
+/*  This is my understanding of the ELIZA script file from the explanation
+    in the CACM article and observation of the example script given in the
+    APPENDIX to the CACM article:
+
+    The script is a series of S-expressions. The first S-expression is a list
+    of words that ELIZA will emit at startup [page 42 (a)]. This may be
+    followed by the atom START. Following that are the pattern-matching and
+    message assembly Rules. Finally, there may be an empty list.
+
+    e.g.
+        (HOW DO YOU DO.  PLEASE TELL ME YOUR PROBLEM)
+        START
+        <Rules>
+        ()
+
+    The following modified BNF is used to define the ELIZA script syntax.
+
+        x : y ;
+
+    Things on the left of the colon must be replaced by (or "produce") the
+    things on the right, and things on the right of the colon are either
+    terminals or must also appear on the left in some other rule.
+    The semicolon signals the end of the rule. In addition, things on the
+    right may be sequences, choices or repetitions:
+
+        x y     means there must be an x followed by a y here
+        x|y     means there must be either x or y here
+        [x]     means there must be zero or one of x here
+        {x}     means there must be zero of more x here; note that {x|y}
+                produces, for example, x, y, xx, yy, xy, yx, xyx, xyxxy, ...
+        'x'     means literally x, a terminal
+
+    The ELIZA script syntax:
+
+    eliza_script        : opening_remarks ['START'] rules ['(' ')']             ;
+    opening_remarks     : '(' {word | punctuation} ')'                          ;
+    rules               : keyword_rule {keyword_rule} memory_rule none_rule     ;
+
+    keyword_rule        : '(' keyword rule ')'                                  ;
+    keyword             : word                                                  ;
+    rule                : '=' substitute_word
+                        | 'DLIST' tags
+                        | ['=' substitute_word]
+                            ['DLIST' tags]
+                            [precedence]
+                            reference
+                        | ['=' substitute_word]
+                            ['DLIST' tags]
+                            [precedence]
+                            transformation {transformation}
+                            [reference]                                         ;
+
+    memory_rule         : '(' 'MEMORY' keyword
+                            '(' decompose_terms '=' reassemble_terms ')'
+                            '(' decompose_terms '=' reassemble_terms ')'
+                            '(' decompose_terms '=' reassemble_terms ')'
+                            '(' decompose_terms '=' reassemble_terms ')' ')'    ;
+
+    none_rule           : '(' 'NONE' '(' '(' '0' ')'
+                            reassemble_pattern {reassemble_pattern} ')' ')'     ;
+
+    substitute_word     : word                                                  ;
+    precedence          : integer                                               ;
+    reference           : '(' '=' keyword ')'                                   ;
+
+    transformation      : '(' decompose_pattern
+                            reassemble_rule {reassemble_rule} ')'               ;
+    decompose_pattern   : '(' decompose_terms ')'                               ;
+    decompose_terms     : decompose_term {decompose_term}                       ;
+    decompose_term      : word | match_count | tags | any_of                    ;
+    match_count         : integer                                               ;
+    tags                : '(' '/' word {word} ')'                               ;
+    any_of              : '(' '*' word {word} ')'                               ;
+
+    reassemble_rule     : reassemble_pattern
+                        | reference
+                        | newkey
+                        | pre_transform_ref                                     ;
+
+    reassemble_pattern  : '(' reassemble_terms ')'                              ;
+    reassemble_terms    : reassemble_term {reassemble_term}                     ;
+    reassemble_term     : word | punctuation | match_index                      ;
+    match_index         : integer                                               ;
+    newkey              : '(' 'NEWKEY' ')'                                      ;
+    pre_transform_ref   : '(' 'PRE' reassemble_pattern reference ')'            ;
+
+    word                : word_char {word_char}                                 ;
+    word_char           : 'A'-'Z' | '-' | ''' (i.e. a single quote)             ;
+    punctuation         : ',' | '.'                                             ;
+    integer             : digit {digit}                                         ;
+    digit               : '0'-'9'                                               ;
+
+
+    Note that whitespace is ignored, except where it is necessary to separate
+    symbols that would otherwise merge. For example, two adjacent words need
+    at least one space between them to stop them merging into one.
+
+    To the syntax we must add these semantic rules
+
+    1. No two keyword_rules may have the same keyword.
+
+    2. If there are multiple transformation rules, the decompose_pattern of
+    each is tried in turn and the first that successfully matches the user’s
+    input text is selected. If none of the decompose_patterns match the user’s
+    input, and the transformation rules are not followed by a reference, the
+    keyword rule fails to produce a response and ELIZA will emit one of four
+    built-in messages.
+
+    3. If a transformation has multiple reassemble_rules they are used in
+    turn: the first time a decompose_pattern matches a user's input the first
+    reassemble_rule is used to create ELIZA’s response. The next time the
+    user's input matches the same decompose_pattern the second reassemble_rule
+    is used, and so on. When they have all been used a subsequent match will
+    begin again with the first reassemble_rule.
+
+    4. There must be exactly one memory_rule. The keyword associated with the
+    memory_rule must also be the keyword in one of the keyword_rules.
+
+    5. There must be a keyword_rule for the special keyword NONE. This rule
+    must have a decompose_pattern that matches any text, (0), and associated
+    "content-free" remarks, such as "PLEASE GO ON". It must not have a
+    substitute_word, precedence or any DLIST tags.
+
+    6. Any tag word referenced in a decompose_pattern must also be associated
+    with at least one keyword via the DLIST mechanism.
+
+    7. match_count will match the specified number of words, but doesn't
+    specify what the words are. So a match_count of 2 means there must be two
+    words here, but they can be any two words. A match_count of 0 means there
+    can be any number, including none, of any words here.
+
+    8. match_index is a 1-based index of the parts matching the
+    decompose_pattern. For example, a decompose_pattern (A 1 0) will match the
+    text "A HILL OF BEANS" and when associated with the reassemble_pattern
+    (FIRST 1 SECOND 2 THIRD 3) will produce the output "FIRST A SECOND HILL
+    THIRD OF BEANS."
+
+    9. There must exist a keyword_rule for any keyword referred to in a
+    (=keyword) reference.
+
+    10. An infinite loop may be created if keyword_rule A has a reference to
+    itself or to another keyword_rule, which either refers directly back to A
+    or refers back to A via one or more other keyword_rules. In this case
+    ELIZA would generate no response message. Weizenbaum does not explicitly
+    disallow this. This looping mechanism is fundamental to the possibility
+    that ELIZA scripts are Turing complete; looping via the pre_transform_ref
+    rule is not necessarily infinite.
+
+    11. The script has the word START following the opening_remarks, and ends
+    with an empty list. Both these elements are present in Weizenbaum's
+    published DOCTOR script, but he doesn't mention them in the CACM paper.
+    The purpose of the START symbol isn't clear, but the ELIZA source code
+    appears to use an empty list as a sentinel signalling the end of the
+    script. Both elements are included in this formal script syntax as
+    optional. 
+*/
+
+
+struct script {
+    // ELIZA's opening remarks e.g. "HOW DO YOU DO.  PLEASE TELL ME YOUR PROBLEM"
+    stringlist hello_message;
+
+    // maps keywords -> transformation rules
+    elizalogic::rulemap rules;
+
+    // the one and only special case MEMORY rule
+    std::shared_ptr<elizalogic::rule_memory> mem_rule;
+};
+
+
+struct token {
+    // types of token in an ELIZA script file
+    enum class typ { eof, symbol, number, open_bracket, close_bracket };
+
+    typ t{ typ::eof };
+    std::string value;
+
+    token() = default;
+    explicit token(typ t) : t(t) {}
+    token(typ t, const std::string & value) : t(t), value(value) {}
+
+    bool symbol()               const { return t == typ::symbol; }
+    bool symbol(const char * v) const { return t == typ::symbol && value == v; }
+    bool number()               const { return t == typ::number; }
+    bool open()                 const { return t == typ::open_bracket; }
+    bool close()                const { return t == typ::close_bracket; }
+    bool eof()                  const { return t == typ::eof; }
+
+    bool operator==(const token & rhs) const { return t == rhs.t && value == rhs.value; }
+};
+
+
+// this is just good enough to divide the ELIZA script file format
+// into tokens useful to eliza_script_reader
+template<typename T>
+class tokenizer {
+public:
+    explicit tokenizer(T & script_file) : stream_(script_file) {}
+
+    // return the current token, but don't advance past it
+    token peektok()
+    {
+        if (got_token_)
+            return t_;
+        got_token_ = true;
+        return t_ = readtok();
+    }
+
+    // return the current token, advance read point past it
+    token nexttok()
+    {
+        if (got_token_) {
+            got_token_ = false;
+            return t_;
+        }
+        return readtok();
+    }
+
+    size_t line() const
+    {
+        return line_number_;
+    }
+
+private:
+    T & stream_;
+    token t_;
+    bool got_token_{ false };
+    const static size_t buflen_ = 512;
+    uint8_t buf_[buflen_];
+    size_t bufdata_{ 0 };
+    size_t bufptr_{ 0 };
+    size_t line_number_{ 1 };
+
+    token readtok()
+    {
+        uint8_t ch;
+        for (;;) {
+            do { // skip whitespace
+                if (!nextch(ch))
+                    return token(token::typ::eof);
+                if (is_newline(ch))
+                    consume_newline(ch);
+            } while (is_whitespace(ch));
+            if (ch != ';')
+                break;
+            do { // skip comment
+                if (!nextch(ch))
+                    return token(token::typ::eof);
+            } while (!is_newline(ch));
+            consume_newline(ch);
+        }
+
+        if (ch == '(')
+            return token(token::typ::open_bracket);
+
+        if (ch == ')')
+            return token(token::typ::close_bracket);
+
+        if (ch == '=')
+            return token(token::typ::symbol, "=");
+
+        if (is_digit(ch)) {
+            token t(token::typ::number);
+            t.value.push_back(ch);
+            while (peekch(ch) && is_digit(ch)) {
+                t.value.push_back(ch);
+                nextch(ch);
+            }
+            return t;
+        }
+
+        // anything else is a symbol
+        token t(token::typ::symbol);
+        t.value.push_back(ch);
+        while (peekch(ch) && !non_symbol(ch) && ch != '=') {
+            t.value.push_back(ch);
+            nextch(ch);
+        }
+        t.value = elizalogic::eliza_uppercase(t.value);
+        return t;
+    }
+
+    bool nextch(uint8_t & ch)
+    {
+        if (peekch(ch)) {
+            ++bufptr_;
+            return true;
+        }
+        return false;
+    }
+
+    bool peekch(uint8_t & ch)
+    {
+        if (bufptr_ == bufdata_) {
+            refilbuf();
+            if (bufptr_ == bufdata_)
+                return false;
+        }
+        ch = buf_[bufptr_];
+        return true;
+    }
+    
+    void refilbuf()
+    {
+        bufptr_ = bufdata_ = 0;
+        if (!stream_.eof()) {
+            stream_.read(reinterpret_cast<char *>(buf_), buflen_);
+            bufdata_ = static_cast<size_t>(stream_.gcount());
+        }
+    }
+
+    inline bool is_whitespace(uint8_t ch) const
+    {
+        return ch <= 0x20 || ch == 0x7F;
+        // this must hold: is_newline(ch) implies is_whitespace(ch)
+    }
+
+    inline bool is_newline(uint8_t ch) const
+    {
+        return ch == '\x0A'     // LF
+            || ch == '\x0B'     // VT
+            || ch == '\x0C'     // FF
+            || ch == '\x0D';    // CR
+    }
+
+    inline void consume_newline(uint8_t ch)
+    {
+        if (ch == '\x0D'        // CR
+            && peekch(ch)
+            && ch == '\x0A')    // LF
+            nextch(ch);
+        ++line_number_;
+    }
+
+    inline bool is_digit(uint8_t ch) const
+    {
+        return unsigned(ch) - '0' < 10;
+    }
+
+    inline bool non_symbol(uint8_t ch) const
+    {
+        return ch == '(' || ch == ')' || ch == ';' || is_whitespace(ch);
+    }
+};
+
+
+template<typename T>
+class eliza_script_reader {
+public:
+
+    eliza_script_reader(T & script_file, script & s)
+        : tok_(script_file), script_(s)
+    {
+        script_.hello_message = rdlist();
+        if (tok_.peektok().symbol("START"))
+            tok_.nexttok(); // skip over START, if present
+
+        while (read_rule())
+            ;
+
+        // does the script meet the minimum requirements?
+        if (script_.rules.find(elizalogic::special_rule_none) == std::end(script_.rules))
+            throw std::runtime_error(
+                "Script error: no NONE rule specified; see Jan 1966 CACM page 41");
+        if (!script_.mem_rule)
+            throw std::runtime_error(
+                "Script error: no MEMORY rule specified; see Jan 1966 CACM page 41");
+        if (script_.rules.find(script_.mem_rule->keyword()) == std::end(script_.rules)) {
+            std::string msg("Script error: MEMORY rule keyword '");
+            msg += script_.mem_rule->keyword();
+            msg += "' is not also a keyword in its own right; see Jan 1966 CACM page 41";
+            throw std::runtime_error(msg);
+        }
+#if 0
+        std::cout << "----------------\n";
+        const int dict_size = 7;
+        stringlist dict[1 << dict_size];
+        int count = 0;
+        for (const auto & tag : script_.rules) {
+            if (tag.first == elizalogic::special_rule_none)
+                continue;
+            //std::cout << tag.first << " '" << tag.first.substr(0, 6) << "' " << elizalogic::hash(elizalogic::last_chunk_as_bcd(tag.first.substr(0, 6)), dict_size) << "\n";
+            dict[elizalogic::hash(elizalogic::last_chunk_as_bcd(tag.first.substr(0, 6)), dict_size)].push_back(tag.first);
+            ++count;
+        }
+        std::cout << count << " total entries\n";
+        for (int i = 0; i < (1 << dict_size); ++i) {
+            std::cout << i << ":";
+            for (const auto k : dict[i]) {
+                std::cout << " " << k;
+            }
+            std::cout << "\n";
+        }
+#endif
+    }
+
+private:
+    tokenizer<T> tok_;
+    script & script_;
+
+
+    std::string errormsg(const std::string & msg)
+    {
+        return std::string("Script error on line ")
+            + std::to_string(tok_.line())
+            + ": "
+            + msg;
+    }
+
+
+    // in the following comments, @ = position in symbol stream on function entry
+
+    // return words between opening and closing brackets
+    // if prior is true nexttok() should be the opening bracket, e.g. @(WORD WORD 0 WORD)
+    // if prior is false nexttok() should be the first symbol following the
+    // opening bracket, e.g. (@WORD WORD 0 WORD)
+    stringlist rdlist(bool prior = true)
+    {
+        stringlist s;
+        token t = tok_.nexttok();
+        if (prior) {
+            if (!t.open())
+                throw std::runtime_error(errormsg("expected '('"));
+            t = tok_.nexttok();
+        }
+        while (!t.close()) {
+            if (t.symbol())
+                s.emplace_back(t.value);
+            else if (t.number())
+                s.emplace_back(t.value);
+            else if (t.open()) {
+                // embed entire sublist in one sub-string
+                std::string sublist;
+                t = tok_.nexttok();
+                while (!t.close()) {
+                    if (!t.symbol())
+                        throw std::runtime_error(errormsg("expected symbol"));
+                    if (!sublist.empty())
+                        sublist += ' ';
+                    sublist += t.value;
+                    t = tok_.nexttok();
+                }
+                s.emplace_back("(" + sublist + ")");
+            }
+            else
+                throw std::runtime_error(errormsg("expected ')'"));
+            t = tok_.nexttok();
+        }
+
+        return s;
+    }
+
+
+    /* e.g.
+        (@MEMORY MY
+            (0 YOUR 0 = LETS DISCUSS FURTHER WHY YOUR 3)
+            (0 YOUR 0 = EARLIER YOU SAID YOUR 3)
+            (0 YOUR 0 = BUT YOUR 3)
+            (0 YOUR 0 = DOES THAT HAVE ANYTHING TO DO WITH THE FACT THAT YOUR 3))
+    */
+    bool read_memory_rule()
+    {
+#define MEMFORM "; expected form is (MEMORY keyword (decomp1=reassm1)(decomp2=reassm2)(decomp3=reassm3)(decomp4=reassm4))"
+
+        token t = tok_.nexttok();
+        assert(t.symbol("MEMORY"));
+        if (script_.mem_rule)
+            throw std::runtime_error(errormsg("MEMORY rule already specified"));
+
+        t = tok_.nexttok();
+        if (!t.symbol())
+            throw std::runtime_error(errormsg("expected keyword to follow MEMORY" MEMFORM));
+        script_.mem_rule = std::make_shared<elizalogic::rule_memory>(t.value);
+
+        for (int i = 0; i < elizalogic::rule_memory::num_transformations; ++i) {
+            stringlist decomposition;
+            std::vector<stringlist> reassembly_rules;
+
+            if (!tok_.nexttok().open())
+                throw std::runtime_error(errormsg("expected '('" MEMFORM));
+            for (t = tok_.nexttok(); !t.symbol("=") && !t.eof(); t = tok_.nexttok())
+                decomposition.push_back(t.value);
+            if (decomposition.empty())
+                throw std::runtime_error(errormsg("expected 'decompose_terms = reassemble_terms'" MEMFORM));
+            if (!t.symbol("="))
+                throw std::runtime_error(errormsg("expected '='" MEMFORM));
+
+            stringlist reassembly;
+            for (t = tok_.nexttok(); !t.close() && !t.eof(); t = tok_.nexttok())
+                reassembly.push_back(t.value);
+            if (reassembly.empty())
+                throw std::runtime_error(errormsg("expected 'decompose_terms = reassemble_terms'" MEMFORM));
+            if (!t.close())
+                throw std::runtime_error(errormsg("expected ')'" MEMFORM));
+            reassembly_rules.push_back(reassembly);
+
+            std::string index_out_of_range_msg;
+            if (!elizalogic::reassembly_indexes_valid(decomposition, reassembly, index_out_of_range_msg))
+                throw std::runtime_error(errormsg(index_out_of_range_msg));
+
+            script_.mem_rule->add_transformation_rule(decomposition, reassembly_rules);
+        }
+
+        if (!tok_.nexttok().close())
+            throw std::runtime_error(errormsg("expected ')'" MEMFORM));
+
+        return true;
+
+#undef MEMFORM
+    }
+
+
+    stringlist read_reassembly()
+    {
+        if (!tok_.nexttok().open())
+            throw std::runtime_error(errormsg("expected '('"));
+        if (!tok_.peektok().symbol("PRE"))
+            return rdlist(false);
+
+        // It's a PRE reassembly, e.g. (PRE (I ARE 3) (=YOU))
+        tok_.nexttok(); // skip "PRE"
+        stringlist pre{ "(", "PRE" };
+        stringlist reconstruct = rdlist();
+        stringlist reference = rdlist();
+        if (reference.size() != 2 || reference[0] != "=")
+            throw std::runtime_error(errormsg("expected '(=reference)' in PRE rule"));
+        pre.emplace_back("(");
+        pre.insert(pre.end(), reconstruct.begin(), reconstruct.end());
+        pre.emplace_back(")");
+        pre.emplace_back("(");
+        pre.insert(pre.end(), reference.begin(), reference.end());
+        pre.emplace_back(")");
+        pre.emplace_back(")");
+        if (!tok_.nexttok().close())
+            throw std::runtime_error(errormsg("expected ')'"));
+        return pre;
+    }
+
+    bool read_keyword_rule()
+    {
+        std::string keyword, keyword_substitution, msg_keyword;
+        int precedence = 0;
+        stringlist tags;
+        struct transform {
+            stringlist decomposition;
+            std::vector<stringlist> reassembly;
+        };
+        std::vector<transform> transformation;
+        std::string class_name;
+
+        token t = tok_.nexttok();
+        assert(t.symbol());
+        keyword = msg_keyword = t.value;
+        if (keyword == "NONE")
+            keyword = elizalogic::special_rule_none;
+
+        if (script_.rules.find(keyword) != script_.rules.end()) {
+            std::string msg("keyword rule already specified for keyword '");
+            msg += msg_keyword;
+            msg += "'";
+            throw std::runtime_error(errormsg(msg));
+        }
+
+        if (tok_.peektok().close()) {
+            std::string msg("keyword '");
+            msg += msg_keyword;
+            msg += "' has no associated body";
+            throw std::runtime_error(errormsg(msg));
+        }
+
+        for (t = tok_.nexttok(); !t.close(); t = tok_.nexttok()) {
+            if (t.symbol("=")) {
+                t = tok_.nexttok();
+                if (!t.symbol())
+                    throw std::runtime_error(errormsg("expected keyword"));
+                keyword_substitution = t.value;
+            }
+            else if (t.number())
+                precedence = std::stoi(t.value);
+            else if (t.symbol("DLIST"))
+                tags = rdlist();
+            else if (t.open()) {
+                // a transformation rule
+                t = tok_.peektok();
+                if (t.symbol("=")) {
+                    // a reference
+                    tok_.nexttok();
+                    t = tok_.nexttok();
+                    if (!t.symbol())
+                        throw std::runtime_error(errormsg("expected equivalence class name"));
+                    class_name = t.value;
+
+                    if (!tok_.nexttok().close())
+                        throw std::runtime_error(errormsg("expected ')'"));
+                    if (!tok_.peektok().close())
+                        throw std::runtime_error(errormsg("expected ')'"));
+                }
+                else {
+                    // a decompose/reassemble transformation
+                    transform trans;
+                    trans.decomposition = rdlist();
+                    if (trans.decomposition.empty())
+                        throw std::runtime_error(errormsg("decompose pattern cannot be empty"));
+                    do {
+                        trans.reassembly.push_back(read_reassembly());
+                        std::string index_out_of_range_msg;
+                        if (!elizalogic::reassembly_indexes_valid(trans.decomposition, trans.reassembly.back(), index_out_of_range_msg))
+                            throw std::runtime_error(errormsg(index_out_of_range_msg));
+                    } while (tok_.peektok().open());
+                    if (!tok_.nexttok().close())
+                        throw std::runtime_error(errormsg("expected ')'"));
+                    transformation.emplace_back(trans);
+                }
+            }
+            else
+                throw std::runtime_error(errormsg("malformed rule"));
+        }
+
+        auto r = std::make_shared<elizalogic::rule_keyword>(
+            keyword, keyword_substitution, precedence, tags, class_name);
+        for (auto const & tr : transformation)
+            r->add_transformation_rule(tr.decomposition, tr.reassembly);
+        script_.rules[keyword] = r;
+
+        return true;
+    }
+
+    // read one rule of any type; return false => end of file reached
+    bool read_rule()
+    {
+        token t = tok_.nexttok();
+        if (t.eof())
+            return false;
+        if (!t.open())
+            throw std::runtime_error(errormsg("expected '('"));
+        t = tok_.peektok();
+        if (t.close()) {
+            tok_.nexttok();
+            return true; // ignore empty rule list, if present
+        }
+        if (!t.symbol())
+            throw std::runtime_error(errormsg("expected keyword|MEMORY|NONE"));
+        if (t.value == "MEMORY")
+            return read_memory_rule();
+        return read_keyword_rule();
+    }
+
+};
+
+
+template<typename T>
+void read(T & script_file, script & s)
+{
+    eliza_script_reader<T> reader(script_file, s);
+}
+
+template<>
+void read(const char * const & script_text, script & s)
+{
+    std::stringstream ss(script_text);
+    elizascript::read<std::stringstream>(ss, s);
+}
+
+template<>
+void read(const char * & script_text, script & s)
+{
+    std::stringstream ss(script_text);
+    elizascript::read<std::stringstream>(ss, s);
+}
+
+
+const char * const CACM_1966_01_DOCTOR_script =
+    ";\n"
+    "; Joseph Weizenbaum's DOCTOR script for ELIZA\n"
+    "; Copyright (c) 1966 Association for Computing Machinery, Inc."
+    ";\n"
+    "; This is a verbatim transcription of the script on page 44 of the\n"
+    "; January 1966 edition of Communications of the ACM, with the following\n"
+    "; caveats:\n"
+    ";\n"
+    "; a) Whitespace has been added to help reveal the structure of the script.\n"
+    "; b) In the CACM paper six lines were printed twice adjacent to each\n"
+    ";    other (with exactly 34 lines between each duplicate), making the\n"
+    ";    structure nonsensical. These duplicates have been commented out of\n"
+    ";    this transcription.\n"
+    "; c) There were no comments in the script in the CACM paper.\n"
+    ";\n"
+    "\n"
+    "\n"
+    "(HOW DO YOU DO.  PLEASE TELL ME YOUR PROBLEM)\n"
+    "\n"
+    "START\n"
+    "\n"
+    "(SORRY\n"
+    "    ((0)\n"
+    "        (PLEASE DON'T APOLIGIZE)\n"
+    "        (APOLOGIES ARE NOT NECESSARY)\n"
+    "        (WHAT FEELINGS DO YOU HAVE WHEN YOU APOLOGIZE)\n"
+    "        (I'VE TOLD YOU THAT APOLOGIES ARE NOT REQUIRED)))\n"
+    "\n"
+    "(DONT = DON'T)\n"
+    "(CANT = CAN'T)\n"
+    "(WONT = WON'T)\n"
+    "\n"
+    "(REMEMBER 5\n"
+    "    ((0 YOU REMEMBER 0)\n"
+    "        (DO YOU OFTEN THINK OF 4)\n"
+    "        (DOES THINKING OF 4 BRING ANYTHING ELSE TO MIND)\n"
+    "        (WHAT ELSE DO YOU REMEMBER)\n"
+    "        (WHY DO YOU REMEMBER 4 JUST NOW)\n"
+    "        (WHAT IN THE PRESENT SITUATION REMINDS YOU OF 4)\n"
+    "        (WHAT IS THE CONNECTION BETWEEN ME AND 4))\n"
+    "    ((0 DO I REMEMBER 0)\n"
+    "        (DID YOU THINK I WOULD FORGET 5)\n"
+    "        (WHY DO YOU THINK I SHOULD RECALL 5 NOW)\n"
+    "        (WHAT ABOUT 5)\n"
+    "        (=WHAT)\n"
+    "        (YOU MENTIONED 5))\n"
+    "    ((0)\n"
+    "        (NEWKEY)))\n"
+    "\n"
+    "(IF 3\n"
+    "    ((0 IF 0)\n"
+    "        (DO YOU THINK ITS LIKELY THAT 3)\n"
+    "        (DO YOU WISH THAT 3)\n"
+    "        (WHAT DO YOU THINK ABOUT 3)\n"
+    "        (REALLY, 2 3)))\n"
+    "; duplicate line removed: (WHAT DO YOU THINK ABOUT 3) (REALLY, 2 3)))\n"
+    "\n"
+    "(DREAMT 4\n"
+    "    ((0 YOU DREAMT 0)\n"
+    "        (REALLY, 4)\n"
+    "        (HAVE YOU EVER FANTASIED 4 WHILE YOU WERE AWAKE)\n"
+    "        (HAVE YOU DREAMT 4 BEFORE)\n"
+    "        (=DREAM)\n"
+    "        (NEWKEY)))\n"
+    "\n"
+    "(DREAMED = DREAMT 4\n"
+    "    (=DREAMT))\n"
+    "\n"
+    "(DREAM 3\n"
+    "    ((0)\n"
+    "        (WHAT DOES THAT DREAM SUGGEST TO YOU)\n"
+    "        (DO YOU DREAM OFTEN)\n"
+    "        (WHAT PERSONS APPEAR IN YOUR DREAMS)\n"
+    "        (DON'T YOU BELIEVE THAT DREAM HAS SOMETHING TO DO WITH YOUR PROBLEM)\n"
+    "        (NEWKEY)))\n"
+    "\n"
+    "(DREAMS = DREAM 3\n"
+    "    (=DREAM))\n"
+    "\n"
+    "(HOW\n"
+    "    (=WHAT))\n"
+    "(WHEN\n"
+    "    (=WHAT))\n"
+    "(ALIKE 10\n"
+    "    (=DIT))\n"
+    "(SAME 10\n"
+    "    (=DIT))\n"
+    "(CERTAINLY\n"
+    "    (=YES))\n"
+    "\n"
+    "(FEEL DLIST(/BELIEF))\n"
+    "(THINK DLIST(/BELIEF))\n"
+    "(BELIEVE DLIST(/BELIEF))\n"
+    "(WISH DLIST(/BELIEF))\n"
+    "\n"
+    "(MEMORY MY\n"
+    "    (0 YOUR 0 = LETS DISCUSS FURTHER WHY YOUR 3)\n"
+    "    (0 YOUR 0 = EARLIER YOU SAID YOUR 3)\n"
+    "    (0 YOUR 0 = BUT YOUR 3)\n"
+    "    (0 YOUR 0 = DOES THAT HAVE ANYTHING TO DO WITH THE FACT THAT YOUR 3))\n"
+    "\n"
+    "(NONE\n"
+    "    ((0)\n"
+    "        (I AM NOT SURE I UNDERSTAND YOU FULLY)\n"
+    "        (PLEASE GO ON)\n"
+    "        (WHAT DOES THAT SUGGEST TO YOU)\n"
+    "        (DO YOU FEEL STRONGLY ABOUT DISCUSSING SUCH THINGS)))\n"
+    "\n"
+    "(PERHAPS\n"
+    "    ((0)\n"
+    "        (YOU DON'T SEEM QUITE CERTAIN)\n"
+    "        (WHY THE UNCERTAIN TONE)\n"
+    "        (CAN'T YOU BE MORE POSITIVE)\n"
+    "        (YOU AREN'T SURE)\n"
+    "        (DON'T YOU KNOW)))\n"
+    "\n"
+    "(MAYBE\n"
+    "    (=PERHAPS))\n"
+    "\n"
+    "(NAME 15\n"
+    "    ((0)\n"
+    "        (I AM NOT INTERESTED IN NAMES)\n"
+    "        (I'VE TOLD YOU BEFORE, I DON'T CARE ABOUT NAMES - PLEASE CONTINUE)))\n"
+    "; duplicate line removed: PLEASE CONTINUE)) )\n"
+    "\n"
+    "(DEUTSCH\n"
+    "    (=XFREMD))\n"
+    "(FRANCAIS\n"
+    "    (=XFREMD))\n"
+    "(ITALIANO\n"
+    "    (=XFREMD))\n"
+    "(ESPANOL\n"
+    "    (=XFREMD))\n"
+    "\n"
+    "(XFREMD\n"
+    "    ((0)\n"
+    "        (I AM SORRY, I SPEAK ONLY ENGLISH)))\n"
+    "\n"
+    "(HELLO\n"
+    "    ((0)\n"
+    "        (HOW DO YOU DO.  PLEASE STATE YOUR PROBLEM)))\n"
+    "\n"
+    "(COMPUTER 50\n"
+    "    ((0)\n"
+    "        (DO COMPUTERS WORRY YOU)\n"
+    "        (WHY DO YOU MENTION COMPUTERS)\n"
+    "        (WHAT DO YOU THINK MACHINES HAVE TO DO WITH YOUR PROBLEM)\n"
+    "        (DON'T YOU THINK COMPUTERS CAN HELP PEOPLE)\n"
+    "        (WHAT ABOUT MACHINES WORRIES YOU)\n"
+    "        (WHAT DO YOU THINK ABOUT MACHINES)))\n"
+    "\n"
+    "(MACHINE 50\n"
+    "    (=COMPUTER))\n"
+    "(MACHINES 50\n"
+    "    (=COMPUTER))\n"
+    "(COMPUTERS 50\n"
+    "    (=COMPUTER))\n"
+    "\n"
+    "(AM = ARE\n"
+    "    ((0 ARE YOU 0)\n"
+    "        (DO YOU BELIEVE YOU ARE 4)\n"
+    "        (WOULD YOU WANT TO BE 4)\n"
+    "        (YOU WISH I WOULD TELL YOU YOU ARE 4)\n"
+    "        (WHAT WOULD IT MEAN IF YOU WERE 4)\n"
+    "        (=WHAT))\n"
+    "    ((0)\n"
+    "        (WHY DO YOU SAY 'AM')\n"
+    "        (I DON'T UNDERSTAND THAT)))\n"
+    "\n"
+    "(ARE\n"
+    "    ((0 ARE I 0)\n"
+    "        (WHY ARE YOU INTERESTED IN WHETHER I AM 4 OR NOT)\n"
+    "        (WOULD YOU PREFER IF I WEREN'T 4)\n"
+    "        (PERHAPS I AM 4 IN YOUR FANTASIES)\n"
+    "        (DO YOU SOMETIMES THINK I AM 4)\n"
+    "        (=WHAT))\n"
+    "    ((0 ARE 0)\n"
+    "        (DID YOU THINK THEY MIGHT NOT BE 3)\n"
+    "        (WOULD YOU LIKE IT IF THEY WERE NOT 3)\n"
+    "        (WHAT IF THEY WERE NOT 3)\n"
+    "        (POSSIBLY THEY ARE 3)))\n"
+    "\n"
+    "(YOUR = MY\n"
+    "    ((0 MY 0)\n"
+    "        (WHY ARE YOU CONCERNED OVER MY 3)\n"
+    "        (WHAT ABOUT YOUR OWN 3)\n"
+    "        (ARE YOU WORRIED ABOUT SOMEONE ELSES 3)\n"
+    "        (REALLY, MY 3)))\n"
+    "\n"
+    "(WAS 2\n"
+    "    ((0 WAS YOU 0)\n"
+    "        (WHAT IF YOU WERE 4)\n"
+    "        (DO YOU THINK YOU WERE 4)\n"
+    "        (WERE YOU 4)\n"
+    "        (WHAT WOULD IT MEAN IF YOU WERE 4)\n"
+    "        (WHAT DOES ' 4 ' SUGGEST TO YOU)\n"
+    "        (=WHAT))\n"
+    "    ((0 YOU WAS 0)\n"
+    "        (WERE YOU REALLY)\n"
+    "        (WHY DO YOU TELL ME YOU WERE 4 NOW)\n"
+    "; duplicate line removed: (WERE YOU REALLY) (WHY DO YOU TELL ME YOU WERE 4 NOW)\n"
+    "        (PERHAPS I ALREADY KNEW YOU WERE 4))\n"
+    "    ((0 WAS I 0)\n"
+    "        (WOULD YOU LIKE TO BELIEVE I WAS 4)\n"
+    "        (WHAT SUGGESTS THAT I WAS 4)\n"
+    "        (WHAT DO YOU THINK)\n"
+    "        (PERHAPS I WAS 4)\n"
+    "        (WHAT IF I HAD BEEN 4))\n"
+    "    ((0)\n"
+    "        (NEWKEY)))\n"
+    "\n"
+    "(WERE = WAS\n"
+    "    (=WAS))\n"
+    "(ME = YOU)\n"
+    "\n"
     "(YOU'RE = I'M\n"
     "    ((0 I'M 0)\n"
     "        (PRE (I ARE 3) (=YOU))))\n"
@@ -4385,7 +8575,369 @@ const char * const CACM_1966_01_DOCTOR_script =
     "\n";
 
 
-}//namespace elizascript
+}//namespace elizascript
+
+
+
+ //////// //       //// ////////    ///     ////////   ////////   ////  //     //  ////////  ////////  
+ //       //        //       //    // //    //     //  //     //   //   //     //  //        //     // 
+ //       //        //      //    //   //   //     //  //     //   //   //     //  //        //     // 
+ //////   //        //     //    //     //  //     //  ////////    //   //     //  //////    ////////  
+ //       //        //    //     /////////  //     //  //   //     //    //   //   //        //   //   
+ //       //        //   //      //     //  //     //  //    //    //     // //    //        //    //  
+ //////// //////// //// //////// //     //  ////////   //     //  ////     ///     ////////  //     // 
+
+
+namespace elizadriver { // runs conversations as coroutines on one thread
+
+
+/*  Each conversation is a coroutine that co_awaits its input and its
+    (possibly paced) output, so one thread can carry on any number of
+    conversations, each at its own speed, and none of them has a thread
+    waiting on it.
+
+    A task is a coroutine; it starts when first co_awaited, or when given
+    to a driver with spawn(). A driver runs tasks until they have all
+    finished: it resumes those ready to run and those whose sleep is over,
+    and when there is nothing else to do it calls the idle function given
+    to run() to get more input. A terminal is where a conversation's input
+    comes from (lines given it by deliver()) and its output goes. */
+
+class driver;
+
+
+class task {
+public:
+    struct promise_type;
+    using handle = std::coroutine_handle<promise_type>;
+
+    struct promise_type {
+        std::coroutine_handle<> continuation;   // resumed when this task finishes
+        std::exception_ptr exception;
+
+        task get_return_object() { return task(handle::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        auto final_suspend() noexcept
+        {
+            struct final_awaiter {
+                bool await_ready() noexcept { return false; }
+                std::coroutine_handle<> await_suspend(handle h) noexcept
+                {
+                    const auto c = h.promise().continuation;
+                    return c ? c : std::noop_coroutine();
+                }
+                void await_resume() noexcept {}
+            };
+            return final_awaiter{};
+        }
+        void return_void() {}
+        void unhandled_exception() { exception = std::current_exception(); }
+    };
+
+    task(task && other) noexcept : h_(std::exchange(other.h_, nullptr)) {}
+    task & operator=(task && other) noexcept
+    {
+        if (this != &other) {
+            if (h_)
+                h_.destroy();
+            h_ = std::exchange(other.h_, nullptr);
+        }
+        return *this;
+    }
+    ~task()
+    {
+        if (h_)
+            h_.destroy();
+    }
+
+    bool done() const { return !h_ || h_.done(); }
+
+    // co_await a task to run it to completion (rethrowing what it throws)
+    bool await_ready() const noexcept { return done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+    {
+        h_.promise().continuation = caller;
+        return h_;
+    }
+    void await_resume() const
+    {
+        if (h_ && h_.promise().exception)
+            std::rethrow_exception(h_.promise().exception);
+    }
+
+private:
+    friend class driver;
+    handle h_;
+
+    explicit task(handle h) : h_(h) {}
+};
+
+
+class driver {
+public:
+    using clock = std::chrono::steady_clock;
+
+    // called with the time the next sleeping task wakes (time_point::max()
+    // if none) when no task is ready; it should return by then, having
+    // perhaps delivered input to a terminal, or return false if no more
+    // input will come
+    using idle_function = std::function<bool(clock::time_point wake)>;
+
+    // with virtual_time, sleeping takes no time: the clock jumps to the
+    // next task's waking time (for tests and simulations)
+    explicit driver(bool virtual_time = false)
+        : virtual_time_(virtual_time), now_(clock::now())
+    {}
+
+    driver(const driver &) = delete;
+    driver & operator=(const driver &) = delete;
+
+    clock::time_point now() const
+    {
+        return virtual_time_ ? now_ : clock::now();
+    }
+
+    // run t (from the next call to run())
+    void spawn(task t)
+    {
+        ready_.push_back(t.h_);
+        tasks_.push_back(std::move(t));
+    }
+
+    // the number of tasks not yet finished
+    size_t tasks() const { return tasks_.size(); }
+
+    // have h resumed by run()
+    void wake(std::coroutine_handle<> h)
+    {
+        ready_.push_back(h);
+    }
+
+    // co_await sleep_until(t) to resume at (or soon after) time t
+    auto sleep_until(clock::time_point t)
+    {
+        struct sleep_awaiter {
+            driver & d;
+            clock::time_point wake;
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> h)
+            {
+                d.sleeping_.push(sleeper{ wake, d.sequence_++, h });
+            }
+            void await_resume() const noexcept {}
+        };
+        return sleep_awaiter{ *this, t };
+    }
+
+    auto sleep_for(clock::duration d)
+    {
+        return sleep_until(now() + d);
+    }
+
+    // run the tasks until all have finished; false if they can't because
+    // they're waiting for input and idle (if given) says none will come;
+    // rethrows anything a task throws
+    bool run(idle_function idle = nullptr)
+    {
+        for (;;) {
+            while (!ready_.empty()) {
+                const auto h = ready_.front();
+                ready_.pop_front();
+                h.resume();
+            }
+            reap();
+            if (tasks_.empty())
+                return true;
+
+            if (!sleeping_.empty()) {
+                const clock::time_point wake = sleeping_.top().wake;
+                if (virtual_time_)
+                    now_ = std::max(now_, wake);
+                else if (clock::now() < wake) {
+                    if (idle) {
+                        if (!idle(wake))
+                            idle = nullptr;
+                        if (!ready_.empty())
+                            continue;
+                    }
+                    else
+                        std::this_thread::sleep_until(wake);
+                }
+                const clock::time_point t = now();
+                while (!sleeping_.empty() && sleeping_.top().wake <= t) {
+                    ready_.push_back(sleeping_.top().h);
+                    sleeping_.pop();
+                }
+            }
+            else if (!idle || !idle(clock::time_point::max()))
+                return false;
+        }
+    }
+
+private:
+    struct sleeper {
+        clock::time_point wake;
+        unsigned long long sequence;    // (so sleepers waking together wake in order)
+        std::coroutine_handle<> h;
+        bool operator>(const sleeper & rhs) const
+        {
+            return wake != rhs.wake ? wake > rhs.wake : sequence > rhs.sequence;
+        }
+    };
+
+    const bool virtual_time_;
+    clock::time_point now_;             // (if virtual_time_)
+    std::deque<std::coroutine_handle<>> ready_;
+    std::priority_queue<sleeper, std::vector<sleeper>, std::greater<sleeper>> sleeping_;
+    unsigned long long sequence_{ 0 };
+    std::vector<task> tasks_;
+
+    // drop the finished tasks, rethrowing the first exception found
+    void reap()
+    {
+        std::exception_ptr thrown;
+        tasks_.erase(std::remove_if(tasks_.begin(), tasks_.end(), [&](const task & t) {
+            if (!t.done())
+                return false;
+            if (!thrown && t.h_.promise().exception)
+                thrown = t.h_.promise().exception;
+            return true;
+        }), tasks_.end());
+        if (thrown)
+            std::rethrow_exception(thrown);
+    }
+};
+
+
+class terminal {
+public:
+    // write s, which may be "\n", to wherever this terminal's output goes
+    using output_function = std::function<void(const std::string & s)>;
+
+    /*  A terminal printing cps characters per second, or as fast as it
+        can if cps is 0. For fun, the console can print at 14 characters
+        per second, the speed of an IBM 2741 teletypewriter from 1965.
+        In an interview with Pamela McCorduck, recorded on 6 March 1975,
+        Weizenbaum talks of the terminal he had in his home:
+
+        "Then I came to MIT in '63 and the next spectacular
+        thing was of course ELIZA. And the history of that
+        is interesting too. Soon after I came here, very soon -
+        like within a couple of months I think - I was given
+        a console, a computer console, at home. I lived in
+        Concord - still do. It was at the time a 2741 tied
+        to a 7094 CTSS system here."
+
+        See the Carnegie Mellon University archives file
+        mccorduck_weizenbaum_1975_03_06_001_a_access.mp3
+        at 17:30. */
+    terminal(driver & d, output_function output, unsigned cps = 0)
+        : driver_(d), output_(std::move(output)), cps_(cps)
+    {}
+
+    terminal(const terminal &) = delete;
+    terminal & operator=(const terminal &) = delete;
+
+    // give the terminal a line of input
+    void deliver(std::string line)
+    {
+        input_.push_back(std::move(line));
+        wake_reader();
+    }
+
+    // there will be no more input
+    void end_input()
+    {
+        ended_ = true;
+        wake_reader();
+    }
+
+    // true if a task is waiting on read_line()
+    bool reading() const { return reader_ != nullptr; }
+
+    // co_await read_line(line) to set line to the next line of input;
+    // false, and line unchanged, if there will be no more
+    auto read_line(std::string & line)
+    {
+        struct read_awaiter {
+            terminal & t;
+            std::string & line;
+            bool await_ready() const noexcept { return !t.input_.empty() || t.ended_; }
+            void await_suspend(std::coroutine_handle<> h) noexcept { t.reader_ = h; }
+            bool await_resume()
+            {
+                if (t.input_.empty())
+                    return false;
+                line = std::move(t.input_.front());
+                t.input_.pop_front();
+                return true;
+            }
+        };
+        return read_awaiter{ *this, line };
+    }
+
+    // co_await write_line(s) to write s and a newline at the terminal's speed
+    task write_line(std::string s)
+    {
+        if (cps_ == 0)
+            output_(s);
+        else {
+            // (each character is due a fixed time after the last was
+            // due, so the pace doesn't drift however late we're woken)
+            const auto interval = std::chrono::duration_cast<driver::clock::duration>(
+                std::chrono::seconds(1)) / cps_;
+            auto due = driver_.now();
+            for (const char c : s) {
+                output_(std::string(1, c));
+                due += interval;
+                co_await driver_.sleep_until(due);
+            }
+        }
+        output_("\n");
+    }
+
+private:
+    driver & driver_;
+    output_function output_;
+    const unsigned cps_;
+    std::deque<std::string> input_;
+    bool ended_{ false };
+    std::coroutine_handle<> reader_;
+
+    void wake_reader()
+    {
+        if (reader_) {
+            driver_.wake(reader_);
+            reader_ = nullptr;
+        }
+    }
+};
+
+
+// how long the doctor takes to reflect before replying, if not quick
+// (Weizenbaum developed ELIZA on an IBM 7094 running CTSS. It's quite
+// likely it took a second or two before responding to the user's
+// statements.)
+const std::chrono::milliseconds reflection_time(1500);
+
+
+// carry on a conversation with eliza at the given terminal until its
+// input ends: a greeting, then a reply to each line of input
+task converse(driver & d, terminal & term, elizalogic::eliza & eliza,
+    const std::string & greeting, bool quick)
+{
+    co_await term.write_line(greeting);
+    std::string input;
+    while (co_await term.read_line(input)) {
+        const std::string reply(eliza.response(input));
+        if (!quick)
+            co_await d.sleep_for(reflection_time);
+        co_await term.write_line(reply);
+    }
+}
+
+
+}//namespace elizadriver
 
 
 
@@ -5335,623 +9887,2220 @@ DEF_TEST_FUNC(test_alternative_men_are_all_alike_convo)
 }
 
 
-DEF_TEST_FUNC(test_busy_beaver_turing_machine)
+DEF_TEST_FUNC(test_snapshot_restore)
 {
-    /*  4-state busy beaver
+    // the first half of the CACM conversation lays down a memory, which
+    // must survive the snapshot for the last exchange to be reproduced
+    const int half = cacm_1966_conversation_size / 2;
+
+    elizascript::script s1;
+    elizascript::read(elizascript::CACM_1966_01_DOCTOR_script, s1);
+    elizalogic::eliza eliza1(s1.rules, s1.mem_rule);
+    for (int i = 0; i < half; ++i)
+        eliza1.response(cacm_1966_conversation[i].prompt);
+    const std::string blob(eliza1.snapshot());
+
+    elizalogic::eliza eliza2(s1.rules, s1.mem_rule);
+    eliza2.restore(blob);
+    TEST_EQUAL(eliza2.snapshot(), blob);
+    for (int i = half; i < cacm_1966_conversation_size; ++i)
+        TEST_EQUAL(eliza2.response(cacm_1966_conversation[i].prompt),
+            cacm_1966_conversation[i].response);
+
+    auto restore_error = [](elizalogic::eliza & e, const std::string & b) {
+        try {
+            e.restore(b);
+        }
+        catch (const std::exception & ex) {
+            return std::string(ex.what());
+        }
+        return std::string();
+    };
 
-            A   B   C   D
-            0   1RB 1LA 1RH 1RD
-            1   1LB 0LC 1LD 0RA
+    // a snapshot is tied to its script
+    const char * other_script = "()\n(NONE\n((0)(A)))\n(MEMORY K(0 = A)(0 = B)(0 = C)(0 = D))\n(K((0)(B)))";
+    elizascript::script s3;
+    elizascript::read(other_script, s3);
+    elizalogic::eliza eliza3(s3.rules, s3.mem_rule);
+    TEST_EQUAL(restore_error(eliza3, blob), "restore: snapshot was taken from a different script");
+
+    // a damaged snapshot is rejected and leaves the conversation unchanged
+    const std::string before(eliza2.snapshot());
+    TEST_EQUAL(restore_error(eliza2, blob.substr(0, blob.size() - 1)).empty(), false);
+    TEST_EQUAL(restore_error(eliza2, "ELZS"), "restore: not an ELIZA session snapshot");
+    TEST_EQUAL(eliza2.snapshot(), before);
+}
 
-        Result: 0 0 1 0 1 1 1 1 1 1 1 1 1 1 1 1 0 0 (107 steps, thirteen "1"s total)
-        https://en.wikipedia.org/wiki/Busy_beaver
-    */
 
-    const char * script_text =
-        "()\n"
+DEF_TEST_FUNC(test_fork)
+{
+    const int half = cacm_1966_conversation_size / 2;
 
-        "(START\n"
-        "    ((0)\n"
-        "        (PRE (' O ') (=QA))))\n"
-
-                                                                // state   read    write   move    state'
-        "(QA\n"
-        "    ((' 0) (PRE (O ' 2) (=QA)))\n"
-        "    ((0 ') (PRE (1 ' O) (=QA)))\n"
-        "    ((0 1 ' O ' 1 0) (PRE (1   2   I ' 6 ' 7) (=QB)))   ; QA      O       I       right   QB\n"
-        "    ((0 1 ' I ' 1 0) (PRE (1 ' 2 ' I   6   7) (=QB))))  ; QA      I       I       left    QB\n"
-
-        "(QB\n"
-        "    ((' 0) (PRE (O ' 2) (=QB)))\n"
-        "    ((0 ') (PRE (1 ' O) (=QB)))\n"
-        "    ((0 1 ' O ' 1 0) (PRE (1 ' 2 ' I   6   7) (=QA)))   ; QB      O       I       left    QA\n"
-        "    ((0 1 ' I ' 1 0) (PRE (1 ' 2 ' O   6   7) (=QC))))  ; QB      O       I       left    QC\n"
-
-        "(QC\n"
-        "    ((' 0) (PRE (O ' 2) (=QC)))\n"
-        "    ((0 ') (PRE (1 ' O) (=QC)))\n"
-        "    ((0 1 ' O ' 1 0) (PRE (1   2   I ' 6 ' 7) (=QHALT))); QC      O       I       right   QHALT\n"
-        "    ((0 1 ' I ' 1 0) (PRE (1 ' 2 ' I   6   7) (=QD))))  ; QC      I       I       left    QD\n"
-
-        "(QD\n"
-        "    ((' 0) (PRE (O ' 2) (=QD)))\n"
-        "    ((0 ') (PRE (1 ' O) (=QD)))\n"
-        "    ((0 1 ' O ' 1 0) (PRE (1   2   I ' 6 ' 7) (=QD)))   ; QD      O       I       right   QD\n"
-        "    ((0 1 ' I ' 1 0) (PRE (1   2   O ' 6 ' 7) (=QA))))  ; QD      O       I       right   QA\n"
-
-        "(QHALT\n"
-        "    ((0)\n"
-        "        (1)))\n"
+    elizascript::script s;
+    elizascript::read(elizascript::CACM_1966_01_DOCTOR_script, s);
+    elizalogic::eliza parent(s.rules, s.mem_rule);
+    for (int i = 0; i < half; ++i)
+        parent.response(cacm_1966_conversation[i].prompt);
+    const std::string parent_state(parent.snapshot());
+
+    // a child branching off in a different direction doesn't affect
+    // the parent, or another child
+    auto wayward = parent.fork();
+    for (int i = half; i < cacm_1966_conversation_size; ++i)
+        wayward->response("My mother is afraid of everybody.");
+    TEST_EQUAL(parent.snapshot(), parent_state);
+
+    auto child = parent.fork();
+    TEST_EQUAL(child->snapshot(), parent_state);
+    for (int i = half; i < cacm_1966_conversation_size; ++i)
+        TEST_EQUAL(child->response(cacm_1966_conversation[i].prompt),
+            cacm_1966_conversation[i].response);
+
+    for (int i = half; i < cacm_1966_conversation_size; ++i)
+        TEST_EQUAL(parent.response(cacm_1966_conversation[i].prompt),
+            cacm_1966_conversation[i].response);
+    TEST_EQUAL(parent.snapshot(), child->snapshot());
+    TEST_EQUAL(parent.snapshot() == wayward->snapshot(), false);
+
+    // contexts sharing rule objects each keep their own cursor layout
+    // (here ALIKE's cursor is missing from the second, moving later ones)
+    auto full = std::make_shared<const elizalogic::script_context>(s.rules, s.mem_rule);
+    elizalogic::rulemap fewer(s.rules);
+    fewer.erase("ALIKE");
+    auto partial = std::make_shared<const elizalogic::script_context>(fewer, s.mem_rule);
+    TEST_EQUAL(full->cursor_base(*s.rules.at("DIT")),
+        partial->cursor_base(*s.rules.at("DIT")) + s.rules.at("ALIKE")->transformation_count());
+    elizalogic::eliza eliza(full);
+    for (int i = 0; i < cacm_1966_conversation_size; ++i)
+        TEST_EQUAL(eliza.response(cacm_1966_conversation[i].prompt),
+            cacm_1966_conversation[i].response);
+}
 
-        "(TURING\n"
-        "    ((0)\n"
-        "        (MACHINE)))\n"
 
-        "(MEMORY TURING\n"
-        "    (0 = TURING MACHINE)\n"
-        "    (0 = TURING MACHINE)\n"
-        "    (0 = TURING MACHINE)\n"
-        "    (0 = TURING MACHINE))\n"
+DEF_TEST_FUNC(test_bounded_memory)
+{
+    elizascript::script s;
+    elizascript::read(elizascript::CACM_1966_01_DOCTOR_script, s);
+
+    auto oldest_memory = [](const elizalogic::eliza & e) {
+        const auto & memories = e.state().memories();
+        return memories.empty() ? std::string() : join(e.context().words.decode(memories[0]));
+    };
 
-        "(NONE\n"
-        "    ((0)\n"
-        "        (NONE)))\n";
+    for (auto policy : { elizalogic::memory_queue::eviction::drop_newest,
+                         elizalogic::memory_queue::eviction::drop_oldest }) {
+        elizalogic::eliza eliza(s.rules, s.mem_rule);
+        eliza.set_memory_capacity(1, policy);
+        eliza.response("My boyfriend made me come here.");
+        eliza.response("My mother takes care of me.");
+        TEST_EQUAL(eliza.state().memories().size(), (size_t)1);
+        TEST_EQUAL(oldest_memory(eliza),
+            policy == elizalogic::memory_queue::eviction::drop_newest
+                ? "DOES THAT HAVE ANYTHING TO DO WITH THE FACT THAT YOUR BOYFRIEND MADE YOU COME HERE"
+                : "BUT YOUR MOTHER TAKES CARE OF YOU");
+    }
 
-    elizascript::script s;
-    elizascript::read(script_text, s);
+    // however long the conversation, the queue stays within its capacity
     elizalogic::eliza eliza(s.rules, s.mem_rule);
-    TEST_EQUAL(eliza.response("START"), "O I ' O ' I I I I I I I I I I I I O");
+    for (int i = 0; i < 1000; ++i)
+        eliza.response("My father is afraid of everybody.");
+    TEST_EQUAL(eliza.state().memories().size(), elizalogic::memory_queue::default_capacity);
+
+    // the capacity and policy are settings, so they survive reset()
+    eliza.set_memory_capacity(2, elizalogic::memory_queue::eviction::drop_oldest);
+    eliza.reset();
+    TEST_EQUAL(eliza.state().memories().size(), (size_t)0);
+    TEST_EQUAL(eliza.state().memories().capacity(), (size_t)2);
+    TEST_EQUAL(eliza.state().memories().policy() == elizalogic::memory_queue::eviction::drop_oldest, true);
+    eliza.response("My boyfriend made me come here.");
+    eliza.response("My mother takes care of me.");
+    eliza.response("My father is afraid of everybody.");
+    TEST_EQUAL(eliza.state().memories().size(), (size_t)2);
+    TEST_EQUAL(oldest_memory(eliza), "BUT YOUR MOTHER TAKES CARE OF YOU");
 }
 
 
-DEF_TEST_FUNC(test_boston_globe_1966_convo)
+DEF_TEST_FUNC(test_idle_session_store)
 {
-    const exchange boston_globe_1966_conversation[] = {
+    elizascript::script s;
+    elizascript::read(elizascript::CACM_1966_01_DOCTOR_script, s);
+    auto context = std::make_shared<const elizalogic::script_context>(s.rules, s.mem_rule);
+
+    // pack() and unpack() round trip
+    elizalogic::eliza e1(context);
+    for (int i = 0; i < cacm_1966_conversation_size / 2; ++i)
+        e1.response(cacm_1966_conversation[i].prompt);
+    const std::string packed(e1.pack());
+    TEST_EQUAL(packed.size() <= 64, true); // (most of which is one memory)
+    elizalogic::eliza e2(context);
+    e2.unpack(packed);
+    TEST_EQUAL(e2.snapshot(), e1.snapshot());
+    TEST_EQUAL(elizalogic::eliza(context).pack().size(), (size_t)2);
+
+    // interleave two conversations, demoting both between every exchange
+    using clock = elizalogic::idle_session_store::clock;
+    auto now = clock::now();
+    elizalogic::idle_session_store store(context, std::chrono::seconds(60));
+    for (int i = 0; i < cacm_1966_conversation_size; ++i) {
+        for (const char * id : { "alice", "bob" })
+            TEST_EQUAL(store.response(id, cacm_1966_conversation[i].prompt, now),
+                cacm_1966_conversation[i].response);
+        TEST_EQUAL(store.demote_idle(now + std::chrono::seconds(30)), (size_t)0);
+        now += std::chrono::seconds(60);
+        TEST_EQUAL(store.demote_idle(now), (size_t)2);
+        TEST_EQUAL(store.idle_count(), (size_t)2);
+    }
+    TEST_EQUAL(store.size(), (size_t)2);
+    TEST_EQUAL(store.idle_bytes() <= 2 * 80, true);
+    store.erase("bob");
+    TEST_EQUAL(store.idle_count(), (size_t)1);
+}
 
-        /* A conversation printed on page 15 of The Boston Globe,
-           22 September 1966 by Robert L. Levey who visited MIT and talked
-           to the "doctor." We don't have the ELIZA script that was used.
-           Using Weizenbaum's CACM published script reproduces a similar
-           but not identical conversation. The responses printed in the
-           newspaper that differ are commented out below. */
 
-        { "hello.",
-          "HOW DO YOU DO. PLEASE STATE YOUR PROBLEM" },
+DEF_TEST_FUNC(test_session_table)
+{
+    elizascript::script s;
+    elizascript::read(elizascript::CACM_1966_01_DOCTOR_script, s);
+    auto context = std::make_shared<const elizalogic::script_context>(s.rules, s.mem_rule);
+
+    using clock = elizalogic::session_table::clock;
+    using std::chrono::seconds;
+    const auto t0 = clock::now();
+    elizalogic::memory_snapshot_store spill;
+    elizalogic::session_table::options opt;
+    opt.capacity = 4;
+    opt.shards = 1;
+    opt.idle_timeout = seconds(60);
+    opt.spill = &spill;
+    elizalogic::session_table table(context, opt, t0);
+
+    // conversations evicted for lack of room or idleness carry on where
+    // they left off when they're next used
+    auto now = t0;
+    for (int i = 0; i < cacm_1966_conversation_size; ++i) {
+        now += seconds(i % 2 ? 1 : 100);
+        for (int c = 0; c < 6; ++c)
+            TEST_EQUAL(table.response("c" + std::to_string(c), cacm_1966_conversation[i].prompt, now),
+                cacm_1966_conversation[i].response);
+        TEST_EQUAL(table.size(), (size_t)4);
+        TEST_EQUAL(spill.size(), (size_t)2);
+    }
 
-        { "my foot hurts",
-        //"TELL ME ABOUT YOUR PAINS IN GENERAL"
-          "YOUR FOOT HURTS" },
+    // least recently used goes first
+    TEST_EQUAL(table.lookup("c0") == nullptr, true);
+    TEST_EQUAL(table.lookup("c5") == nullptr, false);
+    TEST_EQUAL(table.touch("c2", now), true);
+    table.create("c6", now);
+    TEST_EQUAL(table.lookup("c2") == nullptr, false);
+    TEST_EQUAL(table.lookup("c3") == nullptr, true);
+
+    TEST_EQUAL(table.expire(now + seconds(59)), (size_t)0);
+    TEST_EQUAL(table.expire(now + seconds(61)), (size_t)4);
+    TEST_EQUAL(table.size(), (size_t)0);
+    TEST_EQUAL(table.evict("c6"), false);
+
+    // many threads, many sessions
+    elizalogic::session_table::options busy_opt;
+    busy_opt.capacity = 50;
+    elizalogic::session_table busy(context, busy_opt);
+    std::vector<std::thread> threads;
+    std::atomic<int> errors{ 0 };
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < 300; ++i) {
+                const std::string id(std::to_string((i * 7 + t) % 80));
+                if (busy.response(id, "My mother is afraid of everybody.", clock::now()).empty())
+                    ++errors;
+                if (i % 10 == 0)
+                    busy.evict(std::to_string(i % 80));
+            }
+        });
+    }
+    for (auto & t : threads)
+        t.join();
+    TEST_EQUAL(errors.load(), 0);
+    TEST_EQUAL(busy.size() <= 50 + 16, true); // (capacity is rounded up per shard)
+
+    // a session evicted while a caller holds it is marked retired, and
+    // the table carries on with the spilled copy
+    elizalogic::session_table held(context, opt, t0);
+    auto x = held.create("x", t0);
+    TEST_EQUAL(held.response("x", cacm_1966_conversation[0].prompt, t0), cacm_1966_conversation[0].response);
+    TEST_EQUAL(held.evict("x"), true);
+    TEST_EQUAL(x->retired, true);
+    TEST_EQUAL(held.response("x", cacm_1966_conversation[1].prompt, t0), cacm_1966_conversation[1].response);
+    TEST_EQUAL(held.lookup("x") == x, false);
+
+    // conversations evicted over and over by another thread, while they're
+    // being used, lose nothing
+    elizalogic::memory_snapshot_store churn_spill;
+    elizalogic::session_table::options churn_opt;
+    churn_opt.shards = 2;
+    churn_opt.spill = &churn_spill;
+    elizalogic::session_table churn(context, churn_opt);
+    std::atomic<bool> talking{ true };
+    std::thread evictor([&] {
+        for (int i = 0; talking; ++i) {
+            churn.evict(std::to_string(i % 3));
+            std::this_thread::yield();
+        }
+    });
+    threads.clear();
+    for (int t = 0; t < 3; ++t) {
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < cacm_1966_conversation_size; ++i)
+                if (churn.response(std::to_string(t), cacm_1966_conversation[i].prompt, clock::now())
+                        != cacm_1966_conversation[i].response)
+                    ++errors;
+        });
+    }
+    for (auto & t : threads)
+        t.join();
+    talking = false;
+    evictor.join();
+    TEST_EQUAL(errors.load(), 0);
+}
 
-        { "it aches mostly around the toes",
-          "EARLIER YOU SAID YOUR FOOT HURTS" },
 
-        { "right",
-          "I AM NOT SURE I UNDERSTAND YOU FULLY" },
+DEF_TEST_FUNC(test_session_pool)
+{
+    elizascript::script s;
+    elizascript::read(elizascript::CACM_1966_01_DOCTOR_script, s);
+    auto context = std::make_shared<const elizalogic::script_context>(s.rules, s.mem_rule);
+    const std::string fresh(elizalogic::eliza(context).snapshot());
 
-        { "what is your problem",
-          "WHY DO YOU ASK" },
+    elizalogic::session_pool pool(context, 2, nullptr, 1);
+    TEST_EQUAL(pool.available(), (size_t)2);
+    {
+        auto a = pool.acquire();
+        auto b = pool.acquire();
+        auto c = pool.acquire(); // (more than were pre-warmed)
+        TEST_EQUAL(pool.available(), (size_t)0);
+        for (const auto & exchg : cacm_1966_conversation)
+            TEST_EQUAL(a->conversation.response(exchg.prompt), exchg.response);
+        TEST_EQUAL(a->conversation.snapshot() == fresh, false);
+    }
+    TEST_EQUAL(pool.available(), (size_t)3);
+
+    // a recycled session is as good as new
+    for (int i = 0; i < 3; ++i) {
+        auto a = pool.acquire();
+        TEST_EQUAL(a->conversation.snapshot(), fresh);
+        TEST_EQUAL(a->conversation.response(cacm_1966_conversation[0].prompt),
+            cacm_1966_conversation[0].response);
+    }
 
-        { "because",
-          "IS THAT THE REAL REASON" },
+    // a session_table may take its sessions from a pool
+    elizalogic::session_table::options opt;
+    opt.pool = &pool;
+    elizalogic::session_table table(context, opt);
+    const auto now = elizalogic::session_table::clock::now();
+    for (const auto & exchg : cacm_1966_conversation)
+        TEST_EQUAL(table.response("x", exchg.prompt, now), exchg.response);
+    table.evict("x");
+    TEST_EQUAL(pool.available(), (size_t)3);
+}
 
-        { "no - i was simply picking on you",
-        //"LET'S TRY TO GO ON"
-          "WERE YOU REALLY" },
 
-        { "what can i do about my toes",
-        //"YOUR TOES"
-          "WHY DO YOU SAY YOUR TOES" },
+DEF_TEST_FUNC(test_journal_replay)
+{
+    elizascript::script s;
+    elizascript::read(elizascript::CACM_1966_01_DOCTOR_script, s);
+    auto context = std::make_shared<const elizalogic::script_context>(s.rules, s.mem_rule);
 
-        { "they still hurt",
-        //"DOES ANY PART OF YOUR BODY HURT YOU"
-          "PLEASE GO ON" },
+    // record three interleaved conversations
+    const size_t half = cacm_1966_conversation_size / 2;
+    std::stringstream log;
+    {
+        elizalogic::journal::writer journal(log, context->hash);
+        elizalogic::eliza a(context), b(context), c(context);
+        for (size_t i = 0; i < cacm_1966_conversation_size; ++i) {
+            const std::string prompt(cacm_1966_conversation[i].prompt);
+            journal.record("a", prompt, a.response(prompt), 1000 + i);
+            if (i < half)
+                journal.record("b\t\tb", prompt, b.response(prompt), 1000 + i);
+            journal.record("c", prompt, c.response(prompt), 1000 + i);
+        }
+    }
 
-        { "some vague pains in the chest",
-        //"PLEASE GO ON"
-          "WHAT DOES THAT SUGGEST TO YOU" },
+    auto sessions = elizalogic::journal::read(log);
+    TEST_EQUAL(sessions.size(), (size_t)3);
+    TEST_EQUAL(sessions[1].id, "b\t\tb");
+    TEST_EQUAL(sessions[1].exchanges.size(), half);
+    TEST_EQUAL(sessions[2].exchanges.back().time, (uint_least64_t)(1000 + cacm_1966_conversation_size - 1));
+    TEST_EQUAL(sessions[0].script_hash, context->hash);
+
+    auto result = elizalogic::journal::replay(sessions, context, 2, nullptr, true);
+    TEST_EQUAL(result.sessions, (size_t)3);
+    TEST_EQUAL(result.exchanges, 2 * cacm_1966_conversation_size + half);
+    TEST_EQUAL(result.mismatches, (size_t)0);
+
+    // the replayed state is enough to pick up the conversation where it left off
+    elizalogic::memory_snapshot_store store;
+    for (auto & [id, snapshot] : result.snapshots)
+        store.put(id, snapshot);
+    elizalogic::session_table::options opt;
+    opt.spill = &store;
+    elizalogic::session_table table(context, opt);
+    elizalogic::eliza b(context);
+    for (size_t i = 0; i < cacm_1966_conversation_size; ++i) {
+        const std::string reply(b.response(cacm_1966_conversation[i].prompt));
+        if (i >= half)
+            TEST_EQUAL(table.response("b\t\tb", cacm_1966_conversation[i].prompt,
+                elizalogic::session_table::clock::now()), reply);
+    }
 
-        { "the head bothers me too sometimes",
-          "EARLIER YOU SAID YOUR TOES" },
+    // a reply that doesn't match is reported
+    sessions[2].exchanges[5].reply = "I AM NOT ELIZA";
+    result = elizalogic::journal::replay(sessions, context, 1);
+    TEST_EQUAL(result.mismatches, (size_t)1);
+    TEST_EQUAL(result.errors.size(), (size_t)1);
+    TEST_EQUAL(result.errors[0].find("session c exchange 6:") == 0, true);
+
+    // sessions recorded with another script are skipped
+    sessions[0].script_hash ^= 1;
+    result = elizalogic::journal::replay(sessions, context, 1);
+    TEST_EQUAL(result.skipped, (size_t)1);
+    TEST_EQUAL(result.sessions, (size_t)2);
+
+    std::istringstream bad(elizalogic::journal::header + "\nI\tnobody\t1\tHI\tHELLO\n");
+    bool threw = false;
+    try { elizalogic::journal::read(bad); }
+    catch (const std::runtime_error &) { threw = true; }
+    TEST_EQUAL(threw, true);
+
+    // a writer that has forgotten a session (because it ended, there were
+    // too many, or the writer was restarted) starts it again; the
+    // exchanges all belong to the one session
+    std::stringstream again;
+    {
+        elizalogic::journal::writer journal(again, context->hash, 1, 2);
+        journal.record("a", "A1", "R1", 1);
+        journal.record("b", "B1", "R1", 2);
+        journal.record("c", "C1", "R1", 3); // (forgets a and b)
+        journal.record("a", "A2", "R2", 4);
+        journal.end("a");
+        journal.record("a", "A3", "R3", 5);
+    }
+    {
+        elizalogic::journal::writer journal(again, context->hash);
+        journal.record("b", "B2", "R2", 6);
+    }
+    const std::string text(again.str());
+    TEST_EQUAL(std::count(text.begin(), text.end(), 'S'), (std::ptrdiff_t)6);
+    sessions = elizalogic::journal::read(again);
+    TEST_EQUAL(sessions.size(), (size_t)3);
+    TEST_EQUAL(sessions[0].exchanges.size(), (size_t)3);
+    TEST_EQUAL(sessions[0].exchanges[2].input, "A3");
+    TEST_EQUAL(sessions[1].exchanges.size(), (size_t)2);
+
+    // but not with another script
+    std::istringstream changed(elizalogic::journal::header + "\nS\ta\t1\t1\nS\ta\t2\t1\n");
+    threw = false;
+    try { elizalogic::journal::read(changed); }
+    catch (const std::runtime_error &) { threw = true; }
+    TEST_EQUAL(threw, true);
+
+    // a number that isn't one is reported like any other malformed record
+    for (const std::string record : {
+            "S\ta\tzz\t1", "S\ta\t\t1", "S\ta\t 1f\t1", "S\ta\t-1\t1", "S\ta\t1fg\t1",
+            "S\ta\t11111111111111111\t1", "S\ta\t1f\t1\nI\ta\t12x\tHI\tHELLO",
+            "S\ta\t1f\t1\nI\ta\t99999999999999999999\tHI\tHELLO" }) {
+        std::istringstream malformed(elizalogic::journal::header + "\n" + record + "\n");
+        std::string what;
+        try { elizalogic::journal::read(malformed); }
+        catch (const std::runtime_error & e) { what = e.what(); }
+        TEST_EQUAL(what.find("journal: malformed record on line ") == 0, true);
+    }
+}
 
-        { "you wanted to know what else hurt me",
-          "WHY DO YOU THINK I WANTED TO KNOW WHAT ELSE HURT YOU" },
 
-        { "you are the doctor",
-          "WHAT MAKES YOU THINK I AM THE DOCTOR" },
+DEF_TEST_FUNC(test_session_layout)
+{
+    using elizalogic::cache_line_size;
+    TEST_EQUAL(alignof(elizalogic::session), cache_line_size);
+    TEST_EQUAL(sizeof(elizalogic::session) % cache_line_size, (size_t)0);
 
-        { "the operator of this machine assured me that you were the doctor",
-          "DO COMPUTERS WORRY YOU" },
+    elizascript::script s;
+    elizascript::read(elizascript::CACM_1966_01_DOCTOR_script, s);
+    auto context = std::make_shared<const elizalogic::script_context>(s.rules, s.mem_rule);
+    elizalogic::session_table table(context, elizalogic::session_table::options());
+    const auto now = elizalogic::session_table::clock::now();
+
+    // no cache line written by a response in one session is shared by another
+    std::map<uintptr_t, std::string> owner; // cache line -> session id
+    bool shared = false;
+    auto claim = [&](const std::string & id, const void * p, size_t n) {
+        const uintptr_t first = reinterpret_cast<uintptr_t>(p) / cache_line_size;
+        const uintptr_t last = (reinterpret_cast<uintptr_t>(p) + n - 1) / cache_line_size;
+        for (uintptr_t line = first; line <= last; ++line) {
+            auto [o, inserted] = owner.try_emplace(line, id);
+            if (!inserted && o->second != id)
+                shared = true;
+        }
+    };
+    for (int i = 0; i < 20; ++i) {
+        const std::string id(std::to_string(i));
+        for (int x = 0; x < 3; ++x)
+            table.response(id, "Well, my boyfriend made me come here.", now); // (makes a memory)
+        auto sess = table.lookup(id);
+        const auto & state = sess->conversation.state();
+        claim(id, sess.get(), sizeof(elizalogic::session));
+        claim(id, state.cursors().data(), state.cursors().size() * sizeof(state.cursors()[0]));
+        claim(id, &state.memories(), sizeof(elizalogic::memory_queue));
+        claim(id, &state.memories()[0], sizeof(std::string));
+    }
+    TEST_EQUAL(shared, false);
+
+    stringlist inputs;
+    for (const auto & exchg : cacm_1966_conversation)
+        inputs.push_back(exchg.prompt);
+    const auto result = elizalogic::contention_benchmark(context, inputs, 2, 3, 50);
+    TEST_EQUAL(result.exchanges, (size_t)100);
+    TEST_EQUAL(result.threads, 2u);
+}
 
-        { "in general or in specific",
-        //"PERHAPS YOU PREFER NOT TO DISCUSS IT"
-          "DO YOU FEEL STRONGLY ABOUT DISCUSSING SUCH THINGS" },
 
-        { "i am enjoying myself",
-        //"IS IT BECAUSE YOU ARE ENJOYING YOURSELF THAT YOU CAME HERE"
-          "IS IT BECAUSE YOU ARE ENJOYING YOURSELF THAT YOU CAME TO ME" },
+DEF_TEST_FUNC(test_session_scheduler)
+{
+    elizascript::script s;
+    elizascript::read(elizascript::CACM_1966_01_DOCTOR_script, s);
+    auto context = std::make_shared<const elizalogic::script_context>(s.rules, s.mem_rule);
+
+    // each of 3 producers talks to 4 sessions; every session must give
+    // the same replies in the same order as a conversation on its own
+    const int producers = 3, sessions_each = 4;
+    std::vector<std::shared_ptr<elizalogic::session>> sessions;
+    std::vector<std::vector<std::string>> replies(producers * sessions_each);
+    std::mutex replies_mutex;
+    for (int i = 0; i < producers * sessions_each; ++i)
+        sessions.push_back(std::make_shared<elizalogic::session>(context));
+    {
+        elizalogic::session_scheduler scheduler(4);
+        TEST_EQUAL(scheduler.threads(), (size_t)4);
+        std::vector<std::thread> threads;
+        for (int p = 0; p < producers; ++p) {
+            threads.emplace_back([&, p]() {
+                for (const auto & exchg : cacm_1966_conversation) {
+                    for (int i = p * sessions_each; i < (p + 1) * sessions_each; ++i) {
+                        scheduler.submit(sessions[i], exchg.prompt, [&, i](const std::string & reply) {
+                            std::lock_guard<std::mutex> lock(replies_mutex);
+                            replies[i].push_back(reply);
+                        });
+                    }
+                }
+            });
+        }
+        for (auto & t : threads)
+            t.join();
+        scheduler.wait_idle();
+        for (const auto & r : replies) {
+            TEST_EQUAL(r.size(), (size_t)cacm_1966_conversation_size);
+            for (size_t x = 0; x < r.size(); ++x)
+                TEST_EQUAL(r[x], cacm_1966_conversation[x].response);
+        }
 
-        { "i was looking for greater enjoyment when i came to you",
-        //"WERE YOU REALLY"
-          "WHY DO YOU TELL ME YOU WERE LOOKING FOR GREATER ENJOYMENT WHEN YOU CAME TO I NOW" },
+        // a reply handler may submit the session's next input
+        auto a = std::make_shared<elizalogic::session>(context);
+        std::vector<std::string> chain;
+        std::function<void(const std::string &)> next = [&](const std::string & reply) {
+            chain.push_back(reply);
+            if (chain.size() < (size_t)cacm_1966_conversation_size)
+                scheduler.submit(a, cacm_1966_conversation[chain.size()].prompt, next);
+        };
+        scheduler.submit(a, cacm_1966_conversation[0].prompt, next);
+        scheduler.wait_idle();
+        TEST_EQUAL(chain.size(), (size_t)cacm_1966_conversation_size);
+        TEST_EQUAL(chain.back(), cacm_1966_conversation[cacm_1966_conversation_size - 1].response);
+    }
 
-        { "yes - do you think i am being sarcastic",
-        //"YOU SEEM QUITE SURE"
-          "YOU SEEM QUITE POSITIVE" },
+    // sessions that keep submitting more input take turns: one that has
+    // been run goes behind those already waiting
+    {
+        elizalogic::session_scheduler scheduler(1);
+        std::atomic<bool> held{ false }, release{ false };
+        auto h = std::make_shared<elizalogic::session>(context);
+        scheduler.submit(h, "Hello", [&](const std::string &) {
+            held = true;
+            held.notify_all();
+            release.wait(false);
+        });
+        held.wait(false);
+        std::vector<std::shared_ptr<elizalogic::session>> chatty;
+        std::vector<int> order; // (only the one worker writes this)
+        std::vector<std::function<void(const std::string &)>> more(2);
+        for (int c = 0; c < 2; ++c) {
+            chatty.push_back(std::make_shared<elizalogic::session>(context));
+            more[c] = [&, c](const std::string &) {
+                order.push_back(c);
+                if (order.size() < 20)
+                    scheduler.submit(chatty[c], "Men are all alike.", more[c]);
+            };
+        }
+        for (int c = 0; c < 2; ++c)
+            scheduler.submit(chatty[c], "Men are all alike.", more[c]);
+        release = true;
+        release.notify_all();
+        scheduler.wait_idle();
+        TEST_EQUAL(order.size(), (size_t)21);
+        for (size_t i = 0; i < order.size(); ++i)
+            TEST_EQUAL(order[i], (int)(i % 2));
+    }
 
-        { "not sure - just confident",
-        //"WHAT DOES THAT SUGGEST TO YOU"
-          "I AM NOT SURE I UNDERSTAND YOU FULLY" },
+    stringlist inputs;
+    for (const auto & exchg : cacm_1966_conversation)
+        inputs.push_back(exchg.prompt);
+    const auto result = elizalogic::scheduler_benchmark(context, inputs, 2, 3, 50);
+    TEST_EQUAL(result.exchanges, (size_t)100);
+}
 
-        { "superiority",
-        //"DO YOU FEEL STRONGLY ABOUT DISCUSSING SUCH THINGS"
-          "PLEASE GO ON" },
 
-        { "more and more every moment",
-        //"TELL ME MORE ABOUT SUCH FEELINGS"
-          "WHAT DOES THAT SUGGEST TO YOU" },
+DEF_TEST_FUNC(test_admission_control)
+{
+    elizascript::script s;
+    elizascript::read(elizascript::CACM_1966_01_DOCTOR_script, s);
+    auto context = std::make_shared<const elizalogic::script_context>(s.rules, s.mem_rule);
+    using clock = elizalogic::admission_control::clock;
+    using std::chrono::milliseconds;
 
-        { "would you understand",
-          "WE WERE DISCUSSING YOU - NOT ME" },
+    // shed_response() advances LIMIT and nothing else
+    {
+        elizalogic::eliza a(context), b(context);
+        a.response("Men are all alike.");
+        b.response("Men are all alike.");
+        const int limit = a.state().limit();
+        TEST_EQUAL(a.shed_response(), "GO ON , PLEASE");
+        TEST_EQUAL(a.state().limit(), limit % 4 + 1);
+        TEST_EQUAL(a.shed_response(), "I SEE");
+        TEST_EQUAL(a.shed_response(), "PLEASE CONTINUE");
+        TEST_EQUAL(a.shed_response(), "HMMM");
+        TEST_EQUAL(a.snapshot(), b.snapshot());
+    }
 
-        { "i also feel you don't really want to help me",
-          "YOU LIKE TO THINK I DON'T REALLY WANT TO HELP YOU - DON'T YOU" },
+    // a delay above target is overload only once it's lasted an interval
+    {
+        elizalogic::admission_options opt;
+        opt.target_delay = milliseconds(5);
+        opt.interval = milliseconds(100);
+        opt.shed = true;
+        elizalogic::admission_control ac(opt);
+        const clock::time_point t0;
+        TEST_EQUAL(ac.shed(milliseconds(1), t0), false);
+        TEST_EQUAL(ac.shed(milliseconds(6), t0 + milliseconds(10)), false);  // a burst, so far
+        TEST_EQUAL(ac.shed(milliseconds(50), t0 + milliseconds(60)), false);
+        TEST_EQUAL(ac.shed(milliseconds(6), t0 + milliseconds(110)), true);  // a standing queue
+        TEST_EQUAL(ac.shed(milliseconds(90), t0 + milliseconds(120)), true);
+        TEST_EQUAL(ac.shed(milliseconds(4), t0 + milliseconds(130)), false); // on time: overload over
+        TEST_EQUAL(ac.shed(milliseconds(6), t0 + milliseconds(140)), false);
+        TEST_EQUAL(ac.shed(milliseconds(6), t0 + milliseconds(200)), false);
+        TEST_EQUAL(ac.shed(milliseconds(6), t0 + milliseconds(240)), true);
+        const auto stats = ac.stats();
+        TEST_EQUAL(stats.shed, 3ull);
+        TEST_EQUAL(stats.late, 7ull);
+
+        opt.shed = false; // answer late instead
+        elizalogic::admission_control late(opt);
+        TEST_EQUAL(late.shed(milliseconds(6), t0), false);
+        TEST_EQUAL(late.shed(milliseconds(6), t0 + milliseconds(200)), false);
+        TEST_EQUAL(late.stats().late, 2ull);
+    }
 
-        { "i don't like to feel it",
-          "DON'T YOU REALLY LIKE TO FEEL IT" },
+    // with the one worker held up, inputs are refused over the limits,
+    // then, as every input has waited longer than target, all but the
+    // first taken are shed (the scheduler's clock only moves when told
+    // to, so every delay is exactly what the test makes it)
+    {
+        std::atomic<clock::rep> ticks{ 0 };
+        elizalogic::admission_options opt;
+        opt.now = [&ticks]() { return clock::time_point(clock::duration(ticks.load())); };
+        opt.max_in_flight_per_worker = 8;
+        opt.max_per_session = 3;
+        opt.target_delay = milliseconds(1);
+        opt.interval = clock::duration::zero();
+        opt.shed = true;
+        elizalogic::session_scheduler scheduler(1, opt);
+        std::atomic<bool> held{ false }, release{ false };
+        std::atomic<int> replies{ 0 };
+        auto count = [&replies](const std::string &) { ++replies; };
+        std::vector<std::shared_ptr<elizalogic::session>> sessions;
+        for (int i = 0; i < 7; ++i)
+            sessions.push_back(std::make_shared<elizalogic::session>(context));
+
+        TEST_EQUAL(scheduler.submit(sessions[0], "Hello", [&](const std::string &) {
+            held = true;
+            held.notify_all();
+            release.wait(false);
+        }), true);
+        held.wait(false);
+        for (int x = 0; x < 3; ++x)
+            TEST_EQUAL(scheduler.submit(sessions[1], "Men are all alike.", count), true);
+        TEST_EQUAL(scheduler.submit(sessions[1], "Men are all alike.", count), false); // 4 for one session
+        for (int i = 2; i < 7; ++i)
+            TEST_EQUAL(scheduler.submit(sessions[i], "Men are all alike.", count), i < 6); // 9 in flight
+        ticks += clock::duration(milliseconds(5)).count();
+        release = true;
+        release.notify_all();
+        scheduler.wait_idle();
+        TEST_EQUAL(replies.load(), 7);
+        const auto stats = scheduler.admission_stats();
+        TEST_EQUAL(stats.admitted, 8ull);
+        TEST_EQUAL(stats.refused, 2ull);
+        TEST_EQUAL(stats.shed, 6ull);
+    }
 
-        { "no",
-          "ARE YOU SAYING 'NO' JUST TO BE NEGATIVE" },
+    // the default options limit nothing
+    {
+        elizalogic::session_scheduler scheduler(1);
+        auto a = std::make_shared<elizalogic::session>(context);
+        for (const auto & exchg : cacm_1966_conversation)
+            TEST_EQUAL(scheduler.submit(a, exchg.prompt), true);
+        scheduler.wait_idle();
+        const auto stats = scheduler.admission_stats();
+        TEST_EQUAL(stats.admitted, (unsigned long long)cacm_1966_conversation_size);
+        TEST_EQUAL(stats.refused + stats.shed + stats.late, 0ull);
+    }
+}
 
-        { "yes",
-        //"YOU'RE PLAYING GAMES - I WON'T RESPOND UNTIL YOU QUIT"
-          "YOU ARE SURE" },
 
-        { "treat me immediately",
-        //"DOES ANY PART OF YOUR BODY HURT YOU"
-          "DO YOU FEEL STRONGLY ABOUT DISCUSSING SUCH THINGS" },
+DEF_TEST_FUNC(test_batch_scanner)
+{
+    elizascript::script s;
+    elizascript::read(elizascript::CACM_1966_01_DOCTOR_script, s);
+    auto context = std::make_shared<const elizalogic::script_context>(s.rules, s.mem_rule);
+
+    // keywords of different precedences, with and without transformations,
+    // in clauses before and after delimiters
+    const stringlist inputs{
+        "",
+        "Nothing to see here.",
+        ". , BUT",
+        ", you and me",
+        "Well, my boyfriend made me come here.",
+        "Men are all alike, I think, but you are like my father.",
+        "I remember you, BUT you dreamed my dream.",
+        "Perhaps I am, perhaps I am not; you were always like that",
+        "YOU YOU YOU YOU YOU YOU YOU YOU YOU YOU ME",
+        "my mother, your father, my brother",
+        "bye",
+    };
+    {
+        // more conversations than fit in one group of eight, some with
+        // the same input twice, one with delimiters of its own
+        const size_t n = 2 * inputs.size() + 1;
+        std::vector<std::unique_ptr<elizalogic::eliza>> batched, scalar;
+        for (size_t i = 0; i < n; ++i) {
+            batched.push_back(std::make_unique<elizalogic::eliza>(context));
+            scalar.push_back(std::make_unique<elizalogic::eliza>(context));
+        }
+        batched[3]->set_delimeters({ "BUT" });
+        scalar[3]->set_delimeters({ "BUT" });
+        std::vector<elizalogic::response_work> batched_work(n), scalar_work(n);
+        std::vector<elizalogic::eliza *> batched_ptrs;
+        std::vector<elizalogic::response_work *> work_ptrs;
+        for (size_t i = 0; i < n; ++i) {
+            const std::string & input = inputs[i % inputs.size()];
+            batched[i]->split_input(input, batched_work[i]);
+            scalar[i]->split_input(input, scalar_work[i]);
+            batched_ptrs.push_back(batched[i].get());
+            work_ptrs.push_back(&batched_work[i]);
+        }
 
-        { "all parts hurt and then some",
-        //"WHAT DOES THAT SUGGEST TO YOU"
-          "I AM NOT SURE I UNDERSTAND YOU FULLY" },
+        elizalogic::batch_scanner scanner(context, batched[0]->delimiters());
+        TEST_EQUAL(scanner.suits(*batched[0]), true);
+        TEST_EQUAL(scanner.suits(*batched[3]), false);
+        scanner.scan(batched_ptrs.data(), work_ptrs.data(), n);
+        for (size_t i = 0; i < n; ++i) {
+            scalar[i]->scan_keywords(scalar_work[i]);
+            TEST_EQUAL(join(batched_work[i].words), join(scalar_work[i].words));
+            TEST_EQUAL(join(batched_work[i].keystack), join(scalar_work[i].keystack));
+            TEST_EQUAL(batched_work[i].limit, scalar_work[i].limit);
+        }
+    }
 
-        { "maladjustment",
-        //"DO YOU FEEL STRONGLY ABOUT DISCUSSING SUCH THINGS"
-          "PLEASE GO ON" },
+    const auto result = elizalogic::scan_benchmark(context, inputs, true, 20, 3);
+    TEST_EQUAL(result.exchanges, (size_t)60);
+}
 
-        { "no",
-        //"WHY NOT"
-          "YOU ARE BEING A BIT NEGATIVE" },
 
-        { "because you are putting me on",
-          "DON'T ANY OTHER REASONS COME TO MIND" },
+DEF_TEST_FUNC(test_response_pipeline)
+{
+    elizascript::script s;
+    elizascript::read(elizascript::CACM_1966_01_DOCTOR_script, s);
+    auto context = std::make_shared<const elizalogic::script_context>(s.rules, s.mem_rule);
+
+    // many conversations taking turns, in batches that don't divide the
+    // number of inputs; and one conversation whose inputs all come
+    // together, so its next input is scanned while the last is transformed
+    const int sessions = 50;
+    std::vector<std::unique_ptr<elizalogic::eliza>> conversations;
+    for (int i = 0; i <= sessions; ++i)
+        conversations.push_back(std::make_unique<elizalogic::eliza>(context));
+    std::vector<std::vector<std::string>> replies(sessions + 1);
+    {
+        elizalogic::response_pipeline pipeline(7, 4);
+        for (const auto & exchg : cacm_1966_conversation)
+            for (int i = 0; i < sessions; ++i)
+                pipeline.submit(*conversations[i], exchg.prompt, [&replies, i](const std::string & reply) {
+                    replies[i].push_back(reply);
+                });
+        pipeline.wait_idle();
+        for (int i = 0; i < sessions; ++i) {
+            TEST_EQUAL(replies[i].size(), (size_t)cacm_1966_conversation_size);
+            for (size_t x = 0; x < replies[i].size(); ++x)
+                TEST_EQUAL(replies[i][x], cacm_1966_conversation[x].response);
+        }
 
-        { "yes - you seem arrogant and silly",
-        //"I UNDERSTAND"
-          "I SEE" },
+        // (answered as the pipeline closes)
+        for (const auto & exchg : cacm_1966_conversation)
+            pipeline.submit(*conversations[sessions], exchg.prompt, [&replies](const std::string & reply) {
+                replies[sessions].push_back(reply);
+            });
+    }
+    TEST_EQUAL(replies[sessions].size(), (size_t)cacm_1966_conversation_size);
+    for (size_t x = 0; x < replies[sessions].size(); ++x)
+        TEST_EQUAL(replies[sessions][x], cacm_1966_conversation[x].response);
+
+    stringlist inputs;
+    for (const auto & exchg : cacm_1966_conversation)
+        inputs.push_back(exchg.prompt);
+    const auto result = elizalogic::pipeline_benchmark(context, inputs, true, 10, 5);
+    TEST_EQUAL(result.exchanges, (size_t)50);
+    TEST_EQUAL(result.threads, elizalogic::response_pipeline::stages);
+}
 
-        { "you would",
-        //"YOU'RE NOT REALLY TALKING ABOUT ME ARE YOU"
-          "OH, I WOULD" },
 
-        { "who else",
-        //"I AM NOT SURE I UNDERSTAND YOU FULLY"
-          "WHAT DOES THAT SUGGEST TO YOU" },
+DEF_TEST_FUNC(test_batch_scheduler)
+{
+    elizascript::script s;
+    elizascript::read(elizascript::CACM_1966_01_DOCTOR_script, s);
+    auto context = std::make_shared<const elizalogic::script_context>(s.rules, s.mem_rule);
+
+    // each conversation starts somewhere different in the CACM conversation
+    // and goes round it twice, so a batch has inputs with many different
+    // top keywords, and the batch size is such that most batches hold
+    // several inputs of the same conversation
+    const size_t sessions = 10;
+    stringlist inputs;
+    for (const auto & exchg : cacm_1966_conversation)
+        inputs.push_back(exchg.prompt);
+    std::vector<std::unique_ptr<elizalogic::eliza>> batched, reference;
+    for (size_t i = 0; i < sessions; ++i) {
+        batched.push_back(std::make_unique<elizalogic::eliza>(context));
+        reference.push_back(std::make_unique<elizalogic::eliza>(context));
+    }
+    std::vector<std::vector<std::string>> replies(sessions), expected(sessions);
+    elizalogic::batch_scheduler scheduler(37);
+    for (size_t x = 0; x < 2 * inputs.size(); ++x) {
+        for (size_t i = 0; i < sessions; ++i) {
+            const std::string & input = inputs[(i * 3 + x) % inputs.size()];
+            expected[i].push_back(reference[i]->response(input));
+            scheduler.submit(*batched[i], input, [&replies, i](const std::string & reply) {
+                replies[i].push_back(reply);
+            });
+            if (i == 0 && x % 5 == 0) // (a session with runs of inputs)
+                for (int k = 0; k < 3; ++k) {
+                    expected[i].push_back(reference[i]->response(inputs[k]));
+                    scheduler.submit(*batched[i], inputs[k], [&replies, i](const std::string & reply) {
+                        replies[i].push_back(reply);
+                    });
+                }
+        }
+    }
+    scheduler.flush();
+    size_t submitted = 0;
+    for (size_t i = 0; i < sessions; ++i) {
+        submitted += expected[i].size();
+        TEST_EQUAL(replies[i].size(), expected[i].size());
+        for (size_t x = 0; x < replies[i].size(); ++x)
+            TEST_EQUAL(replies[i][x], expected[i][x]);
+        TEST_EQUAL(batched[i]->snapshot(), reference[i]->snapshot());
+    }
+    const auto stats = scheduler.stats();
+    TEST_EQUAL(stats.inputs, (unsigned long long)submitted);
+    TEST_EQUAL(stats.groups < stats.inputs, true);
 
-        { "i am calling you a fink",
-        //"HOW LONG HAVE YOU BEEN CALLING ME A FINK"
-          "HOW LONG HAVE YOU BEEN CALLING I A FINK" },
+    const auto result = elizalogic::batch_benchmark(context, inputs, true, true, 10, 5);
+    TEST_EQUAL(result.exchanges, (size_t)50);
+}
 
-        { "since you started behaving unethically",
-        //"WHAT ARE YOUR FEELINGS NOW"
-          "YOU'RE NOT REALLY TALKING ABOUT ME - ARE YOU" },
 
-        { "i despise you",
-        //"PERHAPS IN YOUR FANTASY WE STILL DESPISE TOGETHER"
-          "PERHAPS IN YOUR FANTASY WE DESPISE EACH OTHER" },
+DEF_TEST_FUNC(test_batch_job)
+{
+    elizascript::script s;
+    elizascript::read(elizascript::CACM_1966_01_DOCTOR_script, s);
+    auto context = std::make_shared<const elizalogic::script_context>(s.rules, s.mem_rule);
+
+    // conversations interleaved, each starting somewhere different in the
+    // CACM conversation; the window is much smaller than the corpus, so
+    // reading has to wait for the replies to be written
+    const size_t sessions = 7, n = std::size(cacm_1966_conversation);
+    std::vector<std::unique_ptr<elizalogic::eliza>> reference;
+    for (size_t i = 0; i < sessions; ++i)
+        reference.push_back(std::make_unique<elizalogic::eliza>(context));
+    std::string tsv("\r\n"), json, expected_tsv, expected_json;
+    for (size_t x = 0; x < n; ++x) {
+        for (size_t i = 0; i < sessions; ++i) {
+            const std::string input(cacm_1966_conversation[(i + x) % n].prompt);
+            const std::string reply(reference[i]->response(input));
+            const std::string id("s\\t" + std::to_string(i));
+            tsv += id + '\t' + input + (i % 2 ? "\r\n" : "\n");
+            expected_tsv += id + '\t' + reply + '\n';
+            json += "{\"input\": " + elizalogic::jsonl::quote(input)
+                + ", \"n\": [1, {\"x\": \"}\"}], \"id\": " + std::to_string(i) + "}\n";
+            expected_json += "{\"id\": " + std::to_string(i) + ", \"reply\": "
+                + elizalogic::jsonl::quote(reply) + "}\n";
+        }
+    }
+    elizalogic::batch_job::options opt;
+    opt.threads = 3;
+    opt.window = 5;             // (rounded up to 8)
+    opt.output_chunk = 100;
+    elizalogic::batch_job job(context, opt);
+    std::ostringstream out;
+    auto result = job.run(tsv.data(), tsv.size(), out);
+    TEST_EQUAL(out.str(), expected_tsv);
+    TEST_EQUAL(result.records, (unsigned long long)(sessions * n));
+    TEST_EQUAL(result.conversations, (unsigned long long)sessions);
+
+    std::ostringstream json_out;
+    result = elizalogic::batch_job(context).run(json.data(), json.size(), json_out);
+    TEST_EQUAL(json_out.str(), expected_json);
+
+    // JSON string escapes, and a JSON Lines corpus with no final newline
+    std::string text;
+    const char * p = "\"it\\u0027s \\u00e9t\\u00C9 \\ud83d\\ude00\\n\\\"\\\\\"";
+    TEST_EQUAL(elizalogic::jsonl::parse_string(p, p + std::strlen(p), text), true);
+    TEST_EQUAL(text, "it's \xC3\xA9t\xC3\x89 \xF0\x9F\x98\x80\n\"\\");
+    TEST_EQUAL(elizalogic::jsonl::quote("a\"b\\c\n\x01"), "\"a\\\"b\\\\c\\n\\u0001\"");
+    const std::string one("{\"id\": \"\\u00e9\", \"input\": \"Men are all alike.\"}");
+    std::ostringstream one_out;
+    elizalogic::batch_job(context).run(one.data(), one.size(), one_out);
+    TEST_EQUAL(one_out.str(), "{\"id\": \"\\u00e9\", \"reply\": \"IN WHAT WAY\"}\n");
+
+    for (const std::string bad : { "alice Men are all alike.\n", "{\"id\": 1}\n", "{\"id\": 1, \"input\": \"hi\"\n" }) {
+        std::ostringstream bad_out;
+        bool threw = false;
+        try { elizalogic::batch_job(context).run(bad.data(), bad.size(), bad_out); }
+        catch (const std::runtime_error &) { threw = true; }
+        TEST_EQUAL(threw, true);
+    }
+}
 
-        { "perhaps i actually despise myself",
-          "YOU DON'T SEEM QUITE CERTAIN" },
 
-        { "i feel more unsure as the moments pass",
-        //"DO YOU OFTEN FEEL MORE UNSURE AS THE MOMENTS PASS"
-          "TELL ME MORE ABOUT SUCH FEELINGS" },
+DEF_TEST_FUNC(test_pipe_filter)
+{
+    elizascript::script s;
+    elizascript::read(elizascript::CACM_1966_01_DOCTOR_script, s);
 
-        { "you are losing control of your mind",
-          "DOES IT PLEASE YOU TO BELIEVE I AM LOSING CONTROL OF MY MIND" },
+    // input arriving a few bytes at a time into a small buffer, with CR LF
+    // and LF line ends and a last line with none
+    std::string input, expected;
+    std::vector<size_t> record_ends;
+    for (const auto & exchg : cacm_1966_conversation) {
+        input += exchg.prompt;
+        input += record_ends.size() % 2 ? "\r\n" : "\n";
+        record_ends.push_back(input.size());
+        expected += std::string(exchg.response) + '\n';
+    }
+    input.pop_back();
+    record_ends.back() = input.size();
+    size_t pos = 0;
+    std::vector<size_t> writes;             // the size of the output at each write
+    std::string output;
+    auto read = [&](char * buf, size_t size) {
+        const size_t n = std::min<size_t>({ size, 7, input.size() - pos });
+        std::memcpy(buf, input.data() + pos, n);
+        pos += n;
+        return n;
+    };
+    auto write = [&](const char * data, size_t size) {
+        output.append(data, size);
+        writes.push_back(output.size());
+        return true;
+    };
+    elizalogic::eliza e1(s.rules, s.mem_rule);
+    elizalogic::pipe_filter::options opt;
+    opt.buffer_size = 16;                   // (smaller than most records)
+    elizalogic::pipe_filter f1(e1, read, write, opt);
+    TEST_EQUAL(f1.run(), true);
+    TEST_EQUAL(output, expected);
+    TEST_EQUAL(f1.records(), (unsigned long long)std::size(cacm_1966_conversation));
+
+    // a reply is written as soon as every record read is answered: here
+    // input comes a record at a time, so each reply is written on its own
+    size_t record = 0;
+    pos = 0;
+    output.clear();
+    writes.clear();
+    auto read_record = [&](char * buf, size_t size) {
+        const size_t n = std::min(size, record_ends[record] - pos);
+        std::memcpy(buf, input.data() + pos, n);
+        pos += n;
+        if (pos == record_ends[record] && record + 1 < record_ends.size())
+            ++record;
+        return n;
+    };
+    elizalogic::eliza e2(s.rules, s.mem_rule);
+    elizalogic::pipe_filter f2(e2, read_record, write);
+    TEST_EQUAL(f2.run(), true);
+    TEST_EQUAL(output, expected);
+    TEST_EQUAL(writes.size(), std::size(cacm_1966_conversation));
+
+    // all at once, flushing every 5 replies; NUL-delimited records may
+    // hold any text
+    input.clear();
+    expected.clear();
+    elizalogic::eliza reference(s.rules, s.mem_rule);
+    for (const auto & exchg : cacm_1966_conversation) {
+        const std::string prompt = std::string(exchg.prompt) + "\r\nHELLO\n";
+        input += prompt + '\0';
+        expected += reference.response(prompt) + '\0';
+    }
+    pos = 0;
+    output.clear();
+    writes.clear();
+    auto read_all = [&](char * buf, size_t size) {
+        const size_t n = std::min(size, input.size() - pos);
+        std::memcpy(buf, input.data() + pos, n);
+        pos += n;
+        return n;
+    };
+    elizalogic::eliza e3(s.rules, s.mem_rule);
+    opt.buffer_size = 1 << 16;
+    opt.delimiter = '\0';
+    opt.flush_every = 5;
+    elizalogic::pipe_filter f3(e3, read_all, write, opt);
+    TEST_EQUAL(f3.run(), true);
+    TEST_EQUAL(output, expected);
+    TEST_EQUAL(writes.size(), (std::size(cacm_1966_conversation) + 4) / 5);
+
+    // a failed write stops the filter
+    pos = 0;
+    elizalogic::eliza e4(s.rules, s.mem_rule);
+    elizalogic::pipe_filter f4(e4, read_all, [](const char *, size_t) { return false; }, opt);
+    TEST_EQUAL(f4.run(), false);
+}
 
-        { "you are more to be pitied than censured",
-          "DO YOU SOMETIMES WISH YOU WERE MORE TO BE PITIED THAN CENSURED" },
 
-        { "i've had enough - goodbye",
-        //"DOES ANY PART OF YOUR BODY HURT YOU"
-          "DO YOU FEEL STRONGLY ABOUT DISCUSSING SUCH THINGS" },
+DEF_TEST_FUNC(test_script_reload)
+{
+    auto make_context = [](const std::string & text) {
+        std::istringstream script_text(text);
+        elizascript::script s;
+        elizascript::read<std::istringstream>(script_text, s);
+        return std::make_shared<const elizalogic::script_context>(s.rules, s.mem_rule);
     };
+    const std::string v1_text(elizascript::CACM_1966_01_DOCTOR_script);
+    std::string v2_text(v1_text);
+    v2_text.replace(v2_text.find("(IN WHAT WAY)"), 13, "(IN WHAT WAY EXACTLY)"); // (changes DIT)
+    auto v1 = make_context(v1_text);
+    auto v2 = make_context(v2_text);
+    const std::weak_ptr<const elizalogic::script_context> v1_weak(v1);
+
+    // MY rule makes a memory; ALIKE links to DIT
+    const stringlist before{ "Well, my boyfriend made me come here.", "Men are all alike." };
+    const std::string after("They're always bugging us about something or other.");
+    {
+        elizalogic::script_migration m(v1, v2);
+        TEST_EQUAL(m.cursor_map.size(), v1->reassembly_counts.size());
+        TEST_EQUAL(m.kept, m.cursor_map.size() - 1); // all but DIT
+
+        elizalogic::eliza a(v1), reference(v1);
+        for (const auto & input : before)
+            TEST_EQUAL(a.response(input), reference.response(input));
+        a.migrate(m);
+        TEST_EQUAL(a.context().hash, v2->hash);
+        TEST_EQUAL(a.state().limit(), reference.state().limit());
+        TEST_EQUAL(a.state().memories().size(), (size_t)1);
+        TEST_EQUAL(join(a.context().words.decode(a.state().memories()[0])),
+            join(reference.context().words.decode(reference.state().memories()[0])));
+        TEST_EQUAL(a.response(after), reference.response(after)); // (unchanged rules carry on)
+        TEST_EQUAL(a.response("Men are all alike."), "IN WHAT WAY EXACTLY"); // (DIT starts afresh)
+
+        bool threw = false;
+        try { a.migrate(m); } // (a is no longer using v1)
+        catch (const std::runtime_error &) { threw = true; }
+        TEST_EQUAL(threw, true);
+    }
+
+    elizalogic::memory_snapshot_store spill;
+    elizalogic::session_table::options opt;
+    opt.spill = &spill;
+    opt.shards = 2;
+    elizalogic::session_table table(v1, opt);
+    const auto now = elizalogic::session_table::clock::now();
+    std::string expected;
+    {
+        elizalogic::eliza reference(v1);
+        for (const auto & input : before) {
+            table.response("x", input, now);
+            table.response("y", input, now);
+            reference.response(input);
+        }
+        expected = reference.response(after);
+    }
+    table.evict("y");
+    table.reload(v2);
+    v1.reset();
+    TEST_EQUAL(table.context() == v2, true);
+    TEST_EQUAL(v1_weak.expired(), false);       // x is still using v1...
+    TEST_EQUAL(table.response("x", after, now), expected);
+    TEST_EQUAL(v1_weak.expired(), true);        // ...until it is next used
+    TEST_EQUAL(table.response("y", after, now), expected); // (restored from v1 snapshot)
+    TEST_EQUAL(&table.lookup("y")->conversation.context(), v2.get());
+
+    // a conversation two versions behind
+    auto v3 = make_context(v1_text);
+    auto v4 = make_context(v2_text);
+    table.reload(v3);
+    table.reload(v4);
+    TEST_EQUAL(table.migrate_all(), (size_t)2);
+    TEST_EQUAL(table.migrate_all(), (size_t)0);
+    TEST_EQUAL(&table.lookup("x")->conversation.context(), v4.get());
+
+    // reloading while conversations are under way
+    std::vector<std::thread> threads;
+    std::atomic<bool> failed{ false };
+    for (int t = 0; t < 3; ++t) {
+        threads.emplace_back([&, t]() {
+            for (int i = 0; i < 200; ++i) {
+                const std::string id(std::to_string(t) + ":" + std::to_string(i % 5));
+                if (table.response(id, cacm_1966_conversation[i % cacm_1966_conversation_size].prompt, now).empty())
+                    failed = true;
+            }
+        });
+    }
+    for (int i = 0; i < 10; ++i)
+        table.reload(i % 2 ? v3 : v4);
+    for (auto & t : threads)
+        t.join();
+    TEST_EQUAL(failed, false);
+    table.migrate_all();
+    for (int t = 0; t < 3; ++t)
+        TEST_EQUAL(&table.lookup(std::to_string(t) + ":0")->conversation.context(), v3.get());
+}
 
+
+DEF_TEST_FUNC(test_conversation_explorer)
+{
     elizascript::script s;
     elizascript::read(elizascript::CACM_1966_01_DOCTOR_script, s);
-    elizalogic::eliza eliza(s.rules, s.mem_rule);
-    for (const auto & exchg : boston_globe_1966_conversation)
-        TEST_EQUAL(eliza.response(exchg.prompt), exchg.response);
+    auto context = std::make_shared<const elizalogic::script_context>(s.rules, s.mem_rule);
+    elizalogic::eliza start(context);
+    start.response(cacm_1966_conversation[0].prompt);
+    const std::string start_state(start.pack());
+
+    const stringlist inputs{
+        "Men are all alike.",
+        "Well, my boyfriend made me come here.",
+        "It's true. I am unhappy.",
+        "Hello there",          // (no keyword:
+        "Nothing to see",       // these two lead to the same state)
+        "You are like my father in some ways.",
+    };
+    elizalogic::conversation_explorer explorer(start);
+    elizalogic::conversation_explorer::options opt;
+    opt.depth = 3;
+    opt.threads = 3;
+    const auto res = explorer.explore(inputs, opt);
+    TEST_EQUAL(start.pack(), start_state); // (the start conversation is untouched)
+    TEST_EQUAL(res.exchanges, res.states + res.duplicates - 1);
+    TEST_EQUAL(res.duplicates > 0, true);
+    TEST_EQUAL(res.exchanges < 6 + 36 + 216, true);
+    TEST_EQUAL(res.replies.count("WHAT RESEMBLANCE DO YOU SEE"), (size_t)1);
+
+    // every reply is reproduced by following its path from the start
+    for (const auto & [reply, rec] : res.replies) {
+        auto e = start.fork();
+        std::string last;
+        for (const auto & input : rec.path)
+            last = e->response(input);
+        TEST_EQUAL(last, reply);
+    }
+
+    // the result doesn't depend on the number of threads
+    opt.threads = 1;
+    const auto res1 = explorer.explore(inputs, opt);
+    TEST_EQUAL(res1.exchanges, res.exchanges);
+    TEST_EQUAL(res1.states, res.states);
+    TEST_EQUAL(res1.replies.size(), res.replies.size());
+    TEST_EQUAL(res1.reassembly_hits == res.reassembly_hits, true);
+
+    // ALIKE links to DIT, which has one decomposition with eight
+    // reassemblies; start used the first, and in three exchanges we can
+    // use no more than the next three
+    const size_t t = context->cursor_base(*s.rules.at("DIT"));
+    TEST_EQUAL(explorer.keyword(t), "DIT");
+    TEST_EQUAL(res.reassembly_hits[explorer.reassembly_index(t, 0)], (size_t)0);
+    TEST_EQUAL(res.reassembly_hits[explorer.reassembly_index(t, 1)] > 0, true);
+    TEST_EQUAL(res.reassembly_hits[explorer.reassembly_index(t, 3)] > 0, true);
+    TEST_EQUAL(res.reassembly_hits[explorer.reassembly_index(t, 4)], (size_t)0);
+    const std::string report(explorer.coverage_report(res));
+    TEST_EQUAL(report.find("keywords not used:") != std::string::npos, true);
+}
+
+
+DEF_TEST_FUNC(test_conversation_driver)
+{
+    using elizadriver::driver;
+    using elizadriver::task;
+    using elizadriver::terminal;
+    using namespace std::chrono_literals;
+
+    {
+        // sleepers wake in time order (those due together, in the order
+        // they slept); a task may await another; an exception comes out
+        // of run()
+        driver d(true);
+        const auto start = d.now();
+        std::string order;
+        auto sleeper = [&](char name, driver::clock::duration t) -> task {
+            co_await d.sleep_for(t);
+            order += name;
+        };
+        auto both = [&]() -> task {
+            co_await sleeper('b', 2s);
+            co_await sleeper('d', 2s);
+        };
+        d.spawn(sleeper('c', 3s));
+        d.spawn(both());
+        d.spawn(sleeper('a', 1s));
+        d.spawn(sleeper('e', 5s));
+        TEST_EQUAL(d.tasks(), (size_t)4);
+        TEST_EQUAL(d.run(), true);
+        TEST_EQUAL(order, "abcde");
+        TEST_EQUAL(d.now() - start, driver::clock::duration(5s));
+
+        auto thrower = [&]() -> task {
+            co_await d.sleep_for(1s);
+            throw std::runtime_error("thrown");
+        };
+        d.spawn(thrower());
+        std::string what;
+        try {
+            d.run();
+        }
+        catch (const std::runtime_error & e) {
+            what = e.what();
+        }
+        TEST_EQUAL(what, "thrown");
+        TEST_EQUAL(d.tasks(), (size_t)0);
+
+        // a task waiting for input that won't come
+        terminal t(d, [](const std::string &) {});
+        auto reader = [&]() -> task {
+            std::string line;
+            while (co_await t.read_line(line))
+                order += line;
+        };
+        d.spawn(reader());
+        TEST_EQUAL(d.run(), false);
+        TEST_EQUAL(t.reading(), true);
+        t.deliver("f");
+        TEST_EQUAL(d.run([&](driver::clock::time_point) { t.end_input(); return true; }), true);
+        TEST_EQUAL(order, "abcdef");
+    }
+
+    elizascript::script s;
+    elizascript::read(elizascript::CACM_1966_01_DOCTOR_script, s);
+    auto context = std::make_shared<const elizalogic::script_context>(s.rules, s.mem_rule);
+    const std::string greeting(join(s.hello_message));
+
+    // what a terminal should print, and how long that should take at
+    // 14 cps, pausing to reflect before each reply
+    std::string expected(greeting + "\n");
+    const auto interval = driver::clock::duration(1s) / 14;
+    auto expected_time = interval * greeting.size();
+    for (const auto & exchg : cacm_1966_conversation) {
+        const std::string response(exchg.response);
+        expected += response + "\n";
+        expected_time += elizadriver::reflection_time + interval * response.size();
+    }
+
+    // 32 teletype-speed conversations, each with a typist who types
+    // the next line every second (faster than the doctor replies), all
+    // carried on by this one thread; being interleaved, they take as
+    // long as one of them alone
+    const size_t sessions = 32;
+    driver d(true);
+    std::vector<std::string> transcripts(sessions);
+    std::vector<std::unique_ptr<terminal>> terminals;
+    std::vector<std::unique_ptr<elizalogic::eliza>> elizas;
+    auto typist = [&](terminal & t) -> task {
+        for (const auto & exchg : cacm_1966_conversation) {
+            t.deliver(exchg.prompt);
+            co_await d.sleep_for(1s);
+        }
+        t.end_input();
+    };
+    for (size_t i = 0; i < sessions; ++i) {
+        terminals.push_back(std::make_unique<terminal>(d,
+            [&transcripts, i](const std::string & s) { transcripts[i] += s; }, 14));
+        elizas.push_back(std::make_unique<elizalogic::eliza>(context));
+        d.spawn(elizadriver::converse(d, *terminals[i], *elizas[i], greeting, false));
+        d.spawn(typist(*terminals[i]));
+    }
+    const auto start = d.now();
+    TEST_EQUAL(d.run(), true);
+    TEST_EQUAL(d.now() - start, expected_time);
+    for (const auto & transcript : transcripts)
+        TEST_EQUAL(transcript, expected);
+}
+
+
+#ifdef SUPPORT_LINE_SERVER
+DEF_TEST_FUNC(test_line_server)
+{
+    elizascript::script s;
+    elizascript::read(elizascript::CACM_1966_01_DOCTOR_script, s);
+    auto context = std::make_shared<const elizalogic::script_context>(s.rules, s.mem_rule);
+
+    // (io_uring falls back to epoll where the kernel can't support it)
+    for (const auto backend : { line_server::backend::epoll, line_server::backend::io_uring }) {
+        elizalogic::session_table table(context, elizalogic::session_table::options());
+        line_server server(backend);
+        if (backend == line_server::backend::epoll)
+            TEST_EQUAL(std::string(server.backend_name()), "epoll");
+        const std::string unix_address("unix:/tmp/eliza-test-"
+            + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".sock");
+        TEST_EQUAL(server.listen("127.0.0.1:0"), true);
+        TEST_EQUAL(server.listen(unix_address), true);
+        TEST_EQUAL(server.listen("127.0.0.1:99999"), false);
+        const std::string tcp_address(std::to_string(server.port()));
+        std::thread serving([&]() {
+            server.run([&](const std::string & id, const std::string & input) {
+                return table.response(id, input, elizalogic::session_table::clock::now());
+            });
+        });
+
+        // many connections, each with its own conversation, taking turns
+        const int clients = 40;
+        std::vector<line_client> client(clients);
+        for (int c = 0; c < clients; ++c)
+            TEST_EQUAL(client[c].connect(c % 2 ? tcp_address : unix_address), true);
+        for (const auto & exchg : cacm_1966_conversation) {
+            for (int c = 0; c < clients; ++c) {
+                std::string reply;
+                // (half name their session; the others use the connection's)
+                const std::string line(c % 4 < 2 ? "client" + std::to_string(c) + "\t" + exchg.prompt : exchg.prompt);
+                TEST_EQUAL(client[c].request(line, reply), true);
+                TEST_EQUAL(reply, exchg.response);
+            }
+        }
+        TEST_EQUAL(server.connections(), (size_t)clients);
+
+        // pipelined requests are answered in order
+        line_client pipelined;
+        TEST_EQUAL(pipelined.connect(tcp_address), true);
+        std::string lines;
+        for (int i = 0; i < 5; ++i)
+            TEST_EQUAL(pipelined.send("pipe\t" + std::string(cacm_1966_conversation[i].prompt) + "\r"), true);
+        for (int i = 0; i < 5; ++i) {
+            std::string reply;
+            TEST_EQUAL(pipelined.receive(reply), true);
+            TEST_EQUAL(reply, cacm_1966_conversation[i].response);
+        }
+
+        // the load generator gets every reply
+        const auto load = line_load(tcp_address, 8, 30, 4, { "Men are all alike.", "In what way?" });
+        TEST_EQUAL(load.requests, (size_t)(8 * 30));
+        TEST_EQUAL(load.errors, (size_t)0);
+        TEST_EQUAL(load.p50_us <= load.p99_us && load.p99_us <= load.max_us, true);
+        TEST_EQUAL(server.stats().lines, (unsigned long long)(clients * std::size(cacm_1966_conversation) + 5 + 8 * 30));
+        TEST_EQUAL(server.stats().syscalls > 0, true);
+
+        for (auto & c : client)
+            c.close();
+        pipelined.close();
+        server.stop();
+        serving.join();
+    }
+}
+
+
+DEF_TEST_FUNC(test_line_server_group)
+{
+    elizascript::script s;
+    elizascript::read(elizascript::CACM_1966_01_DOCTOR_script, s);
+    auto context = std::make_shared<const elizalogic::script_context>(s.rules, s.mem_rule);
+
+    for (const auto backend : { line_server::backend::epoll, line_server::backend::io_uring }) {
+        line_server_group group(3, backend);
+        TEST_EQUAL(group.shards(), 3u);
+        const std::string unix_address("unix:/tmp/eliza-group-test-"
+            + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".sock");
+        TEST_EQUAL(group.listen("127.0.0.1:0"), true);
+        TEST_EQUAL(group.listen(unix_address), true);
+        const std::string tcp_address(std::to_string(group.port()));
+        std::thread serving([&]() {
+            group.run([&](unsigned) {
+                auto table = std::make_shared<elizalogic::session_table>(context, elizalogic::session_table::options());
+                return [table](const std::string & id, const std::string & input) {
+                    return table->response(id, input, elizalogic::session_table::clock::now());
+                };
+            });
+        });
+
+        // a session used from several connections (on whichever shards
+        // the kernel gave them) is one conversation
+        const int clients = 6, sessions = 4;
+        std::vector<line_client> client(clients);
+        for (int c = 0; c < clients; ++c)
+            TEST_EQUAL(client[c].connect(c % 2 ? tcp_address : unix_address), true);
+        const size_t exchanges = std::size(cacm_1966_conversation);
+        for (size_t k = 0; k < exchanges; ++k) {
+            for (int id = 0; id < sessions; ++id) {
+                std::string reply;
+                TEST_EQUAL(client[(k + id) % clients].request("group" + std::to_string(id) + "\t"
+                    + cacm_1966_conversation[k].prompt, reply), true);
+                TEST_EQUAL(reply, cacm_1966_conversation[k].response);
+            }
+        }
+
+        // lines for sessions on different shards, pipelined on one
+        // connection, get their replies in order
+        const std::string q("q");
+        std::string r("r");
+        for (int n = 0; line_server_group::shard_of(r, 3) == line_server_group::shard_of(q, 3); ++n)
+            r = "r" + std::to_string(n);
+        line_client pipelined;
+        TEST_EQUAL(pipelined.connect(tcp_address), true);
+        for (int i = 0; i < 6; ++i) {
+            TEST_EQUAL(pipelined.send(q + "\t" + cacm_1966_conversation[i].prompt), true);
+            TEST_EQUAL(pipelined.send(r + "\t" + cacm_1966_conversation[i].prompt), true);
+        }
+        for (int i = 0; i < 6; ++i) {
+            for (int j = 0; j < 2; ++j) {
+                std::string reply;
+                TEST_EQUAL(pipelined.receive(reply), true);
+                TEST_EQUAL(reply, cacm_1966_conversation[i].response);
+            }
+        }
+        TEST_EQUAL(group.handoffs() > 0, true);
+        TEST_EQUAL(group.stats().lines, (unsigned long long)(exchanges * sessions + 12));
+
+        for (auto & c : client)
+            c.close();
+        pipelined.close();
+        group.stop();
+        serving.join();
+    }
+}
+#endif
+
+
+#ifdef SUPPORT_SHM_SERVER
+DEF_TEST_FUNC(test_shm_server)
+{
+    elizascript::script s;
+    elizascript::read(elizascript::CACM_1966_01_DOCTOR_script, s);
+    auto context = std::make_shared<const elizalogic::script_context>(s.rules, s.mem_rule);
+    elizalogic::session_table table(context, elizalogic::session_table::options());
+
+    shm_server server;
+    const std::string path("/tmp/eliza-test-"
+        + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".shm");
+    TEST_EQUAL(server.listen(""), false);
+    TEST_EQUAL(server.listen(path), true);
+    std::thread serving([&]() {
+        server.run([&](const std::string & id, const std::string & input) {
+            return table.response(id, input, elizalogic::session_table::clock::now());
+        });
+    });
+
+    // each client with its own conversation, taking turns
+    const int clients = 3;
+    std::vector<shm_client> client(clients);
+    for (int c = 0; c < clients; ++c)
+        TEST_EQUAL(client[c].connect(path), true);
+    TEST_EQUAL(server.connections(), (size_t)clients);
+    for (const auto & exchg : cacm_1966_conversation) {
+        for (int c = 0; c < clients; ++c) {
+            std::string reply;
+            TEST_EQUAL(client[c].request("shm" + std::to_string(c), exchg.prompt, reply), true);
+            TEST_EQUAL(reply, exchg.response);
+        }
+    }
+
+    // a request too long for the ring is refused; the channel still works
+    std::string reply;
+    TEST_EQUAL(client[0].send("shm0", std::string(100000, 'A')), false);
+    TEST_EQUAL(client[0].request("shm0", "Men are all alike.", reply), true);
+
+    // many more requests sent than the rings hold, answered in order
+    // (one thread sends while another receives)
+    const int flood = 3000;
+    shm_client pipelined;
+    TEST_EQUAL(pipelined.connect(path), true);
+    std::thread sending([&]() {
+        for (int i = 0; i < flood; ++i)
+            pipelined.send("flood", cacm_1966_conversation[i % cacm_1966_conversation_size].prompt);
+    });
+    elizalogic::eliza expected(context);
+    int in_order = 0;
+    for (int i = 0; i < flood; ++i) {
+        if (pipelined.receive(reply) && reply == expected.response(cacm_1966_conversation[i % cacm_1966_conversation_size].prompt))
+            ++in_order;
+    }
+    sending.join();
+    TEST_EQUAL(in_order, flood);
+    TEST_EQUAL(server.stats().requests, (unsigned long long)(clients * cacm_1966_conversation_size + 1 + flood));
+
+    // a channel closes when its client does
+    pipelined.close();
+    for (int i = 0; i < 1000 && server.connections() > (size_t)clients; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    TEST_EQUAL(server.connections(), (size_t)clients);
+
+    // and when the server stops
+    server.stop();
+    serving.join();
+    TEST_EQUAL(server.connections(), (size_t)0);
+    TEST_EQUAL(client[1].request("shm1", "Hello", reply), false);
+    TEST_EQUAL(client[1].last_error_text().empty(), false);
+}
+#endif
+
+
+#ifdef SUPPORT_TELNET_SERVER
+DEF_TEST_FUNC(test_telnet_server)
+{
+    // the ASR 33 line discipline
+    {
+        const std::string newline("\r\n\0\0", 4);
+        teletype tty(true);
+        std::string out;
+        tty.print("Hello,\r\nworld\xA1\r\n", out); // (0xA1 is '!' with the 8th bit set)
+        TEST_EQUAL(out, "HELLO,\r\nWORLD!\r\n");
+        out.clear();
+        tty.print(std::string(80, 'a'), out);
+        TEST_EQUAL(out, std::string(72, 'A') + newline + std::string(8, 'A'));
+        out.clear();
+        tty.print("\r\n", out);
+        for (const char c : std::string("Men are all alike.")) {
+            TEST_EQUAL(tty.type(static_cast<unsigned char>(c), out), false);
+        }
+        TEST_EQUAL(tty.typed(), (size_t)18);
+        TEST_EQUAL(tty.type('\r', out), true);
+        TEST_EQUAL(tty.line(), "Men are all alike.");
+        TEST_EQUAL(out, "\r\nMEN ARE ALL ALIKE." + newline);
+        TEST_EQUAL(tty.typed(), (size_t)0);
+    }
+
+    elizascript::script s;
+    elizascript::read(elizascript::CACM_1966_01_DOCTOR_script, s);
+    auto context = std::make_shared<const elizalogic::script_context>(s.rules, s.mem_rule);
+    const std::string greeting(join(s.hello_message));
+
+    telnet_server server;
+    TEST_EQUAL(server.listen("127.0.0.1:0"), true);
+    const std::string address(std::to_string(server.port()));
+    std::unordered_map<unsigned long long, std::unique_ptr<elizalogic::eliza>> conversations;
+    std::thread serving([&]() {
+        server.run(
+            [&](unsigned long long client) {
+                conversations[client] = std::make_unique<elizalogic::eliza>(context);
+                return greeting;
+            },
+            [&](unsigned long long client, const std::string & line, std::string & reply) {
+                if (line.empty())
+                    return false;
+                reply = conversations[client]->response(line);
+                return true;
+            },
+            [&](unsigned long long client) {
+                conversations.erase(client);
+            });
+    });
+
+    // two teletypes, each with a conversation of its own; what's
+    // typed is echoed, in upper case and broken at column 72
+    telnet_client a, b;
+    std::string line;
+    TEST_EQUAL(a.connect(address), true);
+    TEST_EQUAL(b.connect(address), true);
+    TEST_EQUAL(a.receive(line) && line == greeting, true);
+    TEST_EQUAL(b.receive(line) && line == greeting, true);
+    for (size_t x = 0; x < 4; ++x) {
+        const std::string prompt(cacm_1966_conversation[x].prompt);
+        TEST_EQUAL(a.send(prompt + "\r\n"), true); // (CR LF, as telnet in line mode)
+        TEST_EQUAL(a.receive(line), true);
+        TEST_EQUAL(line, elizalogic::eliza_uppercase(prompt));
+        TEST_EQUAL(a.receive(line), true);
+        TEST_EQUAL(line, cacm_1966_conversation[x].response);
+    }
+    TEST_EQUAL(b.send(cacm_1966_conversation[0].prompt + std::string("\r")), true);
+    TEST_EQUAL(b.receive(line), true);
+    TEST_EQUAL(b.receive(line), true);
+    TEST_EQUAL(line, cacm_1966_conversation[0].response);
+
+    const std::string long_input(std::string(70, ' ') + "Men are alike");
+    TEST_EQUAL(b.send(long_input + "\n"), true); // (some clients send only LF)
+    TEST_EQUAL(b.receive(line), true);
+    TEST_EQUAL(line, std::string(70, ' ') + "ME");
+    TEST_EQUAL(b.receive(line), true);
+    TEST_EQUAL(line, "N ARE ALIKE");
+    TEST_EQUAL(b.receive(line), true);
+    TEST_EQUAL(line, "WHAT RESEMBLANCE DO YOU SEE");
+
+    // a blank line hangs up
+    TEST_EQUAL(a.send("\r\n"), true);
+    TEST_EQUAL(a.receive(line), true); // (the echo)
+    TEST_EQUAL(line, "");
+    TEST_EQUAL(a.receive(line), true); // (the blank reply)
+    TEST_EQUAL(a.receive(line), false);
+    b.close();
+    for (int i = 0; i < 1000 && server.connections() != 0; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    TEST_EQUAL(server.connections(), (size_t)0);
+
+    server.stop();
+    serving.join();
+    TEST_EQUAL(conversations.size(), (size_t)0);
+
+    // a paced teletype prints no faster than its speed (at 1000 cps the
+    // greeting and its newline take 45ms to print)
+    {
+        telnet_server paced(1000);
+        TEST_EQUAL(paced.listen("127.0.0.1:0"), true);
+        std::thread pacing([&]() {
+            paced.run(
+                [&](unsigned long long) { return greeting; },
+                [&](unsigned long long, const std::string &, std::string &) { return false; },
+                [&](unsigned long long) {});
+        });
+        const auto start = std::chrono::steady_clock::now();
+        telnet_client c;
+        TEST_EQUAL(c.connect(std::to_string(paced.port())), true);
+        TEST_EQUAL(c.receive(line) && line == greeting, true);
+        TEST_EQUAL(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(40), true);
+        c.close();
+        paced.stop();
+        pacing.join();
+    }
 }
+#endif
 
 
-DEF_TEST_FUNC(test_5_march_1965_convo)
-{
-    /* In Joseph Weizenbaum's MIT archive there is a folder titled
-       "Conversation - March 5, 1965" containing a hand-annotated
-       printout of an ELIZA conversation, along with a purple ink
-       (presumably mimeographed) version of the same conversation -
-       perhaps a lecture handout. See MIT archive 02-000311054.pdf.
-
-       We don't have the ELIZA script used to generate this
-       conversation. I've modified the script found in Weizenbaum's
-       MIT archive 02-000311051.pdf just enough to recreate it. */
-
-    const char * script =
-
-    /*  Transcript of an ELIZA script printed in a listing following the ELIZA
-        source code in MIT archive document 02-000311051.pdf. The listing was
-        found in a folder titled COMPUTER CONVERSATIONS 1965 and has the header
-
-            "PRINT,T0109,2531,.TAPE.,100      T0109 2531    1748.8     03/06"
+/*  4-state busy beaver
 
-        The date the listing was printed is therefore assumed to be 6 March 1965.
+        A   B   C   D
+        0   1RB 1LA 1RH 1RD
+        1   1LB 0LC 1LD 0RA
 
-        This is a verbatim transcript except for whitespace, which has been
-        changed for readability. In addition, changes to the script to make
-        the March 5, 1965 conversation work are noted in comments. */
+    Result: 0 0 1 0 1 1 1 1 1 1 1 1 1 1 1 1 0 0 (107 steps, thirteen "1"s total)
+    https://en.wikipedia.org/wiki/Busy_beaver
+*/
+const char * const busy_beaver_script =
+    "()\n"
 
-        "(HOW DO YOU DO.  I AM THE DOCTOR.  PLEASE SIT DOWN AT THE TYPEWRITER AND TELL ME YOUR PROBLEM.)\n"
-        "\n"
-        "(IF 3\n"
-        "    ((0 IF 0)\n"
-        "        (DO YOU THINK ITS LIKELY THAT 3)\n"
-        "        (DO YOU WISH THAT 3)\n"
-        "        (WHAT DO YOU THINK ABOUT 3)\n"
-        "        (REALLY, 2 3)))\n"
-        "\n"
-        "(HOW\n"
-        "    (=WHAT))\n"
-        "\n"
-        //[3] If WHEN links to WHAT you get the wrong response, "WHY DO YOU ASK."
-        //    Remove this link and you get the required answer.
-        //"(WHEN\n"
-        //"    (=WHAT))\n"
-        "\n"
-        "(MEMORY MY\n"
-        "    (0 YOUR 0 = LETS DISCUSS FURTHER WHY YOUR 3)\n"
-        "    (0 YOUR 0 = EARLIER YOU SAID YOUR 3)\n"
-        "    (0 YOUR 0 = BUT YOUR 3)\n"
-        //[2] This one is a puzzle. The word being HASHed is "HERE". We know from the
-        //    1966 script and published conversation that HASH("HERE", 2) = 3. (Assuming
-        //    the same mechanism is being used in both.) So, I've just swapped this
-        //    message for the (0 YOUR 0 = YOU SAID YOUR 3).
-        //        "    (0 YOUR 0 = DOES THAT HAVE ANYTHING TO DO WITH THE FACT THAT YOUR 3))\n"
-        "    (0 YOUR 0 = YOU SAID YOUR 3))\n"
-        "\n"
-        "(NONE\n"
-        "    ((0)\n"
-        "        (I AM NOT SURE I UNDERSTAND YOU FULLY)\n"
-        "        (PLEASE GO ON)\n"
-        "        (WHAT DOES THAT SUGGEST TO YOU)\n"
-        "        (DO YOU FEEL STRONGLY ABOUT DISCUSSING SUCH THINGS)))\n"
-        "\n"
-        "(PERHAPS\n"
-        "    ((0)\n"
-        //[4] "AND MAYBE NOT" doesn't appear in the script, so I added it.
-        "        (AND MAYBE NOT)\n"
-        "        (YOU DON'T SEEM QUITE CERTAIN)\n"
-        "        (WHY THE UNCERTAIN TONE)\n"
-        "        (CAN'T YOU BE MORE POSITIVE)\n"
-        "        (YOU AREN'T SURE)\n"
-        "        (DON'T YOU KNOW)))\n"
-        "\n"
-        "(MAYBE\n"
-        "    (=PERHAPS))\n"
-        "\n"
-        "(AM = ARE\n"
-        "    ((0 ARE YOU 0)\n"
-        "        (DO YOU BELIEVE YOU ARE 4)\n"
-        "        (WOULD YOU WANT TO BE 4)\n"
-        "        (YOU WISH I WOULD TELL YOU YOU ARE 4)\n"
-        "        (WHAT WOULD IT MEAN IF YOU WERE 4))\n"
-        "    ((0)\n"
-        "        (WHY DO YOU SAY 'AM')\n"
-        "        (I DON'T UNDERSTAND THAT)))\n"
-        "\n"
-        "(ARE = AM\n"
-        "    ((0 AM I 0)\n"
-        "        (WHY ARE YOU INTERESTED IN WHETHER I AM 4 OR NOT)\n"
-        "        (WOULD YOU PREFER IF I WEREN'T 4)\n"
-        "        (PERHAPS I AM 4 IN YOUR FANTASIES)\n"
-        "        (DO YOU SOMETIMES THINK I AM 4))\n"
-        "    ((0 AM 0)\n"
-        "        (DID YOU THINK THEY MIGHT NOT BE 3)\n"
-        "        (WOULD YOU LIKE IT IF THEY WERE NOT 3)\n"
-        "        (WHAT IF THEY WERE NOT 3)\n"
-        "        (POSSIBLY THEY ARE 3)))\n"
-        "\n"
-        "(YOUR = MY\n"
-        "    ((0 MY 0)\n"
-        "        (WHY ARE YOU CONCERNED OVER MY 3)\n"
-        "        (WHAT ABOUT YOUR OWN 3)\n"
-        "        (ARE YOU WORRIED ABOUT SOMEONE ELSES 3)\n"
-        "        (REALLY, MY 3)))\n"
-        "\n"
-        "(WAS = WERE)\n"
-        "(WERE = WAS)\n"
-        "(ME = YOU)\n"
-        "(YOU'RE = I'M)\n"
-        "(I'M = YOU'RE)\n"
-        "(MYSELF = YOURSELF)\n"
-        "(YOURSELF = MYSELF)\n"
-        "\n"
-        "(MOTHER DLIST(/NOUN FAMILY))\n"
-        "(FATHER DLIST(/NOUN FAMILY))\n"
-        "(SISTER DLIST(/FAMILY))\n"
-        "(BROTHER DLIST(/FAMILY))\n"
-        "(WIFE DLIST(/FAMILY))\n"
-        "(CHILDREN DLIST(/FAMILY))\n"
-        "\n"
-        "(I = YOU\n"
-        "    ((0 YOU ARE 0 I 0)\n"
-        "        (PERHAPS YOU ARE 4 SOMEONE ELSE)\n"
-        "        (ARE YOU 4 ANYONE)\n"
-        "        (ARE YOU 4 ANYONE IN YOUR FAMILY)\n"
-        "        (PERHAPS YOU WISH I WERE 4 YOU 6))\n"
-        "    ((0 YOU ARE 0)\n"
-        "        (IS IT BECAUSE YOU ARE 4 THAT YOU CAME TO ME)\n"
-        "        (HOW LONG HAVE YOU BEEN 4)\n"
-        "        (DO YOU BELIEVE IT NORMAL TO BE 4)\n"
-        "        (DO YOU ENJOY BEING 4))\n"
-        "    ((0 YOU CAN'T 0)\n"
-        "        (HOW DO YOU KNOW YOU CAN'T 4)\n"
-        "        (HAVE YOU TRIED)\n"
-        "        (PERHAPS YOU COULD 4 NOW)\n"
-        "        (DO YOU REALLY WANT TO BE ABLE TO 4))\n"
-        "    ((0 YOU DON'T 0)\n"
-        "        (DON'T YOU REALLY 4)\n"
-        "        (WHY DON'T YOU 4)\n"
-        "        (DO YOU WISH TO BE ABLE TO 4)\n"
-        "        (DOES THAT TROUBLE YOU))\n"
-        "    ((0 YOU FEEL 0)\n"
-        "        (TELL ME MORE ABOUT SUCH FEELINGS)\n"
-        "        (DO YOU OFTEN FEEL 4)\n"
-        "        (DO YOU ENJOY FEELING 4)\n"
-        "        (OF WHAT DOES FEELING 4 REMIND YOU))\n"
-        "    ((0 YOU 0 I 0)\n"
-        "        (PERHAPS IN YOUR FANTASY WE 3 EACH OTHER)\n"
-        "        (DO YOU WISH TO 3 ME)\n"
-        "        (YOU SEEM TO NEED TO 3 ME)\n"
-        "        (DO YOU 3 ANYONE ELSE))\n"
-        "    ((0)\n"
-        "        (YOU SAY 1)\n"
-        "        (CAN YOU ELABORATE ON THAT)\n"
-        "        (DO YOU SAY 1 FOR SOME SPECIAL REASON)\n"
-        "        (THAT'S QUITE INTERESTING)))\n"
-        "\n"
-        "(YOU = I\n"
-        "    ((0 I 0 YOU 0)\n"
-        "        (WHY DO YOU THINK I 3 YOU)\n"
-        "        (DID YOUR PARENTS 3 YOU))\n"
-        "    ((0 I AM 0)\n"
-        "        (WHAT MAKES YOU THINK I AM 4)\n"
-        "        (DOES IT PLEASE YOU TO BELIEVE I AM 4)\n"
-        "        (DO YOU SOMETIMES WISH YOU WERE 4)\n"
-        "        (PERHAPS YOU WOULD LIKE TO BE 4))\n"
-        "    ((0 I 0)\n"
-        "        (WE WERE DISCUSSING YOU - NOT ME)\n"
-        "        (OH, I 3)\n"
-        "        (YOU'RE NOT REALLY TALKING ABOUT ME - ARE YOU)\n"
-        "        (WHAT ARE YOUR FEELINGS NOW)))\n"
-        "\n"
-        "(YES\n"
-        "    ((0)\n"
-        "        (YOU SEEM QUITE POSITIVE)\n"
-        "        (YOU ARE SURE)\n"
-        "        (I SEE)\n"
-        "        (I UNDERSTAND)))\n"
-        "\n"
-        "(NO\n"
-        "    ((0)\n"
-        "        (ARE YOU SAYING 'NO' JUST TO BE NEGATIVE)\n"
-        "        (YOU ARE BEING A BIT NEGATIVE)\n"
-        "        (WHY NOT)\n"
-        "        (WHY 'NO')))\n"
-        "\n"
-        "(MY = YOUR\n"
-        "    ((0 YOUR 0 (/FAMILY) 0)\n"
-        "        (TELL ME MORE ABOUT YOUR FAMILY)\n"
-        "        (WHO ELSE IN YOUR FAMILY 5)\n"
-        "        (YOUR 4)\n"
-        "        (WHAT ELSE COMES TO MIND WHEN YOU THINK OF YOUR 4))\n"
-        "    ((0 YOUR 0)\n"
-        "        (YOUR 3)\n"
-        "        (WHY DO YOU SAY YOUR 3)\n"
-        "        (DOES THAT SUGGEST ANYTHING ELSE WHICH BELONGS TO YOU)\n"
-        "        (IS IT IMPORTANT TO YOU THAT 2 3)))\n"
-        "\n"
-        "(CAN\n"
-        "    ((0 CAN I 0)\n"
-        "        (YOU BELIEVE I CAN 4 DON'T YOU)\n"
-        "        (YOU WANT BE TO BE ABLE TO 4)\n"
-        "        (PERHAPS YOU WOULD LIKE TO BE ABLE TO 4 YOURSELF))\n"
-        "    ((0 CAN YOU 0)\n"
-        "        (WHETHER OR NOT YOU CAN 4 DEPENDS ON YOU MORE THAN ON ME)\n"
-        "        (DO YOU WANT TO BE ABLE TO 4)\n"
-        "        (PERHAPS YOU DON'T WANT TO 4)))\n"
-        "\n"
-        "(WHAT\n"
-        "    ((0)\n"
-        "        (WHY DO YOU ASK)\n"
-        "        (DOES THAT QUESTION INTEREST YOU)\n"
-        "        (WHAT IS IT YOU REALLY WANT TO KNOW)\n"
-        "        (ARE SUCH QUESTIONS MUCH ON YOUR MIND)\n"
-        "        (WHAT ANSWER WOULD PLEASE YOU MOST)\n"
-        "        (WHAT DO YOU THINK)\n"
-        "        (WHAT COMES TO YOUR MIND WHEN YOU ASK THAT)\n"
-        "        (HAVE YOU ASKED SUCH QUESTIONS BEFORE)\n"
-        "        (HAVE YOU ASKED ANYONE ELSE)))\n"
-        "\n"
-        "(BECAUSE\n"
-        "    ((0)\n"
-        "        (IS THAT THE REAL REASON)\n"
-        "        (DON'T ANY OTHER REASONS COME TO MIND)\n"
-        "        (DOES THAT REASON SEEM TO EXPLAIN ANYTHING ELSE)\n"
-        "        (WHAT OTHER REASONS MIGHT THERE BE)))\n"
-        "\n"
-        "(WHY\n"
-        "    ((0 WHY DON'T I 0)\n"
-        "        (DO YOU BELIEVE I DON'T 5)\n"
-        "        (PERHAPS I WILL 5 IN GOOD TIME)\n"
-        "        (SHOULD YOU 5 YOURSELF)\n"
-        "        (YOU WANT ME TO 5))\n"
-        "    ((0 WHY CAN'T YOU 0)\n"
-        "        (DO YOU THINK YOU SHOULD BE ABLE TO 5)\n"
-        "        (DO YOU WANT TO BE ABLE TO 5)\n"
-        "        (DO YOU BELIEVE THIS WILL HELP YOU TO 5)\n"
-        "        (HAVE YOU ANY IDEA WHY YOU CAN'T 5))\n"
-        "    (= WHAT))\n"
-        "\n"
-        "(EVERYONE 2\n"
-        "    ((0)\n"
-        //[1] JW may have added these responses at a later date, and/or the ordering
-        //    of the possible responses in the script may have changed.
-        //"        (REALLY, EVERYONE)\n"
-        //"        (CAN YOU THINK OF ANYONE IN PARTICULAR)\n"
-        //"        (WHO, FOR EXAMPLE)\n"
-        //"        (YOU ARE THINKING OF A VERY SPECIAL PERSON)\n"
-        "        (WHO, MAY I ASK)\n"
-        "        (SOMEONE SPECIAL PERHAPS)\n"
-        "        (YOU HAVE A PARTICULAR PERSON IN MIND, DON'T YOU)\n"
-        "        (WHO DO YOU THINK YOU'RE TALKING ABOUT)))\n"
-        "\n"
-        "(EVERYBODY 2\n"
-        "    (= EVERYONE))\n"
-        "\n"
-        "(NOBODY 2\n"
-        "    (=EVERYONE))\n"
-        "\n"
-        "(NOONE 2\n"
-        "    (=EVERYONE))\n"
-        "\n"
-        "(ALWAYS 1\n"
-        "    ((0)\n"
-        "        (CAN YOU THINK OF A SPECIFIC EXAMPLE)\n"
-        "        (WHEN)\n"
-        "        (WHAT INCIDENT ARE YOU THINKING OF)\n"
-        "        (REALLY, ALWAYS)))\n"
-        "\n"
-        "()\n";
+    "(START\n"
+    "    ((0)\n"
+    "        (PRE (' O ') (=QA))))\n"
+
+                                                            // state   read    write   move    state'
+    "(QA\n"
+    "    ((' 0) (PRE (O ' 2) (=QA)))\n"
+    "    ((0 ') (PRE (1 ' O) (=QA)))\n"
+    "    ((0 1 ' O ' 1 0) (PRE (1   2   I ' 6 ' 7) (=QB)))   ; QA      O       I       right   QB\n"
+    "    ((0 1 ' I ' 1 0) (PRE (1 ' 2 ' I   6   7) (=QB))))  ; QA      I       I       left    QB\n"
+
+    "(QB\n"
+    "    ((' 0) (PRE (O ' 2) (=QB)))\n"
+    "    ((0 ') (PRE (1 ' O) (=QB)))\n"
+    "    ((0 1 ' O ' 1 0) (PRE (1 ' 2 ' I   6   7) (=QA)))   ; QB      O       I       left    QA\n"
+    "    ((0 1 ' I ' 1 0) (PRE (1 ' 2 ' O   6   7) (=QC))))  ; QB      O       I       left    QC\n"
+
+    "(QC\n"
+    "    ((' 0) (PRE (O ' 2) (=QC)))\n"
+    "    ((0 ') (PRE (1 ' O) (=QC)))\n"
+    "    ((0 1 ' O ' 1 0) (PRE (1   2   I ' 6 ' 7) (=QHALT))); QC      O       I       right   QHALT\n"
+    "    ((0 1 ' I ' 1 0) (PRE (1 ' 2 ' I   6   7) (=QD))))  ; QC      I       I       left    QD\n"
+
+    "(QD\n"
+    "    ((' 0) (PRE (O ' 2) (=QD)))\n"
+    "    ((0 ') (PRE (1 ' O) (=QD)))\n"
+    "    ((0 1 ' O ' 1 0) (PRE (1   2   I ' 6 ' 7) (=QD)))   ; QD      O       I       right   QD\n"
+    "    ((0 1 ' I ' 1 0) (PRE (1   2   O ' 6 ' 7) (=QA))))  ; QD      O       I       right   QA\n"
+
+    "(QHALT\n"
+    "    ((0)\n"
+    "        (1)))\n"
+
+    "(TURING\n"
+    "    ((0)\n"
+    "        (MACHINE)))\n"
+
+    "(MEMORY TURING\n"
+    "    (0 = TURING MACHINE)\n"
+    "    (0 = TURING MACHINE)\n"
+    "    (0 = TURING MACHINE)\n"
+    "    (0 = TURING MACHINE))\n"
+
+    "(NONE\n"
+    "    ((0)\n"
+    "        (NONE)))\n";
+
+
+DEF_TEST_FUNC(test_busy_beaver_turing_machine)
+{
+    elizascript::script s;
+    elizascript::read(busy_beaver_script, s);
+    elizalogic::eliza eliza(s.rules, s.mem_rule);
+    TEST_EQUAL(eliza.response("START"), "O I ' O ' I I I I I I I I I I I I O");
+}
+
+
+const exchange boston_globe_1966_conversation[] = {
+
+    /* A conversation printed on page 15 of The Boston Globe,
+       22 September 1966 by Robert L. Levey who visited MIT and talked
+       to the "doctor." We don't have the ELIZA script that was used.
+       Using Weizenbaum's CACM published script reproduces a similar
+       but not identical conversation. The responses printed in the
+       newspaper that differ are commented out below. */
+
+    { "hello.",
+      "HOW DO YOU DO. PLEASE STATE YOUR PROBLEM" },
+
+    { "my foot hurts",
+    //"TELL ME ABOUT YOUR PAINS IN GENERAL"
+      "YOUR FOOT HURTS" },
+
+    { "it aches mostly around the toes",
+      "EARLIER YOU SAID YOUR FOOT HURTS" },
+
+    { "right",
+      "I AM NOT SURE I UNDERSTAND YOU FULLY" },
+
+    { "what is your problem",
+      "WHY DO YOU ASK" },
+
+    { "because",
+      "IS THAT THE REAL REASON" },
+
+    { "no - i was simply picking on you",
+    //"LET'S TRY TO GO ON"
+      "WERE YOU REALLY" },
+
+    { "what can i do about my toes",
+    //"YOUR TOES"
+      "WHY DO YOU SAY YOUR TOES" },
+
+    { "they still hurt",
+    //"DOES ANY PART OF YOUR BODY HURT YOU"
+      "PLEASE GO ON" },
+
+    { "some vague pains in the chest",
+    //"PLEASE GO ON"
+      "WHAT DOES THAT SUGGEST TO YOU" },
+
+    { "the head bothers me too sometimes",
+      "EARLIER YOU SAID YOUR TOES" },
+
+    { "you wanted to know what else hurt me",
+      "WHY DO YOU THINK I WANTED TO KNOW WHAT ELSE HURT YOU" },
+
+    { "you are the doctor",
+      "WHAT MAKES YOU THINK I AM THE DOCTOR" },
+
+    { "the operator of this machine assured me that you were the doctor",
+      "DO COMPUTERS WORRY YOU" },
+
+    { "in general or in specific",
+    //"PERHAPS YOU PREFER NOT TO DISCUSS IT"
+      "DO YOU FEEL STRONGLY ABOUT DISCUSSING SUCH THINGS" },
+
+    { "i am enjoying myself",
+    //"IS IT BECAUSE YOU ARE ENJOYING YOURSELF THAT YOU CAME HERE"
+      "IS IT BECAUSE YOU ARE ENJOYING YOURSELF THAT YOU CAME TO ME" },
+
+    { "i was looking for greater enjoyment when i came to you",
+    //"WERE YOU REALLY"
+      "WHY DO YOU TELL ME YOU WERE LOOKING FOR GREATER ENJOYMENT WHEN YOU CAME TO I NOW" },
+
+    { "yes - do you think i am being sarcastic",
+    //"YOU SEEM QUITE SURE"
+      "YOU SEEM QUITE POSITIVE" },
+
+    { "not sure - just confident",
+    //"WHAT DOES THAT SUGGEST TO YOU"
+      "I AM NOT SURE I UNDERSTAND YOU FULLY" },
+
+    { "superiority",
+    //"DO YOU FEEL STRONGLY ABOUT DISCUSSING SUCH THINGS"
+      "PLEASE GO ON" },
+
+    { "more and more every moment",
+    //"TELL ME MORE ABOUT SUCH FEELINGS"
+      "WHAT DOES THAT SUGGEST TO YOU" },
+
+    { "would you understand",
+      "WE WERE DISCUSSING YOU - NOT ME" },
+
+    { "i also feel you don't really want to help me",
+      "YOU LIKE TO THINK I DON'T REALLY WANT TO HELP YOU - DON'T YOU" },
+
+    { "i don't like to feel it",
+      "DON'T YOU REALLY LIKE TO FEEL IT" },
+
+    { "no",
+      "ARE YOU SAYING 'NO' JUST TO BE NEGATIVE" },
+
+    { "yes",
+    //"YOU'RE PLAYING GAMES - I WON'T RESPOND UNTIL YOU QUIT"
+      "YOU ARE SURE" },
+
+    { "treat me immediately",
+    //"DOES ANY PART OF YOUR BODY HURT YOU"
+      "DO YOU FEEL STRONGLY ABOUT DISCUSSING SUCH THINGS" },
+
+    { "all parts hurt and then some",
+    //"WHAT DOES THAT SUGGEST TO YOU"
+      "I AM NOT SURE I UNDERSTAND YOU FULLY" },
+
+    { "maladjustment",
+    //"DO YOU FEEL STRONGLY ABOUT DISCUSSING SUCH THINGS"
+      "PLEASE GO ON" },
+
+    { "no",
+    //"WHY NOT"
+      "YOU ARE BEING A BIT NEGATIVE" },
+
+    { "because you are putting me on",
+      "DON'T ANY OTHER REASONS COME TO MIND" },
+
+    { "yes - you seem arrogant and silly",
+    //"I UNDERSTAND"
+      "I SEE" },
+
+    { "you would",
+    //"YOU'RE NOT REALLY TALKING ABOUT ME ARE YOU"
+      "OH, I WOULD" },
+
+    { "who else",
+    //"I AM NOT SURE I UNDERSTAND YOU FULLY"
+      "WHAT DOES THAT SUGGEST TO YOU" },
+
+    { "i am calling you a fink",
+    //"HOW LONG HAVE YOU BEEN CALLING ME A FINK"
+      "HOW LONG HAVE YOU BEEN CALLING I A FINK" },
+
+    { "since you started behaving unethically",
+    //"WHAT ARE YOUR FEELINGS NOW"
+      "YOU'RE NOT REALLY TALKING ABOUT ME - ARE YOU" },
+
+    { "i despise you",
+    //"PERHAPS IN YOUR FANTASY WE STILL DESPISE TOGETHER"
+      "PERHAPS IN YOUR FANTASY WE DESPISE EACH OTHER" },
+
+    { "perhaps i actually despise myself",
+      "YOU DON'T SEEM QUITE CERTAIN" },
+
+    { "i feel more unsure as the moments pass",
+    //"DO YOU OFTEN FEEL MORE UNSURE AS THE MOMENTS PASS"
+      "TELL ME MORE ABOUT SUCH FEELINGS" },
+
+    { "you are losing control of your mind",
+      "DOES IT PLEASE YOU TO BELIEVE I AM LOSING CONTROL OF MY MIND" },
+
+    { "you are more to be pitied than censured",
+      "DO YOU SOMETIMES WISH YOU WERE MORE TO BE PITIED THAN CENSURED" },
+
+    { "i've had enough - goodbye",
+    //"DOES ANY PART OF YOUR BODY HURT YOU"
+      "DO YOU FEEL STRONGLY ABOUT DISCUSSING SUCH THINGS" },
+};
+
+
+DEF_TEST_FUNC(test_boston_globe_1966_convo)
+{
+    elizascript::script s;
+    elizascript::read(elizascript::CACM_1966_01_DOCTOR_script, s);
+    elizalogic::eliza eliza(s.rules, s.mem_rule);
+    for (const auto & exchg : boston_globe_1966_conversation)
+        TEST_EQUAL(eliza.response(exchg.prompt), exchg.response);
+}
+
+
+/* In Joseph Weizenbaum's MIT archive there is a folder titled
+   "Conversation - March 5, 1965" containing a hand-annotated
+   printout of an ELIZA conversation, along with a purple ink
+   (presumably mimeographed) version of the same conversation -
+   perhaps a lecture handout. See MIT archive 02-000311054.pdf.
+
+   We don't have the ELIZA script used to generate this
+   conversation. I've modified the script found in Weizenbaum's
+   MIT archive 02-000311051.pdf just enough to recreate it. */
+
+const char * const march_1965_script =
+
+/*  Transcript of an ELIZA script printed in a listing following the ELIZA
+    source code in MIT archive document 02-000311051.pdf. The listing was
+    found in a folder titled COMPUTER CONVERSATIONS 1965 and has the header
+
+        "PRINT,T0109,2531,.TAPE.,100      T0109 2531    1748.8     03/06"
+
+    The date the listing was printed is therefore assumed to be 6 March 1965.
+
+    This is a verbatim transcript except for whitespace, which has been
+    changed for readability. In addition, changes to the script to make
+    the March 5, 1965 conversation work are noted in comments. */
+
+    "(HOW DO YOU DO.  I AM THE DOCTOR.  PLEASE SIT DOWN AT THE TYPEWRITER AND TELL ME YOUR PROBLEM.)\n"
+    "\n"
+    "(IF 3\n"
+    "    ((0 IF 0)\n"
+    "        (DO YOU THINK ITS LIKELY THAT 3)\n"
+    "        (DO YOU WISH THAT 3)\n"
+    "        (WHAT DO YOU THINK ABOUT 3)\n"
+    "        (REALLY, 2 3)))\n"
+    "\n"
+    "(HOW\n"
+    "    (=WHAT))\n"
+    "\n"
+    //[3] If WHEN links to WHAT you get the wrong response, "WHY DO YOU ASK."
+    //    Remove this link and you get the required answer.
+    //"(WHEN\n"
+    //"    (=WHAT))\n"
+    "\n"
+    "(MEMORY MY\n"
+    "    (0 YOUR 0 = LETS DISCUSS FURTHER WHY YOUR 3)\n"
+    "    (0 YOUR 0 = EARLIER YOU SAID YOUR 3)\n"
+    "    (0 YOUR 0 = BUT YOUR 3)\n"
+    //[2] This one is a puzzle. The word being HASHed is "HERE". We know from the
+    //    1966 script and published conversation that HASH("HERE", 2) = 3. (Assuming
+    //    the same mechanism is being used in both.) So, I've just swapped this
+    //    message for the (0 YOUR 0 = YOU SAID YOUR 3).
+    //        "    (0 YOUR 0 = DOES THAT HAVE ANYTHING TO DO WITH THE FACT THAT YOUR 3))\n"
+    "    (0 YOUR 0 = YOU SAID YOUR 3))\n"
+    "\n"
+    "(NONE\n"
+    "    ((0)\n"
+    "        (I AM NOT SURE I UNDERSTAND YOU FULLY)\n"
+    "        (PLEASE GO ON)\n"
+    "        (WHAT DOES THAT SUGGEST TO YOU)\n"
+    "        (DO YOU FEEL STRONGLY ABOUT DISCUSSING SUCH THINGS)))\n"
+    "\n"
+    "(PERHAPS\n"
+    "    ((0)\n"
+    //[4] "AND MAYBE NOT" doesn't appear in the script, so I added it.
+    "        (AND MAYBE NOT)\n"
+    "        (YOU DON'T SEEM QUITE CERTAIN)\n"
+    "        (WHY THE UNCERTAIN TONE)\n"
+    "        (CAN'T YOU BE MORE POSITIVE)\n"
+    "        (YOU AREN'T SURE)\n"
+    "        (DON'T YOU KNOW)))\n"
+    "\n"
+    "(MAYBE\n"
+    "    (=PERHAPS))\n"
+    "\n"
+    "(AM = ARE\n"
+    "    ((0 ARE YOU 0)\n"
+    "        (DO YOU BELIEVE YOU ARE 4)\n"
+    "        (WOULD YOU WANT TO BE 4)\n"
+    "        (YOU WISH I WOULD TELL YOU YOU ARE 4)\n"
+    "        (WHAT WOULD IT MEAN IF YOU WERE 4))\n"
+    "    ((0)\n"
+    "        (WHY DO YOU SAY 'AM')\n"
+    "        (I DON'T UNDERSTAND THAT)))\n"
+    "\n"
+    "(ARE = AM\n"
+    "    ((0 AM I 0)\n"
+    "        (WHY ARE YOU INTERESTED IN WHETHER I AM 4 OR NOT)\n"
+    "        (WOULD YOU PREFER IF I WEREN'T 4)\n"
+    "        (PERHAPS I AM 4 IN YOUR FANTASIES)\n"
+    "        (DO YOU SOMETIMES THINK I AM 4))\n"
+    "    ((0 AM 0)\n"
+    "        (DID YOU THINK THEY MIGHT NOT BE 3)\n"
+    "        (WOULD YOU LIKE IT IF THEY WERE NOT 3)\n"
+    "        (WHAT IF THEY WERE NOT 3)\n"
+    "        (POSSIBLY THEY ARE 3)))\n"
+    "\n"
+    "(YOUR = MY\n"
+    "    ((0 MY 0)\n"
+    "        (WHY ARE YOU CONCERNED OVER MY 3)\n"
+    "        (WHAT ABOUT YOUR OWN 3)\n"
+    "        (ARE YOU WORRIED ABOUT SOMEONE ELSES 3)\n"
+    "        (REALLY, MY 3)))\n"
+    "\n"
+    "(WAS = WERE)\n"
+    "(WERE = WAS)\n"
+    "(ME = YOU)\n"
+    "(YOU'RE = I'M)\n"
+    "(I'M = YOU'RE)\n"
+    "(MYSELF = YOURSELF)\n"
+    "(YOURSELF = MYSELF)\n"
+    "\n"
+    "(MOTHER DLIST(/NOUN FAMILY))\n"
+    "(FATHER DLIST(/NOUN FAMILY))\n"
+    "(SISTER DLIST(/FAMILY))\n"
+    "(BROTHER DLIST(/FAMILY))\n"
+    "(WIFE DLIST(/FAMILY))\n"
+    "(CHILDREN DLIST(/FAMILY))\n"
+    "\n"
+    "(I = YOU\n"
+    "    ((0 YOU ARE 0 I 0)\n"
+    "        (PERHAPS YOU ARE 4 SOMEONE ELSE)\n"
+    "        (ARE YOU 4 ANYONE)\n"
+    "        (ARE YOU 4 ANYONE IN YOUR FAMILY)\n"
+    "        (PERHAPS YOU WISH I WERE 4 YOU 6))\n"
+    "    ((0 YOU ARE 0)\n"
+    "        (IS IT BECAUSE YOU ARE 4 THAT YOU CAME TO ME)\n"
+    "        (HOW LONG HAVE YOU BEEN 4)\n"
+    "        (DO YOU BELIEVE IT NORMAL TO BE 4)\n"
+    "        (DO YOU ENJOY BEING 4))\n"
+    "    ((0 YOU CAN'T 0)\n"
+    "        (HOW DO YOU KNOW YOU CAN'T 4)\n"
+    "        (HAVE YOU TRIED)\n"
+    "        (PERHAPS YOU COULD 4 NOW)\n"
+    "        (DO YOU REALLY WANT TO BE ABLE TO 4))\n"
+    "    ((0 YOU DON'T 0)\n"
+    "        (DON'T YOU REALLY 4)\n"
+    "        (WHY DON'T YOU 4)\n"
+    "        (DO YOU WISH TO BE ABLE TO 4)\n"
+    "        (DOES THAT TROUBLE YOU))\n"
+    "    ((0 YOU FEEL 0)\n"
+    "        (TELL ME MORE ABOUT SUCH FEELINGS)\n"
+    "        (DO YOU OFTEN FEEL 4)\n"
+    "        (DO YOU ENJOY FEELING 4)\n"
+    "        (OF WHAT DOES FEELING 4 REMIND YOU))\n"
+    "    ((0 YOU 0 I 0)\n"
+    "        (PERHAPS IN YOUR FANTASY WE 3 EACH OTHER)\n"
+    "        (DO YOU WISH TO 3 ME)\n"
+    "        (YOU SEEM TO NEED TO 3 ME)\n"
+    "        (DO YOU 3 ANYONE ELSE))\n"
+    "    ((0)\n"
+    "        (YOU SAY 1)\n"
+    "        (CAN YOU ELABORATE ON THAT)\n"
+    "        (DO YOU SAY 1 FOR SOME SPECIAL REASON)\n"
+    "        (THAT'S QUITE INTERESTING)))\n"
+    "\n"
+    "(YOU = I\n"
+    "    ((0 I 0 YOU 0)\n"
+    "        (WHY DO YOU THINK I 3 YOU)\n"
+    "        (DID YOUR PARENTS 3 YOU))\n"
+    "    ((0 I AM 0)\n"
+    "        (WHAT MAKES YOU THINK I AM 4)\n"
+    "        (DOES IT PLEASE YOU TO BELIEVE I AM 4)\n"
+    "        (DO YOU SOMETIMES WISH YOU WERE 4)\n"
+    "        (PERHAPS YOU WOULD LIKE TO BE 4))\n"
+    "    ((0 I 0)\n"
+    "        (WE WERE DISCUSSING YOU - NOT ME)\n"
+    "        (OH, I 3)\n"
+    "        (YOU'RE NOT REALLY TALKING ABOUT ME - ARE YOU)\n"
+    "        (WHAT ARE YOUR FEELINGS NOW)))\n"
+    "\n"
+    "(YES\n"
+    "    ((0)\n"
+    "        (YOU SEEM QUITE POSITIVE)\n"
+    "        (YOU ARE SURE)\n"
+    "        (I SEE)\n"
+    "        (I UNDERSTAND)))\n"
+    "\n"
+    "(NO\n"
+    "    ((0)\n"
+    "        (ARE YOU SAYING 'NO' JUST TO BE NEGATIVE)\n"
+    "        (YOU ARE BEING A BIT NEGATIVE)\n"
+    "        (WHY NOT)\n"
+    "        (WHY 'NO')))\n"
+    "\n"
+    "(MY = YOUR\n"
+    "    ((0 YOUR 0 (/FAMILY) 0)\n"
+    "        (TELL ME MORE ABOUT YOUR FAMILY)\n"
+    "        (WHO ELSE IN YOUR FAMILY 5)\n"
+    "        (YOUR 4)\n"
+    "        (WHAT ELSE COMES TO MIND WHEN YOU THINK OF YOUR 4))\n"
+    "    ((0 YOUR 0)\n"
+    "        (YOUR 3)\n"
+    "        (WHY DO YOU SAY YOUR 3)\n"
+    "        (DOES THAT SUGGEST ANYTHING ELSE WHICH BELONGS TO YOU)\n"
+    "        (IS IT IMPORTANT TO YOU THAT 2 3)))\n"
+    "\n"
+    "(CAN\n"
+    "    ((0 CAN I 0)\n"
+    "        (YOU BELIEVE I CAN 4 DON'T YOU)\n"
+    "        (YOU WANT BE TO BE ABLE TO 4)\n"
+    "        (PERHAPS YOU WOULD LIKE TO BE ABLE TO 4 YOURSELF))\n"
+    "    ((0 CAN YOU 0)\n"
+    "        (WHETHER OR NOT YOU CAN 4 DEPENDS ON YOU MORE THAN ON ME)\n"
+    "        (DO YOU WANT TO BE ABLE TO 4)\n"
+    "        (PERHAPS YOU DON'T WANT TO 4)))\n"
+    "\n"
+    "(WHAT\n"
+    "    ((0)\n"
+    "        (WHY DO YOU ASK)\n"
+    "        (DOES THAT QUESTION INTEREST YOU)\n"
+    "        (WHAT IS IT YOU REALLY WANT TO KNOW)\n"
+    "        (ARE SUCH QUESTIONS MUCH ON YOUR MIND)\n"
+    "        (WHAT ANSWER WOULD PLEASE YOU MOST)\n"
+    "        (WHAT DO YOU THINK)\n"
+    "        (WHAT COMES TO YOUR MIND WHEN YOU ASK THAT)\n"
+    "        (HAVE YOU ASKED SUCH QUESTIONS BEFORE)\n"
+    "        (HAVE YOU ASKED ANYONE ELSE)))\n"
+    "\n"
+    "(BECAUSE\n"
+    "    ((0)\n"
+    "        (IS THAT THE REAL REASON)\n"
+    "        (DON'T ANY OTHER REASONS COME TO MIND)\n"
+    "        (DOES THAT REASON SEEM TO EXPLAIN ANYTHING ELSE)\n"
+    "        (WHAT OTHER REASONS MIGHT THERE BE)))\n"
+    "\n"
+    "(WHY\n"
+    "    ((0 WHY DON'T I 0)\n"
+    "        (DO YOU BELIEVE I DON'T 5)\n"
+    "        (PERHAPS I WILL 5 IN GOOD TIME)\n"
+    "        (SHOULD YOU 5 YOURSELF)\n"
+    "        (YOU WANT ME TO 5))\n"
+    "    ((0 WHY CAN'T YOU 0)\n"
+    "        (DO YOU THINK YOU SHOULD BE ABLE TO 5)\n"
+    "        (DO YOU WANT TO BE ABLE TO 5)\n"
+    "        (DO YOU BELIEVE THIS WILL HELP YOU TO 5)\n"
+    "        (HAVE YOU ANY IDEA WHY YOU CAN'T 5))\n"
+    "    (= WHAT))\n"
+    "\n"
+    "(EVERYONE 2\n"
+    "    ((0)\n"
+    //[1] JW may have added these responses at a later date, and/or the ordering
+    //    of the possible responses in the script may have changed.
+    //"        (REALLY, EVERYONE)\n"
+    //"        (CAN YOU THINK OF ANYONE IN PARTICULAR)\n"
+    //"        (WHO, FOR EXAMPLE)\n"
+    //"        (YOU ARE THINKING OF A VERY SPECIAL PERSON)\n"
+    "        (WHO, MAY I ASK)\n"
+    "        (SOMEONE SPECIAL PERHAPS)\n"
+    "        (YOU HAVE A PARTICULAR PERSON IN MIND, DON'T YOU)\n"
+    "        (WHO DO YOU THINK YOU'RE TALKING ABOUT)))\n"
+    "\n"
+    "(EVERYBODY 2\n"
+    "    (= EVERYONE))\n"
+    "\n"
+    "(NOBODY 2\n"
+    "    (=EVERYONE))\n"
+    "\n"
+    "(NOONE 2\n"
+    "    (=EVERYONE))\n"
+    "\n"
+    "(ALWAYS 1\n"
+    "    ((0)\n"
+    "        (CAN YOU THINK OF A SPECIFIC EXAMPLE)\n"
+    "        (WHEN)\n"
+    "        (WHAT INCIDENT ARE YOU THINKING OF)\n"
+    "        (REALLY, ALWAYS)))\n"
+    "\n"
+    "()\n";
 
-    const exchange conversation[] = {
+const exchange march_1965_conversation[] = {
 
-        // --- exact conversation from Weizenbaum's MIT archive dated 5 March 1965 ---
+    // --- exact conversation from Weizenbaum's MIT archive dated 5 March 1965 ---
 
-        { "Doctor, I am terribly depressed.",
-          "IS IT BECAUSE YOU ARE TERRIBLY DEPRESSED THAT YOU CAME TO ME" },
+    { "Doctor, I am terribly depressed.",
+      "IS IT BECAUSE YOU ARE TERRIBLY DEPRESSED THAT YOU CAME TO ME" },
 
-        { "Actually, my wife suggested I come here.",
-          "TELL ME MORE ABOUT YOUR FAMILY" },
+    { "Actually, my wife suggested I come here.",
+      "TELL ME MORE ABOUT YOUR FAMILY" },
 
-        { "I have no children.",
-          "YOU SAY YOU HAVE NO CHILDREN" },
+    { "I have no children.",
+      "YOU SAY YOU HAVE NO CHILDREN" },
 
-        { "I can't resign myself to fatherhood.",
-          "HOW DO YOU KNOW YOU CAN'T RESIGN YOURSELF TO FATHERHOOD" },
+    { "I can't resign myself to fatherhood.",
+      "HOW DO YOU KNOW YOU CAN'T RESIGN YOURSELF TO FATHERHOOD" },
 
-        { "Well, my wife wants kids but I don't. That's all I can say about it.",
-          "WHO ELSE IN YOUR FAMILY WANTS KIDS" },
+    { "Well, my wife wants kids but I don't. That's all I can say about it.",
+      "WHO ELSE IN YOUR FAMILY WANTS KIDS" },
 
-        { "Everybody is always hinting and bugging me about it.",               //[1]
-          "WHO, MAY I ASK" },
+    { "Everybody is always hinting and bugging me about it.",               //[1]
+      "WHO, MAY I ASK" },
 
-        { "My father talks about grandchildren all the time.",
-          "YOUR FATHER" },
+    { "My father talks about grandchildren all the time.",
+      "YOUR FATHER" },
 
-        { "He pokes his nose into our affairs much too much.",
-          "I AM NOT SURE I UNDERSTAND YOU FULLY" },
+    { "He pokes his nose into our affairs much too much.",
+      "I AM NOT SURE I UNDERSTAND YOU FULLY" },
 
-        { "He's always trying to run the house.",
-          "CAN YOU THINK OF A SPECIFIC EXAMPLE" },
+    { "He's always trying to run the house.",
+      "CAN YOU THINK OF A SPECIFIC EXAMPLE" },
 
-        { "Apart from the children thing, my father wants me to change jobs.",
-          "WHAT ELSE COMES TO MIND WHEN YOU THINK OF YOUR FATHER" },
+    { "Apart from the children thing, my father wants me to change jobs.",
+      "WHAT ELSE COMES TO MIND WHEN YOU THINK OF YOUR FATHER" },
 
-        { "Nothing.",                                                           //[2]
-          "YOU SAID YOUR WIFE SUGGESTED YOU COME HERE" },
+    { "Nothing.",                                                           //[2]
+      "YOU SAID YOUR WIFE SUGGESTED YOU COME HERE" },
 
-        { "Yes.",
-          "YOU SEEM QUITE POSITIVE" },
+    { "Yes.",
+      "YOU SEEM QUITE POSITIVE" },
 
-        { "She said that I should either get help or she would leave me.",
-          "CAN YOU ELABORATE ON THAT" },
+    { "She said that I should either get help or she would leave me.",
+      "CAN YOU ELABORATE ON THAT" },
 
-        { "My wife can't stand dad any longer.",
-          "TELL ME MORE ABOUT YOUR FAMILY" },
+    { "My wife can't stand dad any longer.",
+      "TELL ME MORE ABOUT YOUR FAMILY" },
 
-        { "Mother is dead.",
-          "EARLIER YOU SAID YOUR WIFE WANTS KIDS" },
+    { "Mother is dead.",
+      "EARLIER YOU SAID YOUR WIFE WANTS KIDS" },
 
-        { "That's right. Can you understand how that bugs me.",
-          "YOU BELIEVE I CAN UNDERSTAND HOW THAT BUGS YOU DON'T YOU" },
+    { "That's right. Can you understand how that bugs me.",
+      "YOU BELIEVE I CAN UNDERSTAND HOW THAT BUGS YOU DON'T YOU" },
 
-        { "I can't take it much longer.",
-          "HAVE YOU TRIED" },
+    { "I can't take it much longer.",
+      "HAVE YOU TRIED" },
 
-        { "I'm always patient.",
-          "WHEN" },
+    { "I'm always patient.",
+      "WHEN" },
 
-        { "When she yells at me.",                                              //[3]
-          "LETS DISCUSS FURTHER WHY YOUR FATHER TALKS ABOUT GRANDCHILDREN ALL THE TIME" },
+    { "When she yells at me.",                                              //[3]
+      "LETS DISCUSS FURTHER WHY YOUR FATHER TALKS ABOUT GRANDCHILDREN ALL THE TIME" },
 
-        { "He's getting old. I guess he wants to be immortal.",
-          "DO YOU SAY YOU GUESS HE WANTS TO BE IMMORTAL FOR SOME SPECIAL REASON" },
+    { "He's getting old. I guess he wants to be immortal.",
+      "DO YOU SAY YOU GUESS HE WANTS TO BE IMMORTAL FOR SOME SPECIAL REASON" },
 
-        { "He also talks about dying a lot.  Because he is sick, you know.",
-          "IS THAT THE REAL REASON" },
+    { "He also talks about dying a lot.  Because he is sick, you know.",
+      "IS THAT THE REAL REASON" },
 
-        { "Maybe.",                                                             //[4]
-          "AND MAYBE NOT" },
+    { "Maybe.",                                                             //[4]
+      "AND MAYBE NOT" },
 
-        { "I think he needs help more than I do.",
-          "THAT'S QUITE INTERESTING" },
+    { "I think he needs help more than I do.",
+      "THAT'S QUITE INTERESTING" },
 
-        { "I can't help him. I've tried all my life.",
-          "PERHAPS YOU COULD HELP HIM NOW" },
+    { "I can't help him. I've tried all my life.",
+      "PERHAPS YOU COULD HELP HIM NOW" },
 
-        { "What do you mean.",
-          "WHY DO YOU ASK" },
+    { "What do you mean.",
+      "WHY DO YOU ASK" },
 
-        { "I don't understand you.",
-          "DON'T YOU REALLY UNDERSTAND I" }, // JW preceded this with a P in the margin
+    { "I don't understand you.",
+      "DON'T YOU REALLY UNDERSTAND I" }, // JW preceded this with a P in the margin
 
-        { "No.",
-          "ARE YOU SAYING 'NO' JUST TO BE NEGATIVE" },
+    { "No.",
+      "ARE YOU SAYING 'NO' JUST TO BE NEGATIVE" },
 
-        { "Are you suggesting its all my fault.",
-          "WHY ARE YOU INTERESTED IN WHETHER I AM SUGGESTING ITS ALL YOUR FAULT OR NOT" },
+    { "Are you suggesting its all my fault.",
+      "WHY ARE YOU INTERESTED IN WHETHER I AM SUGGESTING ITS ALL YOUR FAULT OR NOT" },
 
-        { "You are the expert, after all. I have to listen to you.",
-          "WHAT MAKES YOU THINK I AM THE EXPERT" },
+    { "You are the expert, after all. I have to listen to you.",
+      "WHAT MAKES YOU THINK I AM THE EXPERT" },
 
-        { "Or are you a computer.",
-          "WOULD YOU PREFER IF I WEREN'T A COMPUTER" },
+    { "Or are you a computer.",
+      "WOULD YOU PREFER IF I WEREN'T A COMPUTER" },
 
-        { "I don't trust computers. Anyway, no computer could talk as you do.",
-          "WHY DON'T YOU TRUST COMPUTERS" },
+    { "I don't trust computers. Anyway, no computer could talk as you do.",
+      "WHY DON'T YOU TRUST COMPUTERS" },
 
-        { "Because they're hardly human, that's why.",
-          "DON'T ANY OTHER REASONS COME TO MIND" },
+    { "Because they're hardly human, that's why.",
+      "DON'T ANY OTHER REASONS COME TO MIND" },
+
+    // --- end of 5 March 1965 conversation from Weizenbaum's MIT archive ---
+};
 
-        // --- end of 5 March 1965 conversation from Weizenbaum's MIT archive ---
-    };
 
+DEF_TEST_FUNC(test_5_march_1965_convo)
+{
     elizascript::script s;
-    elizascript::read(script, s);
+    elizascript::read(march_1965_script, s);
     elizalogic::eliza eliza(s.rules, s.mem_rule);
 
-    for (const auto & exchg : conversation)
+    for (const auto & exchg : march_1965_conversation)
         TEST_EQUAL(eliza.response(exchg.prompt), exchg.response);
 }
 
@@ -6574,48 +12723,318 @@ DEF_TEST_FUNC(test_11_june_1964_prof_student_convo)
 }
 
 
-}//namespace elizatest
+
+/*  Standard workloads, to characterise a build on a host: each of the
+    recorded conversations above replayed again and again from the start
+    of a new session, the busy beaver Turing machine, and inputs of random
+    words from the DOCTOR script and the CACM conversation. Each workload
+    is one thread timing each response. */
+struct workload_result {
+    std::string name;
+    std::string script;                 // the script the workload uses
+    size_t exchanges{ 0 };              // responses timed
+    double seconds{ 0 };                // time spent in those responses
+    double p50_us{ 0 };                 // response latency percentiles, microseconds
+    double p99_us{ 0 };
+    double p999_us{ 0 };
+
+    double exchanges_per_second() const { return seconds > 0 ? exchanges / seconds : 0; }
+};
+
+
+// random_inputs inputs of 2 to 12 words taken at random from the DOCTOR
+// script's keywords and the words of the CACM conversation, some with a
+// comma or full stop, the same inputs every time
+stringlist doctor_random_inputs(size_t random_inputs)
+{
+    elizascript::script s;
+    elizascript::read(elizascript::CACM_1966_01_DOCTOR_script, s);
+    std::vector<std::string> vocabulary;
+    for (const auto & rule : s.rules)
+        if (rule.first != elizalogic::special_rule_none)
+            vocabulary.push_back(rule.first);
+    for (const auto & exchg : cacm_1966_conversation) {
+        std::istringstream words(exchg.prompt);
+        for (std::string word; words >> word; )
+            vocabulary.push_back(word);
+    }
+
+    std::mt19937 random(1966);
+    auto pick = [&random](size_t n) {
+        return std::uniform_int_distribution<size_t>(0, n - 1)(random);
+    };
+    stringlist inputs;
+    for (size_t i = 0; i < random_inputs; ++i) {
+        std::string input;
+        for (size_t n = 2 + pick(11); n; --n) {
+            if (!input.empty())
+                input += pick(8) == 0 ? ", " : " ";
+            input += vocabulary[pick(vocabulary.size())];
+        }
+        if (pick(2) == 0)
+            input += '.';
+        inputs.push_back(input);
+    }
+    return inputs;
+}
+
+
+// run each standard workload for at least seconds_each seconds (and at
+// least once through)
+std::vector<workload_result> run_workloads(double seconds_each = 1.0)
+{
+    struct workload {
+        const char * name;
+        const char * script_name;
+        const char * script_text;
+        stringlist inputs;
+    };
+    auto prompts = [](const auto & conversation) {
+        stringlist inputs;
+        for (const auto & exchg : conversation)
+            inputs.push_back(exchg.prompt);
+        return inputs;
+    };
+    const char * doctor = elizascript::CACM_1966_01_DOCTOR_script;
+    const workload workloads[] = {
+        { "cacm_1966",          "DOCTOR 1966",      doctor,                 prompts(cacm_1966_conversation) },
+        { "boston_globe_1966",  "DOCTOR 1966",      doctor,                 prompts(boston_globe_1966_conversation) },
+        { "march_1965",         "MIT archive 1965", march_1965_script,      prompts(march_1965_conversation) },
+        { "busy_beaver",        "busy beaver",      busy_beaver_script,     { "START" } },
+        { "doctor_random",      "DOCTOR 1966",      doctor,                 doctor_random_inputs(1000) },
+    };
+
+    std::vector<workload_result> results;
+    std::vector<double> latency_us;
+    for (const workload & w : workloads) {
+        elizascript::script s;
+        elizascript::read(w.script_text, s);
+        const auto context = std::make_shared<const elizalogic::script_context>(s.rules, s.mem_rule);
+        latency_us.clear();
+        const auto start = std::chrono::steady_clock::now();
+        do {
+            elizalogic::eliza eliza(context);
+            for (const auto & input : w.inputs) {
+                const auto before = std::chrono::steady_clock::now();
+                eliza.response(input);
+                latency_us.push_back(std::chrono::duration<double, std::micro>(
+                    std::chrono::steady_clock::now() - before).count());
+            }
+        } while (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() < seconds_each);
+
+        workload_result r;
+        r.name = w.name;
+        r.script = w.script_name;
+        r.exchanges = latency_us.size();
+        for (const double us : latency_us)
+            r.seconds += us / 1e6;
+        std::sort(latency_us.begin(), latency_us.end());
+        auto percentile = [&](double p) {
+            return latency_us[std::min(latency_us.size() - 1, static_cast<size_t>(p * latency_us.size()))];
+        };
+        r.p50_us = percentile(0.5);
+        r.p99_us = percentile(0.99);
+        r.p999_us = percentile(0.999);
+        results.push_back(r);
+    }
+    return results;
+}
+
+
+DEF_TEST_FUNC(test_workloads)
+{
+    const stringlist inputs(doctor_random_inputs(50));
+    TEST_EQUAL(inputs.size(), (size_t)50);
+    TEST_EQUAL(inputs == doctor_random_inputs(50), true);
+
+    const auto results = run_workloads(0);
+    TEST_EQUAL(results.size(), (size_t)5);
+    TEST_EQUAL(results[0].name, "cacm_1966");
+    TEST_EQUAL(results[0].exchanges, std::size(cacm_1966_conversation));
+    TEST_EQUAL(results[3].exchanges, (size_t)1);
+    for (const auto & r : results) {
+        TEST_EQUAL(r.p50_us <= r.p99_us && r.p99_us <= r.p999_us, true);
+        TEST_EQUAL(r.seconds > 0, true);
+    }
+}
 
 
 
-void sleep_ms(long ms)
+// a conversation recorded with a script that reproduces it exactly
+struct recorded_conversation {
+    const char * name;
+    const char * script_text;
+    const exchange * exchanges;
+    size_t size;
+};
+
+// the recorded conversations above that this implementation reproduces;
+// (we don't have the scripts for the 02-000311052.pdf and 11 June 1964
+// conversations, and doc/ELIZA_transcription.txt is the source code)
+std::vector<recorded_conversation> recorded_corpus()
 {
-    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+    return {
+        { "cacm_1966",          elizascript::CACM_1966_01_DOCTOR_script,
+          cacm_1966_conversation,           std::size(cacm_1966_conversation) },
+        { "boston_globe_1966",  elizascript::CACM_1966_01_DOCTOR_script,
+          boston_globe_1966_conversation,   std::size(boston_globe_1966_conversation) },
+        { "march_1965",         march_1965_script,
+          march_1965_conversation,          std::size(march_1965_conversation) },
+    };
+}
+
+
+struct replay_benchmark_result {
+    struct conversation_result {
+        std::string name;
+        size_t sessions{ 0 };           // times the conversation was replayed
+        size_t exchanges{ 0 };
+        size_t mismatches{ 0 };         // replies that differ from those recorded
+        double p50_us{ 0 };             // response latency percentiles, microseconds
+        double p99_us{ 0 };
+        double p999_us{ 0 };
+    };
+    std::vector<conversation_result> conversations;
+    unsigned threads{ 0 };
+    size_t exchanges{ 0 };
+    size_t mismatches{ 0 };
+    std::vector<std::string> errors;    // a description of each mismatch (up to max_errors)
+    double seconds{ 0 };                // wall-clock time taken
+    double p50_us{ 0 };                 // over all the conversations
+    double p99_us{ 0 };
+    double p999_us{ 0 };
+
+    double exchanges_per_second() const { return seconds > 0 ? exchanges / seconds : 0; }
 };
 
 
-// write given s to std::cout, followed by newline
-void writeln(const std::string & s)
+/*  Replay each conversation in the corpus repeats times, each time in a
+    new session, threads sessions at a time, timing each response and
+    checking each reply against the reply recorded. The sessions are
+    interleaved, so every thread replays every conversation. */
+replay_benchmark_result replay_benchmark(
+    const std::vector<recorded_conversation> & corpus,
+    size_t repeats,
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency()),
+    size_t max_errors = 100)
 {
-    /* For fun, output given s at 14 characters per second,
-       the speed of an IBM 2741 teletypewriter from 1965.
-       In an interview with Pamela McCorduck, recorded
-       on 6 March 1975, Weizenbaum talks of the terminal
-       he had in his home:
+    if (corpus.empty() || repeats == 0)
+        throw std::runtime_error("replay_benchmark: nothing to do");
+    threads = std::max(1u, threads);
+    std::vector<std::shared_ptr<const elizalogic::script_context>> contexts;
+    for (const auto & c : corpus) {
+        elizascript::script s;
+        elizascript::read(c.script_text, s);
+        contexts.push_back(std::make_shared<const elizalogic::script_context>(s.rules, s.mem_rule));
+    }
 
-       "Then I came to MIT in '63 and the next spectacular
-       thing was of course ELIZA. And the history of that
-       is interesting too. Soon after I came here, very soon -
-       like within a couple of months I think - I was given
-       a console, a computer console, at home. I lived in
-       Concord - still do. It was at the time a 2741 tied
-       to a 7094 CTSS system here."
+    replay_benchmark_result result;
+    result.threads = threads;
+    result.conversations.resize(corpus.size());
+    std::vector<std::vector<double>> latency_us(corpus.size());
+    std::mutex mutex;
+    std::atomic<size_t> next{ 0 };
+    const size_t sessions = corpus.size() * repeats;
+    const auto start = std::chrono::steady_clock::now();
+
+    auto work = [&]() {
+        std::vector<std::vector<double>> us(corpus.size());
+        std::vector<size_t> mismatches(corpus.size()), replayed(corpus.size());
+        for (size_t i; (i = next++) < sessions; ) {
+            const size_t c = i % corpus.size();
+            const recorded_conversation & rec = corpus[c];
+            elizalogic::eliza eliza(contexts[c]);
+            ++replayed[c];
+            for (size_t x = 0; x < rec.size; ++x) {
+                const auto before = std::chrono::steady_clock::now();
+                const std::string reply(eliza.response(rec.exchanges[x].prompt));
+                us[c].push_back(std::chrono::duration<double, std::micro>(
+                    std::chrono::steady_clock::now() - before).count());
+                if (reply != rec.exchanges[x].response) {
+                    ++mismatches[c];
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (result.errors.size() < max_errors)
+                        result.errors.push_back(std::string(rec.name) + " exchange "
+                            + std::to_string(x + 1) + ": expected '" + rec.exchanges[x].response
+                            + "', but got '" + reply + "'");
+                }
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t c = 0; c < corpus.size(); ++c) {
+            result.conversations[c].sessions += replayed[c];
+            result.conversations[c].mismatches += mismatches[c];
+            latency_us[c].insert(latency_us[c].end(), us[c].begin(), us[c].end());
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < threads; ++t)
+        workers.emplace_back(work);
+    work();
+    for (auto & w : workers)
+        w.join();
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-       See the Carnegie Mellon University archives file
-       mccorduck_weizenbaum_1975_03_06_001_a_access.mp3
-       at 17:30. */
+    auto percentile = [](const std::vector<double> & sorted, double p) {
+        return sorted.empty() ? 0 : sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+    };
+    std::vector<double> all_us;
+    for (size_t c = 0; c < corpus.size(); ++c) {
+        auto & r = result.conversations[c];
+        auto & us = latency_us[c];
+        std::sort(us.begin(), us.end());
+        r.name = corpus[c].name;
+        r.exchanges = us.size();
+        r.p50_us = percentile(us, 0.5);
+        r.p99_us = percentile(us, 0.99);
+        r.p999_us = percentile(us, 0.999);
+        result.exchanges += r.exchanges;
+        result.mismatches += r.mismatches;
+        all_us.insert(all_us.end(), us.begin(), us.end());
+    }
+    std::sort(all_us.begin(), all_us.end());
+    result.p50_us = percentile(all_us, 0.5);
+    result.p99_us = percentile(all_us, 0.99);
+    result.p999_us = percentile(all_us, 0.999);
+    return result;
+}
 
-    const long cps = 14; // the IBM 2741 printed at ~14.1 cps
 
-    for (const auto c : s) {
-        std::cout << c << std::flush;
-        sleep_ms(1000/cps);
+DEF_TEST_FUNC(test_replay_benchmark)
+{
+    auto corpus = recorded_corpus();
+    auto result = replay_benchmark(corpus, 3, 2);
+    TEST_EQUAL(result.mismatches, (size_t)0);
+    TEST_EQUAL(result.errors.empty(), true);
+    TEST_EQUAL(result.conversations.size(), corpus.size());
+    size_t exchanges = 0;
+    for (size_t c = 0; c < corpus.size(); ++c) {
+        TEST_EQUAL(result.conversations[c].sessions, (size_t)3);
+        TEST_EQUAL(result.conversations[c].exchanges, 3 * corpus[c].size);
+        exchanges += 3 * corpus[c].size;
     }
+    TEST_EQUAL(result.exchanges, exchanges);
+    TEST_EQUAL(result.p50_us <= result.p99_us && result.p99_us <= result.p999_us, true);
 
-    std::cout << std::endl;
+    // a wrong reply is caught every time it's replayed
+    const exchange wrong[] = {
+        { "Men are all alike.", "IN WHAT WAY" },
+        { "They're always bugging us about something or other.", "IN WHAT WAY" },
+    };
+    corpus.push_back({ "wrong", elizascript::CACM_1966_01_DOCTOR_script, wrong, std::size(wrong) });
+    result = replay_benchmark(corpus, 4, 3);
+    TEST_EQUAL(result.mismatches, (size_t)4);
+    TEST_EQUAL(result.conversations.back().mismatches, (size_t)4);
+    TEST_EQUAL(result.errors.size(), (size_t)4);
+    TEST_EQUAL(result.errors[0], "wrong exchange 2: expected 'IN WHAT WAY', but got 'CAN YOU THINK OF A SPECIFIC EXAMPLE'");
 }
 
 
+}//namespace elizatest
+
+
+
 #if defined(_WIN32)
 const std::string option_escape("/");
 #else
@@ -6644,45 +13063,164 @@ std::string pad(std::string s)
 }
 
 
-bool parse_cmdline(
-    int argc, const char * argv[],
-    bool & showscript,
-    bool & nobanner,
-    bool & quick,
-    bool & help,
-    bool & port,
-    std::string & port_name,
-    std::string & script_filename)
+struct cmdline_options {
+    bool showscript{ false };
+    bool nobanner{ false };
+    bool quick{ true };
+    bool help{ false };
+    bool port{ false };
+    std::string port_name;
+    std::string script_filename;
+    std::string journal_filename;   // append console exchanges to this journal
+    std::string replay_filename;    // replay this journal and report
+    std::string explore_filename;   // explore replies to the inputs in this file
+    unsigned explore_depth{ 2 };
+    bool bench{ false };            // run the benchmarks and report
+    bool json{ false };             // (with bench) run the standard workloads and report in JSON
+    unsigned corpus_repeats{ 0 };   // (with bench) replay the recorded conversations this many times
+    std::string batch_in_filename;  // answer the corpus in this file...
+    std::string batch_out_filename; // ...writing the replies to this file
+    bool pipe{ false };             // be a filter: a reply record for each input record
+    char pipe_delimiter{ '\n' };    // (with pipe) the character that ends a record
+    size_t flush_every{ 0 };        // (with pipe) flush after this many replies (0: when all read are answered)
+    stringlist serve_addresses;     // serve the line protocol on these
+    std::string serve_backend;      // "epoll" or "io_uring" (default: whichever is best)
+    int serve_cores{ -1 };          // serve with a shard per core (0: every core)
+    int serve_workers{ -1 };        // serve (or answer a batch) with a pool of worker threads (0: one per core)
+    unsigned target_delay_ms{ 5 };  // (with serve_workers) the queue delay target, milliseconds
+    bool shed{ false };             // (with serve_workers) shed inputs when overloaded
+    std::string shm_path;           // serve through shared memory; clients come here
+    std::string telnet_address;     // serve telnet clients, as teletypes, here
+    unsigned baud{ 0 };             // (with telnet_address) print at this speed (0: full speed)
+};
+
+
+bool parse_cmdline(int argc, const char * argv[], cmdline_options & opt)
 {
-    showscript = nobanner = help = port = false;
-    quick = true;
-    script_filename.clear();
+    opt = cmdline_options();
+    // set given s to the argument following option i; false if there isn't one
+    auto argument = [&](int & i, std::string & s) {
+        if (++i == argc)
+            return false;
+        s = argv[i];
+        return true;
+    };
     for (int i = 1; i < argc; ++i) {
         if (is_option(argv[i])) {
             if (as_option("help") == argv[i])
-                help = true;
+                opt.help = true;
             else if (as_option("showscript") == argv[i])
-                showscript = true;
+                opt.showscript = true;
             else if (as_option("nobanner") == argv[i])
-                nobanner = true;
+                opt.nobanner = true;
             else if (as_option("quick") == argv[i])
-                quick = true;
+                opt.quick = true;
             else if (as_option("slow") == argv[i])
-                quick = false;
+                opt.quick = false;
+            else if (as_option("journal") == argv[i]) {
+                if (!argument(i, opt.journal_filename))
+                    return false;
+            }
+            else if (as_option("replay") == argv[i]) {
+                if (!argument(i, opt.replay_filename))
+                    return false;
+            }
+            else if (as_option("bench") == argv[i])
+                opt.bench = true;
+            else if (as_option("json") == argv[i])
+                opt.json = opt.nobanner = true;
+            else if (as_option("corpus") == argv[i]) {
+                std::string n;
+                if (!argument(i, n) || n.empty() || n.size() > 7 || !std::all_of(n.begin(), n.end(), ::isdigit) || std::stoul(n) == 0)
+                    return false;
+                opt.corpus_repeats = static_cast<unsigned>(std::stoul(n));
+            }
+            else if (as_option("batch") == argv[i]) {
+                if (!argument(i, opt.batch_in_filename) || !argument(i, opt.batch_out_filename))
+                    return false;
+            }
+            else if (as_option("pipe") == argv[i])
+                opt.pipe = opt.nobanner = true;
+            else if (as_option("nul") == argv[i])
+                opt.pipe_delimiter = '\0';
+            else if (as_option("flush") == argv[i]) {
+                std::string n;
+                if (!argument(i, n) || n.empty() || n.size() > 9 || !std::all_of(n.begin(), n.end(), ::isdigit))
+                    return false;
+                opt.flush_every = std::stoul(n);
+            }
+            else if (as_option("workers") == argv[i]) {
+                std::string workers;
+                if (!argument(i, workers) || workers.empty() || workers.size() > 4 || !std::all_of(workers.begin(), workers.end(), ::isdigit))
+                    return false;
+                opt.serve_workers = std::stoi(workers);
+            }
+            else if (as_option("explore") == argv[i]) {
+                if (!argument(i, opt.explore_filename))
+                    return false;
+            }
+            else if (as_option("depth") == argv[i]) {
+                std::string depth;
+                if (!argument(i, depth) || depth.empty() || depth.size() > 9 || !std::all_of(depth.begin(), depth.end(), ::isdigit))
+                    return false;
+                opt.explore_depth = static_cast<unsigned>(std::stoul(depth));
+            }
 #ifdef SUPPORT_SERIAL_IO
             else if (as_option("port") == argv[i]) {
-                ++i;
-                if (i == argc)
+                if (!argument(i, opt.port_name))
+                    return false;
+                opt.port = true;
+            }
+#endif
+#ifdef SUPPORT_LINE_SERVER
+            else if (as_option("serve") == argv[i]) {
+                std::string address;
+                if (!argument(i, address))
+                    return false;
+                opt.serve_addresses.push_back(address);
+            }
+            else if (as_option("cores") == argv[i]) {
+                std::string cores;
+                if (!argument(i, cores) || cores.empty() || cores.size() > 4 || !std::all_of(cores.begin(), cores.end(), ::isdigit))
+                    return false;
+                opt.serve_cores = std::stoi(cores);
+            }
+            else if (as_option("delay") == argv[i]) {
+                std::string ms;
+                if (!argument(i, ms) || ms.empty() || ms.size() > 6 || !std::all_of(ms.begin(), ms.end(), ::isdigit))
+                    return false;
+                opt.target_delay_ms = static_cast<unsigned>(std::stoul(ms));
+            }
+            else if (as_option("shed") == argv[i])
+                opt.shed = true;
+            else if (as_option("backend") == argv[i]) {
+                if (!argument(i, opt.serve_backend) || (opt.serve_backend != "epoll" && opt.serve_backend != "io_uring"))
+                    return false;
+            }
+#endif
+#ifdef SUPPORT_TELNET_SERVER
+            else if (as_option("telnet") == argv[i]) {
+                if (!argument(i, opt.telnet_address))
+                    return false;
+            }
+            else if (as_option("baud") == argv[i]) {
+                std::string baud;
+                if (!argument(i, baud) || baud.empty() || baud.size() > 6 || !std::all_of(baud.begin(), baud.end(), ::isdigit))
+                    return false;
+                opt.baud = static_cast<unsigned>(std::stoul(baud));
+            }
+#endif
+#ifdef SUPPORT_SHM_SERVER
+            else if (as_option("shm") == argv[i]) {
+                if (!argument(i, opt.shm_path))
                     return false;
-                port = true;
-                port_name = argv[i];
             }
 #endif
             else
                 return false;
         }
-        else if (script_filename.empty())
-            script_filename = argv[i];
+        else if (opt.script_filename.empty())
+            opt.script_filename = argv[i];
         else
             return false;
     }
@@ -6698,8 +13236,8 @@ bool parse_cmdline(
 int main(int argc, const char * argv[])
 {
     try {
-        bool showscript, nobanner, quick, help, port, traceauto = false;
-        std::string port_name, script_filename;
+        cmdline_options opt;
+        bool traceauto = false;
         const std::string command_help{
            "  <blank line>    quit\n"
            "  *               print trace of most recent exchange\n"
@@ -6715,11 +13253,30 @@ int main(int argc, const char * argv[])
            "                  (for watching the operation of Turing machines)\n"
         };
 
-        if (!parse_cmdline(argc, argv, showscript, nobanner, quick, help, port, port_name, script_filename) || help) {
-            (help ? std::cout : std::cerr)
+        if (!parse_cmdline(argc, argv, opt) || opt.help) {
+            (opt.help ? std::cout : std::cerr)
                 << "Usage: ELIZA [options] [<filename>]\n"
                 << "\n"
+                << "  " << pad(as_option("batch IN OUT")) << "answer every input in IN, lines of \"<conversation id> TAB\n"
+                << "  " << pad("")                      << "<input>\" or JSON Lines {\"id\": ..., \"input\": ...}, writing\n"
+                << "  " << pad("")                      << "the replies to OUT in the same order and format; with\n"
+                << "  " << pad("")                      << as_option("workers N") << ", on N threads (default: one per core)\n"
+                << "  " << pad(as_option("bench"))      << "measure throughput with 1, 2, 4... threads and report\n"
+                << "  " << pad(as_option("corpus N"))   << "with " << as_option("bench") << ", replay each recorded conversation N\n"
+                << "  " << pad("")                      << "times instead, checking every reply; with " << as_option("workers T") << ",\n"
+                << "  " << pad("")                      << "on T threads (default: one per core)\n"
+                << "  " << pad(as_option("depth N"))    << "explore N exchanges deep (default 2)\n"
+                << "  " << pad(as_option("explore FILE")) << "try every input in FILE (one per line) at every step of\n"
+                << "  " << pad("")                      << "the conversation and report the replies and script coverage\n"
+                << "  " << pad(as_option("journal FILE")) << "append each exchange to journal FILE\n"
+                << "  " << pad(as_option("json"))       << "with " << as_option("bench") << ", run the standard workloads instead and\n"
+                << "  " << pad("")                      << "print their throughput and latency as JSON\n"
+                << "  " << pad(as_option("flush N"))    << "with " << as_option("pipe") << ", also flush after every N replies\n"
                 << "  " << pad(as_option("nobanner"))   << "don't display startup banner\n"
+                << "  " << pad(as_option("nul"))        << "with " << as_option("pipe") << ", records end with NUL, not newline\n"
+                << "  " << pad(as_option("pipe"))       << "be a filter: answer each line of standard input with a line\n"
+                << "  " << pad("")                      << "of standard output, and nothing else; flush when all the\n"
+                << "  " << pad("")                      << "input read has been answered\n"
 #ifdef SUPPORT_SERIAL_IO
 #if defined(_WIN32)
                 << "  " << pad(as_option("port COMn"))  << "use serial port COMn (e.g. COM2)\n"
@@ -6728,6 +13285,29 @@ int main(int argc, const char * argv[])
 #endif
 #endif
                 << "  " << pad(as_option("quick"))      << "print at full speed (default)\n"
+                << "  " << pad(as_option("replay FILE")) << "replay journal FILE and report any replies that differ\n"
+#ifdef SUPPORT_LINE_SERVER
+                << "  " << pad(as_option("serve ADDR")) << "serve conversations on ADDR: [HOST:]PORT or unix:PATH\n"
+                << "  " << pad("")                      << "(each line \"<session id> TAB <input>\" gets a reply line)\n"
+                << "  " << pad(as_option("backend NAME")) << "serve with NAME: epoll or io_uring (default: io_uring if available)\n"
+                << "  " << pad(as_option("cores N"))    << "serve with a thread per core on N cores, sharing nothing (0: all)\n"
+                << "  " << pad(as_option("workers N"))  << "serve with N worker threads (0: one per core) behind admission\n"
+                << "  " << pad("")                      << "control; an input refused when too many are waiting is\n"
+                << "  " << pad("")                      << "answered " << elizalogic::busy_reply << "\n"
+                << "  " << pad(as_option("delay MS"))   << "with " << as_option("workers") << ", the queue delay target: the server\n"
+                << "  " << pad("")                      << "is overloaded once delays exceed it for 100ms (default 5)\n"
+                << "  " << pad(as_option("shed"))       << "with " << as_option("workers") << ", answer inputs while overloaded with\n"
+                << "  " << pad("")                      << "a nomatch message, rather than late\n"
+#endif
+#ifdef SUPPORT_TELNET_SERVER
+                << "  " << pad(as_option("telnet ADDR")) << "serve telnet clients on ADDR, [HOST:]PORT, each as a teletype\n"
+                << "  " << pad("")                      << "with a conversation of its own\n"
+                << "  " << pad(as_option("baud N"))     << "with " << as_option("telnet") << ", print at N baud (110 for an ASR 33)\n"
+#endif
+#ifdef SUPPORT_SHM_SERVER
+                << "  " << pad(as_option("shm PATH"))   << "serve clients on this host through shared memory; they\n"
+                << "  " << pad("")                      << "come to the UNIX socket PATH for their channels\n"
+#endif
                 << "  " << pad(as_option("showscript")) << "print Weizenbaum's 1966 DOCTOR script\n"
                 << "  " << pad("")                      << "e.g. ELIZA " << as_option("showscript") << " > script.txt\n"
                 << "  " << pad(as_option("slow"))       << "print at IBM 2741 TTY speed (14 characters per second)\n"
@@ -6735,16 +13315,16 @@ int main(int argc, const char * argv[])
                 << "  " << pad("")                      << "e.g. ELIZA script.txt\n"
                 << "\nIn a conversation with ELIZA, these inputs have special meaning:\n"
                 << command_help;
-            return help ? EXIT_SUCCESS : EXIT_FAILURE;
+            return opt.help ? EXIT_SUCCESS : EXIT_FAILURE;
         }
 
-        if (showscript) {
+        if (opt.showscript) {
             // just output Weizenbaum's DOCTOR script
             std::cout << elizascript::CACM_1966_01_DOCTOR_script;
             return EXIT_SUCCESS;
         }
 
-        if (!nobanner) {
+        if (!opt.nobanner) {
             std::cout
                 << "-----------------------------------------------------------------\n"
                 << "      ELIZA -- A Computer Program for the Study of Natural\n"
@@ -6759,26 +13339,532 @@ int main(int argc, const char * argv[])
 
 
         elizascript::script eliza_script;
-        if (script_filename.empty()) {
+        if (opt.script_filename.empty()) {
             // use default 'internal' 1966 CACM published script
-            if (!nobanner)
+            if (!opt.nobanner)
                 std::cout << "No script filename given; using built-in 1966 DOCTOR script.\n";
             elizascript::read(elizascript::CACM_1966_01_DOCTOR_script, eliza_script);
         }
         else {
             // use the named script file
-            std::ifstream script_file(script_filename);
+            std::ifstream script_file(opt.script_filename);
             if (!script_file.is_open()) {
                 std::cerr << argv[0] << ": failed to open script file '"
-                          << script_filename << "'\n";
+                          << opt.script_filename << "'\n";
                 return EXIT_FAILURE;
             }
-            if (!nobanner)
-                std::cout << "Using script file '" << script_filename << "'\n\n\n";
+            if (!opt.nobanner)
+                std::cout << "Using script file '" << opt.script_filename << "'\n\n\n";
             elizascript::read<std::ifstream>(script_file, eliza_script);
         }
 
-        if (!nobanner)
+        if (opt.pipe) {
+            elizalogic::eliza eliza(eliza_script.rules, eliza_script.mem_rule);
+            elizalogic::pipe_filter::options pipe_opt;
+            pipe_opt.delimiter = opt.pipe_delimiter;
+            pipe_opt.flush_every = opt.flush_every;
+            elizalogic::pipe_filter filter(eliza,
+                elizalogic::pipe_filter::read_stdin, elizalogic::pipe_filter::write_stdout, pipe_opt);
+            return filter.run() ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+
+#ifdef SUPPORT_TELNET_SERVER
+        if (!opt.telnet_address.empty()) {
+            const auto context = std::make_shared<const elizalogic::script_context>(
+                eliza_script.rules, eliza_script.mem_rule);
+            // (an ASR 33 sends 11 bits a character: a start bit, 7 data
+            // bits, a parity bit and 2 stop bits)
+            static telnet_server server(opt.baud == 0 ? 0 : std::max(1u, opt.baud / 11));
+            if (!server.listen(opt.telnet_address)) {
+                std::cerr << argv[0] << ": " << server.last_error_text() << '\n';
+                return EXIT_FAILURE;
+            }
+            std::cout << "Serving teletypes on " << opt.telnet_address << '\n';
+            std::signal(SIGINT, [](int) { server.stop(); });
+            std::signal(SIGTERM, [](int) { server.stop(); });
+            const std::string greeting(join(eliza_script.hello_message));
+            std::unordered_map<unsigned long long, std::unique_ptr<elizalogic::eliza>> conversations;
+            const bool ok = server.run(
+                [&](unsigned long long client) {
+                    conversations[client] = std::make_unique<elizalogic::eliza>(context);
+                    return greeting;
+                },
+                [&](unsigned long long client, const std::string & line, std::string & reply) {
+                    if (line.empty())
+                        return false; // (as at the console, a blank line ends the conversation)
+                    reply = conversations[client]->response(line);
+                    return true;
+                },
+                [&](unsigned long long client) {
+                    conversations.erase(client);
+                });
+            if (!ok)
+                std::cerr << argv[0] << ": " << server.last_error_text() << '\n';
+            return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+#endif
+
+#ifdef SUPPORT_SHM_SERVER
+        if (!opt.shm_path.empty()) {
+            if (!opt.serve_addresses.empty()) {
+                std::cerr << argv[0] << ": serve with " << as_option("serve") << " or " << as_option("shm") << ", not both\n";
+                return EXIT_FAILURE;
+            }
+            const auto context = std::make_shared<const elizalogic::script_context>(
+                eliza_script.rules, eliza_script.mem_rule);
+            static shm_server server;
+            if (!server.listen(opt.shm_path)) {
+                std::cerr << argv[0] << ": " << server.last_error_text() << '\n';
+                return EXIT_FAILURE;
+            }
+            std::cout << "Serving through shared memory; clients connect to " << opt.shm_path << '\n';
+            std::signal(SIGINT, [](int) { server.stop(); });
+            std::signal(SIGTERM, [](int) { server.stop(); });
+            elizalogic::session_table table(context, elizalogic::session_table::options());
+            const bool ok = server.run([&](const std::string & id, const std::string & input) {
+                return table.response(id, input, elizalogic::session_table::clock::now());
+            });
+            if (!ok)
+                std::cerr << argv[0] << ": " << server.last_error_text() << '\n';
+            return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+#endif
+
+#ifdef SUPPORT_LINE_SERVER
+        if (!opt.serve_addresses.empty()) {
+            const auto backend = opt.serve_backend == "epoll" ? line_server::backend::epoll
+                : opt.serve_backend == "io_uring" ? line_server::backend::io_uring
+                : line_server::backend::automatic;
+            const auto context = std::make_shared<const elizalogic::script_context>(
+                eliza_script.rules, eliza_script.mem_rule);
+            if (opt.serve_cores >= 0 && opt.serve_workers >= 0) {
+                std::cerr << argv[0] << ": serve with " << as_option("cores") << " or " << as_option("workers") << ", not both\n";
+                return EXIT_FAILURE;
+            }
+            if (opt.serve_cores >= 0) {
+                // thread-per-core: each shard has its own session_table;
+                // only the script is shared
+                static line_server_group group(static_cast<unsigned>(opt.serve_cores), backend);
+                if (opt.serve_backend == "io_uring" && group.backend_name() != opt.serve_backend)
+                    std::cerr << argv[0] << ": io_uring not available; using epoll\n";
+                for (const auto & address : opt.serve_addresses) {
+                    if (!group.listen(address)) {
+                        std::cerr << argv[0] << ": " << group.last_error_text() << '\n';
+                        return EXIT_FAILURE;
+                    }
+                    std::cout << "Serving on " << address << '\n';
+                }
+                std::cout << "with " << group.shards() << " shards\n";
+                std::signal(SIGINT, [](int) { group.stop(); });
+                std::signal(SIGTERM, [](int) { group.stop(); });
+                const bool ok = group.run([&](unsigned) {
+                    auto table = std::make_shared<elizalogic::session_table>(context, elizalogic::session_table::options());
+                    return [table](const std::string & id, const std::string & input) {
+                        return table->response(id, input, elizalogic::session_table::clock::now());
+                    };
+                });
+                if (!ok)
+                    std::cerr << argv[0] << ": " << group.last_error_text() << '\n';
+                return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+            }
+
+            static line_server server(backend);
+            if (opt.serve_backend == "io_uring" && server.backend_name() != opt.serve_backend)
+                std::cerr << argv[0] << ": " << server.last_error_text() << "; using epoll\n";
+            for (const auto & address : opt.serve_addresses) {
+                if (!server.listen(address)) {
+                    std::cerr << argv[0] << ": " << server.last_error_text() << '\n';
+                    return EXIT_FAILURE;
+                }
+                std::cout << "Serving on " << address << '\n';
+            }
+            std::signal(SIGINT, [](int) { server.stop(); });
+            std::signal(SIGTERM, [](int) { server.stop(); });
+            elizalogic::session_table table(context, elizalogic::session_table::options());
+            if (opt.serve_workers >= 0) {
+                // the event loop hands each line to a worker, through
+                // admission control, and the worker hands back the reply
+                elizalogic::admission_options admission;
+                admission.max_in_flight_per_worker = 1024;
+                admission.max_per_session = 64;
+                admission.target_delay = std::chrono::milliseconds(opt.target_delay_ms);
+                admission.shed = opt.shed;
+                elizalogic::session_scheduler scheduler(opt.serve_workers > 0
+                    ? static_cast<unsigned>(opt.serve_workers)
+                    : std::max(1u, std::thread::hardware_concurrency()), admission);
+                std::cout << "with " << scheduler.threads() << " workers\n";
+                const bool ok = server.run_deferred([&](const std::string & id, const std::string & input, line_server::ticket t) {
+                    auto s = table.create(id, elizalogic::session_table::clock::now());
+                    const bool admitted = scheduler.submit(std::move(s), input, [t](const std::string & reply) {
+                        server.post([t, reply]() { server.reply(t, reply); });
+                    });
+                    if (!admitted)
+                        server.reply(t, elizalogic::busy_reply);
+                });
+                scheduler.wait_idle();
+                const auto stats = scheduler.admission_stats();
+                std::cout << stats.admitted << " inputs admitted, " << stats.refused << " refused, "
+                    << stats.shed << " shed, " << stats.late << " late\n";
+                if (!ok)
+                    std::cerr << argv[0] << ": " << server.last_error_text() << '\n';
+                return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+            }
+            const bool ok = server.run([&](const std::string & id, const std::string & input) {
+                return table.response(id, input, elizalogic::session_table::clock::now());
+            });
+            if (!ok)
+                std::cerr << argv[0] << ": " << server.last_error_text() << '\n';
+            return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+#endif
+
+        if (opt.bench && opt.corpus_repeats != 0) {
+            const auto result = elizatest::replay_benchmark(elizatest::recorded_corpus(), opt.corpus_repeats,
+                opt.serve_workers > 0 ? static_cast<unsigned>(opt.serve_workers)
+                    : std::max(1u, std::thread::hardware_concurrency()));
+            if (opt.json) {
+                std::ostringstream json;
+                json << std::fixed << std::setprecision(2)
+                    << "{\n"
+                    << "  \"threads\": " << result.threads << ",\n"
+                    << "  \"repeats\": " << opt.corpus_repeats << ",\n"
+                    << "  \"exchanges\": " << result.exchanges << ",\n"
+                    << "  \"mismatches\": " << result.mismatches << ",\n"
+                    << "  \"seconds\": " << result.seconds << ",\n"
+                    << "  \"exchanges_per_second\": " << result.exchanges_per_second() << ",\n"
+                    << "  \"latency_us\": {\"p50\": " << result.p50_us
+                    << ", \"p99\": " << result.p99_us << ", \"p999\": " << result.p999_us << "},\n"
+                    << "  \"conversations\": [";
+                for (size_t i = 0; i < result.conversations.size(); ++i) {
+                    const auto & c = result.conversations[i];
+                    json << (i ? "," : "") << "\n    {"
+                        << "\"name\": " << elizalogic::jsonl::quote(c.name)
+                        << ", \"exchanges\": " << c.exchanges
+                        << ", \"mismatches\": " << c.mismatches
+                        << ", \"latency_us\": {\"p50\": " << c.p50_us
+                        << ", \"p99\": " << c.p99_us
+                        << ", \"p999\": " << c.p999_us << "}}";
+                }
+                json << "\n  ],\n  \"errors\": [";
+                for (size_t i = 0; i < result.errors.size(); ++i)
+                    json << (i ? ",\n    " : "\n    ") << elizalogic::jsonl::quote(result.errors[i]);
+                json << (result.errors.empty() ? "]\n}\n" : "\n  ]\n}\n");
+                std::cout << json.str();
+            }
+            else {
+                for (const auto & error : result.errors)
+                    std::cout << error << '\n';
+                std::cout << "recorded conversations: each replayed " << opt.corpus_repeats
+                    << " times on " << result.threads << " threads\n"
+                    << "conversation        exchanges  mismatches  p50 us  p99 us  p99.9 us\n"
+                    << std::fixed;
+                auto row = [](const std::string & name, size_t exchanges, size_t mismatches,
+                    double p50, double p99, double p999) {
+                    std::cout << std::left << std::setw(18) << name << std::right
+                        << std::setw(11) << exchanges
+                        << std::setw(12) << mismatches
+                        << std::setw(8) << std::setprecision(1) << p50
+                        << std::setw(8) << p99
+                        << std::setw(10) << p999 << '\n';
+                };
+                for (const auto & c : result.conversations)
+                    row(c.name, c.exchanges, c.mismatches, c.p50_us, c.p99_us, c.p999_us);
+                row("all", result.exchanges, result.mismatches, result.p50_us, result.p99_us, result.p999_us);
+                std::cout << static_cast<long long>(result.exchanges_per_second()) << " exchanges/s\n";
+            }
+            return result.mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+
+        if (opt.bench && opt.json) {
+            const auto results = elizatest::run_workloads();
+            std::ostringstream json;
+            json << std::fixed << std::setprecision(2)
+                << "{\n"
+                << "  \"eliza\": \"0.97\",\n"
+#if defined(__clang__)
+                << "  \"compiler\": " << elizalogic::jsonl::quote("clang " __clang_version__) << ",\n"
+#elif defined(__GNUC__)
+                << "  \"compiler\": " << elizalogic::jsonl::quote("gcc " __VERSION__) << ",\n"
+#elif defined(_MSC_VER)
+                << "  \"compiler\": \"msvc " << _MSC_FULL_VER << "\",\n"
+#endif
+                << "  \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n"
+                << "  \"workloads\": [";
+            for (size_t i = 0; i < results.size(); ++i) {
+                const auto & r = results[i];
+                json << (i ? "," : "") << "\n    {"
+                    << "\"name\": " << elizalogic::jsonl::quote(r.name)
+                    << ", \"script\": " << elizalogic::jsonl::quote(r.script)
+                    << ", \"exchanges\": " << r.exchanges
+                    << ", \"exchanges_per_second\": " << r.exchanges_per_second()
+                    << ", \"latency_us\": {\"p50\": " << r.p50_us
+                    << ", \"p99\": " << r.p99_us
+                    << ", \"p999\": " << r.p999_us << "}}";
+            }
+            json << "\n  ]\n}\n";
+            std::cout << json.str();
+            return EXIT_SUCCESS;
+        }
+
+        if (opt.bench) {
+            const auto context = std::make_shared<const elizalogic::script_context>(
+                eliza_script.rules, eliza_script.mem_rule);
+            stringlist inputs;
+            for (const auto & exchg : elizatest::cacm_1966_conversation)
+                inputs.push_back(exchg.prompt);
+            const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+            std::vector<unsigned> thread_counts;
+            for (unsigned n = 1; n < cores; n *= 2)
+                thread_counts.push_back(n);
+            thread_counts.push_back(cores);
+
+            auto report = [&](const char * title, auto benchmark) {
+                std::cout << title << ": 64 sessions per thread, "
+                    << cores << " hardware threads\n"
+                    << "threads  exchanges/s  speedup\n";
+                double base = 0;
+                for (const unsigned n : thread_counts) {
+                    const elizalogic::contention_result r = benchmark(context, inputs, n, 64, 20000);
+                    if (base == 0)
+                        base = r.exchanges_per_second();
+                    std::cout << std::setw(7) << n << std::setw(13) << static_cast<long long>(r.exchanges_per_second())
+                        << std::setw(9) << std::fixed << std::setprecision(2) << r.exchanges_per_second() / base << '\n';
+                }
+            };
+            report("contended session table", elizalogic::contention_benchmark);
+            report("session scheduler", elizalogic::scheduler_benchmark);
+            std::cout << "staged pipeline: 1024 sessions, one stage per thread\n"
+                << "threads  exchanges/s  speedup\n";
+            double base = 0;
+            for (const bool staged : { false, true }) {
+                const elizalogic::contention_result r = elizalogic::pipeline_benchmark(context, inputs, staged);
+                if (base == 0)
+                    base = r.exchanges_per_second();
+                std::cout << std::setw(7) << r.threads << std::setw(13) << static_cast<long long>(r.exchanges_per_second())
+                    << std::setw(9) << std::fixed << std::setprecision(2) << r.exchanges_per_second() / base << '\n';
+            }
+            std::cout << "batch scheduling: 1024 sessions, consecutive inputs differ\n"
+                << "schedule            exchanges/s  speedup\n";
+            base = 0;
+            for (const auto & [name, batched, grouped] : {
+                    std::make_tuple("one at a time", false, false),
+                    std::make_tuple("batched", true, false),
+                    std::make_tuple("batched, grouped", true, true) }) {
+                const elizalogic::contention_result r = elizalogic::batch_benchmark(context, inputs, batched, grouped);
+                if (base == 0)
+                    base = r.exchanges_per_second();
+                std::cout << std::left << std::setw(16) << name << std::right
+                    << std::setw(15) << static_cast<long long>(r.exchanges_per_second())
+                    << std::setw(9) << std::fixed << std::setprecision(2) << r.exchanges_per_second() / base << '\n';
+            }
+            std::cout << "keyword scan: 256 conversations\n"
+                << "scan                inputs/s  speedup\n";
+            base = 0;
+            for (const auto & [name, batched] : {
+                    std::make_pair("one at a time", false),
+                    std::make_pair("batched", true) }) {
+                const elizalogic::contention_result r = elizalogic::scan_benchmark(context, inputs, batched);
+                if (base == 0)
+                    base = r.exchanges_per_second();
+                std::cout << std::left << std::setw(16) << name << std::right
+                    << std::setw(12) << static_cast<long long>(r.exchanges_per_second())
+                    << std::setw(9) << std::fixed << std::setprecision(2) << r.exchanges_per_second() / base << '\n';
+            }
+#ifdef SUPPORT_LINE_SERVER
+            std::cout << "line server over loopback TCP: 100 connections, 4 requests in flight on each\n"
+                << "server                 requests/s  syscalls/request  p50 us  p99 us  p99.9 us\n";
+            const std::vector<std::string> load_inputs(inputs.begin(), inputs.end());
+            // load server (a line_server or line_server_group), which
+            // serve() runs, and report how it did
+            auto measure = [&](const std::string & name, auto & server, auto serve) {
+                if (!server.listen("127.0.0.1:0")) {
+                    std::cerr << argv[0] << ": " << server.last_error_text() << '\n';
+                    return false;
+                }
+                std::thread serving(serve);
+                const line_load_result r = line_load(std::to_string(server.port()), 100, 500, 4, load_inputs);
+                const auto stats = server.stats();
+                server.stop();
+                serving.join();
+                std::cout << std::left << std::setw(21) << name << std::right
+                    << std::setw(12) << static_cast<long long>(r.requests / r.seconds)
+                    << std::setw(18) << std::setprecision(2) << double(stats.syscalls) / std::max<size_t>(1, r.requests)
+                    << std::setw(8) << std::setprecision(0) << r.p50_us
+                    << std::setw(8) << r.p99_us
+                    << std::setw(10) << r.p999_us;
+                if (r.errors)
+                    std::cout << "  (" << r.errors << " connections failed)";
+                std::cout << '\n';
+                return true;
+            };
+            for (const auto backend : { line_server::backend::epoll, line_server::backend::io_uring }) {
+                line_server server(backend);
+                if (backend == line_server::backend::io_uring && server.backend_name() != std::string("io_uring")) {
+                    std::cout << "io_uring   (" << server.last_error_text() << ")\n";
+                    continue;
+                }
+                elizalogic::session_table table(context, elizalogic::session_table::options());
+                const bool ok = measure(server.backend_name(), server, [&]() {
+                    server.run([&](const std::string & id, const std::string & input) {
+                        return table.response(id, input, elizalogic::session_table::clock::now());
+                    });
+                });
+                if (!ok)
+                    return EXIT_FAILURE;
+            }
+            line_server_group group;
+            const bool ok = measure("per-core " + std::string(group.backend_name()) + " (" + std::to_string(group.shards()) + ")", group, [&]() {
+                group.run([&](unsigned) {
+                    auto table = std::make_shared<elizalogic::session_table>(context, elizalogic::session_table::options());
+                    return [table](const std::string & id, const std::string & input) {
+                        return table->response(id, input, elizalogic::session_table::clock::now());
+                    };
+                });
+            });
+            if (!ok)
+                return EXIT_FAILURE;
+            std::cout << "(" << group.handoffs() << " lines handed to another core)\n";
+#endif
+#ifdef SUPPORT_SHM_SERVER
+            {
+                shm_server server;
+                const std::string path("/tmp/eliza-bench-"
+                    + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".shm");
+                if (!server.listen(path)) {
+                    std::cerr << argv[0] << ": " << server.last_error_text() << '\n';
+                    return EXIT_FAILURE;
+                }
+                elizalogic::session_table table(context, elizalogic::session_table::options());
+                std::thread serving([&]() {
+                    server.run([&](const std::string & id, const std::string & input) {
+                        return table.response(id, input, elizalogic::session_table::clock::now());
+                    });
+                });
+                const std::vector<std::string> request_inputs(inputs.begin(), inputs.end());
+                shm_client client;
+                std::vector<double> round_trip_us;
+                const auto start = std::chrono::steady_clock::now();
+                if (client.connect(path)) {
+                    std::string reply;
+                    for (size_t i = 0; i < 50000; ++i) {
+                        const auto sent = std::chrono::steady_clock::now();
+                        if (!client.request("bench", request_inputs[i % request_inputs.size()], reply))
+                            break;
+                        round_trip_us.push_back(std::chrono::duration<double, std::micro>(
+                            std::chrono::steady_clock::now() - sent).count());
+                    }
+                }
+                const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                const auto wakeups = server.stats().wakeups;
+                client.close();
+                server.stop();
+                serving.join();
+                if (round_trip_us.empty()) {
+                    std::cerr << argv[0] << ": " << client.last_error_text() << '\n';
+                    return EXIT_FAILURE;
+                }
+                std::sort(round_trip_us.begin(), round_trip_us.end());
+                auto percentile = [&](double p) {
+                    return round_trip_us[std::min(round_trip_us.size() - 1, static_cast<size_t>(p * round_trip_us.size()))];
+                };
+                std::cout << "shared memory: 1 client, 1 request in flight\n"
+                    << "requests/s  wakeups/request  p50 us  p99 us  p99.9 us\n"
+                    << std::setw(10) << static_cast<long long>(round_trip_us.size() / seconds)
+                    << std::setw(17) << std::setprecision(2) << double(wakeups) / round_trip_us.size()
+                    << std::setw(8) << std::setprecision(1) << percentile(0.5)
+                    << std::setw(8) << percentile(0.99)
+                    << std::setw(10) << percentile(0.999) << '\n';
+            }
+#endif
+            return EXIT_SUCCESS;
+        }
+
+        if (!opt.batch_in_filename.empty()) {
+            std::unique_ptr<elizalogic::mapped_file> corpus;
+            try {
+                corpus = std::make_unique<elizalogic::mapped_file>(opt.batch_in_filename);
+            }
+            catch (const std::runtime_error & e) {
+                std::cerr << argv[0] << ": " << e.what() << '\n';
+                return EXIT_FAILURE;
+            }
+            std::ofstream output_file(opt.batch_out_filename, std::ios::binary | std::ios::trunc);
+            if (!output_file.is_open()) {
+                std::cerr << argv[0] << ": failed to open output file '"
+                          << opt.batch_out_filename << "'\n";
+                return EXIT_FAILURE;
+            }
+            const auto context = std::make_shared<const elizalogic::script_context>(
+                eliza_script.rules, eliza_script.mem_rule);
+            elizalogic::batch_job::options batch_opt;
+            if (opt.serve_workers > 0)
+                batch_opt.threads = static_cast<unsigned>(opt.serve_workers);
+            elizalogic::batch_job job(context, batch_opt);
+            const auto result = job.run(corpus->data(), corpus->size(), output_file);
+            if (!output_file) {
+                std::cerr << argv[0] << ": failed to write output file '"
+                          << opt.batch_out_filename << "'\n";
+                return EXIT_FAILURE;
+            }
+            std::cout
+                << result.records << " inputs to "
+                << result.conversations << " conversations answered in "
+                << result.seconds << "s on "
+                << batch_opt.threads << " threads\n";
+            return EXIT_SUCCESS;
+        }
+
+        if (!opt.explore_filename.empty()) {
+            std::ifstream input_file(opt.explore_filename);
+            if (!input_file.is_open()) {
+                std::cerr << argv[0] << ": failed to open input file '"
+                          << opt.explore_filename << "'\n";
+                return EXIT_FAILURE;
+            }
+            stringlist inputs;
+            for (std::string line; std::getline(input_file, line); )
+                if (!line.empty())
+                    inputs.push_back(line);
+            const elizalogic::eliza start(eliza_script.rules, eliza_script.mem_rule);
+            const elizalogic::conversation_explorer explorer(start);
+            elizalogic::conversation_explorer::options explore_opt;
+            explore_opt.depth = opt.explore_depth;
+            const auto result = explorer.explore(inputs, explore_opt);
+            std::cout << explorer.coverage_report(result) << '\n';
+            for (const auto & [reply, rec] : result.replies) {
+                std::cout << std::setw(7) << rec.count << "  " << reply << "\n         <-";
+                for (const auto & input : rec.path)
+                    std::cout << " [" << input << "]";
+                std::cout << '\n';
+            }
+            return EXIT_SUCCESS;
+        }
+
+        if (!opt.replay_filename.empty()) {
+            std::ifstream journal_file(opt.replay_filename);
+            if (!journal_file.is_open()) {
+                std::cerr << argv[0] << ": failed to open journal file '"
+                          << opt.replay_filename << "'\n";
+                return EXIT_FAILURE;
+            }
+            const auto sessions = elizalogic::journal::read(journal_file);
+            const auto context = std::make_shared<const elizalogic::script_context>(
+                eliza_script.rules, eliza_script.mem_rule);
+            const auto result = elizalogic::journal::replay(sessions, context);
+            for (const auto & error : result.errors)
+                std::cout << error << '\n';
+            std::cout
+                << result.sessions << " sessions, "
+                << result.exchanges << " exchanges replayed in "
+                << result.seconds << "s; "
+                << result.mismatches << " mismatches";
+            if (result.skipped)
+                std::cout << "; " << result.skipped << " sessions skipped (recorded with a different script)";
+            std::cout << '\n';
+            return result.mismatches == 0 && result.skipped == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+
+        if (!opt.nobanner)
             std::cout << "Enter a blank line to quit.\n\n\n";
 
 
@@ -6789,64 +13875,82 @@ int main(int argc, const char * argv[])
         elizalogic::eliza eliza(eliza_script.rules, eliza_script.mem_rule);
         eliza.set_tracer(&trace);
 
+        std::ofstream journal_file;
+        std::unique_ptr<elizalogic::journal::writer> journal;
+        std::string journal_session;
+        if (!opt.journal_filename.empty()) {
+            journal_file.open(opt.journal_filename, std::ios::app);
+            if (!journal_file.is_open()) {
+                std::cerr << argv[0] << ": failed to open journal file '"
+                          << opt.journal_filename << "'\n";
+                return EXIT_FAILURE;
+            }
+            // (each run of the program is a new session)
+            journal = std::make_unique<elizalogic::journal::writer>(journal_file,
+                eliza.context().hash);
+            journal_session = "console-" + std::to_string(elizalogic::journal::now_ms());
+        }
+
 #ifdef SUPPORT_SERIAL_IO
         serial_io serial_port;
-        if (port) {
-            if (serial_port.open(port_name, "")) {
+        if (opt.port) {
+            if (serial_port.open(opt.port_name, "")) {
                 std::cout
                     << "Switching to serial port "
-                    << port_name << '\n';
+                    << opt.port_name << '\n';
             }
             else {
                 std::cerr << serial_port.last_error_text() << '\n';
                 return EXIT_FAILURE;
             }
         }
-        auto print = [&](const std::string & s) {
-            if (port) {
-                serial_port.write(s);
-                serial_port.write("\r\n");
-            }
-            else if (quick)
-                std::cout << s << std::endl;
+        auto output = [&](const std::string & s) {
+            if (opt.port)
+                serial_port.write(s == "\n" ? "\r\n" : s);
             else
-                writeln(s);
+                std::cout << s << std::flush;
         };
-        auto input = [&](std::string & s) {
-            if (port)
+        auto input = [&](std::string & s) -> bool {
+            if (opt.port) {
                 s = serial_port.getline();
-            else
-                std::getline(std::cin, s);
+                return true;
+            }
+            return static_cast<bool>(std::getline(std::cin, s));
         };
+        const bool paced = !opt.quick && !opt.port;
 #else
-        auto print = [&](const std::string & s) {
-            if (quick)
-                std::cout << s << std::endl;
-            else
-                writeln(s);
+        auto output = [](const std::string & s) {
+            std::cout << s << std::flush;
         };
-        auto input = [&](std::string & s) {
-            std::getline(std::cin, s);
+        auto input = [](std::string & s) -> bool {
+            return static_cast<bool>(std::getline(std::cin, s));
         };
+        const bool paced = !opt.quick;
 #endif
 
-        print(join(eliza_script.hello_message));
-
-        for (int cacm_index = -1;;) {
-            std::string userinput;
-
-            print("");
-            input(userinput);
-
-            if (userinput.empty()) {
-                if (cacm_index >= 0) {
-                    userinput = elizatest::cacm_1966_conversation[cacm_index++].prompt;
-                    print(userinput);
-                }
+        // the console is a terminal on a driver (see elizadriver), its one
+        // conversation a coroutine; the driver comes back here to wait for
+        // the time to print the next character or for the next line of input
+        elizadriver::driver driver;
+        elizadriver::terminal terminal(driver, output, paced ? 14 : 0); // the IBM 2741 printed at ~14.1 cps
+        auto wait = [&](elizadriver::driver::clock::time_point wake) {
+            if (wake != elizadriver::driver::clock::time_point::max())
+                std::this_thread::sleep_until(wake);
+            else if (terminal.reading()) {
+                std::string s;
+                if (input(s))
+                    terminal.deliver(s);
                 else
-                    break;
+                    terminal.end_input();
             }
-            if (userinput[0] == '*') {
+            else
+                return false;
+            return true;
+        };
+
+        auto console = [&]() -> elizadriver::task {
+            // carry out the command in userinput (which starts with '*')
+            auto obey = [&](const std::string & userinput, int & cacm_index) {
                 const stringlist cmd_line{ split(to_upper(userinput)) };
                 const std::string command{ cmd_line[0] };
                 if (command == "*") {
@@ -6920,29 +14024,55 @@ int main(int argc, const char * argv[])
                 }
                 else
                     std::cout << "Unknown command. Commands are\n" << command_help;
-                continue;
-            }
+            };
 
-            const std::string response{eliza.response(userinput)};
+            co_await terminal.write_line(join(eliza_script.hello_message));
 
-            if (!quick) {
-                // The doctor takes a moment to reflect before replying.
-                // (Weizenbaum developed ELIZA on an IBM 7094 running CTSS.
-                // It's quite likely it took a second or two before responding
-                // to the user's statements.)
-                sleep_ms(1500);
-            }
+            for (int cacm_index = -1;;) {
+                std::string userinput;
+
+                co_await terminal.write_line("");
+                if (!co_await terminal.read_line(userinput))
+                    userinput.clear();
+
+                if (userinput.empty()) {
+                    if (cacm_index >= 0) {
+                        userinput = elizatest::cacm_1966_conversation[cacm_index++].prompt;
+                        co_await terminal.write_line(userinput);
+                    }
+                    else
+                        break;
+                }
+                if (userinput[0] == '*') {
+                    obey(userinput, cacm_index);
+                    continue;
+                }
+
+                const std::string response{eliza.response(userinput)};
+                if (journal)
+                    journal->record(journal_session, userinput, response);
+
+                if (!opt.quick) {
+                    // The doctor takes a moment to reflect before replying.
+                    // (Weizenbaum developed ELIZA on an IBM 7094 running CTSS.
+                    // It's quite likely it took a second or two before responding
+                    // to the user's statements.)
+                    co_await driver.sleep_for(elizadriver::reflection_time);
+                }
 
-            if (traceauto)
-                std::cout << trace.text();
+                if (traceauto)
+                    std::cout << trace.text();
 
-            print(response);
+                co_await terminal.write_line(response);
 
-            if (cacm_index >= elizatest::cacm_1966_conversation_size) {
-                std::cout << "\n<end of CACM conversation>\n";
-                cacm_index = -1;
+                if (cacm_index >= elizatest::cacm_1966_conversation_size) {
+                    std::cout << "\n<end of CACM conversation>\n";
+                    cacm_index = -1;
+                }
             }
-        }
+        };
+        driver.spawn(console());
+        driver.run(wait);
     }
     catch (const std::exception & e) {
         std::cerr << "exception: " << e.what() << std::endl;
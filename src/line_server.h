@@ -0,0 +1,195 @@
+#ifndef LINE_SERVER_H_INCLUDED
+#define LINE_SERVER_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+/*  A server for a simple line protocol. A client connects, over TCP or a
+    UNIX domain socket, and sends lines of the form
+
+        <session id> TAB <input>
+
+    and for each the server sends back one line, the handler's reply.
+    A line with no TAB is input for a session named after the connection.
+    Replies on a connection come in the order the lines were sent. Lines
+    end with LF (a CR before the LF is ignored). */
+class line_server {
+public:
+    // return the reply to the given input in the given session
+    using handler = std::function<std::string(const std::string & session_id, const std::string & input)>;
+
+    // identifies a line whose reply is to be given later, by reply()
+    struct ticket {
+        unsigned long long connection{ 0 };
+        unsigned long long line{ 0 };
+    };
+
+    // like handler, but the reply is given by calling reply(t) now or later
+    using deferred_handler = std::function<void(const std::string & session_id, const std::string & input, ticket t)>;
+
+    // how the server waits for and does I/O; automatic means io_uring
+    // if this kernel supports what we need of it, otherwise epoll
+    enum class backend { automatic, epoll, io_uring };
+
+    struct statistics {
+        unsigned long long lines{ 0 };      // lines answered
+        unsigned long long syscalls{ 0 };   // system calls made while serving
+    };
+
+    explicit line_server(backend b = backend::automatic);
+    ~line_server();
+
+    // the backend in use: "epoll" or "io_uring" (if io_uring was asked
+    // for but isn't available, "epoll" and last_error_text() says why)
+    const char * backend_name() const;
+
+    // listen on address, which is "unix:PATH" for a UNIX domain socket
+    // or "[HOST:]PORT" for TCP (HOST defaults to 127.0.0.1; PORT 0 means
+    // any free port, see port()); may be called more than once to listen
+    // on several addresses; if reuse_port, other sockets may listen on the
+    // same TCP port and the kernel spreads connections between them
+    bool listen(const std::string & address, bool reuse_port = false);
+
+    // the TCP port most recently listened on
+    uint16_t port() const;
+
+    // serve connections, calling h for each line received, until stop()
+    bool run(handler h);
+
+    // as run(), but the replies are given by reply(); a connection's
+    // replies are still sent in the order its lines came
+    bool run_deferred(deferred_handler h);
+
+    // give the reply to the line t; call only from within run_deferred()
+    // (e.g. from the handler or a posted task); ignored if t's connection
+    // has closed
+    void reply(ticket t, const std::string & text);
+
+    // have task called, soon, on the thread in run(); may be called from
+    // any thread and doesn't block (tasks go through a lock-free queue)
+    void post(std::function<void()> task);
+
+    // make run() return; may be called from any thread (or a signal handler)
+    void stop();
+
+    // the number of connections currently open
+    size_t connections() const;
+
+    statistics stats() const;
+
+    std::string last_error_text() const;
+
+    class implementation;
+
+private:
+    std::unique_ptr<implementation> impl_;
+};
+
+
+// a blocking client for line_server, for tests and tools
+class line_client {
+public:
+    line_client();
+    ~line_client();
+
+    // connect to address (as for line_server::listen())
+    bool connect(const std::string & address);
+
+    // send given line (which should not contain LF)
+    bool send(const std::string & line);
+
+    // wait for and return the next line received, without its LF;
+    // false if the connection closed first
+    bool receive(std::string & line);
+
+    // send then receive
+    bool request(const std::string & line, std::string & reply);
+
+    void close();
+
+    std::string last_error_text() const;
+
+private:
+    class implementation;
+    std::unique_ptr<implementation> impl_;
+};
+
+
+/*  Thread-per-core: a line_server for each shard, each run by a thread of
+    its own pinned to a CPU of its own, all listening on the same addresses
+    (TCP with SO_REUSEPORT, so the kernel spreads connections between them;
+    a UNIX socket can't be shared so only the first shard listens on one).
+
+    Each session belongs to one shard, chosen by hashing its id. A line
+    that arrives on another shard goes through the owner's mailbox (see
+    line_server::post()) to be answered there, and the reply comes back
+    the same way. So a shard's sessions are only ever touched by its own
+    thread, and shards share nothing the handlers don't. */
+class line_server_group {
+public:
+    // shards 0 means one for each CPU this process may run on
+    explicit line_server_group(unsigned shards = 0, line_server::backend b = line_server::backend::automatic);
+    ~line_server_group();
+
+    unsigned shards() const;
+
+    // the shard session_id belongs to
+    static unsigned shard_of(const std::string & session_id, unsigned shards);
+
+    const char * backend_name() const;
+
+    // listen on address (as for line_server::listen()) in every shard
+    bool listen(const std::string & address);
+
+    uint16_t port() const;
+
+    // serve connections until stop(); make_handler(shard) is called on
+    // each shard's own thread to make that shard's handler
+    bool run(std::function<line_server::handler(unsigned shard)> make_handler);
+
+    // make run() return; may be called from any thread (or a signal handler)
+    void stop();
+
+    size_t connections() const;
+
+    // summed over the shards
+    line_server::statistics stats() const;
+
+    // lines answered by a shard other than the one they arrived on
+    unsigned long long handoffs() const;
+
+    std::string last_error_text() const;
+
+private:
+    class implementation;
+    std::unique_ptr<implementation> impl_;
+};
+
+
+/*  A load generator for line_server: open the given number of connections
+    to address and on each send requests_per_connection lines, keeping up
+    to pipeline of them waiting for a reply. Line i on connection c is
+    "c<c> TAB inputs[i % inputs.size()]". Every round trip is timed. */
+struct line_load_result {
+    size_t requests{ 0 };       // replies received
+    size_t errors{ 0 };         // connections that failed
+    double seconds{ 0 };
+    double p50_us{ 0 };         // round-trip latency percentiles, microseconds
+    double p99_us{ 0 };
+    double p999_us{ 0 };
+    double max_us{ 0 };
+};
+
+line_load_result line_load(
+    const std::string & address,
+    size_t connections,
+    size_t requests_per_connection,
+    size_t pipeline,
+    const std::vector<std::string> & inputs);
+
+#endif
@@ -0,0 +1,1705 @@
+// Implement line_server, line_client and line_load() for Linux.
+// The server is one thread serving every connection, waiting with either
+// edge-triggered epoll or io_uring.
+
+
+#include "line_server.h"
+
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/utsname.h>
+#include <pthread.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <cstddef>
+#include <cstdio>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+namespace {
+
+// a line longer than this is a protocol error: the connection is closed
+const size_t max_line_length = 64 * 1024;
+
+// stop reading from a connection while it has this much output unsent
+const size_t max_pending_output = 1024 * 1024;
+
+// closed connections kept for reuse (with their buffers)
+const size_t max_free_connections = 4096;
+
+// stop reading from a connection while it has this many deferred replies
+// outstanding
+const size_t max_waiting_replies = 4096;
+
+// numbers connections (and so names their sessions) uniquely in the process
+std::atomic<unsigned long long> connection_numbers{ 0 };
+
+
+std::string error_text(const std::string & what, int error_number)
+{
+    return what + ": " + ::strerror(error_number);
+}
+
+
+// set sa and len to the socket address given in address (see
+// line_server::listen()); return false, with error set, if it's not valid
+bool parse_address(const std::string & address, sockaddr_storage & sa, socklen_t & len, std::string & error)
+{
+    ::memset(&sa, 0, sizeof sa);
+    if (address.compare(0, 5, "unix:") == 0) {
+        const std::string path(address.substr(5));
+        sockaddr_un * un = reinterpret_cast<sockaddr_un *>(&sa);
+        if (path.empty() || path.size() >= sizeof un->sun_path) {
+            error = "Invalid UNIX socket path '" + path + "'";
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        ::memcpy(un->sun_path, path.c_str(), path.size() + 1);
+        len = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + path.size() + 1);
+        return true;
+    }
+
+    std::string host("127.0.0.1"), port(address);
+    const auto colon = address.rfind(':');
+    if (colon != std::string::npos) {
+        host = address.substr(0, colon);
+        port = address.substr(colon + 1);
+    }
+    sockaddr_in * in = reinterpret_cast<sockaddr_in *>(&sa);
+    if (port.empty() || port.size() > 5
+        || port.find_first_not_of("0123456789") != std::string::npos
+        || std::stoul(port) > 65535
+        || ::inet_pton(AF_INET, host.c_str(), &in->sin_addr) != 1) {
+        error = "Invalid address '" + address + "'";
+        return false;
+    }
+    in->sin_family = AF_INET;
+    in->sin_port = htons(static_cast<uint16_t>(std::stoul(port)));
+    len = sizeof(sockaddr_in);
+    return true;
+}
+
+
+/*  A queue of tasks with many producers and one consumer, none of which
+    ever waits for another: push() is an exchange and a store; pop() may
+    find the last push not yet finished, in which case it returns null and
+    the pusher's wake-up (see line_server::implementation::post()) brings
+    the consumer back for it. (Dmitry Vyukov's intrusive MPSC queue.) */
+class mailbox {
+public:
+    mailbox() : head_(&stub_), tail_(&stub_) {}
+
+    ~mailbox()
+    {
+        while (pop())
+            ;
+    }
+
+    void push(std::function<void()> task)
+    {
+        push(new node(std::move(task)));
+    }
+
+    // remove and return the oldest task, if there is one (consumer only)
+    std::unique_ptr<std::function<void()>> pop()
+    {
+        node * tail = tail_;
+        node * next = tail->next.load(std::memory_order_acquire);
+        if (tail == &stub_) {
+            if (next == nullptr)
+                return nullptr;
+            tail_ = tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next == nullptr) {
+            if (tail != head_.load(std::memory_order_acquire))
+                return nullptr; // (a push is under way)
+            push(&stub_);
+            next = tail->next.load(std::memory_order_acquire);
+            if (next == nullptr)
+                return nullptr;
+        }
+        tail_ = next;
+        std::unique_ptr<node> popped(tail);
+        return std::make_unique<std::function<void()>>(std::move(popped->task));
+    }
+
+private:
+    struct node {
+        node() = default;
+        explicit node(std::function<void()> t) : task(std::move(t)) {}
+        std::atomic<node *> next{ nullptr };
+        std::function<void()> task;
+    };
+
+    node stub_;
+    alignas(64) std::atomic<node *> head_;  // (pushers)
+    alignas(64) node * tail_;               // (the consumer)
+
+    void push(node * n)
+    {
+        n->next.store(nullptr, std::memory_order_relaxed);
+        node * prev = head_.exchange(n, std::memory_order_acq_rel);
+        prev->next.store(n, std::memory_order_release);
+    }
+};
+
+}//anonymous namespace
+
+
+
+/*  The parts of the server common to both backends: the listening sockets,
+    the connections and answering the lines received on them. A backend
+    gets input into connection::in, calls answer() and sends what that
+    (or later, reply()) appends to output(c), starting when told by
+    output_ready(). It runs posted tasks (run_posted()) when post_fd_ is
+    readable. */
+class line_server::implementation {
+public:
+    implementation()
+    {
+        stop_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        // (blocking, for io_uring to read; we only read it when it's readable)
+        post_fd_ = ::eventfd(0, EFD_CLOEXEC);
+        if (stop_fd_ == -1 || post_fd_ == -1)
+            last_error_text_ = error_text("eventfd create failed", errno);
+    }
+
+    virtual ~implementation()
+    {
+        for (auto & c : live_)
+            if (c->fd != -1)
+                ::close(c->fd);
+        for (auto & l : listeners_) {
+            ::close(l->fd);
+            if (!l->unix_path.empty())
+                ::unlink(l->unix_path.c_str());
+        }
+        if (stop_fd_ != -1)
+            ::close(stop_fd_);
+        if (post_fd_ != -1)
+            ::close(post_fd_);
+    }
+
+    virtual const char * name() const = 0;
+
+    // (listening starts in run())
+    bool listen(const std::string & address, bool reuse_port)
+    {
+        if (stop_fd_ == -1 || post_fd_ == -1)
+            return false;
+        sockaddr_storage sa;
+        socklen_t len;
+        if (!parse_address(address, sa, len, last_error_text_))
+            return false;
+
+        const int fd = ::socket(sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            last_error_text_ = error_text("socket failed", errno);
+            return false;
+        }
+        auto l = std::make_unique<listener>();
+        l->fd = fd;
+        if (sa.ss_family == AF_UNIX) {
+            l->unix_path = reinterpret_cast<sockaddr_un *>(&sa)->sun_path;
+            ::unlink(l->unix_path.c_str()); // (left over from a previous run)
+        }
+        else {
+            const int on = 1;
+            ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+            if (reuse_port && ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) == -1) {
+                last_error_text_ = error_text("SO_REUSEPORT failed", errno);
+                ::close(fd);
+                return false;
+            }
+        }
+        if (::bind(fd, reinterpret_cast<sockaddr *>(&sa), len) == -1
+            || ::listen(fd, SOMAXCONN) == -1) {
+            last_error_text_ = error_text("Listen on '" + address + "' failed", errno);
+            ::close(fd);
+            return false;
+        }
+        if (sa.ss_family == AF_INET) {
+            sockaddr_in bound{};
+            socklen_t bound_len = sizeof bound;
+            if (::getsockname(fd, reinterpret_cast<sockaddr *>(&bound), &bound_len) == 0)
+                port_ = ntohs(bound.sin_port);
+        }
+        listeners_.push_back(std::move(l));
+        return true;
+    }
+
+    uint16_t port() const { return port_; }
+
+    bool run(handler h)
+    {
+        handler_ = std::move(h);
+        deferred_ = nullptr;
+        return serve();
+    }
+
+    bool run_deferred(deferred_handler h)
+    {
+        handler_ = nullptr;
+        deferred_ = std::move(h);
+        return serve();
+    }
+
+    void reply(ticket t, const std::string & text)
+    {
+        const auto i = by_number_.find(t.connection);
+        if (i == by_number_.end() || i->second->closing)
+            return;
+        connection & c = *i->second;
+        const size_t slot = static_cast<size_t>(t.line - c.lines_out);
+        if (t.line < c.lines_out || slot >= c.waiting.size() || c.waiting[slot])
+            return;
+        c.waiting[slot] = text;
+        if (slot != 0)
+            return; // (an earlier line's reply must go first)
+        std::string & out = output(c);
+        for (; !c.waiting.empty() && c.waiting.front(); c.waiting.pop_front(), ++c.lines_out)
+            append_reply(out, *c.waiting.front());
+        if (!in_answer_)
+            output_ready(c);
+    }
+
+    void post(std::function<void()> task)
+    {
+        mailbox_.push(std::move(task));
+        // (one wake-up will do for any number of tasks; run_posted()
+        // clears wake_pending_ before it looks for them)
+        if (!wake_pending_.exchange(true, std::memory_order_acq_rel)) {
+            const uint64_t one = 1;
+            [[maybe_unused]] const ssize_t n = ::write(post_fd_, &one, sizeof one);
+        }
+    }
+
+    void stop()
+    {
+        const uint64_t one = 1;
+        // (this is async-signal-safe; if it fails the counter is already
+        // non-zero, so run() will stop anyway)
+        [[maybe_unused]] const ssize_t n = ::write(stop_fd_, &one, sizeof one);
+    }
+
+    size_t connections() const { return connection_count_; }
+
+    statistics stats() const
+    {
+        statistics s;
+        s.lines = lines_;
+        s.syscalls = syscalls_;
+        return s;
+    }
+
+    std::string last_error_text() const { return last_error_text_; }
+
+    void set_last_error_text(const std::string & text) { last_error_text_ = text; }
+
+protected:
+    struct endpoint {
+        int fd{ -1 };
+        bool is_listener{ false };
+    };
+
+    struct listener : endpoint {
+        listener() { is_listener = true; }
+        std::string unix_path;
+        bool stalled{ false };          // (io_uring) accepting again when a connection closes
+    };
+
+    struct connection : endpoint {
+        unsigned long long number{ 0 };
+        unsigned long long lines_out{ 0 };  // the line the next reply is for
+        std::deque<std::optional<std::string>> waiting; // deferred replies, from lines_out
+        std::string in;                 // received but not yet answered
+        std::string out;                // replies not yet sent, from out_pos
+        size_t out_pos{ 0 };
+        std::string out_next;           // (io_uring) replies to send after out
+        std::string session_id;         // for lines with no session id
+        size_t index{ 0 };              // in live_
+        bool paused{ false };           // not reading until output drains
+        bool peer_closed{ false };      // no more input will come
+        bool closing{ false };
+        bool recv_armed{ false };       // (io_uring) a receive is outstanding
+        bool send_in_flight{ false };   // (io_uring) a send is outstanding
+    };
+
+    int stop_fd_{ -1 };
+    int post_fd_{ -1 };                 // readable when tasks have been posted
+    uint16_t port_{ 0 };
+    handler handler_;                   // (one of these is set by run())
+    deferred_handler deferred_;
+    std::unordered_map<unsigned long long, connection *> by_number_;    // (if deferred_)
+    bool in_answer_{ false };
+    mailbox mailbox_;
+    std::atomic<bool> wake_pending_{ false };
+    std::vector<std::unique_ptr<listener>> listeners_;
+    std::vector<std::unique_ptr<connection>> live_;
+    std::vector<std::unique_ptr<connection>> free_;
+    std::vector<connection *> closing_;
+    std::atomic<size_t> connection_count_{ 0 };
+    std::atomic<unsigned long long> lines_{ 0 };
+    std::atomic<unsigned long long> syscalls_{ 0 };
+    std::string last_error_text_;
+
+    virtual bool serve() = 0;
+
+    // the buffer c's replies should be appended to
+    virtual std::string & output(connection & c) = 0;
+
+    // replies have been appended to output(c) other than by answer()
+    virtual void output_ready(connection & c) = 0;
+
+    // run the tasks posted so far
+    void run_posted()
+    {
+        wake_pending_.store(false, std::memory_order_seq_cst);
+        while (auto task = mailbox_.pop())
+            (*task)();
+    }
+
+    // true if c shouldn't be read from until some of its output is sent
+    bool too_much_pending(const connection & c) const
+    {
+        return c.out.size() - c.out_pos + c.out_next.size() > max_pending_output
+            || c.waiting.size() > max_waiting_replies;
+    }
+
+    // return a connection for the socket fd just accepted from l
+    connection & new_connection(int fd, const listener & l)
+    {
+        if (l.unix_path.empty()) {
+            const int on = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+            ++syscalls_;
+        }
+        std::unique_ptr<connection> c;
+        if (free_.empty())
+            c = std::make_unique<connection>();
+        else {
+            c = std::move(free_.back());
+            free_.pop_back();
+        }
+        c->fd = fd;
+        c->number = ++connection_numbers;
+        c->session_id = "connection-" + std::to_string(c->number);
+        c->index = live_.size();
+        if (deferred_)
+            by_number_[c->number] = c.get();
+        live_.push_back(std::move(c));
+        ++connection_count_;
+        return *live_.back();
+    }
+
+    // answer every complete line in c.in, appending the replies (those
+    // that aren't deferred) to output(c); false if what's left is too long
+    // to be a line
+    bool answer(connection & c)
+    {
+        in_answer_ = true;
+        size_t start = 0;
+        for (size_t end; (end = c.in.find('\n', start)) != std::string::npos; start = end + 1) {
+            size_t line_end = end;
+            if (line_end > start && c.in[line_end - 1] == '\r')
+                --line_end;
+            // (look for the tab in this line only: a line without one
+            // mustn't cost a scan of everything after it)
+            const char * line = c.in.data() + start;
+            const char * t = static_cast<const char *>(memchr(line, '\t', line_end - start));
+            const size_t tab = t ? start + (t - line) : line_end;
+            std::string id, input;
+            if (tab < line_end) {
+                id = c.in.substr(start, tab - start);
+                input = c.in.substr(tab + 1, line_end - tab - 1);
+            }
+            else {
+                id = c.session_id;
+                input = c.in.substr(start, line_end - start);
+            }
+            if (deferred_) {
+                c.waiting.emplace_back();
+                deferred_(id, input, ticket{ c.number, c.lines_out + c.waiting.size() - 1 });
+            }
+            else
+                append_reply(output(c), handler_(id, input));
+        }
+        c.in.erase(0, start);
+        in_answer_ = false;
+        return c.in.size() <= max_line_length;
+    }
+
+    void append_reply(std::string & out, std::string reply)
+    {
+        for (auto & ch : reply)
+            if (ch == '\n' || ch == '\r')
+                ch = ' ';
+        out += reply;
+        out += '\n';
+        ++lines_;
+    }
+
+    // move c (whose socket is closed) from live_ to free_, keeping modest
+    // buffers for reuse
+    void release(connection & c)
+    {
+        std::unique_ptr<connection> owned(std::move(live_[c.index]));
+        if (c.index + 1 != live_.size()) {
+            live_[c.index] = std::move(live_.back());
+            live_[c.index]->index = c.index;
+        }
+        live_.pop_back();
+        --connection_count_;
+        by_number_.erase(c.number);
+
+        if (free_.size() < max_free_connections) {
+            c.in.clear();
+            c.out.clear();
+            c.out_next.clear();
+            if (c.in.capacity() > max_line_length)
+                std::string().swap(c.in);
+            if (c.out.capacity() > max_line_length)
+                std::string().swap(c.out);
+            if (c.out_next.capacity() > max_line_length)
+                std::string().swap(c.out_next);
+            c.out_pos = 0;
+            c.waiting.clear();
+            c.lines_out = 0;
+            c.paused = c.peer_closed = c.closing = c.recv_armed = c.send_in_flight = false;
+            free_.push_back(std::move(owned));
+        }
+    }
+};
+
+
+namespace {
+
+using handler = line_server::handler;
+
+
+// one thread serving every connection with non-blocking sockets and
+// edge-triggered epoll
+class epoll_implementation : public line_server::implementation {
+public:
+    epoll_implementation()
+    {
+        epoll_fd_ = ::epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd_ == -1) {
+            last_error_text_ = error_text("epoll create failed", errno);
+            return;
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.ptr = &stop_endpoint_;
+        ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, stop_fd_, &ev);
+        ev.data.ptr = &post_endpoint_;
+        ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, post_fd_, &ev);
+    }
+
+    ~epoll_implementation() override
+    {
+        if (epoll_fd_ != -1)
+            ::close(epoll_fd_);
+    }
+
+    const char * name() const override { return "epoll"; }
+
+private:
+    int epoll_fd_{ -1 };
+    endpoint stop_endpoint_;
+    endpoint post_endpoint_;
+
+    bool serve() override
+    {
+        if (epoll_fd_ == -1 || stop_fd_ == -1 || post_fd_ == -1)
+            return false;
+        for (auto & l : listeners_) {
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLET;
+            ev.data.ptr = l.get();
+            if (::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, l->fd, &ev) == -1 && errno != EEXIST) {
+                last_error_text_ = error_text("epoll_ctl failed", errno);
+                return false;
+            }
+        }
+        std::vector<epoll_event> events(256);
+        for (bool stopping = false; !stopping; ) {
+            const int n = ::epoll_wait(epoll_fd_, events.data(), static_cast<int>(events.size()), -1);
+            ++syscalls_;
+            if (n == -1) {
+                if (errno == EINTR)
+                    continue;
+                last_error_text_ = error_text("epoll_wait failed", errno);
+                return false;
+            }
+            for (int i = 0; i < n; ++i) {
+                endpoint * e = static_cast<endpoint *>(events[i].data.ptr);
+                if (e == &stop_endpoint_) {
+                    uint64_t count;
+                    while (::read(stop_fd_, &count, sizeof count) == sizeof count)
+                        ;
+                    stopping = true;
+                }
+                else if (e == &post_endpoint_) {
+                    uint64_t count;
+                    [[maybe_unused]] const ssize_t r = ::read(post_fd_, &count, sizeof count);
+                    ++syscalls_;
+                    run_posted();
+                }
+                else if (e->is_listener)
+                    accept_all(*static_cast<listener *>(e));
+                else {
+                    connection & c = *static_cast<connection *>(e);
+                    if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                        read_all(c);
+                    if (!c.closing && (events[i].events & EPOLLOUT))
+                        flush(c);
+                }
+            }
+            // (closed only now, so no event above refers to a reused connection)
+            for (connection * c : closing_)
+                release(*c);
+            closing_.clear();
+        }
+        return true;
+    }
+
+    std::string & output(connection & c) override { return c.out; }
+
+    void output_ready(connection & c) override
+    {
+        if (!c.closing)
+            flush(c);
+    }
+
+    void accept_all(listener & l)
+    {
+        for (;;) {
+            const int fd = ::accept4(l.fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            ++syscalls_;
+            if (fd == -1) {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                // EAGAIN: no more for now; otherwise (e.g. EMFILE) the
+                // rest wait until the next connection attempt wakes us
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    last_error_text_ = error_text("accept failed", errno);
+                return;
+            }
+            connection & c = new_connection(fd, l);
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.ptr = &c;
+            ++syscalls_;
+            if (::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) == -1) {
+                last_error_text_ = error_text("epoll_ctl failed", errno);
+                ::close(fd);
+                c.fd = -1;
+                release(c);
+            }
+        }
+    }
+
+    // read everything available on c (edge-triggered, so we must), answer
+    // every complete line and send the replies
+    void read_all(connection & c)
+    {
+        while (!c.peer_closed && !c.closing) {
+            if (too_much_pending(c)) {
+                c.paused = true; // (flush() resumes reading)
+                return;
+            }
+            const size_t old_size = c.in.size();
+            c.in.resize(old_size + 16 * 1024);
+            const ssize_t n = ::read(c.fd, &c.in[old_size], c.in.size() - old_size);
+            ++syscalls_;
+            c.in.resize(old_size + (n > 0 ? n : 0));
+            if (n > 0) {
+                if (!answer(c))
+                    close(c);
+            }
+            else if (n == 0)
+                c.peer_closed = true;
+            else if (errno == EINTR)
+                continue;
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            else
+                close(c);
+        }
+        if (!c.closing)
+            flush(c);
+    }
+
+    // send as much of c.out as the socket will take
+    void flush(connection & c)
+    {
+        while (c.out_pos < c.out.size()) {
+            const ssize_t n = ::send(c.fd, c.out.data() + c.out_pos, c.out.size() - c.out_pos, MSG_NOSIGNAL);
+            ++syscalls_;
+            if (n >= 0)
+                c.out_pos += n;
+            else if (errno == EINTR)
+                continue;
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return; // (EPOLLOUT will tell us when to carry on)
+            else {
+                close(c);
+                return;
+            }
+        }
+        c.out.clear();
+        c.out_pos = 0;
+        if (c.peer_closed) {
+            if (c.waiting.empty())
+                close(c);
+        }
+        else if (c.paused && !too_much_pending(c)) {
+            c.paused = false;
+            read_all(c);
+        }
+    }
+
+    void close(connection & c)
+    {
+        if (c.closing)
+            return;
+        c.closing = true;
+        ::close(c.fd); // (which also removes it from the epoll set)
+        ++syscalls_;
+        c.fd = -1;
+        closing_.push_back(&c);
+    }
+};
+
+
+
+/*  One thread serving every connection through an io_uring. Each time
+    round the loop one io_uring_enter() both submits everything queued
+    (sends, receives, closes) and waits for completions, so the system
+    calls per line fall as the load rises. Listeners have a multishot
+    accept and connections a multishot receive, so neither is resubmitted
+    for each connection or each read; received data goes into buffers from
+    a ring registered with the kernel (IORING_REGISTER_PBUF_RING), which
+    are handed back as soon as their data is copied to the connection.
+
+    A connection has at most one send outstanding, of its out buffer;
+    replies made meanwhile go to out_next, so out doesn't move under the
+    kernel's feet. A connection with too much output unsent has its
+    receive cancelled until the output drains. */
+class uring_implementation : public line_server::implementation {
+public:
+    // return the io_uring backend, or null, with why set, if this kernel
+    // can't support it (multishot receive needs Linux 6.0)
+    static std::unique_ptr<uring_implementation> create(std::string & why)
+    {
+        utsname u;
+        unsigned major = 0, minor = 0;
+        if (::uname(&u) != 0 || std::sscanf(u.release, "%u.%u", &major, &minor) != 2 || major < 6) {
+            why = "io_uring backend needs Linux 6.0 or later";
+            return nullptr;
+        }
+        std::unique_ptr<uring_implementation> result(new uring_implementation);
+        if (!result->setup(why))
+            return nullptr;
+        return result;
+    }
+
+    ~uring_implementation() override
+    {
+        // (closing the ring cancels everything outstanding, before the
+        // connections' buffers go)
+        if (ring_fd_ != -1)
+            ::close(ring_fd_);
+        if (sq_ring_ != MAP_FAILED)
+            ::munmap(sq_ring_, sq_ring_size_);
+        if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+            ::munmap(cq_ring_, cq_ring_size_);
+        if (sqes_ != MAP_FAILED)
+            ::munmap(sqes_, sqes_size_);
+        if (buf_ring_ != MAP_FAILED)
+            ::munmap(buf_ring_, buffer_count * sizeof(io_uring_buf));
+        if (buffers_ != MAP_FAILED)
+            ::munmap(buffers_, buffer_count * buffer_size);
+    }
+
+    const char * name() const override { return "io_uring"; }
+
+private:
+    bool serve() override
+    {
+        // (the ring was created disabled so that the thread calling run()
+        // may become its single issuer)
+        ++syscalls_;
+        if (::syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_ENABLE_RINGS, nullptr, 0) == -1) {
+            last_error_text_ = error_text("io_uring enable failed", errno);
+            return false;
+        }
+        io_uring_sqe * sqe = next_sqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = stop_fd_;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = op_stop;
+        arm_post();
+        for (auto & l : listeners_)
+            arm_accept(*l);
+
+        for (stopping_ = false; !stopping_; ) {
+            if (enter(IORING_ENTER_GETEVENTS, 1) == -1
+                && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                last_error_text_ = error_text("io_uring_enter failed", errno);
+                return false;
+            }
+            unsigned head = *cq_head_;
+            const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head) {
+                const io_uring_cqe & cqe = cqes_[head & cq_mask_];
+                complete(cqe.user_data, cqe.res, cqe.flags);
+            }
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+            // (released only now, so no completion above refers to a reused connection)
+            for (connection * c : closing_)
+                release(*c);
+            closing_.clear();
+            if (stalled_ && live_.size() < stalled_at_) {
+                stalled_ = false;
+                for (auto & l : listeners_)
+                    if (l->stalled)
+                        arm_accept(*l);
+            }
+        }
+        return true;
+    }
+
+    std::string & output(connection & c) override { return c.out_next; }
+
+    void output_ready(connection & c) override
+    {
+        settle(c);
+    }
+
+    static constexpr unsigned ring_entries = 4096;
+    static constexpr unsigned buffer_count = 1024;      // (a power of 2)
+    static constexpr unsigned buffer_size = 4096;
+    static constexpr uint16_t buffer_group = 0;
+
+    // a completion's user_data is the listener or connection it concerns
+    // with what the operation was in the low bits
+    enum operation : uint64_t {
+        op_stop, op_post, op_accept, op_recv, op_send, op_ignore,
+        op_mask = 7
+    };
+
+    int ring_fd_{ -1 };
+    void * sq_ring_{ MAP_FAILED };
+    void * cq_ring_{ MAP_FAILED };
+    size_t sq_ring_size_{ 0 };
+    size_t cq_ring_size_{ 0 };
+    io_uring_sqe * sqes_{ static_cast<io_uring_sqe *>(MAP_FAILED) };
+    size_t sqes_size_{ 0 };
+    unsigned * sq_head_{ nullptr };
+    unsigned * sq_tail_{ nullptr };
+    unsigned * sq_array_{ nullptr };
+    unsigned sq_mask_{ 0 };
+    unsigned sq_entries_{ 0 };
+    unsigned sq_tail_local_{ 0 };   // (published to *sq_tail_ on enter())
+    unsigned * cq_head_{ nullptr };
+    unsigned * cq_tail_{ nullptr };
+    unsigned cq_mask_{ 0 };
+    io_uring_cqe * cqes_{ nullptr };
+
+    // (io_uring_buf_ring as an array: in C++ its flexible array member
+    // comes after an empty struct of size 1, so bufs isn't at offset 0)
+    io_uring_buf * buf_ring_{ static_cast<io_uring_buf *>(MAP_FAILED) };
+    char * buffers_{ static_cast<char *>(MAP_FAILED) };
+    uint16_t buf_ring_tail_{ 0 };
+
+    uint64_t post_count_{ 0 };      // (read from post_fd_)
+    bool stopping_{ false };
+    bool stalled_{ false };         // a listener is waiting for a connection to close
+    size_t stalled_at_{ 0 };        // ...below this many
+
+    uring_implementation() = default;
+
+    static uint64_t tag(const void * p, operation op)
+    {
+        return reinterpret_cast<uint64_t>(p) | op;
+    }
+
+    bool setup(std::string & why)
+    {
+        if (stop_fd_ == -1) {
+            why = last_error_text_;
+            return false;
+        }
+        io_uring_params p{};
+        p.flags = IORING_SETUP_R_DISABLED | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+        ring_fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, ring_entries, &p));
+        if (ring_fd_ == -1 && errno == EINVAL) {
+            p = io_uring_params{};
+            p.flags = IORING_SETUP_R_DISABLED;
+            ring_fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, ring_entries, &p));
+        }
+        if (ring_fd_ == -1) {
+            why = error_text("io_uring_setup failed", errno);
+            return false;
+        }
+
+        sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        const bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap)
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        sq_ring_ = ::mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+        cq_ring_ = single_mmap ? sq_ring_ : ::mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+        sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = static_cast<io_uring_sqe *>(::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES));
+        if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED || sqes_ == MAP_FAILED) {
+            why = error_text("io_uring mmap failed", errno);
+            return false;
+        }
+        char * sq = static_cast<char *>(sq_ring_);
+        sq_head_ = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+        sq_array_ = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+        sq_mask_ = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+        sq_entries_ = p.sq_entries;
+        sq_tail_local_ = *sq_tail_;
+        char * cq = static_cast<char *>(cq_ring_);
+        cq_head_ = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+
+        // the receive buffers and the ring through which we hand them to the kernel
+        buf_ring_ = static_cast<io_uring_buf *>(::mmap(nullptr, buffer_count * sizeof(io_uring_buf),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        buffers_ = static_cast<char *>(::mmap(nullptr, buffer_count * buffer_size,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (buf_ring_ == MAP_FAILED || buffers_ == MAP_FAILED) {
+            why = error_text("buffer mmap failed", errno);
+            return false;
+        }
+        io_uring_buf_reg reg{};
+        reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring_);
+        reg.ring_entries = buffer_count;
+        reg.bgid = buffer_group;
+        if (::syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+            why = error_text("io_uring buffer ring registration failed", errno);
+            return false;
+        }
+        for (unsigned bid = 0; bid < buffer_count; ++bid)
+            recycle(static_cast<uint16_t>(bid));
+        return true;
+    }
+
+    // publish what's queued and call io_uring_enter(); return its result
+    int enter(unsigned flags, unsigned min_complete)
+    {
+        __atomic_store_n(sq_tail_, sq_tail_local_, __ATOMIC_RELEASE);
+        const unsigned to_submit = sq_tail_local_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        ++syscalls_;
+        return static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd_, to_submit, min_complete, flags, nullptr, 0));
+    }
+
+    // return a cleared submission queue entry, to be submitted on the next enter()
+    io_uring_sqe * next_sqe()
+    {
+        while (sq_tail_local_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_) {
+            if (enter(0, 0) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                break;
+        }
+        const unsigned index = sq_tail_local_ & sq_mask_;
+        io_uring_sqe * sqe = &sqes_[index];
+        ::memset(sqe, 0, sizeof *sqe);
+        sq_array_[index] = index;
+        ++sq_tail_local_;
+        return sqe;
+    }
+
+    // give buffer bid back to the kernel for receiving into
+    void recycle(uint16_t bid)
+    {
+        io_uring_buf & b = buf_ring_[buf_ring_tail_ & (buffer_count - 1)];
+        // (set each field but resv: the ring's tail is buf_ring_[0].resv)
+        b.addr = reinterpret_cast<uint64_t>(buffers_ + size_t(bid) * buffer_size);
+        b.len = buffer_size;
+        b.bid = bid;
+        __atomic_store_n(&buf_ring_[0].resv, ++buf_ring_tail_, __ATOMIC_RELEASE);
+    }
+
+    void arm_post()
+    {
+        io_uring_sqe * sqe = next_sqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = post_fd_;
+        sqe->addr = reinterpret_cast<uint64_t>(&post_count_);
+        sqe->len = sizeof post_count_;
+        sqe->user_data = op_post;
+    }
+
+    void arm_accept(listener & l)
+    {
+        l.stalled = false;
+        io_uring_sqe * sqe = next_sqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = l.fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = tag(&l, op_accept);
+    }
+
+    void arm_recv(connection & c)
+    {
+        io_uring_sqe * sqe = next_sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = c.fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = buffer_group;
+        sqe->user_data = tag(&c, op_recv);
+        c.recv_armed = true;
+    }
+
+    // cancel c's receive or, if all, everything outstanding on c
+    void cancel(connection & c, bool all)
+    {
+        io_uring_sqe * sqe = next_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        if (all) {
+            sqe->fd = c.fd;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        }
+        else
+            sqe->addr = tag(&c, op_recv);
+        sqe->user_data = op_ignore;
+    }
+
+    void complete(uint64_t user_data, int res, unsigned flags)
+    {
+        void * p = reinterpret_cast<void *>(user_data & ~uint64_t(op_mask));
+        switch (user_data & op_mask) {
+        case op_stop:
+            stopping_ = true;
+            break;
+        case op_post:
+            run_posted();
+            arm_post();
+            break;
+        case op_accept:
+            accepted(*static_cast<listener *>(p), res, flags);
+            break;
+        case op_recv:
+            received(*static_cast<connection *>(p), res, flags);
+            break;
+        case op_send:
+            sent(*static_cast<connection *>(p), res);
+            break;
+        default:
+            break;
+        }
+    }
+
+    void accepted(listener & l, int res, unsigned flags)
+    {
+        if (res >= 0)
+            arm_recv(new_connection(res, l));
+        else if (res != -ECONNABORTED && res != -EINTR)
+            last_error_text_ = error_text("accept failed", -res);
+        if (!(flags & IORING_CQE_F_MORE)) {
+            // the kernel has stopped accepting for us; if we're out of file
+            // descriptors or memory try again when a connection has closed
+            if (res == -EMFILE || res == -ENFILE || res == -ENOBUFS || res == -ENOMEM) {
+                l.stalled = stalled_ = true;
+                stalled_at_ = live_.size();
+            }
+            else
+                arm_accept(l);
+        }
+    }
+
+    void received(connection & c, int res, unsigned flags)
+    {
+        if (flags & IORING_CQE_F_BUFFER) {
+            const uint16_t bid = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+            if (res > 0 && !c.closing)
+                c.in.append(buffers_ + size_t(bid) * buffer_size, res);
+            recycle(bid);
+        }
+        if (!(flags & IORING_CQE_F_MORE))
+            c.recv_armed = false; // (settle() rearms it if need be)
+        if (res > 0) {
+            if (!c.closing && !answer(c))
+                begin_close(c);
+        }
+        else if (res == 0)
+            c.peer_closed = true;
+        else if (res != -ENOBUFS && res != -ECANCELED && res != -EINTR)
+            begin_close(c);
+        settle(c);
+    }
+
+    void sent(connection & c, int res)
+    {
+        c.send_in_flight = false;
+        if (res >= 0)
+            c.out_pos += res;
+        else if (res != -EINTR && res != -EAGAIN)
+            begin_close(c);
+        settle(c);
+    }
+
+    void begin_close(connection & c)
+    {
+        if (c.closing)
+            return;
+        c.closing = true;
+        if (c.recv_armed || c.send_in_flight)
+            cancel(c, true);
+    }
+
+    // start whatever c needs next: sending, receiving or closing
+    void settle(connection & c)
+    {
+        if (!c.closing) {
+            if (!c.send_in_flight) {
+                if (c.out_pos == c.out.size()) {
+                    c.out.clear();
+                    c.out_pos = 0;
+                    c.out.swap(c.out_next);
+                }
+                if (c.out_pos < c.out.size()) {
+                    io_uring_sqe * sqe = next_sqe();
+                    sqe->opcode = IORING_OP_SEND;
+                    sqe->fd = c.fd;
+                    sqe->addr = reinterpret_cast<uint64_t>(c.out.data() + c.out_pos);
+                    sqe->len = static_cast<uint32_t>(std::min<size_t>(c.out.size() - c.out_pos, 1u << 30));
+                    sqe->msg_flags = MSG_NOSIGNAL;
+                    sqe->user_data = tag(&c, op_send);
+                    c.send_in_flight = true;
+                }
+            }
+            if (too_much_pending(c)) {
+                if (!c.paused) {
+                    c.paused = true;
+                    if (c.recv_armed)
+                        cancel(c, false);
+                }
+            }
+            else if (c.out_pos == c.out.size() && c.out_next.empty()) {
+                c.paused = false;
+                if (c.peer_closed && c.waiting.empty())
+                    begin_close(c);
+            }
+            if (!c.closing && !c.paused && !c.peer_closed && !c.recv_armed)
+                arm_recv(c);
+        }
+        if (c.closing && !c.recv_armed && !c.send_in_flight && c.fd != -1) {
+            io_uring_sqe * sqe = next_sqe();
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = c.fd;
+            sqe->user_data = op_ignore;
+            c.fd = -1;
+            closing_.push_back(&c);
+        }
+    }
+};
+
+}//anonymous namespace
+
+
+line_server::line_server(backend b)
+{
+    std::string why_not;
+    if (b != backend::epoll)
+        impl_ = uring_implementation::create(why_not);
+    if (!impl_) {
+        impl_ = std::make_unique<epoll_implementation>();
+        if (b == backend::io_uring)
+            impl_->set_last_error_text(why_not);
+    }
+}
+
+line_server::~line_server() = default;
+
+const char * line_server::backend_name() const
+{
+    return impl_->name();
+}
+
+bool line_server::listen(const std::string & address, bool reuse_port)
+{
+    return impl_->listen(address, reuse_port);
+}
+
+uint16_t line_server::port() const
+{
+    return impl_->port();
+}
+
+bool line_server::run(handler h)
+{
+    return impl_->run(std::move(h));
+}
+
+bool line_server::run_deferred(deferred_handler h)
+{
+    return impl_->run_deferred(std::move(h));
+}
+
+void line_server::reply(ticket t, const std::string & text)
+{
+    impl_->reply(t, text);
+}
+
+void line_server::post(std::function<void()> task)
+{
+    impl_->post(std::move(task));
+}
+
+void line_server::stop()
+{
+    impl_->stop();
+}
+
+size_t line_server::connections() const
+{
+    return impl_->connections();
+}
+
+line_server::statistics line_server::stats() const
+{
+    return impl_->stats();
+}
+
+std::string line_server::last_error_text() const
+{
+    return impl_->last_error_text();
+}
+
+
+
+class line_server_group::implementation {
+public:
+    implementation(unsigned shards, line_server::backend b)
+    {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (::sched_getaffinity(0, sizeof allowed, &allowed) == 0)
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+                if (CPU_ISSET(cpu, &allowed))
+                    cpus_.push_back(cpu);
+        if (shards == 0)
+            shards = std::max<unsigned>(1, static_cast<unsigned>(cpus_.size()));
+        for (unsigned i = 0; i < shards; ++i)
+            servers_.push_back(std::make_unique<line_server>(b));
+        handlers_.resize(shards);
+        handoffs_ = std::make_unique<shard_counter[]>(shards);
+    }
+
+    unsigned shards() const { return static_cast<unsigned>(servers_.size()); }
+
+    const char * backend_name() const { return servers_[0]->backend_name(); }
+
+    bool listen(const std::string & address)
+    {
+        if (address.compare(0, 5, "unix:") == 0)
+            return listened(*servers_[0], servers_[0]->listen(address));
+        if (!listened(*servers_[0], servers_[0]->listen(address, true)))
+            return false;
+        // (so if the port was 0 the others listen on the one the first got)
+        const auto colon = address.rfind(':');
+        const std::string shared((colon == std::string::npos ? "" : address.substr(0, colon + 1))
+            + std::to_string(servers_[0]->port()));
+        for (size_t i = 1; i < servers_.size(); ++i)
+            if (!listened(*servers_[i], servers_[i]->listen(shared, true)))
+                return false;
+        return true;
+    }
+
+    uint16_t port() const { return servers_[0]->port(); }
+
+    bool run(const std::function<line_server::handler(unsigned shard)> & make_handler)
+    {
+        std::vector<std::thread> threads;
+        std::vector<char> ok(servers_.size(), true);
+        for (unsigned i = 0; i < servers_.size(); ++i) {
+            threads.emplace_back([&, i]() {
+                if (!cpus_.empty()) {
+                    cpu_set_t set;
+                    CPU_ZERO(&set);
+                    CPU_SET(cpus_[i % cpus_.size()], &set);
+                    ::pthread_setaffinity_np(::pthread_self(), sizeof set, &set);
+                }
+                // (so the handler's state is allocated by, and near, its thread)
+                handlers_[i] = make_handler(i);
+                ok[i] = servers_[i]->run_deferred([this, i](const std::string & id, const std::string & input, line_server::ticket t) {
+                    route(i, id, input, t);
+                });
+                if (!ok[i])
+                    stop(); // (the others may be waiting on this shard)
+            });
+        }
+        for (auto & t : threads)
+            t.join();
+        for (size_t i = 0; i < servers_.size(); ++i)
+            if (!ok[i]) {
+                last_error_text_ = servers_[i]->last_error_text();
+                return false;
+            }
+        return true;
+    }
+
+    void stop()
+    {
+        for (auto & server : servers_)
+            server->stop();
+    }
+
+    size_t connections() const
+    {
+        size_t total = 0;
+        for (auto & server : servers_)
+            total += server->connections();
+        return total;
+    }
+
+    line_server::statistics stats() const
+    {
+        line_server::statistics total;
+        for (auto & server : servers_) {
+            const auto s = server->stats();
+            total.lines += s.lines;
+            total.syscalls += s.syscalls;
+        }
+        return total;
+    }
+
+    unsigned long long handoffs() const
+    {
+        unsigned long long total = 0;
+        for (size_t i = 0; i < servers_.size(); ++i)
+            total += handoffs_[i].count;
+        return total;
+    }
+
+    std::string last_error_text() const { return last_error_text_; }
+
+private:
+    // (each shard's in a cache line of its own, only that shard writing it)
+    struct alignas(64) shard_counter {
+        std::atomic<unsigned long long> count{ 0 };
+    };
+
+    std::vector<int> cpus_;         // those we may run on
+    std::vector<std::unique_ptr<line_server>> servers_;
+    std::vector<line_server::handler> handlers_;    // (each used by its shard only)
+    std::unique_ptr<shard_counter[]> handoffs_;
+    std::string last_error_text_;
+
+    bool listened(const line_server & server, bool ok)
+    {
+        if (!ok)
+            last_error_text_ = server.last_error_text();
+        return ok;
+    }
+
+    // answer the line t, from shard i, on the shard its session belongs to
+    void route(unsigned i, const std::string & id, const std::string & input, line_server::ticket t)
+    {
+        const unsigned owner = line_server_group::shard_of(id, shards());
+        if (owner == i) {
+            servers_[i]->reply(t, handlers_[i](id, input));
+            return;
+        }
+        handoffs_[i].count.store(handoffs_[i].count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        servers_[owner]->post([this, owner, i, id, input, t]() {
+            std::string reply(handlers_[owner](id, input));
+            servers_[i]->post([this, i, t, reply = std::move(reply)]() {
+                servers_[i]->reply(t, reply);
+            });
+        });
+    }
+};
+
+
+line_server_group::line_server_group(unsigned shards, line_server::backend b)
+    : impl_(std::make_unique<implementation>(shards, b))
+{}
+
+line_server_group::~line_server_group() = default;
+
+unsigned line_server_group::shards() const
+{
+    return impl_->shards();
+}
+
+unsigned line_server_group::shard_of(const std::string & session_id, unsigned shards)
+{
+    // (FNV-1a, not std::hash, which a session_table within a shard may use:
+    // all of a shard's ids then having the same std::hash modulo shards
+    // would crowd them into few of its table's shards)
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (const unsigned char c : session_id) {
+        h ^= c;
+        h *= 0x100000001b3ull;
+    }
+    return shards == 0 ? 0 : static_cast<unsigned>(h % shards);
+}
+
+const char * line_server_group::backend_name() const
+{
+    return impl_->backend_name();
+}
+
+bool line_server_group::listen(const std::string & address)
+{
+    return impl_->listen(address);
+}
+
+uint16_t line_server_group::port() const
+{
+    return impl_->port();
+}
+
+bool line_server_group::run(std::function<line_server::handler(unsigned shard)> make_handler)
+{
+    return impl_->run(make_handler);
+}
+
+void line_server_group::stop()
+{
+    impl_->stop();
+}
+
+size_t line_server_group::connections() const
+{
+    return impl_->connections();
+}
+
+line_server::statistics line_server_group::stats() const
+{
+    return impl_->stats();
+}
+
+unsigned long long line_server_group::handoffs() const
+{
+    return impl_->handoffs();
+}
+
+std::string line_server_group::last_error_text() const
+{
+    return impl_->last_error_text();
+}
+
+
+
+class line_client::implementation {
+public:
+    ~implementation() { close(); }
+
+    bool connect(const std::string & address)
+    {
+        close();
+        sockaddr_storage sa;
+        socklen_t len;
+        if (!parse_address(address, sa, len, last_error_text_))
+            return false;
+        fd_ = ::socket(sa.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd_ == -1) {
+            last_error_text_ = error_text("socket failed", errno);
+            return false;
+        }
+        if (::connect(fd_, reinterpret_cast<sockaddr *>(&sa), len) == -1) {
+            last_error_text_ = error_text("Connect to '" + address + "' failed", errno);
+            close();
+            return false;
+        }
+        if (sa.ss_family == AF_INET) {
+            const int on = 1;
+            ::setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+        }
+        return true;
+    }
+
+    bool send(const std::string & line)
+    {
+        const std::string data(line + '\n');
+        for (size_t sent = 0; sent < data.size(); ) {
+            const ssize_t n = ::send(fd_, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n == -1) {
+                if (errno == EINTR)
+                    continue;
+                last_error_text_ = error_text("send failed", errno);
+                return false;
+            }
+            sent += n;
+        }
+        return true;
+    }
+
+    bool receive(std::string & line)
+    {
+        for (;;) {
+            const auto lf = buffer_.find('\n');
+            if (lf != std::string::npos) {
+                line = buffer_.substr(0, lf);
+                buffer_.erase(0, lf + 1);
+                return true;
+            }
+            char data[4096];
+            const ssize_t n = ::read(fd_, data, sizeof data);
+            if (n > 0)
+                buffer_.append(data, n);
+            else if (n == -1 && errno == EINTR)
+                continue;
+            else {
+                last_error_text_ = n == 0 ? "Connection closed" : error_text("read failed", errno);
+                return false;
+            }
+        }
+    }
+
+    void close()
+    {
+        if (fd_ != -1)
+            ::close(fd_);
+        fd_ = -1;
+        buffer_.clear();
+    }
+
+    std::string last_error_text() const { return last_error_text_; }
+
+private:
+    int fd_{ -1 };
+    std::string buffer_;
+    std::string last_error_text_;
+};
+
+
+line_client::line_client()
+    : impl_(std::make_unique<implementation>())
+{}
+
+line_client::~line_client() = default;
+
+bool line_client::connect(const std::string & address)
+{
+    return impl_->connect(address);
+}
+
+bool line_client::send(const std::string & line)
+{
+    return impl_->send(line);
+}
+
+bool line_client::receive(std::string & line)
+{
+    return impl_->receive(line);
+}
+
+bool line_client::request(const std::string & line, std::string & reply)
+{
+    return impl_->send(line) && impl_->receive(reply);
+}
+
+void line_client::close()
+{
+    impl_->close();
+}
+
+std::string line_client::last_error_text() const
+{
+    return impl_->last_error_text();
+}
+
+
+
+line_load_result line_load(
+    const std::string & address,
+    size_t connections,
+    size_t requests_per_connection,
+    size_t pipeline,
+    const std::vector<std::string> & inputs)
+{
+    using clock = std::chrono::steady_clock;
+    line_load_result result;
+    sockaddr_storage sa;
+    socklen_t len;
+    std::string error;
+    if (inputs.empty() || pipeline == 0 || !parse_address(address, sa, len, error))
+        return result;
+
+    struct client {
+        int fd{ -1 };
+        std::string prefix;         // "c<n> TAB"
+        std::string out, in;
+        size_t out_pos{ 0 };
+        size_t sent{ 0 };           // lines queued in out (or sent)
+        size_t received{ 0 };
+        std::deque<clock::time_point> started;
+        bool want_out{ false };     // in the epoll set for EPOLLOUT
+    };
+    std::vector<client> clients(connections);
+    std::vector<double> latencies;
+    latencies.reserve(connections * requests_per_connection);
+    const int epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+        return result;
+
+    size_t remaining = 0;
+    auto finish = [&](client & c, bool failed) {
+        ::close(c.fd); // (which also removes it from the epoll set)
+        c.fd = -1;
+        --remaining;
+        if (failed)
+            ++result.errors;
+    };
+    // queue more requests, send what the socket will take; false on error
+    auto pump = [&](client & c) {
+        while (c.sent < requests_per_connection && c.sent - c.received < pipeline) {
+            c.out += c.prefix;
+            c.out += inputs[c.sent % inputs.size()];
+            c.out += '\n';
+            c.started.push_back(clock::now());
+            ++c.sent;
+        }
+        while (c.out_pos < c.out.size()) {
+            const ssize_t n = ::send(c.fd, c.out.data() + c.out_pos, c.out.size() - c.out_pos, MSG_NOSIGNAL);
+            if (n >= 0)
+                c.out_pos += n;
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            else if (errno != EINTR)
+                return false;
+        }
+        if (c.out_pos == c.out.size()) {
+            c.out.clear();
+            c.out_pos = 0;
+        }
+        const bool want_out = !c.out.empty();
+        if (want_out != c.want_out) {
+            c.want_out = want_out;
+            epoll_event ev{};
+            ev.events = want_out ? EPOLLIN | EPOLLOUT : EPOLLIN;
+            ev.data.ptr = &c;
+            ::epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c.fd, &ev);
+        }
+        return true;
+    };
+
+    const auto start = clock::now();
+    for (size_t i = 0; i < connections; ++i) {
+        client & c = clients[i];
+        c.prefix = "c" + std::to_string(i) + "\t";
+        c.fd = ::socket(sa.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (c.fd == -1 || ::connect(c.fd, reinterpret_cast<sockaddr *>(&sa), len) == -1) {
+            if (c.fd != -1)
+                ::close(c.fd);
+            c.fd = -1;
+            ++result.errors;
+            continue;
+        }
+        const int on = 1;
+        if (sa.ss_family == AF_INET)
+            ::setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+        ::fcntl(c.fd, F_SETFL, ::fcntl(c.fd, F_GETFL) | O_NONBLOCK);
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.ptr = &c;
+        ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c.fd, &ev);
+        ++remaining;
+        if (requests_per_connection == 0)
+            finish(c, false);
+        else if (!pump(c))
+            finish(c, true);
+    }
+
+    std::vector<epoll_event> events(256);
+    while (remaining > 0) {
+        const int n = ::epoll_wait(epoll_fd, events.data(), static_cast<int>(events.size()), 10000);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break; // (no reply in 10 seconds: give up)
+        for (int i = 0; i < n; ++i) {
+            client & c = *static_cast<client *>(events[i].data.ptr);
+            if (c.fd == -1)
+                continue;
+            bool failed = false;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                char data[16 * 1024];
+                const ssize_t got = ::read(c.fd, data, sizeof data);
+                if (got > 0) {
+                    c.in.append(data, got);
+                    size_t pos = 0;
+                    for (size_t lf; (lf = c.in.find('\n', pos)) != std::string::npos; pos = lf + 1) {
+                        if (c.started.empty()) {
+                            failed = true; // (a reply we didn't ask for)
+                            break;
+                        }
+                        const std::chrono::duration<double, std::micro> rtt(clock::now() - c.started.front());
+                        latencies.push_back(rtt.count());
+                        c.started.pop_front();
+                        ++c.received;
+                    }
+                    c.in.erase(0, pos);
+                }
+                else if (got == 0 || (errno != EAGAIN && errno != EINTR))
+                    failed = true;
+            }
+            if (failed)
+                finish(c, true);
+            else if (c.received == requests_per_connection)
+                finish(c, false);
+            else if (!pump(c))
+                finish(c, true);
+        }
+    }
+    result.seconds = std::chrono::duration<double>(clock::now() - start).count();
+    for (auto & c : clients)
+        if (c.fd != -1) {
+            ::close(c.fd);
+            ++result.errors;
+        }
+    ::close(epoll_fd);
+
+    result.requests = latencies.size();
+    if (!latencies.empty()) {
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&](double p) {
+            return latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))];
+        };
+        result.p50_us = percentile(0.50);
+        result.p99_us = percentile(0.99);
+        result.p999_us = percentile(0.999);
+        result.max_us = latencies.back();
+    }
+    return result;
+}
@@ -0,0 +1,878 @@
+// Implement shm_server and shm_client for Linux.
+// Each channel is a memfd shared by the server and one client; the server
+// is one thread serving every channel.
+
+
+#include "shm_server.h"
+
+#include <linux/futex.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <thread>
+#include <vector>
+
+
+namespace {
+
+// the size of each ring, in bytes (a power of 2)
+const uint32_t ring_capacity = 64 * 1024;
+
+// the most a request or response may hold, in bytes (a longer reply is
+// cut short)
+const uint32_t max_record_length = ring_capacity / 4;
+
+// (a record length meaning the next record is at the start of the ring)
+const uint32_t wrap_marker = 0xffffffff;
+
+const uint32_t channel_magic = 0x454c5a31; // "ELZ1"
+
+// how long to poll for work before going to sleep, if there's another
+// CPU the other side may be running on (with only one, polling would
+// just keep the other side from running)
+const std::chrono::microseconds server_spin(50);
+const std::chrono::microseconds client_spin(20);
+
+// how long a client sleeps before checking whether the server has gone
+const long client_check_ns = 100 * 1000 * 1000;
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free,
+    "atomics shared between processes must be lock-free");
+
+
+/*  A ring of records with one producer and one consumer, which may be in
+    different processes. head and tail count the bytes ever written and
+    read (modulo 2^32), so the ring is empty when they are equal. A record
+    is a 4-byte length and that many bytes, padded to a multiple of 4. A
+    record never wraps: if there isn't room for it before the end of the
+    ring the producer writes wrap_marker and puts it at the start.
+
+    A side that has found nothing to do and is going to sleep first sets
+    its waiting flag, then looks again; the other side, having moved head
+    or tail, wakes it if the flag is set. (The stores and loads are
+    sequentially consistent so they can't both miss.) */
+struct ring {
+    alignas(64) std::atomic<uint32_t> head{ 0 };
+    std::atomic<uint32_t> consumer_waiting{ 0 };    // for head to move
+    alignas(64) std::atomic<uint32_t> tail{ 0 };
+    std::atomic<uint32_t> producer_waiting{ 0 };    // for tail to move
+    alignas(64) unsigned char data[ring_capacity];
+};
+
+// the shared memory of a channel
+struct channel_memory {
+    uint32_t magic{ channel_magic };
+    uint32_t capacity{ ring_capacity };
+    std::atomic<uint32_t> closed{ 0 };              // the server has gone
+    ring requests;                                  // client to server
+    ring responses;                                 // server to client
+};
+
+
+std::string error_text(const std::string & what, int error_number)
+{
+    return what + ": " + ::strerror(error_number);
+}
+
+
+uint32_t padded(uint32_t n)
+{
+    return (n + 3) & ~3u;
+}
+
+uint32_t load_u32(const unsigned char * p)
+{
+    uint32_t n;
+    ::memcpy(&n, p, sizeof n);
+    return n;
+}
+
+void store_u32(unsigned char * p, uint32_t n)
+{
+    ::memcpy(p, &n, sizeof n);
+}
+
+
+// the bytes to skip to the start of the ring, if a record of n bytes
+// won't fit before the end of it, when head is as given
+uint32_t skip_for(uint32_t head, uint32_t n)
+{
+    const uint32_t at = head % ring_capacity;
+    return ring_capacity - at < 4 + padded(n) ? ring_capacity - at : 0;
+}
+
+// true if r has room for a record of n bytes (producer only)
+bool has_room(const ring & r, uint32_t n)
+{
+    const uint32_t head = r.head.load(std::memory_order_relaxed);
+    const uint32_t tail = r.tail.load(std::memory_order_seq_cst);
+    return ring_capacity - (head - tail) >= skip_for(head, n) + 4 + padded(n);
+}
+
+// return where to write a record of n bytes in r, or null if there isn't
+// room for it yet (producer only)
+unsigned char * begin_write(ring & r, uint32_t n)
+{
+    if (!has_room(r, n))
+        return nullptr;
+    const uint32_t head = r.head.load(std::memory_order_relaxed);
+    uint32_t at = head % ring_capacity;
+    if (skip_for(head, n)) {
+        store_u32(r.data + at, wrap_marker);
+        at = 0;
+    }
+    store_u32(r.data + at, n);
+    return r.data + at + 4;
+}
+
+// publish the record of n bytes begun by begin_write()
+void end_write(ring & r, uint32_t n)
+{
+    const uint32_t head = r.head.load(std::memory_order_relaxed);
+    r.head.store(head + skip_for(head, n) + 4 + padded(n), std::memory_order_seq_cst);
+}
+
+// return the next record in r, setting n to its length, or null if there
+// isn't one yet, or (with n set to wrap_marker) if it's malformed
+// (consumer only)
+const unsigned char * begin_read(const ring & r, uint32_t & n)
+{
+    const uint32_t tail = r.tail.load(std::memory_order_relaxed);
+    const uint32_t head = r.head.load(std::memory_order_acquire);
+    if (head == tail)
+        return nullptr;
+    uint32_t at = tail % ring_capacity;
+    n = load_u32(r.data + at);
+    if (n == wrap_marker) {
+        at = 0;
+        n = load_u32(r.data);
+    }
+    if (n > max_record_length || at + 4 + padded(n) > ring_capacity || head - tail > ring_capacity) {
+        n = wrap_marker;
+        return nullptr;
+    }
+    return r.data + at + 4;
+}
+
+// consume the record of n bytes at p returned by begin_read() (which is
+// either where tail is or, if it wrapped, at the start of the ring)
+void end_read(ring & r, const unsigned char * p, uint32_t n)
+{
+    const uint32_t tail = r.tail.load(std::memory_order_relaxed);
+    const uint32_t at = tail % ring_capacity;
+    const uint32_t skipped = p - 4 == r.data + at ? 0 : ring_capacity - at;
+    r.tail.store(tail + skipped + 4 + padded(n), std::memory_order_seq_cst);
+}
+
+// true, clearing it, if the flag was set
+bool take_flag(std::atomic<uint32_t> & flag)
+{
+    return flag.load(std::memory_order_seq_cst) && flag.exchange(0);
+}
+
+
+// (the futexes are shared between processes, so not FUTEX_PRIVATE)
+long futex_wait(std::atomic<uint32_t> & word, uint32_t expected, long timeout_ns)
+{
+    const timespec timeout{ 0, timeout_ns };
+    return ::syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, expected, &timeout, nullptr, 0);
+}
+
+void futex_wake(std::atomic<uint32_t> & word)
+{
+    ::syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+}
+
+void ring_doorbell(int fd)
+{
+    const uint64_t one = 1;
+    [[maybe_unused]] const ssize_t n = ::write(fd, &one, sizeof one);
+}
+
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+bool spinning_pays()
+{
+    static const bool pays = std::thread::hardware_concurrency() > 1;
+    return pays;
+}
+
+
+bool unix_address(const std::string & path, sockaddr_un & un, socklen_t & len, std::string & error)
+{
+    ::memset(&un, 0, sizeof un);
+    if (path.empty() || path.size() >= sizeof un.sun_path) {
+        error = "Invalid UNIX socket path '" + path + "'";
+        return false;
+    }
+    un.sun_family = AF_UNIX;
+    ::memcpy(un.sun_path, path.c_str(), path.size() + 1);
+    len = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + path.size() + 1);
+    return true;
+}
+
+}//namespace
+
+
+
+class shm_server::implementation {
+public:
+    implementation()
+    {
+        stop_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        doorbell_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (stop_fd_ == -1 || doorbell_fd_ == -1)
+            last_error_text_ = error_text("eventfd create failed", errno);
+    }
+
+    ~implementation()
+    {
+        while (!channels_.empty())
+            close_channel(channels_.size() - 1);
+        if (listen_fd_ != -1) {
+            ::close(listen_fd_);
+            ::unlink(path_.c_str());
+        }
+        if (stop_fd_ != -1)
+            ::close(stop_fd_);
+        if (doorbell_fd_ != -1)
+            ::close(doorbell_fd_);
+    }
+
+    bool listen(const std::string & path)
+    {
+        if (stop_fd_ == -1 || doorbell_fd_ == -1)
+            return false;
+        if (listen_fd_ != -1) {
+            last_error_text_ = "Already listening on '" + path_ + "'";
+            return false;
+        }
+        sockaddr_un un;
+        socklen_t len;
+        if (!unix_address(path, un, len, last_error_text_))
+            return false;
+        const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            last_error_text_ = error_text("socket failed", errno);
+            return false;
+        }
+        ::unlink(path.c_str()); // (left over from a previous run)
+        if (::bind(fd, reinterpret_cast<sockaddr *>(&un), len) == -1
+            || ::listen(fd, SOMAXCONN) == -1) {
+            last_error_text_ = error_text("Listen on '" + path + "' failed", errno);
+            ::close(fd);
+            return false;
+        }
+        listen_fd_ = fd;
+        path_ = path;
+        return true;
+    }
+
+    bool run(handler h)
+    {
+        if (listen_fd_ == -1) {
+            if (last_error_text_.empty())
+                last_error_text_ = "Not listening";
+            return false;
+        }
+        handler_ = std::move(h);
+        stopping_ = false;
+
+        epoll_fd_ = ::epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd_ == -1) {
+            last_error_text_ = error_text("epoll_create1 failed", errno);
+            return false;
+        }
+        watch(listen_fd_, listener_tag);
+        watch(stop_fd_, stop_tag);
+        watch(doorbell_fd_, doorbell_tag);
+        for (size_t i = 0; i < channels_.size(); ++i)
+            watch(channels_[i]->socket_fd, channels_[i]->number);
+
+        bool ok = true;
+        unsigned busy = 0;
+        while (!stopping_) {
+            int timeout = -1;
+            if (serve_channels()) {
+                // (keep serving without a system call, but now and then
+                // look for new clients and clients gone)
+                if (++busy % 64)
+                    continue;
+                timeout = 0;
+            }
+            else if (spinning_pays() && spin())
+                continue;
+            else if (arm_waits())
+                timeout = 0;
+
+            epoll_event events[64];
+            const int n = ::epoll_wait(epoll_fd_, events, 64, timeout);
+            if (n == -1) {
+                if (errno == EINTR)
+                    continue;
+                last_error_text_ = error_text("epoll_wait failed", errno);
+                ok = false;
+                break;
+            }
+            if (timeout == -1)
+                ++wakeups_;
+            for (int i = 0; i < n; ++i) {
+                const uint64_t tag = events[i].data.u64;
+                if (tag == stop_tag)
+                    stopping_ = true;
+                else if (tag == doorbell_tag) {
+                    uint64_t count;
+                    [[maybe_unused]] const ssize_t r = ::read(doorbell_fd_, &count, sizeof count);
+                }
+                else if (tag == listener_tag)
+                    accept_clients();
+                else
+                    client_gone(tag);
+            }
+        }
+
+        // (so clients waiting on them know we've gone)
+        while (!channels_.empty())
+            close_channel(channels_.size() - 1);
+        uint64_t count;
+        [[maybe_unused]] const ssize_t r = ::read(stop_fd_, &count, sizeof count);
+        ::close(epoll_fd_);
+        epoll_fd_ = -1;
+        return ok;
+    }
+
+    void stop()
+    {
+        stopping_ = true;
+        // (async-signal-safe, like the store above)
+        ring_doorbell(stop_fd_);
+    }
+
+    size_t connections() const { return connection_count_; }
+
+    statistics stats() const
+    {
+        statistics s;
+        s.requests = requests_;
+        s.wakeups = wakeups_;
+        return s;
+    }
+
+    std::string last_error_text() const { return last_error_text_; }
+
+private:
+    // epoll tags; a client's socket is tagged with its channel's number
+    static const uint64_t listener_tag = 0, stop_tag = 1, doorbell_tag = 2, first_channel_number = 3;
+
+    struct channel {
+        uint64_t number{ 0 };
+        int socket_fd{ -1 };
+        channel_memory * memory{ nullptr };
+        std::string pending;        // a reply waiting for room in the response ring
+        bool blocked{ false };      // (so pending holds a reply)
+    };
+
+    handler handler_;
+    int listen_fd_{ -1 };
+    std::string path_;
+    int stop_fd_{ -1 };
+    int doorbell_fd_{ -1 };
+    int epoll_fd_{ -1 };
+    std::atomic<bool> stopping_{ false };
+    std::vector<std::unique_ptr<channel>> channels_;
+    uint64_t next_number_{ first_channel_number };
+    std::atomic<size_t> connection_count_{ 0 };
+    std::atomic<unsigned long long> requests_{ 0 };
+    std::atomic<unsigned long long> wakeups_{ 0 };
+    std::string session_id_, input_;    // (reused, to save allocations)
+    std::string last_error_text_;
+
+    static uint32_t reply_length(const std::string & reply)
+    {
+        return static_cast<uint32_t>(std::min<size_t>(reply.size(), max_record_length));
+    }
+
+    void watch(int fd, uint64_t tag)
+    {
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.u64 = tag;
+        ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    void accept_clients()
+    {
+        for (;;) {
+            const int fd = ::accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd == -1) {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                return; // (EAGAIN, or out of file descriptors: the client waits)
+            }
+            if (!open_channel(fd))
+                ::close(fd);
+        }
+    }
+
+    // make a channel for the client connected on fd and send it the memfd
+    // and the doorbell
+    bool open_channel(int fd)
+    {
+        const int memfd = ::memfd_create("eliza-shm-channel", MFD_CLOEXEC);
+        if (memfd == -1)
+            return false;
+        void * p = MAP_FAILED;
+        if (::ftruncate(memfd, sizeof(channel_memory)) == 0)
+            p = ::mmap(nullptr, sizeof(channel_memory), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        if (p == MAP_FAILED) {
+            ::close(memfd);
+            return false;
+        }
+        auto c = std::make_unique<channel>();
+        c->number = next_number_++;
+        c->socket_fd = fd;
+        c->memory = new (p) channel_memory;
+
+        char byte = 'E';
+        iovec iov{ &byte, 1 };
+        alignas(cmsghdr) char control[CMSG_SPACE(2 * sizeof(int))];
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+        const int fds[2] = { memfd, doorbell_fd_ };
+        ::memcpy(CMSG_DATA(cmsg), fds, sizeof fds);
+        ++connection_count_; // (before the client can know of it)
+        const bool sent = ::sendmsg(fd, &msg, MSG_NOSIGNAL) == 1;
+        ::close(memfd); // (the mapping keeps it)
+        if (!sent) {
+            --connection_count_;
+            ::munmap(p, sizeof(channel_memory));
+            return false;
+        }
+        watch(fd, c->number);
+        channels_.push_back(std::move(c));
+        return true;
+    }
+
+    void close_channel(size_t i)
+    {
+        channel & c = *channels_[i];
+        c.memory->closed.store(1, std::memory_order_seq_cst);
+        futex_wake(c.memory->responses.head);
+        futex_wake(c.memory->requests.tail);
+        ::munmap(c.memory, sizeof(channel_memory));
+        ::close(c.socket_fd); // (and so out of the epoll set)
+        channels_[i] = std::move(channels_.back());
+        channels_.pop_back();
+        --connection_count_;
+    }
+
+    // the client never writes to its socket, so if it's readable the
+    // client has closed it
+    void client_gone(uint64_t number)
+    {
+        for (size_t i = 0; i < channels_.size(); ++i) {
+            if (channels_[i]->number == number) {
+                close_channel(i);
+                return;
+            }
+        }
+    }
+
+    // answer what requests there are (as many as there is room for the
+    // replies to); return true iff there were any
+    bool serve_channels()
+    {
+        bool worked = false;
+        for (size_t i = 0; i < channels_.size(); ) {
+            bool bad = false;
+            worked |= serve(*channels_[i], bad);
+            if (bad)
+                close_channel(i);
+            else
+                ++i;
+        }
+        return worked;
+    }
+
+    bool serve(channel & c, bool & bad)
+    {
+        ring & requests = c.memory->requests;
+        bool worked = false;
+        if (c.blocked) {
+            if (!write_reply(c, c.pending))
+                return false;
+            c.blocked = false;
+            worked = true;
+        }
+        for (int served = 0; served < 64; ++served) {
+            uint32_t n = 0;
+            const unsigned char * p = begin_read(requests, n);
+            if (!p) {
+                bad = n == wrap_marker;
+                break;
+            }
+            const uint32_t id_length = n >= 4 ? load_u32(p) : wrap_marker;
+            if (id_length > n - 4) {
+                bad = true;
+                break;
+            }
+            // (copied out before use, as the client could change them)
+            session_id_.assign(reinterpret_cast<const char *>(p + 4), id_length);
+            input_.assign(reinterpret_cast<const char *>(p + 4 + id_length), n - 4 - id_length);
+            end_read(requests, p, n);
+            if (take_flag(requests.producer_waiting))
+                futex_wake(requests.tail);
+            worked = true;
+            ++requests_;
+
+            std::string reply(handler_(session_id_, input_));
+            if (!write_reply(c, reply)) {
+                c.pending = std::move(reply);
+                c.blocked = true;
+                break;
+            }
+        }
+        return worked;
+    }
+
+    // copy reply into c's response ring; false if there isn't room
+    bool write_reply(channel & c, const std::string & reply)
+    {
+        ring & responses = c.memory->responses;
+        const uint32_t n = reply_length(reply);
+        unsigned char * p = begin_write(responses, n);
+        if (!p)
+            return false;
+        ::memcpy(p, reply.data(), n);
+        end_write(responses, n);
+        if (take_flag(responses.consumer_waiting))
+            futex_wake(responses.head);
+        return true;
+    }
+
+    // true if a channel has a request, or room for its blocked reply
+    bool work_waiting() const
+    {
+        for (const auto & c : channels_) {
+            if (c->blocked) {
+                if (has_room(c->memory->responses, reply_length(c->pending)))
+                    return true;
+            }
+            else if (c->memory->requests.head.load(std::memory_order_seq_cst)
+                    != c->memory->requests.tail.load(std::memory_order_relaxed))
+                return true;
+        }
+        return false;
+    }
+
+    // poll for a while; true if work came
+    bool spin()
+    {
+        const auto until = std::chrono::steady_clock::now() + server_spin;
+        do {
+            for (int i = 0; i < 64; ++i) {
+                if (work_waiting() || stopping_)
+                    return true;
+                cpu_relax();
+            }
+        } while (std::chrono::steady_clock::now() < until);
+        return false;
+    }
+
+    // ask each client to ring the doorbell when there's work for us;
+    // true if there is already
+    bool arm_waits()
+    {
+        for (const auto & c : channels_) {
+            if (c->blocked)
+                c->memory->responses.producer_waiting.store(1, std::memory_order_seq_cst);
+            else
+                c->memory->requests.consumer_waiting.store(1, std::memory_order_seq_cst);
+        }
+        return work_waiting();
+    }
+};
+
+
+
+class shm_client::implementation {
+public:
+    ~implementation() { close(); }
+
+    bool connect(const std::string & path)
+    {
+        close();
+        sockaddr_un un;
+        socklen_t len;
+        if (!unix_address(path, un, len, last_error_text_))
+            return false;
+        socket_fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (socket_fd_ == -1) {
+            last_error_text_ = error_text("socket failed", errno);
+            return false;
+        }
+        if (::connect(socket_fd_, reinterpret_cast<sockaddr *>(&un), len) == -1) {
+            last_error_text_ = error_text("Connect to '" + path + "' failed", errno);
+            close();
+            return false;
+        }
+
+        char byte;
+        iovec iov{ &byte, 1 };
+        alignas(cmsghdr) char control[CMSG_SPACE(2 * sizeof(int))];
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        ssize_t n;
+        do
+            n = ::recvmsg(socket_fd_, &msg, MSG_CMSG_CLOEXEC);
+        while (n == -1 && errno == EINTR);
+        const cmsghdr * cmsg = n == 1 ? CMSG_FIRSTHDR(&msg) : nullptr;
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+            || cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+            last_error_text_ = n == -1 ? error_text("recvmsg failed", errno) : "No channel given by '" + path + "'";
+            close();
+            return false;
+        }
+        int fds[2];
+        ::memcpy(fds, CMSG_DATA(cmsg), sizeof fds);
+        doorbell_fd_ = fds[1];
+        struct stat st;
+        void * p = MAP_FAILED;
+        if (::fstat(fds[0], &st) == 0 && st.st_size == static_cast<off_t>(sizeof(channel_memory)))
+            p = ::mmap(nullptr, sizeof(channel_memory), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+        ::close(fds[0]);
+        if (p == MAP_FAILED) {
+            last_error_text_ = "Unusable channel given by '" + path + "'";
+            close();
+            return false;
+        }
+        memory_ = static_cast<channel_memory *>(p);
+        if (memory_->magic != channel_magic || memory_->capacity != ring_capacity) {
+            last_error_text_ = "Unusable channel given by '" + path + "'";
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    bool send(const std::string & session_id, const std::string & input)
+    {
+        if (!memory_) {
+            last_error_text_ = "Not connected";
+            return false;
+        }
+        const size_t length = 4 + session_id.size() + input.size();
+        if (length > max_record_length) {
+            last_error_text_ = "Request too long";
+            return false;
+        }
+        ring & requests = memory_->requests;
+        const uint32_t n = static_cast<uint32_t>(length);
+        unsigned char * p;
+        while ((p = begin_write(requests, n)) == nullptr) {
+            const uint32_t tail = requests.tail.load(std::memory_order_relaxed);
+            if (!wait(requests.tail, tail, requests.producer_waiting, [&]() { return has_room(requests, n); }))
+                return false;
+        }
+        store_u32(p, static_cast<uint32_t>(session_id.size()));
+        ::memcpy(p + 4, session_id.data(), session_id.size());
+        ::memcpy(p + 4 + session_id.size(), input.data(), input.size());
+        end_write(requests, n);
+        if (take_flag(requests.consumer_waiting))
+            ring_doorbell(doorbell_fd_);
+        return true;
+    }
+
+    bool receive(std::string & reply)
+    {
+        if (!memory_) {
+            last_error_text_ = "Not connected";
+            return false;
+        }
+        ring & responses = memory_->responses;
+        uint32_t n = 0;
+        const unsigned char * p;
+        while ((p = begin_read(responses, n)) == nullptr) {
+            if (n == wrap_marker) {
+                last_error_text_ = "Malformed response";
+                return false;
+            }
+            const uint32_t tail = responses.tail.load(std::memory_order_relaxed);
+            if (!wait(responses.head, tail, responses.consumer_waiting,
+                    [&]() { return responses.head.load(std::memory_order_seq_cst) != tail; }))
+                return false;
+        }
+        reply.assign(reinterpret_cast<const char *>(p), n);
+        end_read(responses, p, n);
+        if (take_flag(responses.producer_waiting))
+            ring_doorbell(doorbell_fd_);
+        return true;
+    }
+
+    void close()
+    {
+        if (memory_)
+            ::munmap(memory_, sizeof(channel_memory));
+        memory_ = nullptr;
+        if (doorbell_fd_ != -1)
+            ::close(doorbell_fd_);
+        doorbell_fd_ = -1;
+        if (socket_fd_ != -1)
+            ::close(socket_fd_);
+        socket_fd_ = -1;
+    }
+
+    std::string last_error_text() const { return last_error_text_; }
+
+private:
+    int socket_fd_{ -1 };
+    int doorbell_fd_{ -1 };
+    channel_memory * memory_{ nullptr };
+    std::string last_error_text_;
+
+    // wait until ready(), sleeping on the futex word while it still holds
+    // value, having set flag to ask the server to wake us; false if the
+    // server has gone
+    template <typename ready_function>
+    bool wait(std::atomic<uint32_t> & word, uint32_t value, std::atomic<uint32_t> & flag, ready_function ready)
+    {
+        if (spinning_pays()) {
+            const auto until = std::chrono::steady_clock::now() + client_spin;
+            do {
+                for (int i = 0; i < 64; ++i) {
+                    if (ready())
+                        return true;
+                    cpu_relax();
+                }
+            } while (std::chrono::steady_clock::now() < until);
+        }
+        for (;;) {
+            flag.store(1, std::memory_order_seq_cst);
+            if (ready())
+                return true;
+            if (memory_->closed.load(std::memory_order_seq_cst)) {
+                last_error_text_ = "Server closed the channel";
+                return false;
+            }
+            if (futex_wait(word, value, client_check_ns) == -1 && errno == ETIMEDOUT) {
+                // (the server writes nothing to the socket after the
+                // channel, so if it's readable the server has gone)
+                pollfd pfd{ socket_fd_, POLLIN, 0 };
+                if (::poll(&pfd, 1, 0) != 0) {
+                    last_error_text_ = "Server has gone";
+                    return false;
+                }
+            }
+            if (word.load(std::memory_order_seq_cst) != value)
+                return true;
+        }
+    }
+};
+
+
+
+shm_server::shm_server()
+    : impl_(std::make_unique<implementation>())
+{}
+
+shm_server::~shm_server() = default;
+
+bool shm_server::listen(const std::string & path)
+{
+    return impl_->listen(path);
+}
+
+bool shm_server::run(handler h)
+{
+    return impl_->run(std::move(h));
+}
+
+void shm_server::stop()
+{
+    impl_->stop();
+}
+
+size_t shm_server::connections() const
+{
+    return impl_->connections();
+}
+
+shm_server::statistics shm_server::stats() const
+{
+    return impl_->stats();
+}
+
+std::string shm_server::last_error_text() const
+{
+    return impl_->last_error_text();
+}
+
+
+shm_client::shm_client()
+    : impl_(std::make_unique<implementation>())
+{}
+
+shm_client::~shm_client() = default;
+
+bool shm_client::connect(const std::string & path)
+{
+    return impl_->connect(path);
+}
+
+bool shm_client::send(const std::string & session_id, const std::string & input)
+{
+    return impl_->send(session_id, input);
+}
+
+bool shm_client::receive(std::string & reply)
+{
+    return impl_->receive(reply);
+}
+
+bool shm_client::request(const std::string & session_id, const std::string & input, std::string & reply)
+{
+    return impl_->send(session_id, input) && impl_->receive(reply);
+}
+
+void shm_client::close()
+{
+    impl_->close();
+}
+
+std::string shm_client::last_error_text() const
+{
+    return impl_->last_error_text();
+}
@@ -0,0 +1,685 @@
+// Implement telnet_server and telnet_client for Linux.
+// The server is one thread serving every client, waiting with epoll; the
+// paced output of every client is timed from one queue of deadlines.
+
+
+#include "telnet_server.h"
+#include "teletype.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <queue>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+namespace {
+
+// a client typing a line longer than this is hung up on
+const size_t max_line_length = 4096;
+
+// telnet commands (RFC 854) and the options we use (RFC 857, RFC 858)
+const unsigned char SE = 240;
+const unsigned char SB = 250;
+const unsigned char WILL = 251;
+const unsigned char WONT = 252;
+const unsigned char DO = 253;
+const unsigned char DONT = 254;
+const unsigned char IAC = 255;
+const unsigned char ECHO = 1;
+const unsigned char SUPPRESS_GO_AHEAD = 3;
+
+// numbers clients uniquely in the process
+std::atomic<unsigned long long> client_numbers{ 0 };
+
+
+std::string error_text(const std::string & what, int error_number)
+{
+    return what + ": " + ::strerror(error_number);
+}
+
+
+// set sa to the address given in address (see telnet_server::listen());
+// return false, with error set, if it's not valid
+bool parse_address(const std::string & address, sockaddr_in & sa, std::string & error)
+{
+    ::memset(&sa, 0, sizeof sa);
+    std::string host("127.0.0.1"), port(address);
+    const auto colon = address.rfind(':');
+    if (colon != std::string::npos) {
+        host = address.substr(0, colon);
+        port = address.substr(colon + 1);
+    }
+    if (port.empty() || port.size() > 5
+        || port.find_first_not_of("0123456789") != std::string::npos
+        || std::stoul(port) > 65535
+        || ::inet_pton(AF_INET, host.c_str(), &sa.sin_addr) != 1) {
+        error = "Invalid address '" + address + "'";
+        return false;
+    }
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(static_cast<uint16_t>(std::stoul(port)));
+    return true;
+}
+
+
+/*  Telnet's in-band commands, taken out of the data received. For each
+    byte, take() returns true if it's data; a command that asks us to DO
+    or WILL an option we don't have gets its refusal appended to reply.
+    (Both ends refuse only what's asked for and never answer a refusal,
+    so they can't talk each other into a loop.) */
+class telnet_parser {
+public:
+    // given the options we'll do, and those we'd have the other end do
+    telnet_parser(std::vector<unsigned char> ours, std::vector<unsigned char> theirs)
+        : ours_(std::move(ours)), theirs_(std::move(theirs))
+    {}
+
+    bool take(unsigned char b, std::string & reply)
+    {
+        switch (state_) {
+        case state::data:
+            if (b == IAC) {
+                state_ = state::command;
+                return false;
+            }
+            return true;
+        case state::command:
+            if (b >= WILL && b <= DONT) {
+                verb_ = b;
+                state_ = state::option;
+            }
+            else
+                state_ = b == SB ? state::subnegotiation : state::data;
+            return false; // (IAC IAC is a data 255, which isn't 7-bit anyway)
+        case state::option:
+            if (verb_ == DO && !has(ours_, b))
+                reply += { static_cast<char>(IAC), static_cast<char>(WONT), static_cast<char>(b) };
+            else if (verb_ == WILL && !has(theirs_, b))
+                reply += { static_cast<char>(IAC), static_cast<char>(DONT), static_cast<char>(b) };
+            state_ = state::data;
+            return false;
+        case state::subnegotiation:
+            if (b == IAC)
+                state_ = state::subnegotiation_iac;
+            return false;
+        case state::subnegotiation_iac:
+            state_ = b == SE ? state::data : state::subnegotiation;
+            return false;
+        }
+        return false;
+    }
+
+private:
+    enum class state { data, command, option, subnegotiation, subnegotiation_iac };
+    const std::vector<unsigned char> ours_;
+    const std::vector<unsigned char> theirs_;
+    state state_{ state::data };
+    unsigned char verb_{ 0 };
+
+    static bool has(const std::vector<unsigned char> & options, unsigned char option)
+    {
+        for (const auto o : options)
+            if (o == option)
+                return true;
+        return false;
+    }
+};
+
+}//namespace
+
+
+
+class telnet_server::implementation {
+public:
+    explicit implementation(unsigned cps)
+        : interval_(cps == 0 ? clock::duration::zero()
+            : std::chrono::duration_cast<clock::duration>(std::chrono::seconds(1)) / cps)
+    {
+        stop_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (stop_fd_ == -1)
+            last_error_text_ = error_text("eventfd create failed", errno);
+    }
+
+    ~implementation()
+    {
+        for (auto & [number, c] : clients_)
+            ::close(c->fd);
+        if (listen_fd_ != -1)
+            ::close(listen_fd_);
+        if (stop_fd_ != -1)
+            ::close(stop_fd_);
+    }
+
+    bool listen(const std::string & address)
+    {
+        if (stop_fd_ == -1)
+            return false;
+        sockaddr_in sa;
+        if (!parse_address(address, sa, last_error_text_))
+            return false;
+        const int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            last_error_text_ = error_text("socket failed", errno);
+            return false;
+        }
+        const int on = 1;
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+        if (::bind(fd, reinterpret_cast<sockaddr *>(&sa), sizeof sa) == -1
+            || ::listen(fd, SOMAXCONN) == -1) {
+            last_error_text_ = error_text("Listen on '" + address + "' failed", errno);
+            ::close(fd);
+            return false;
+        }
+        sockaddr_in bound{};
+        socklen_t bound_len = sizeof bound;
+        if (::getsockname(fd, reinterpret_cast<sockaddr *>(&bound), &bound_len) == 0)
+            port_ = ntohs(bound.sin_port);
+        if (listen_fd_ != -1)
+            ::close(listen_fd_);
+        listen_fd_ = fd;
+        return true;
+    }
+
+    uint16_t port() const { return port_; }
+
+    bool run(connect_handler on_connect, line_handler on_line, disconnect_handler on_disconnect)
+    {
+        if (listen_fd_ == -1 || stop_fd_ == -1) {
+            if (last_error_text_.empty())
+                last_error_text_ = "Not listening";
+            return false;
+        }
+        on_connect_ = std::move(on_connect);
+        on_line_ = std::move(on_line);
+        on_disconnect_ = std::move(on_disconnect);
+
+        epoll_fd_ = ::epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd_ == -1) {
+            last_error_text_ = error_text("epoll_create1 failed", errno);
+            return false;
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = listener_key;
+        ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev);
+        ev.data.u64 = stop_key;
+        ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, stop_fd_, &ev);
+
+        bool ok = true;
+        epoll_event events[64];
+        for (bool stopping = false; !stopping; ) {
+            int timeout = -1;
+            if (!due_.empty()) {
+                const auto wait = due_.top().first - clock::now();
+                timeout = wait <= clock::duration::zero() ? 0
+                    : static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(wait).count());
+            }
+            const int n = ::epoll_wait(epoll_fd_, events, 64, timeout);
+            if (n == -1) {
+                if (errno == EINTR)
+                    continue;
+                last_error_text_ = error_text("epoll_wait failed", errno);
+                ok = false;
+                break;
+            }
+            for (int i = 0; i < n; ++i) {
+                const uint64_t key = events[i].data.u64;
+                if (key == stop_key) {
+                    uint64_t count;
+                    while (::read(stop_fd_, &count, sizeof count) == sizeof count)
+                        ;
+                    stopping = true;
+                }
+                else if (key == listener_key)
+                    accept_clients();
+                else {
+                    const auto c = clients_.find(key);
+                    if (c == clients_.end())
+                        continue; // (closed earlier in this batch of events)
+                    client & cl = *c->second;
+                    if (events[i].events & (EPOLLERR | EPOLLHUP))
+                        cl.closed = true;
+                    else {
+                        if (events[i].events & (EPOLLIN | EPOLLRDHUP))
+                            receive(cl);
+                        if (!cl.closed && (events[i].events & EPOLLOUT))
+                            resume(cl);
+                    }
+                    if (cl.closed)
+                        close(key);
+                }
+            }
+            send_paced();
+        }
+
+        for (auto & [number, c] : clients_) {
+            ::close(c->fd);
+            if (on_disconnect_)
+                on_disconnect_(number);
+        }
+        clients_.clear();
+        due_ = {};
+        connection_count_ = 0;
+        ::close(epoll_fd_);
+        epoll_fd_ = -1;
+        return ok;
+    }
+
+    void stop()
+    {
+        const uint64_t one = 1;
+        // (this is async-signal-safe)
+        [[maybe_unused]] const ssize_t n = ::write(stop_fd_, &one, sizeof one);
+    }
+
+    size_t connections() const { return connection_count_; }
+
+    std::string last_error_text() const { return last_error_text_; }
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    // (client numbers start at 1)
+    static constexpr uint64_t listener_key = 0;
+    static constexpr uint64_t stop_key = ~uint64_t(0);
+
+    struct client {
+        int fd{ -1 };
+        unsigned long long number{ 0 };
+        teletype tty{ true };
+        telnet_parser telnet{ { ECHO, SUPPRESS_GO_AHEAD }, { SUPPRESS_GO_AHEAD } };
+        bool after_cr{ false };         // the last character typed was CR
+        std::string out;                // to send, from out_pos
+        size_t out_pos{ 0 };
+        size_t urgent{ 0 };             // characters from out_pos to send unpaced
+        bool want_out{ false };         // waiting for EPOLLOUT
+        bool paced{ false };            // in due_
+        clock::time_point next_due;     // when the next paced character may go
+        bool peer_closed{ false };      // nothing more will be typed
+        bool hanging_up{ false };       // close once out is sent
+        bool closed{ false };
+    };
+
+    const clock::duration interval_;    // between paced characters (0: not paced)
+    int listen_fd_{ -1 };
+    uint16_t port_{ 0 };
+    int stop_fd_{ -1 };
+    int epoll_fd_{ -1 };
+    connect_handler on_connect_;
+    line_handler on_line_;
+    disconnect_handler on_disconnect_;
+    std::unordered_map<unsigned long long, std::unique_ptr<client>> clients_;
+    // when each paced client with output waiting may send its next character
+    std::priority_queue<std::pair<clock::time_point, unsigned long long>,
+        std::vector<std::pair<clock::time_point, unsigned long long>>,
+        std::greater<>> due_;
+    std::atomic<size_t> connection_count_{ 0 };
+    std::string last_error_text_;
+
+    void accept_clients()
+    {
+        for (;;) {
+            const int fd = ::accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd == -1)
+                return; // (EAGAIN, or an error that's the client's problem)
+            const int on = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+            auto c = std::make_unique<client>();
+            c->fd = fd;
+            c->number = ++client_numbers;
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLRDHUP;
+            ev.data.u64 = c->number;
+            if (::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) == -1) {
+                ::close(fd);
+                continue;
+            }
+            client & cl = *c;
+            clients_.emplace(cl.number, std::move(c));
+            ++connection_count_;
+
+            // (the negotiation isn't paced: a teletype wouldn't see it)
+            const char hello[] = {
+                static_cast<char>(IAC), static_cast<char>(WILL), static_cast<char>(ECHO),
+                static_cast<char>(IAC), static_cast<char>(WILL), static_cast<char>(SUPPRESS_GO_AHEAD) };
+            cl.out.append(hello, sizeof hello);
+            cl.urgent = sizeof hello;
+            print(cl, on_connect_(cl.number) + "\r\n");
+        }
+    }
+
+    void close(unsigned long long number)
+    {
+        const auto c = clients_.find(number);
+        ::close(c->second->fd);
+        clients_.erase(c);
+        --connection_count_;
+        if (on_disconnect_)
+            on_disconnect_(number);
+    }
+
+    void receive(client & c)
+    {
+        char data[4096];
+        for (;;) {
+            const ssize_t n = ::read(c.fd, data, sizeof data);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == -1 && errno == EAGAIN)
+                return;
+            if (n == -1) {
+                c.closed = true;
+                return;
+            }
+            if (n == 0) {
+                // hang up once what's already been said is printed
+                c.peer_closed = c.hanging_up = true;
+                if (c.out_pos == c.out.size())
+                    c.closed = true;
+                else
+                    listen_for(c);
+                return;
+            }
+            if (c.hanging_up)
+                continue;
+            std::string reply, echo;
+            for (ssize_t i = 0; i < n && !c.hanging_up; ++i) {
+                const unsigned char b = static_cast<unsigned char>(data[i]);
+                if (!c.telnet.take(b, reply))
+                    continue;
+                // a telnet client ends a line with CR LF or CR NUL; some
+                // send only LF
+                if (c.after_cr && (b == '\n' || b == '\0')) {
+                    c.after_cr = false;
+                    continue;
+                }
+                c.after_cr = b == '\r';
+                if (!c.tty.type(b == '\n' ? '\r' : b, echo)) {
+                    if (c.tty.typed() > max_line_length) {
+                        c.closed = true;
+                        return;
+                    }
+                    continue;
+                }
+                print(c, echo);
+                echo.clear();
+                std::string answer;
+                if (!on_line_(c.number, c.tty.line(), answer))
+                    c.hanging_up = true;
+                print(c, answer + "\r\n");
+            }
+            print(c, echo);
+            if (!reply.empty()) {
+                // (telnet replies jump the queue)
+                c.out.insert(c.out_pos, reply);
+                c.urgent += reply.size();
+                flush(c);
+            }
+        }
+    }
+
+    // queue text to print on c's teletype
+    void print(client & c, const std::string & text)
+    {
+        if (text.empty() || c.closed)
+            return;
+        c.tty.print(text, c.out);
+        flush(c);
+    }
+
+    // send what may be sent of c.out now: all of it, if not paced,
+    // otherwise what's urgent, the rest being left to send_paced()
+    void flush(client & c)
+    {
+        if (c.want_out)
+            return; // (until EPOLLOUT)
+        if (interval_ == clock::duration::zero())
+            write(c, c.out.size() - c.out_pos);
+        else if (write(c, c.urgent) && !c.paced && c.out_pos != c.out.size()) {
+            c.next_due = std::max(c.next_due, clock::now());
+            due_.emplace(c.next_due, c.number);
+            c.paced = true;
+        }
+    }
+
+    // (paced) send the next character of every client whose time has come
+    void send_paced()
+    {
+        const auto now = clock::now();
+        while (!due_.empty() && due_.top().first <= now) {
+            const unsigned long long number = due_.top().second;
+            due_.pop();
+            const auto i = clients_.find(number);
+            if (i == clients_.end())
+                continue;
+            client & c = *i->second;
+            c.paced = false;
+            if (write(c, 1)) {
+                c.next_due += interval_;
+                flush(c);
+            }
+            if (c.closed)
+                close(number);
+        }
+    }
+
+    // send up to n characters of c.out; true iff they were all sent (on
+    // EAGAIN, waits for EPOLLOUT; on error, marks c closed)
+    bool write(client & c, size_t n)
+    {
+        n = std::min(n, c.out.size() - c.out_pos);
+        while (n > 0) {
+            const ssize_t k = ::send(c.fd, c.out.data() + c.out_pos, n, MSG_NOSIGNAL);
+            if (k == -1 && errno == EINTR)
+                continue;
+            if (k == -1 && errno == EAGAIN) {
+                c.want_out = true;
+                listen_for(c);
+                return false;
+            }
+            if (k == -1) {
+                c.closed = true;
+                return false;
+            }
+            const size_t sent = static_cast<size_t>(k);
+            c.out_pos += sent;
+            c.urgent -= std::min(c.urgent, sent);
+            n -= sent;
+        }
+        if (c.out_pos == c.out.size()) {
+            c.out.clear();
+            c.out_pos = 0;
+            if (c.hanging_up)
+                c.closed = true;
+        }
+        return true;
+    }
+
+    // (on EPOLLOUT)
+    void resume(client & c)
+    {
+        c.want_out = false;
+        listen_for(c);
+        flush(c);
+    }
+
+    // have epoll tell us of what we're now waiting for on c
+    void listen_for(client & c)
+    {
+        epoll_event ev{};
+        ev.events = 0;
+        if (!c.peer_closed)
+            ev.events |= EPOLLIN | EPOLLRDHUP;
+        if (c.want_out)
+            ev.events |= EPOLLOUT;
+        ev.data.u64 = c.number;
+        ::epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, c.fd, &ev);
+    }
+};
+
+
+telnet_server::telnet_server(unsigned cps)
+    : impl_(std::make_unique<implementation>(cps))
+{}
+
+telnet_server::~telnet_server() = default;
+
+bool telnet_server::listen(const std::string & address)
+{
+    return impl_->listen(address);
+}
+
+uint16_t telnet_server::port() const
+{
+    return impl_->port();
+}
+
+bool telnet_server::run(connect_handler on_connect, line_handler on_line, disconnect_handler on_disconnect)
+{
+    return impl_->run(std::move(on_connect), std::move(on_line), std::move(on_disconnect));
+}
+
+void telnet_server::stop()
+{
+    impl_->stop();
+}
+
+size_t telnet_server::connections() const
+{
+    return impl_->connections();
+}
+
+std::string telnet_server::last_error_text() const
+{
+    return impl_->last_error_text();
+}
+
+
+
+class telnet_client::implementation {
+public:
+    ~implementation() { close(); }
+
+    bool connect(const std::string & address)
+    {
+        close();
+        sockaddr_in sa;
+        if (!parse_address(address, sa, last_error_text_))
+            return false;
+        fd_ = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd_ == -1) {
+            last_error_text_ = error_text("socket failed", errno);
+            return false;
+        }
+        if (::connect(fd_, reinterpret_cast<sockaddr *>(&sa), sizeof sa) == -1) {
+            last_error_text_ = error_text("Connect to '" + address + "' failed", errno);
+            close();
+            return false;
+        }
+        const int on = 1;
+        ::setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+        return true;
+    }
+
+    bool send(const std::string & typed)
+    {
+        for (size_t sent = 0; sent < typed.size(); ) {
+            const ssize_t n = ::send(fd_, typed.data() + sent, typed.size() - sent, MSG_NOSIGNAL);
+            if (n == -1) {
+                if (errno == EINTR)
+                    continue;
+                last_error_text_ = error_text("send failed", errno);
+                return false;
+            }
+            sent += n;
+        }
+        return true;
+    }
+
+    bool receive(std::string & line)
+    {
+        for (;;) {
+            const auto crlf = buffer_.find("\r\n");
+            if (crlf != std::string::npos) {
+                line = buffer_.substr(0, crlf);
+                buffer_.erase(0, crlf + 2);
+                return true;
+            }
+            char data[4096];
+            const ssize_t n = ::read(fd_, data, sizeof data);
+            if (n > 0) {
+                std::string reply;
+                for (ssize_t i = 0; i < n; ++i)
+                    if (telnet_.take(static_cast<unsigned char>(data[i]), reply) && data[i] != '\0')
+                        buffer_ += data[i];
+                if (!reply.empty() && !send(reply))
+                    return false;
+            }
+            else if (n == -1 && errno == EINTR)
+                continue;
+            else {
+                last_error_text_ = n == 0 ? "Connection closed" : error_text("read failed", errno);
+                return false;
+            }
+        }
+    }
+
+    void close()
+    {
+        if (fd_ != -1)
+            ::close(fd_);
+        fd_ = -1;
+        buffer_.clear();
+    }
+
+    std::string last_error_text() const { return last_error_text_; }
+
+private:
+    int fd_{ -1 };
+    std::string buffer_;
+    telnet_parser telnet_{ { SUPPRESS_GO_AHEAD }, { ECHO, SUPPRESS_GO_AHEAD } };
+    std::string last_error_text_;
+};
+
+
+telnet_client::telnet_client()
+    : impl_(std::make_unique<implementation>())
+{}
+
+telnet_client::~telnet_client() = default;
+
+bool telnet_client::connect(const std::string & address)
+{
+    return impl_->connect(address);
+}
+
+bool telnet_client::send(const std::string & typed)
+{
+    return impl_->send(typed);
+}
+
+bool telnet_client::receive(std::string & line)
+{
+    return impl_->receive(line);
+}
+
+void telnet_client::close()
+{
+    impl_->close();
+}
+
+std::string telnet_client::last_error_text() const
+{
+    return impl_->last_error_text();
+}
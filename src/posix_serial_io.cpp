@@ -4,13 +4,13 @@
 
 
 #include "serial_io.h"
+#include "teletype.h"
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <termios.h>
 #include <string.h>
 #include <sstream>
-#include <cctype>
 
 
 class serial_io::implementation {
@@ -127,52 +127,28 @@ public:
 
     std::string getline()
     {
-        std::string line;
-
         for (;;) {
             unsigned char ch;
             if (::read(fd_, &ch, 1) == 1) {
-                ch &= 0x7F;
-                if (ch == '\r')
+                std::string out;
+                const bool end = tty_.type(ch, out);
+                for (const char c : out)
+                    ::write(fd_, &c, 1);
+                if (end)
                     break;
-                line += ch;
-                if (std::isprint(ch))
-                    ++column_;
-                if (column_ > column_limit_) {
-                    // break lines at column_limit_
-                   ::write(fd_, newline_, sizeof(newline_));
-                   column_ = 1;
-                }
             }
             ::usleep(100000);
         }
-        ::write(fd_, newline_, sizeof(newline_));
-        column_ = 1;
 
-        return line;
+        return tty_.line();
     }
 
     void write(const std::string & data)
     {
-        unsigned remaining = data.length();
-        if (remaining) {
-            const char * p = data.c_str();
-
-            while (remaining) {
-                const unsigned char ch = std::toupper(*p++ & 0x7F);
-                if (std::isprint(ch) && column_ > column_limit_) {
-                    // break lines at column_limit_
-                    ::write(fd_, newline_, sizeof(newline_));
-                    column_ = 1;
-                }
-                ::write(fd_, &ch, 1);
-                --remaining;
-                if (ch == '\r')
-                    column_ = 1;
-                else if (std::isprint(ch))
-                    ++column_;
-            }
-        }
+        std::string out;
+        tty_.print(data, out);
+        for (const char c : out)
+            ::write(fd_, &c, 1);
     }
 
     std::string last_error_text() const
@@ -183,9 +159,7 @@ public:
 private:
     int fd_ = -1;
     std::string last_error_text_;
-    unsigned column_ = 1;
-    const unsigned column_limit_ = 72; // ASR 33 last column
-    const char newline_[4] = {'\r', '\n', '\0', '\0'};
+    teletype tty_; // (the TTY device echoes what's typed)
 
     std::string format_error_message(const std::string & msg, const std::string & value)
     {
@@ -0,0 +1,86 @@
+#ifndef SHM_SERVER_H_INCLUDED
+#define SHM_SERVER_H_INCLUDED
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+
+
+/*  A server for clients on the same host that talk to it through shared
+    memory rather than a socket. A client connects to the server's UNIX
+    domain socket only to be given a channel: a memfd holding a ring of
+    requests (written by the client, read by the server) and a ring of
+    responses (written by the server, read by the client), each with one
+    producer and one consumer. A request carries a session id and an input;
+    the response is the handler's reply, copied straight into the response
+    ring. Responses come in the order the requests were sent.
+
+    Nothing is copied through the kernel and, while both sides are busy,
+    no system call is made: the server is woken through an eventfd only
+    when it has gone to sleep, and a client through a futex in the shared
+    memory only when it's waiting for a response. */
+class shm_server {
+public:
+    // return the reply to the given input in the given session
+    using handler = std::function<std::string(const std::string & session_id, const std::string & input)>;
+
+    struct statistics {
+        unsigned long long requests{ 0 };   // requests answered
+        unsigned long long wakeups{ 0 };    // times the server slept and was woken
+    };
+
+    shm_server();
+    ~shm_server();
+
+    // clients will come for channels to the UNIX domain socket at path
+    bool listen(const std::string & path);
+
+    // serve the clients, calling h for each request, until stop()
+    bool run(handler h);
+
+    // make run() return; may be called from any thread (or a signal handler)
+    void stop();
+
+    // the number of channels currently open
+    size_t connections() const;
+
+    statistics stats() const;
+
+    std::string last_error_text() const;
+
+private:
+    class implementation;
+    std::unique_ptr<implementation> impl_;
+};
+
+
+// a client for shm_server; one thread may send while another receives
+class shm_client {
+public:
+    shm_client();
+    ~shm_client();
+
+    // get a channel from the server listening at path
+    bool connect(const std::string & path);
+
+    // send a request; waits while the request ring is full; false if the
+    // request is too long for the ring or the server has gone
+    bool send(const std::string & session_id, const std::string & input);
+
+    // wait for and return the next response; false if the server has gone
+    bool receive(std::string & reply);
+
+    // send then receive
+    bool request(const std::string & session_id, const std::string & input, std::string & reply);
+
+    void close();
+
+    std::string last_error_text() const;
+
+private:
+    class implementation;
+    std::unique_ptr<implementation> impl_;
+};
+
+#endif
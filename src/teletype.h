@@ -0,0 +1,81 @@
+#ifndef TELETYPE_H_INCLUDED
+#define TELETYPE_H_INCLUDED
+
+#include <cctype>
+#include <string>
+
+
+/*  The line discipline of a Teletype Model 33 ASR, apart from whatever it's
+    connected by (see serial_io, telnet_server). Characters are 7-bit and
+    printed in upper case, and a line is broken before it runs off the end
+    of the platen at column 72. A line typed ends with CR (RETURN).
+
+    A newline is CR LF followed by two NULs, which print nothing but give
+    the carriage time to get back to column 1. */
+class teletype {
+public:
+    static constexpr unsigned columns = 72; // ASR 33 last column
+
+    // if echo, what's typed is sent back to be printed (as it must be
+    // unless the connection does that itself, as a TTY device may)
+    explicit teletype(bool echo = false) : echo_(echo) {}
+
+    // append to out the characters to send to print given data
+    void print(const std::string & data, std::string & out)
+    {
+        for (const char c : data) {
+            const unsigned char ch = static_cast<unsigned char>(
+                std::toupper(static_cast<unsigned char>(c) & 0x7F));
+            if (std::isprint(ch) && column_ > columns) {
+                // break lines at columns
+                out.append(newline, sizeof newline);
+                column_ = 1;
+            }
+            out += static_cast<char>(ch);
+            if (ch == '\r')
+                column_ = 1;
+            else if (std::isprint(ch))
+                ++column_;
+        }
+    }
+
+    // take given character typed, appending to out the characters to send
+    // back; return true iff it ends a line, which line() then returns
+    bool type(unsigned char ch, std::string & out)
+    {
+        ch &= 0x7F;
+        if (ch == '\r') {
+            out.append(newline, sizeof newline);
+            column_ = 1;
+            line_.swap(typed_);
+            typed_.clear();
+            return true;
+        }
+        typed_ += static_cast<char>(ch);
+        if (echo_)
+            out += static_cast<char>(std::toupper(ch));
+        if (std::isprint(ch))
+            ++column_;
+        if (column_ > columns) {
+            // break lines at columns
+            out.append(newline, sizeof newline);
+            column_ = 1;
+        }
+        return false;
+    }
+
+    // the line most recently ended
+    const std::string & line() const { return line_; }
+
+    // the length of the line being typed
+    size_t typed() const { return typed_.size(); }
+
+private:
+    static constexpr char newline[4] = { '\r', '\n', '\0', '\0' };
+    const bool echo_;
+    unsigned column_{ 1 };
+    std::string typed_;
+    std::string line_;
+};
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef TELNET_SERVER_H_INCLUDED
+#define TELNET_SERVER_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+
+/*  A server of virtual teletypes: each telnet client that connects over
+    TCP gets a session of its own, with the line discipline of an ASR 33
+    (see teletype): 7-bit upper case, 72 columns, lines typed ending with
+    RETURN. The server echoes what's typed (it tells the client it WILL
+    ECHO and SUPPRESS-GO-AHEAD, so the client sends each character as
+    it's typed) and, if paced, prints no faster than a teletype would,
+    echo included. One thread serves every client. */
+class telnet_server {
+public:
+    // a client has connected; return the greeting to print
+    using connect_handler = std::function<std::string(unsigned long long client)>;
+
+    // client typed line; set reply to the reply to print; return false
+    // to hang up once it's printed
+    using line_handler = std::function<bool(unsigned long long client, const std::string & line, std::string & reply)>;
+
+    // client's connection has closed
+    using disconnect_handler = std::function<void(unsigned long long client)>;
+
+    // print at most cps characters per second to each client (0: as fast
+    // as the network will take them; 10 is an ASR 33's 110 baud)
+    explicit telnet_server(unsigned cps = 0);
+    ~telnet_server();
+
+    // listen on address, "[HOST:]PORT" (HOST defaults to 127.0.0.1; PORT 0
+    // means any free port, see port())
+    bool listen(const std::string & address);
+
+    // the TCP port listened on
+    uint16_t port() const;
+
+    // serve clients until stop()
+    bool run(connect_handler on_connect, line_handler on_line, disconnect_handler on_disconnect = nullptr);
+
+    // make run() return; may be called from any thread (or a signal handler)
+    void stop();
+
+    // the number of clients currently connected
+    size_t connections() const;
+
+    std::string last_error_text() const;
+
+private:
+    class implementation;
+    std::unique_ptr<implementation> impl_;
+};
+
+
+// a blocking telnet client, for tests and tools; it refuses every option
+// the server offers or asks for except those telnet_server uses
+class telnet_client {
+public:
+    telnet_client();
+    ~telnet_client();
+
+    // connect to address (as for telnet_server::listen())
+    bool connect(const std::string & address);
+
+    // send given characters, as typed (so end a line with "\r")
+    bool send(const std::string & typed);
+
+    // wait for and return the next line printed, without its newline (or
+    // the NULs after it) and with any telnet commands removed; false if the
+    // connection closed first
+    bool receive(std::string & line);
+
+    void close();
+
+    std::string last_error_text() const;
+
+private:
+    class implementation;
+    std::unique_ptr<implementation> impl_;
+};
+
+#endif
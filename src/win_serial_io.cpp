@@ -3,6 +3,7 @@
 
 
 #include "serial_io.h"
+#include "teletype.h"
 
 #include <stdio.h>
 #include <conio.h>
@@ -89,56 +90,28 @@ public:
 
     std::string getline()
     {
-        std::string line;
-
         for (;;) {
             unsigned char ch;
             if (getch(ch)) {
-                ch &= 0x7F;
-                if (ch == '\r')
+                std::string out;
+                const bool end = tty_.type(ch, out);
+                for (const char c : out)
+                    putch(c);
+                if (end)
                     break;
-                line += ch;
-                if (std::isprint(ch))
-                    ++column_;
-                if (column_ > column_limit_) {
-                    // break lines at column_limit_
-                    for (auto c : newline_)
-                        putch(c);
-                    column_ = 1;
-                }
             }
             ::Sleep(100);
         }
-        for (auto c : newline_)
-            putch(c);
-        column_ = 1;
 
-        return line;
+        return tty_.line();
     }
 
     void write(const std::string & data)
     {
-        unsigned remaining = static_cast<unsigned>(data.length());
-        if (remaining) {
-            const char * p = data.c_str();
-
-            while (remaining) {
-                const unsigned char ch = static_cast<unsigned char>(
-                    std::toupper(*p++ & 0x7F));
-                if (std::isprint(ch) && column_ > column_limit_) {
-                    // break lines at column_limit_
-                    for (auto c : newline_)
-                        putch(c);
-                    column_ = 1;
-                }
-                putch(ch);
-                --remaining;
-                if (ch == '\r')
-                    column_ = 1;
-                else if (std::isprint(ch))
-                    ++column_;
-            }
-        }
+        std::string out;
+        tty_.print(data, out);
+        for (const char c : out)
+            putch(c);
     }
 
     std::string last_error_text() const
@@ -149,9 +122,7 @@ public:
 private:
     HANDLE serial_port_handle_;
     std::string last_error_text_;
-    unsigned column_ = 1;
-    const unsigned column_limit_ = 72; // ASR 33 last column
-    const char newline_[4] = {'\r', '\n', '\0', '\0'};
+    teletype tty_; // (the ASR 33, in simplex mode, prints what's typed)
 
     std::string get_last_windows_error_message() {
         std::ostringstream oss;